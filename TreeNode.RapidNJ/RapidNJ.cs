@@ -6,7 +6,7 @@ using System.Text;
 namespace PhyloTree
 {
     /// <summary>
-    /// Contains method to compute neighbour-joining trees using the rapidNJ algorithm (doi:10.1007/978-3-540-87361-7_10). Methods in this class are not thread-safe!
+    /// Contains method to compute neighbour-joining trees using the rapidNJ algorithm (doi:10.1007/978-3-540-87361-7_10). Methods in this class can be called concurrently from multiple threads.
     /// </summary>
     public static class RapidNJ
     {
@@ -0,0 +1,587 @@
+/*Benchmark of the distance kernels and NJ engines of rapidNJWrapper on synthetic alignments and distance matrices.
+
+The results are written to the standard output as CSV, with one line for each run and a header line. Runs that do not fit in the memory or disk budget, or that
+use a kernel that is not supported by the current CPU, are still listed, with a status other than "ok", so that the output of different machines can be compared
+line by line. Diagnostic messages are written to the standard error.
+
+Usage: rapidNJBenchmark [options], where the options are:
+	--benchmarks list	Comma-separated list of benchmarks to run among kernels, engines and matrices (default: all of them).
+	--types list		Comma-separated list of sequence types among dna and protein (default: both).
+	--taxa list		Comma-separated list of numbers of taxa (default: 1000,10000,100000).
+	--length n		Length of the alignments (default: 1000).
+	--threads list		Comma-separated list of thread counts (default: 1 and the number of hardware threads).
+	--repetitions n		Number of times each run is repeated (default: 3).
+	--memory n		Memory budget in MB, which the distance matrices and the planned memory of the engines must fit in (default: 4096).
+	--disk n		Disk budget in MB for RapidDiskNJ (default: 16384).
+	--cache-dir path	Directory of the temporary files of RapidDiskNJ (default: the current directory).
+	--sorted-percentage n	Percentage of the sorted matrix kept by memory efficient RapidNJ (default: 25).
+	--simple-nj-limit n	Largest number of taxa for naive NJ, whose running time is cubic (default: 10000).
+	--seed n		Seed of the synthetic data (default: 1).*/
+
+#include "rapidNJWrapper.h"
+#include <random>
+#include <thread>
+
+/*Settings of a benchmark run, filled from the command line.*/
+struct benchmarkSettings {
+	vector<string> benchmarks;
+	vector<InputType> types;
+	vector<int> taxa;
+	int length;
+	vector<int> threads;
+	int repetitions;
+	long long memoryBudget;
+	long long diskBudget;
+	string cacheDir;
+	int sortedPercentage;
+	int simpleNJLimit;
+	unsigned int seed;
+};
+
+/*What is measured in a run. Times are in seconds.*/
+struct benchmarkResult {
+	string status;
+	double wallTime;
+	double cpuTime;
+	rapidNJStatistics statistics;
+	long long plannedMemory;
+};
+
+/*A random alignment that evolved along a random tree. Each taxon descends from one of the previous ones, with a few substitutions and gaps.*/
+struct syntheticAlignment {
+	InputType type;
+	int sequenceCount;
+	int sequenceLength;
+	vector<string> names;
+	vector<int> nameLengths;
+	vector<char*> namePointers;
+	vector<string> sequences;
+	vector<char*> sequencePointers;
+};
+
+/*An algorithm, and the options of the context that select its implementation.*/
+struct engineConfiguration {
+	const char* name;
+	int algorithm;
+	int njEngine;
+	int diskMatrixBackend;
+};
+
+static const engineConfiguration engineConfigurations[] = {
+	{ "rapidNJ", TREE_ALGORITHM_RAPIDNJ, NJ_ENGINE_LIBRARY, DISK_MATRIX_STREAM },
+	{ "rapidNJ", TREE_ALGORITHM_RAPIDNJ, NJ_ENGINE_PARALLEL, DISK_MATRIX_STREAM },
+	{ "rapidNJ", TREE_ALGORITHM_RAPIDNJ, NJ_ENGINE_RELAXED, DISK_MATRIX_STREAM },
+	{ "rapidNJMem", TREE_ALGORITHM_RAPIDNJ_MEMORY_EFFICIENT, NJ_ENGINE_LIBRARY, DISK_MATRIX_STREAM },
+	{ "rapidNJMem", TREE_ALGORITHM_RAPIDNJ_MEMORY_EFFICIENT, NJ_ENGINE_PARALLEL, DISK_MATRIX_STREAM },
+	{ "rapidNJMem", TREE_ALGORITHM_RAPIDNJ_MEMORY_EFFICIENT, NJ_ENGINE_RELAXED, DISK_MATRIX_STREAM },
+	{ "rapidNJDisk", TREE_ALGORITHM_RAPIDNJ_DISK, NJ_ENGINE_LIBRARY, DISK_MATRIX_STREAM },
+	{ "rapidNJDisk", TREE_ALGORITHM_RAPIDNJ_DISK, NJ_ENGINE_LIBRARY, DISK_MATRIX_MAPPED },
+	{ "simpleNJ", TREE_ALGORITHM_SIMPLE_NJ, NJ_ENGINE_LIBRARY, DISK_MATRIX_STREAM }
+};
+
+/*Returns the name of an NJ engine, as printed in the variant column.*/
+static const char* getEngineName(int njEngine) {
+	switch (njEngine) {
+	case NJ_ENGINE_PARALLEL:
+		return "parallel";
+	case NJ_ENGINE_RELAXED:
+		return "relaxed";
+	default:
+		return "library";
+	}
+}
+
+static const distanceKernelType benchmarkKernels[] = { KERNEL_LIBRARY, KERNEL_SSE2, KERNEL_AVX2, KERNEL_AVX512, KERNEL_NEON, KERNEL_POPCNT, KERNEL_AVX512_VPOPCNT };
+
+static const char dnaAlphabet[] = "ACGT";
+static const char proteinAlphabet[] = "ARNDCQEGHILKMFPSTWYV";
+
+static vector<string> splitList(const string& list) {
+	vector<string> items;
+	size_t start = 0;
+	while (start <= list.length()) {
+		size_t end = list.find(',', start);
+		if (end == string::npos) {
+			end = list.length();
+		}
+		if (end > start) {
+			items.push_back(list.substr(start, end - start));
+		}
+		start = end + 1;
+	}
+	return items;
+}
+
+static vector<int> parseIntList(const string& list) {
+	vector<string> items = splitList(list);
+	vector<int> values;
+	for (size_t i = 0; i < items.size(); i++) {
+		values.push_back(atoi(items[i].c_str()));
+	}
+	return values;
+}
+
+static bool contains(const vector<string>& items, const string& item) {
+	return find(items.begin(), items.end(), item) != items.end();
+}
+
+static const char* getTypeName(InputType type) {
+	return type == DNA ? "dna" : "protein";
+}
+
+// The inputType of the exported functions.
+static int getInputTypeCode(InputType type) {
+	return type == DNA ? 0 : 1;
+}
+
+static bool parseSettings(int argc, char** argv, benchmarkSettings& settings) {
+	settings.benchmarks = splitList("kernels,engines,matrices");
+	settings.types.push_back(DNA);
+	settings.types.push_back(PROTEIN);
+	settings.taxa = parseIntList("1000,10000,100000");
+	settings.length = 1000;
+	settings.threads.push_back(1);
+	int hardwareThreads = (int)std::thread::hardware_concurrency();
+	if (hardwareThreads > 1) {
+		settings.threads.push_back(hardwareThreads);
+	}
+	settings.repetitions = 3;
+	settings.memoryBudget = 4096LL * 1024 * 1024;
+	settings.diskBudget = 16384LL * 1024 * 1024;
+	settings.cacheDir = ".";
+	settings.sortedPercentage = 25;
+	settings.simpleNJLimit = 10000;
+	settings.seed = 1;
+
+	for (int i = 1; i < argc; i++) {
+		string option = argv[i];
+		if (i + 1 >= argc) {
+			cerr << "Missing value for option " << option << endl;
+			return false;
+		}
+		string value = argv[++i];
+
+		if (option == "--benchmarks") {
+			settings.benchmarks = splitList(value);
+		}
+		else if (option == "--types") {
+			vector<string> types = splitList(value);
+			settings.types.clear();
+			for (size_t j = 0; j < types.size(); j++) {
+				if (types[j] == "dna") {
+					settings.types.push_back(DNA);
+				}
+				else if (types[j] == "protein") {
+					settings.types.push_back(PROTEIN);
+				}
+				else {
+					cerr << "Unknown sequence type " << types[j] << endl;
+					return false;
+				}
+			}
+		}
+		else if (option == "--taxa") {
+			settings.taxa = parseIntList(value);
+		}
+		else if (option == "--length") {
+			settings.length = atoi(value.c_str());
+		}
+		else if (option == "--threads") {
+			settings.threads = parseIntList(value);
+		}
+		else if (option == "--repetitions") {
+			settings.repetitions = atoi(value.c_str());
+		}
+		else if (option == "--memory") {
+			settings.memoryBudget = atoll(value.c_str()) * 1024 * 1024;
+		}
+		else if (option == "--disk") {
+			settings.diskBudget = atoll(value.c_str()) * 1024 * 1024;
+		}
+		else if (option == "--cache-dir") {
+			settings.cacheDir = value;
+		}
+		else if (option == "--sorted-percentage") {
+			settings.sortedPercentage = atoi(value.c_str());
+		}
+		else if (option == "--simple-nj-limit") {
+			settings.simpleNJLimit = atoi(value.c_str());
+		}
+		else if (option == "--seed") {
+			settings.seed = (unsigned int)atoi(value.c_str());
+		}
+		else {
+			cerr << "Unknown option " << option << endl;
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < settings.taxa.size(); i++) {
+		if (settings.taxa[i] < 3) {
+			cerr << "The number of taxa must be at least 3" << endl;
+			return false;
+		}
+	}
+	for (size_t i = 0; i < settings.threads.size(); i++) {
+		settings.threads[i] = max(settings.threads[i], 1);
+	}
+	settings.length = max(settings.length, 1);
+	settings.repetitions = max(settings.repetitions, 1);
+	settings.sortedPercentage = min(max(settings.sortedPercentage, 1), 100);
+	return true;
+}
+
+static void makeNames(int sequenceCount, vector<string>& names, vector<int>& nameLengths, vector<char*>& namePointers) {
+	names.resize(sequenceCount);
+	nameLengths.resize(sequenceCount);
+	namePointers.resize(sequenceCount);
+	for (int i = 0; i < sequenceCount; i++) {
+		ostringstream name;
+		name << "t" << i;
+		names[i] = name.str();
+	}
+	// The pointers are taken once all the names are stored, so that they cannot be invalidated.
+	for (int i = 0; i < sequenceCount; i++) {
+		nameLengths[i] = (int)names[i].length();
+		namePointers[i] = &names[i][0];
+	}
+}
+
+static void makeAlignment(InputType type, int sequenceCount, int sequenceLength, unsigned int seed, syntheticAlignment& alignment) {
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	const char* alphabet = type == DNA ? dnaAlphabet : proteinAlphabet;
+	int alphabetSize = type == DNA ? 4 : 20;
+
+	alignment.type = type;
+	alignment.sequenceCount = sequenceCount;
+	alignment.sequenceLength = sequenceLength;
+	makeNames(sequenceCount, alignment.names, alignment.nameLengths, alignment.namePointers);
+	alignment.sequences.resize(sequenceCount);
+	alignment.sequencePointers.resize(sequenceCount);
+
+	alignment.sequences[0].resize(sequenceLength);
+	for (int j = 0; j < sequenceLength; j++) {
+		alignment.sequences[0][j] = alphabet[rng() % alphabetSize];
+	}
+
+	for (int i = 1; i < sequenceCount; i++) {
+		const string& parent = alignment.sequences[rng() % i];
+		string& sequence = alignment.sequences[i];
+		sequence = parent;
+		double substitutionRate = 0.005 + 0.045 * uniform(rng);
+		for (int j = 0; j < sequenceLength; j++) {
+			double draw = uniform(rng);
+			if (draw < 0.002) {
+				sequence[j] = '-';
+			}
+			else if (draw < substitutionRate || sequence[j] == '-') {
+				if (type == DNA && uniform(rng) < 2.0 / 3.0) {
+					// Transitions are twice as frequent as transversions.
+					switch (sequence[j]) {
+					case 'A': sequence[j] = 'G'; break;
+					case 'G': sequence[j] = 'A'; break;
+					case 'C': sequence[j] = 'T'; break;
+					case 'T': sequence[j] = 'C'; break;
+					default: sequence[j] = alphabet[rng() % alphabetSize]; break;
+					}
+				}
+				else {
+					sequence[j] = alphabet[rng() % alphabetSize];
+				}
+			}
+		}
+	}
+
+	for (int i = 0; i < sequenceCount; i++) {
+		alignment.sequencePointers[i] = &alignment.sequences[i][0];
+	}
+}
+
+static distType** allocateMatrix(int sequenceCount) {
+	distType** matrix = new distType*[sequenceCount];
+	for (int i = 0; i < sequenceCount; i++) {
+		matrix[i] = new distType[sequenceCount];
+	}
+	return matrix;
+}
+
+static void deleteMatrix(distType** matrix, int sequenceCount) {
+	for (int i = 0; i < sequenceCount; i++) {
+		delete[] matrix[i];
+	}
+	delete[] matrix;
+}
+
+/*Fills a full matrix with the additive distances of a random tree, with some noise. Each taxon is attached to one of the previous ones by a branch of random length.*/
+static void makeDistanceMatrix(int sequenceCount, unsigned int seed, distType** matrix) {
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+	matrix[0][0] = 0;
+	for (int i = 1; i < sequenceCount; i++) {
+		int parent = rng() % i;
+		double branchLength = 0.001 + 0.05 * uniform(rng);
+		for (int j = 0; j < i; j++) {
+			double distance = (j == parent ? 0 : matrix[parent][j]) + branchLength;
+			matrix[i][j] = matrix[j][i] = (distType)(distance * (0.98 + 0.04 * uniform(rng)));
+		}
+		matrix[i][i] = 0;
+	}
+}
+
+static double megabytes(long long bytes) {
+	return bytes / 1024.0 / 1024.0;
+}
+
+static void noProgress(double /*progress*/) {
+}
+
+// The trees are discarded, only their length is kept so that the serialization cannot be skipped.
+static size_t treeLength = 0;
+
+static void discardTree(size_t length, const char* /*tree*/) {
+	treeLength += length;
+}
+
+static void printHeader() {
+	cout << "benchmark,type,taxa,length,method,engine,threads,repetition,status,wall_time,cpu_time,encoding_time,distance_time,initialization_time,nj_time,serialization_time,pairs_per_second,planned_memory_mb,nj_iterations,sorted_entries_scanned" << endl;
+}
+
+static void printResult(const char* benchmark, const char* type, int taxa, int length, const string& method, const char* engine, int threads, int repetition, const benchmarkResult& result) {
+	const rapidNJStatistics& statistics = result.statistics;
+	double pairs = (double)taxa * (taxa - 1) / 2;
+	double distanceTime = statistics.distanceEstimation.wallTime;
+	// When the engine computes the distances itself, they are part of the construction of the sorted rows.
+	double pairsPerSecond = distanceTime > 0 ? pairs / distanceTime : 0;
+
+	cout << benchmark << "," << type << "," << taxa << "," << length << "," << method << "," << engine << "," << threads << "," << repetition << "," << result.status << ",";
+	cout << result.wallTime << "," << result.cpuTime << "," << statistics.encoding.wallTime << "," << distanceTime << ",";
+	cout << (statistics.matrixInitialization.wallTime + statistics.sortedRowBuild.wallTime) << "," << statistics.njIterations.wallTime << "," << statistics.serialization.wallTime << ",";
+	cout << pairsPerSecond << "," << megabytes(result.plannedMemory) << "," << statistics.njIterationCount << "," << statistics.sortedEntriesScanned << endl;
+}
+
+static benchmarkResult skippedResult(const string& status, long long plannedMemory) {
+	benchmarkResult result;
+	memset(&result.statistics, 0, sizeof(result.statistics));
+	result.status = status;
+	result.wallTime = 0;
+	result.cpuTime = 0;
+	result.plannedMemory = plannedMemory;
+	return result;
+}
+
+static rapidNJContext* createContext(const benchmarkSettings& settings, int threads) {
+	rapidNJContext* ctx = CreateRapidNJContext();
+	SetRapidNJContextOption(ctx, OPTION_MAX_MEMORY, (int)min(settings.memoryBudget / 1024 / 1024, (long long)INT_MAX));
+	SetRapidNJContextOption(ctx, OPTION_NUM_CORES, threads);
+	SetRapidNJContextOption(ctx, OPTION_COLLECT_STATISTICS, 1);
+	return ctx;
+}
+
+// The options that force an algorithm are not exposed through SetRapidNJContextOption, so they are set directly as the command line of rapidNJ would.
+static void forceAlgorithm(rapidNJContext* ctx, const benchmarkSettings& settings, const engineConfiguration& engine) {
+	SetRapidNJContextOption(ctx, OPTION_NJ_ENGINE, engine.njEngine);
+	SetRapidNJContextOption(ctx, OPTION_DISK_MATRIX_BACKEND, engine.diskMatrixBackend);
+	switch (engine.algorithm) {
+	case TREE_ALGORITHM_RAPIDNJ:
+		ctx->options.rapidNJ = true;
+		break;
+	case TREE_ALGORITHM_RAPIDNJ_MEMORY_EFFICIENT: {
+		ostringstream percentage;
+		percentage << settings.sortedPercentage;
+		ctx->options.percentageMemoryUsage = percentage.str();
+		break;
+	}
+	case TREE_ALGORITHM_SIMPLE_NJ:
+		ctx->options.simpleNJ = true;
+		break;
+	default:
+		// RapidDiskNJ is used when a cache directory is given and no other algorithm is requested.
+		ctx->options.cacheDir = settings.cacheDir;
+		break;
+	}
+}
+
+static benchmarkResult finishRun(rapidNJContext* ctx, double startWallTime, double startCpuTime, long long plannedMemory) {
+	benchmarkResult result;
+	result.wallTime = getWallTime() - startWallTime;
+	result.cpuTime = getProcessCpuTime() - startCpuTime;
+	result.status = "ok";
+	result.plannedMemory = plannedMemory;
+	GetRapidNJContextStatistics(ctx, &result.statistics);
+	return result;
+}
+
+/*Times the computation of a distance matrix from an alignment, with the library estimators or with the distance kernels.*/
+static void runKernelBenchmark(const benchmarkSettings& settings, const syntheticAlignment& alignment) {
+	const char* distanceNames[] = { "jc", "kimura" };
+	long long matrixBytes = (long long)alignment.sequenceCount * alignment.sequenceCount * sizeof(distType);
+
+	for (size_t k = 0; k < sizeof(benchmarkKernels) / sizeof(benchmarkKernels[0]); k++) {
+		distanceKernelType kernel = benchmarkKernels[k];
+		for (int distance = 0; distance < 2; distance++) {
+			string method;
+			if (kernel == KERNEL_LIBRARY) {
+				method = string(distance == 0 ? "JCdistance" : "KimuraDistance") + "/" + (alignment.type == DNA ? "bitDistanceGap" : "bitDistanceProtein");
+			}
+			else {
+				method = string(distanceNames[distance]) + "/" + getDistanceKernels(kernel).name;
+			}
+
+			for (size_t t = 0; t < settings.threads.size(); t++) {
+				for (int repetition = 0; repetition < settings.repetitions; repetition++) {
+					benchmarkResult result;
+					if (kernel != KERNEL_LIBRARY && !isDistanceKernelSupported(kernel)) {
+						result = skippedResult("unsupported", 0);
+					}
+					else if (matrixBytes > settings.memoryBudget) {
+						result = skippedResult("memory", matrixBytes);
+					}
+					else {
+						rapidNJContext* ctx = createContext(settings, settings.threads[t]);
+						SetRapidNJContextOption(ctx, OPTION_DISTANCE, distance);
+						SetRapidNJContextOption(ctx, OPTION_DISTANCE_KERNEL, kernel);
+						distType** matrix = allocateMatrix(alignment.sequenceCount);
+
+						double startWallTime = getWallTime();
+						double startCpuTime = getProcessCpuTime();
+						ContextBuildDistanceMatrixFromAlignment(ctx, getInputTypeCode(alignment.type), alignment.sequenceCount, alignment.sequenceLength, (int*)&alignment.nameLengths[0], (char**)&alignment.namePointers[0], (char**)&alignment.sequencePointers[0], matrix);
+						result = finishRun(ctx, startWallTime, startCpuTime, matrixBytes);
+
+						deleteMatrix(matrix, alignment.sequenceCount);
+						DestroyRapidNJContext(ctx);
+					}
+					printResult("kernels", getTypeName(alignment.type), alignment.sequenceCount, alignment.sequenceLength, method, "", settings.threads[t], repetition, result);
+				}
+			}
+		}
+	}
+}
+
+/*Times the construction of a tree from an alignment with each algorithm, using the fastest distance kernels.*/
+static void runEngineBenchmark(const benchmarkSettings& settings, const syntheticAlignment& alignment) {
+	for (size_t e = 0; e < sizeof(engineConfigurations) / sizeof(engineConfigurations[0]); e++) {
+		const engineConfiguration& engine = engineConfigurations[e];
+		const char* variant = engine.algorithm == TREE_ALGORITHM_RAPIDNJ_DISK ? (engine.diskMatrixBackend == DISK_MATRIX_MAPPED ? "mapped" : "stream") : getEngineName(engine.njEngine);
+
+		for (size_t t = 0; t < settings.threads.size(); t++) {
+			for (int repetition = 0; repetition < settings.repetitions; repetition++) {
+				rapidNJContext* ctx = createContext(settings, settings.threads[t]);
+				forceAlgorithm(ctx, settings, engine);
+
+				rapidNJPlan plan;
+				ContextPlanTreeFromAlignment(ctx, getInputTypeCode(alignment.type), alignment.sequenceCount, alignment.sequenceLength, &plan);
+
+				benchmarkResult result;
+				if (engine.algorithm == TREE_ALGORITHM_SIMPLE_NJ && alignment.sequenceCount > settings.simpleNJLimit) {
+					result = skippedResult("size", plan.peakMemory);
+				}
+				else if (plan.peakMemory > settings.memoryBudget) {
+					result = skippedResult("memory", plan.peakMemory);
+				}
+				else if (plan.diskMemory > settings.diskBudget) {
+					result = skippedResult("disk", plan.peakMemory);
+				}
+				else {
+					double startWallTime = getWallTime();
+					double startCpuTime = getProcessCpuTime();
+					ContextBuildTreeFromAlignment(ctx, getInputTypeCode(alignment.type), alignment.sequenceCount, alignment.sequenceLength, (int*)&alignment.nameLengths[0], (char**)&alignment.namePointers[0], (char**)&alignment.sequencePointers[0], noProgress, discardTree);
+					result = finishRun(ctx, startWallTime, startCpuTime, plan.peakMemory);
+				}
+				DestroyRapidNJContext(ctx);
+
+				printResult("engines", getTypeName(alignment.type), alignment.sequenceCount, alignment.sequenceLength, engine.name, variant, settings.threads[t], repetition, result);
+			}
+		}
+	}
+}
+
+/*Times the construction of a tree from a distance matrix passed by pointer. RapidDiskNJ only works on alignments and distance matrix files, so it is not part of this benchmark.*/
+static void runMatrixBenchmark(const benchmarkSettings& settings, int sequenceCount, unsigned int seed) {
+	distType** matrix = NULL;
+	vector<string> names;
+	vector<int> nameLengths;
+	vector<char*> namePointers;
+
+	for (size_t e = 0; e < sizeof(engineConfigurations) / sizeof(engineConfigurations[0]); e++) {
+		const engineConfiguration& engine = engineConfigurations[e];
+		if (engine.algorithm == TREE_ALGORITHM_RAPIDNJ_DISK) {
+			continue;
+		}
+		const char* variant = getEngineName(engine.njEngine);
+
+		for (size_t t = 0; t < settings.threads.size(); t++) {
+			for (int repetition = 0; repetition < settings.repetitions; repetition++) {
+				rapidNJContext* ctx = createContext(settings, settings.threads[t]);
+				forceAlgorithm(ctx, settings, engine);
+
+				rapidNJPlan plan;
+				ContextPlanTreeFromDistanceMatrix(ctx, sequenceCount, false, &plan);
+
+				benchmarkResult result;
+				if (engine.algorithm == TREE_ALGORITHM_SIMPLE_NJ && sequenceCount > settings.simpleNJLimit) {
+					result = skippedResult("size", plan.peakMemory);
+				}
+				else if (plan.peakMemory > settings.memoryBudget) {
+					result = skippedResult("memory", plan.peakMemory);
+				}
+				else {
+					// The matrix is only generated once one of the runs fits in memory, and the engines do not modify matrices passed by pointer.
+					if (matrix == NULL) {
+						matrix = allocateMatrix(sequenceCount);
+						makeDistanceMatrix(sequenceCount, seed, matrix);
+						makeNames(sequenceCount, names, nameLengths, namePointers);
+					}
+
+					double startWallTime = getWallTime();
+					double startCpuTime = getProcessCpuTime();
+					ContextBuildTreeFromDistanceMatrix(ctx, sequenceCount, &nameLengths[0], &namePointers[0], false, matrix, noProgress, discardTree);
+					result = finishRun(ctx, startWallTime, startCpuTime, plan.peakMemory);
+				}
+				DestroyRapidNJContext(ctx);
+
+				printResult("matrices", "distance", sequenceCount, 0, engine.name, variant, settings.threads[t], repetition, result);
+			}
+		}
+	}
+
+	if (matrix != NULL) {
+		deleteMatrix(matrix, sequenceCount);
+	}
+}
+
+int main(int argc, char** argv) {
+	benchmarkSettings settings;
+	if (!parseSettings(argc, argv, settings)) {
+		return 1;
+	}
+
+	printHeader();
+
+	for (size_t i = 0; i < settings.taxa.size(); i++) {
+		int sequenceCount = settings.taxa[i];
+
+		if (contains(settings.benchmarks, "kernels") || contains(settings.benchmarks, "engines")) {
+			for (size_t j = 0; j < settings.types.size(); j++) {
+				cerr << "Generating " << sequenceCount << " " << getTypeName(settings.types[j]) << " sequences of length " << settings.length << endl;
+				syntheticAlignment alignment;
+				makeAlignment(settings.types[j], sequenceCount, settings.length, settings.seed + i, alignment);
+
+				if (contains(settings.benchmarks, "kernels")) {
+					runKernelBenchmark(settings, alignment);
+				}
+				if (contains(settings.benchmarks, "engines")) {
+					runEngineBenchmark(settings, alignment);
+				}
+			}
+		}
+
+		if (contains(settings.benchmarks, "matrices")) {
+			runMatrixBenchmark(settings, sequenceCount, settings.seed + i);
+		}
+	}
+
+	cerr << "Done, " << treeLength << " bytes of trees were discarded" << endl;
+	return 0;
+}
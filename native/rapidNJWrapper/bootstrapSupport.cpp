@@ -0,0 +1,125 @@
+#include "bootstrapSupport.hpp"
+#include "treeExport.hpp"
+
+// splitmix64, used to derive the same keys for the leaves of all the trees.
+static unsigned long long mixBits(unsigned long long x) {
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+static inline bool equalSplits(splitHash a, splitHash b) {
+	return a.low == b.low && a.high == b.high;
+}
+
+// Splits are listed in node order, with the edge between the two root nodes in place of the edge above rootLeftIndex; rootRightIndex has no split.
+// Leaves are included, since their edges are part of the tree even though every replicate has them.
+vector<splitHash> bootstrapSupport::getSplits(polytree* tree) {
+	polytreeTopology topology = getPolytreeTopology(tree);
+	vector<splitHash> splits(topology.nodeCount);
+	vector<char> hasFirstLeaf(topology.nodeCount, 0);
+
+	for (int i = 0; i < topology.leafCount; i++) {
+		splits[i].low = mixBits(2 * (unsigned long long)i);
+		splits[i].high = mixBits(2 * (unsigned long long)i + 1);
+	}
+	hasFirstLeaf[0] = 1;
+
+	// Internal nodes are created after their children, so the subtrees can be combined in node order.
+	for (int i = topology.leafCount; i < topology.nodeCount; i++) {
+		int left = topology.leftChildIndices[i - topology.leafCount];
+		int right = topology.rightChildIndices[i - topology.leafCount];
+		splits[i].low = splits[left].low ^ splits[right].low;
+		splits[i].high = splits[left].high ^ splits[right].high;
+		hasFirstLeaf[i] = hasFirstLeaf[left] | hasFirstLeaf[right];
+	}
+
+	// The leaves on the other side of an edge are those of the whole tree, minus those below it.
+	splitHash allLeaves;
+	allLeaves.low = splits[topology.rootLeftIndex].low ^ splits[topology.rootRightIndex].low;
+	allLeaves.high = splits[topology.rootLeftIndex].high ^ splits[topology.rootRightIndex].high;
+	for (int i = 0; i < topology.nodeCount; i++) {
+		if (hasFirstLeaf[i]) {
+			splits[i].low ^= allLeaves.low;
+			splits[i].high ^= allLeaves.high;
+		}
+	}
+	if (topology.rootRightIndex >= 0 && topology.rootRightIndex < topology.nodeCount) {
+		splits[topology.rootRightIndex].low = 0;
+		splits[topology.rootRightIndex].high = 0;
+	}
+	return splits;
+}
+
+bootstrapSupport::bootstrapSupport(polytree* reference) {
+	bootstrapSupport::reference = reference;
+	polytreeTopology topology = getPolytreeTopology(reference);
+	rootLeftIndex = topology.rootLeftIndex;
+	rootRightIndex = topology.rootRightIndex;
+
+	if (reference->bootstrap_counts == NULL) {
+		reference->bootstrap_counts = new int[topology.nodeCount];
+		memset(reference->bootstrap_counts, 0, topology.nodeCount * sizeof(int));
+	}
+
+	// At most half of the slots are used.
+	unsigned int slotCount = 16;
+	while (slotCount < 2 * (unsigned int)topology.nodeCount) {
+		slotCount *= 2;
+	}
+	slotMask = slotCount - 1;
+	slotNodes = new int[slotCount];
+	slotSplits = new splitHash[slotCount];
+	for (unsigned int i = 0; i < slotCount; i++) {
+		slotNodes[i] = -1;
+	}
+
+	vector<splitHash> splits = getSplits(reference);
+	for (int i = 0; i < topology.nodeCount; i++) {
+		if (i == rootRightIndex) {
+			continue;
+		}
+		int slot = findSlot(splits[i]);
+		// A split can only appear once in a tree; should two edges still have the same hash, only the first one is counted.
+		if (slotNodes[slot] == -1) {
+			slotNodes[slot] = i;
+			slotSplits[slot] = splits[i];
+		}
+	}
+}
+
+bootstrapSupport::~bootstrapSupport() {
+	delete[] slotNodes;
+	delete[] slotSplits;
+}
+
+// Returns the slot holding the split, or the empty slot where it would be inserted.
+int bootstrapSupport::findSlot(splitHash split) {
+	unsigned int slot = (unsigned int)split.low & slotMask;
+	while (slotNodes[slot] != -1 && !equalSplits(slotSplits[slot], split)) {
+		slot = (slot + 1) & slotMask;
+	}
+	return (int)slot;
+}
+
+void bootstrapSupport::addReplicate(const vector<splitHash>& splits) {
+	for (unsigned int i = 0; i < splits.size(); i++) {
+		if (splits[i].low == 0 && splits[i].high == 0) {
+			continue;
+		}
+		int node = slotNodes[findSlot(splits[i])];
+		if (node != -1) {
+			reference->bootstrap_counts[node]++;
+			// The count of the root edge is kept on both of its nodes.
+			if (node == rootLeftIndex) {
+				reference->bootstrap_counts[rootRightIndex]++;
+			}
+		}
+	}
+	getBootstrapReplicateCount(reference)++;
+}
+
+void bootstrapSupport::addReplicate(polytree* replicate) {
+	addReplicate(getSplits(replicate));
+}
@@ -0,0 +1,41 @@
+#ifndef BOOTSTRAP_SUPPORT_HPP
+#define BOOTSTRAP_SUPPORT_HPP
+
+#include "stdinclude.h"
+#include "polytree.h"
+
+/*A split of the leaves of an unrooted tree, identified by a 128-bit hash: each leaf has a random key, and a split is the XOR of the keys of the leaves on the side
+that does not contain leaf 0. Both sides of an edge, and the same edge in trees with different roots, give the same hash.*/
+struct splitHash {
+	unsigned long long low;
+	unsigned long long high;
+};
+
+/*Counts how many bootstrap replicates contain each edge of a reference tree, replacing polytree::compareTreeBootstrap. The splits of the reference tree are kept in
+an open addressing hash table, so that comparing a replicate takes time linear in the number of leaves and allocates a single array.*/
+class bootstrapSupport {
+
+public:
+	bootstrapSupport(polytree* reference);
+	~bootstrapSupport();
+
+	/*Returns the splits of the edges of a tree, which can be computed from several threads at once.*/
+	static vector<splitHash> getSplits(polytree* tree);
+
+	/*Adds 1 to the bootstrap counts of the reference tree for each of its edges that has one of the splits, and counts one more replicate.*/
+	void addReplicate(const vector<splitHash>& splits);
+
+	void addReplicate(polytree* replicate);
+
+private:
+	polytree* reference;
+	// Node whose bootstrap count is incremented for each slot of the table, or -1 for empty slots.
+	int* slotNodes;
+	splitHash* slotSplits;
+	unsigned int slotMask;
+	int rootLeftIndex;
+	int rootRightIndex;
+	int findSlot(splitHash split);
+};
+
+#endif
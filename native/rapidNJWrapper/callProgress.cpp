@@ -0,0 +1,73 @@
+#include "callProgress.hpp"
+#include "callStatistics.hpp"
+#include <limits>
+
+// The ProgressBar callbacks take no argument to find the call with, so each thread has its own.
+static thread_local callProgress* currentProgress = NULL;
+
+callProgress::callProgress(rapidNJProgress* block, progress_callback callback, double callbackInterval) {
+	callProgress::block = block;
+	callProgress::callback = callback;
+	callProgress::callbackInterval = callbackInterval;
+	lastCallbackTime = -numeric_limits<double>::max();
+	lastProgress = 0;
+	callbackPending = false;
+	if (block != NULL) {
+		storeProgress(&block->progress, 0);
+		storeFlag(&block->cancelled, 0);
+	}
+	previous = setCurrent(this);
+}
+
+callProgress::~callProgress() {
+	// The last update is never dropped by the interval.
+	if (callbackPending) {
+		callback(lastProgress);
+	}
+	setCurrent(previous);
+}
+
+progress_callback callProgress::getCallback() {
+	if (block == NULL && callbackInterval <= 0) {
+		return callback;
+	}
+	return callProgress::reportProgress;
+}
+
+void callProgress::setProgress(double progress) {
+	lastProgress = progress;
+	if (block != NULL) {
+		storeProgress(&block->progress, progress);
+	}
+	if (callback == NULL) {
+		return;
+	}
+	double time = getWallTime();
+	if (progress >= 1 || time - lastCallbackTime >= callbackInterval) {
+		lastCallbackTime = time;
+		callbackPending = false;
+		callback(progress);
+	}
+	else {
+		callbackPending = true;
+	}
+}
+
+void callProgress::setCancelled() {
+	callbackPending = false;
+	if (block != NULL) {
+		storeFlag(&block->cancelled, 1);
+	}
+}
+
+callProgress* callProgress::setCurrent(callProgress* progress) {
+	callProgress* retVal = currentProgress;
+	currentProgress = progress;
+	return retVal;
+}
+
+void callProgress::reportProgress(double progress) {
+	if (currentProgress != NULL) {
+		currentProgress->setProgress(progress);
+	}
+}
@@ -0,0 +1,88 @@
+#ifndef CALL_PROGRESS_HPP
+#define CALL_PROGRESS_HPP
+
+#include "stdinclude.h"
+#include "ProgressBar.hpp"
+#if defined _MSC_VER
+#include <intrin.h>
+#endif
+
+/*Progress and cancellation of the calls made with a context, in memory owned by the caller, see SetRapidNJContextProgress. Each field is an aligned word that is only
+read and written whole, so the caller can poll the block and cancel the call from any thread while the call runs, without locks and without callbacks.*/
+struct rapidNJProgress {
+	// Fraction of the call done so far, from 0 to 1. Written by the call.
+	double progress;
+	// Set to a non-zero value by the caller to cancel the call. Never cleared by the call, so it must be reset before the block is used by the next call.
+	int cancel;
+	// Set to 1 by the call when it returns without a result because it was cancelled, and to 0 when it starts.
+	int cancelled;
+};
+
+/*Reports the progress of a call to the rapidNJProgress block of its context and to its progress callback, and tells the engines whether the call was cancelled.
+The library engines only know the ProgressBar of the call, which is given the callback returned by getCallback: it forwards the progress to the callProgress of the
+thread it is called from, writes it to the block, and only calls the progress callback of the caller once per interval, so that frequent updates stay cheap.*/
+class callProgress {
+
+public:
+	/*block and callback may be NULL. callbackInterval is the minimum time between two calls of callback, in seconds. The object becomes the callProgress of the
+	calling thread until it is destroyed.*/
+	callProgress(rapidNJProgress* block, progress_callback callback, double callbackInterval);
+	~callProgress();
+
+	/*The callback to create the ProgressBar of the call with. Without block and interval, it is the callback of the caller itself.*/
+	progress_callback getCallback();
+
+	/*Reports progress, from 0 to 1, as if the ProgressBar had.*/
+	void setProgress(double progress);
+
+	/*Returns true once the caller has set the cancel flag of the block. It only reads the flag, so it can be polled in every iteration and tile.*/
+	bool isCancelled() {
+		return block != NULL && loadFlag(&block->cancel) != 0;
+	}
+
+	/*Records in the block that the call returns without a result.*/
+	void setCancelled();
+
+	/*Makes progress the callProgress of the calling thread, which receives the progress reported through getCallback, and returns the previous one. Used by workers that
+	report the progress of the call from their own threads.*/
+	static callProgress* setCurrent(callProgress* progress);
+
+private:
+	rapidNJProgress* block;
+	progress_callback callback;
+	double callbackInterval;
+	double lastCallbackTime;
+	double lastProgress;
+	// Whether lastProgress is yet to be passed to callback.
+	bool callbackPending;
+	callProgress* previous;
+
+	static void reportProgress(double progress);
+
+	// The block is a plain struct shared with the caller, so its fields are accessed with the atomic intrinsics of the compiler rather than through std::atomic.
+	static int loadFlag(int* flag) {
+#if defined _MSC_VER
+		return _InterlockedCompareExchange((volatile long*)flag, 0, 0);
+#else
+		return __atomic_load_n(flag, __ATOMIC_ACQUIRE);
+#endif
+	}
+
+	static void storeFlag(int* flag, int value) {
+#if defined _MSC_VER
+		_InterlockedExchange((volatile long*)flag, value);
+#else
+		__atomic_store_n(flag, value, __ATOMIC_RELEASE);
+#endif
+	}
+
+	static void storeProgress(double* progress, double value) {
+#if defined _MSC_VER
+		_InterlockedExchange64((volatile __int64*)progress, *(__int64*)&value);
+#else
+		__atomic_store(progress, &value, __ATOMIC_RELAXED);
+#endif
+	}
+};
+
+#endif
@@ -0,0 +1,87 @@
+#include "callStatistics.hpp"
+#include <chrono>
+
+#ifdef __WINDOWS__
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+statisticsCollector::statisticsCollector() {
+	pthread_mutex_init(&mutex, NULL);
+	reset();
+}
+
+statisticsCollector::~statisticsCollector() {
+	pthread_mutex_destroy(&mutex);
+}
+
+void statisticsCollector::reset() {
+	pthread_mutex_lock(&mutex);
+	memset(&values, 0, sizeof(values));
+	pthread_mutex_unlock(&mutex);
+}
+
+rapidNJStatistics statisticsCollector::get() {
+	pthread_mutex_lock(&mutex);
+	rapidNJStatistics retVal = values;
+	pthread_mutex_unlock(&mutex);
+	return retVal;
+}
+
+void statisticsCollector::addTime(phaseTime rapidNJStatistics::* phase, double wallTime, double cpuTime) {
+	pthread_mutex_lock(&mutex);
+	(values.*phase).wallTime += wallTime;
+	(values.*phase).cpuTime += cpuTime;
+	pthread_mutex_unlock(&mutex);
+}
+
+void statisticsCollector::addCount(long long rapidNJStatistics::* counter, long long count) {
+	pthread_mutex_lock(&mutex);
+	values.*counter += count;
+	pthread_mutex_unlock(&mutex);
+}
+
+phaseTimer::phaseTimer(statisticsCollector* statistics, phaseTime rapidNJStatistics::* phase) {
+	phaseTimer::statistics = statistics;
+	phaseTimer::phase = phase;
+	if (statistics != NULL) {
+		startWallTime = getWallTime();
+		startCpuTime = getProcessCpuTime();
+	}
+}
+
+phaseTimer::~phaseTimer() {
+	stop();
+}
+
+void phaseTimer::stop() {
+	if (statistics != NULL) {
+		statistics->addTime(phase, getWallTime() - startWallTime, getProcessCpuTime() - startCpuTime);
+		statistics = NULL;
+	}
+}
+
+double getWallTime() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double getProcessCpuTime() {
+#ifdef __WINDOWS__
+	FILETIME creationTime, exitTime, kernelTime, userTime;
+	if (!GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime)) {
+		return 0;
+	}
+	// FILETIMEs are in units of 100 ns.
+	unsigned long long kernel = ((unsigned long long)kernelTime.dwHighDateTime << 32) | kernelTime.dwLowDateTime;
+	unsigned long long user = ((unsigned long long)userTime.dwHighDateTime << 32) | userTime.dwLowDateTime;
+	return (kernel + user) * 1e-7;
+#else
+	struct timespec time;
+	if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time) != 0) {
+		return 0;
+	}
+	return time.tv_sec + time.tv_nsec * 1e-9;
+#endif
+}
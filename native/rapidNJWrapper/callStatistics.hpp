@@ -0,0 +1,84 @@
+#ifndef CALL_STATISTICS_HPP
+#define CALL_STATISTICS_HPP
+
+#include "stdinclude.h"
+
+/*Time spent in a phase of a call, in seconds. cpuTime is the processor time of the whole process, so it includes all the threads that took part in the phase.*/
+struct phaseTime {
+	double wallTime;
+	double cpuTime;
+};
+
+/*Where the time of the last call made with a context went. Phases that did not run are 0. When replicates are computed concurrently, their phases overlap, so the times
+of the bootstrap phases can add up to more than the duration of the call.
+The engine counters are only collected by the wrapper's own code (rapidNJParallel and mappedMatrix); the rapidNJ, rapidNJMem and rapidNJDisk classes of the library do not expose them.*/
+struct rapidNJStatistics {
+	// Conversion of the sequences into bit strings.
+	phaseTime encoding;
+	// Computation of the distance matrix, when it is separate from the tree.
+	phaseTime distanceEstimation;
+	// Conversion of the distance matrix for the NJ engine, and computation of the separation sums.
+	phaseTime matrixInitialization;
+	// Construction of the sorted rows of rapidNJParallel, which also includes the distances computed by the engine itself.
+	phaseTime sortedRowBuild;
+	// NJ iterations. For the library engines, this also includes their own initialisation of the sorted matrix.
+	phaseTime njIterations;
+	// Resampling of the bootstrap replicates.
+	phaseTime bootstrapSampling;
+	// Comparison of the bootstrap replicates with the tree.
+	phaseTime treeComparison;
+	// Conversion of the tree into a Newick string or a rapidNJTree.
+	phaseTime serialization;
+
+	// Number of iterations of rapidNJParallel, and number of sorted row entries that they read while looking for the pair of clusters to join.
+	long long njIterationCount;
+	long long sortedEntriesScanned;
+	// Rows that ran out of entries and were rebuilt from the distance matrix.
+	long long rowsRebuilt;
+	// Rows whose entries for clusters that were already joined were removed.
+	long long rowsCompacted;
+	// Bytes of a mappedMatrix read ahead and written behind by its I/O thread.
+	long long mappedBytesPrefetched;
+	long long mappedBytesWrittenBehind;
+};
+
+/*Collects the statistics of a call. All the methods can be called from several threads at once.*/
+class statisticsCollector {
+
+public:
+	statisticsCollector();
+	~statisticsCollector();
+	void reset();
+	rapidNJStatistics get();
+	void addTime(phaseTime rapidNJStatistics::* phase, double wallTime, double cpuTime);
+	void addCount(long long rapidNJStatistics::* counter, long long count);
+
+private:
+	rapidNJStatistics values;
+	pthread_mutex_t mutex;
+};
+
+/*Adds the time from its construction to its destruction to a phase. Does nothing if statistics is NULL, which is the case unless OPTION_COLLECT_STATISTICS is set.*/
+class phaseTimer {
+
+public:
+	phaseTimer(statisticsCollector* statistics, phaseTime rapidNJStatistics::* phase);
+	~phaseTimer();
+
+	/*Adds the time elapsed so far, and stops the timer before its destruction.*/
+	void stop();
+
+private:
+	statisticsCollector* statistics;
+	phaseTime rapidNJStatistics::* phase;
+	double startWallTime;
+	double startCpuTime;
+};
+
+/*Seconds elapsed since an arbitrary point, on a monotonic clock.*/
+double getWallTime();
+
+/*Processor time used by all the threads of the process, in seconds.*/
+double getProcessCpuTime();
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef CLUSTER_PAIR_SORT_HPP
+#define CLUSTER_PAIR_SORT_HPP
+
+#include "stdinclude.h"
+#include "cluster_pair.h"
+#include <cstring>
+
+// Below this number of pairs, std::sort is faster than going through the four radix passes.
+static const int RADIX_SORT_MIN_SIZE = 256;
+
+/*Maps a distance to an unsigned integer with the same ordering, so that distances can be sorted by their bits. Negative distances have all their bits flipped, positive distances only their sign bit.*/
+inline unsigned int clusterPairSortKey(distType distance) {
+	unsigned int bits;
+	memcpy(&bits, &distance, sizeof(bits));
+	return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+/*Sorts cluster pairs by distance with a least significant digit radix sort on the bits of the distances. buffer must have room for count pairs.*/
+inline void sortClusterPairs(cluster_pair* data, cluster_pair* buffer, int count) {
+	if (count < RADIX_SORT_MIN_SIZE) {
+		sort(data, data + count);
+		return;
+	}
+
+	unsigned int histograms[4][256];
+	memset(histograms, 0, sizeof(histograms));
+	for (int i = 0; i < count; i++) {
+		unsigned int key = clusterPairSortKey(data[i].distance);
+		histograms[0][key & 255]++;
+		histograms[1][(key >> 8) & 255]++;
+		histograms[2][(key >> 16) & 255]++;
+		histograms[3][key >> 24]++;
+	}
+
+	cluster_pair* source = data;
+	cluster_pair* target = buffer;
+	for (int digit = 0; digit < 4; digit++) {
+		int shift = digit * 8;
+		unsigned int* histogram = histograms[digit];
+
+		// Digits shared by all the distances (typically the sign and the high bits of the exponent) do not need a pass.
+		if (histogram[(clusterPairSortKey(source[0].distance) >> shift) & 255] == (unsigned int)count) {
+			continue;
+		}
+
+		unsigned int offset = 0;
+		for (int i = 0; i < 256; i++) {
+			unsigned int bucketSize = histogram[i];
+			histogram[i] = offset;
+			offset += bucketSize;
+		}
+		for (int i = 0; i < count; i++) {
+			target[histogram[(clusterPairSortKey(source[i].distance) >> shift) & 255]++] = source[i];
+		}
+
+		cluster_pair* temp = source;
+		source = target;
+		target = temp;
+	}
+
+	if (source != data) {
+		memcpy(data, source, count * sizeof(cluster_pair));
+	}
+}
+
+/*Moves the selectedCount pairs with the smallest distances to the start of the array, in sorted order. The order of the other pairs is unspecified.
+The cost depends on selectedCount rather than count for the sort, which matters when only a small part of each row is kept.*/
+inline void selectClusterPairs(cluster_pair* data, cluster_pair* buffer, int count, int selectedCount) {
+	if (selectedCount < count) {
+		nth_element(data, data + selectedCount, data + count);
+		count = selectedCount;
+	}
+	sortClusterPairs(data, buffer, count);
+}
+
+#endif
@@ -0,0 +1,267 @@
+#ifndef DATALOADER_BOOTSTRAP_H
+#define DATALOADER_BOOTSTRAP_H
+
+#include "stdinclude.h"
+#include "dataloader.hpp"
+#include "distanceKernels.h"
+#include "packedProteins.hpp"
+#include <random>
+
+// Number of weight planes of a typical replicate, used to estimate their memory usage: the largest of L column multiplicities drawn from L columns is almost always below 16.
+const unsigned int TYPICAL_COLUMN_WEIGHT_PLANES = 4;
+
+/*Multiplicities of the columns of a bootstrap replicate, as the bit planes taken by the weighted distance kernels. Each plane has the layout of the bit strings of the alignment,
+except for packed protein sequences, where it has one bit per column.*/
+struct columnWeights {
+	unsigned int planeCount;
+	unsigned int* planes;
+};
+
+/*Holds a single bootstrap replicate of a fastdist dataloader. Unlike dataloader::sample_sequences, the original data is left untouched, so several replicates can be sampled and used at the same time.
+With useColumnWeights, the replicate shares the bit strings of the source and only stores how many times each column was drawn, which the distance kernels use as weights. Code that
+reads the bit strings without going through kernelDistance must call resampleColumns first. The replicates of packed protein sequences are packed too.*/
+class dataloaderBootstrap : public dataloader, public packedProteinSource {
+
+public:
+	dataloaderBootstrap(dataloader* source, unsigned int seed, bool useColumnWeights = false) {
+		sequences = NULL;
+		bitStrings = NULL;
+		gapFilters = NULL;
+		bitStringSlab = NULL;
+		dataloaderBootstrap::source = source;
+		weights.planeCount = 0;
+		weights.planes = NULL;
+
+		type = source->type;
+		fastdist = source->fastdist;
+		sequenceLength = source->getSequenceLength();
+		sequenceCount = source->getSequenceCount();
+		bitStringsCount = source->getBitStringsCount();
+		sequenceNames = source->getSequenceNames();
+		packedProteins = hasPackedProteins(source);
+
+		// Draw the columns of the replicate with replacement.
+		vector<unsigned int> columns(sequenceLength);
+		std::mt19937 rng(seed);
+		std::uniform_int_distribution<unsigned int> column(0, sequenceLength - 1);
+		for (unsigned int i = 0; i < sequenceLength; i++) {
+			columns[i] = column(rng);
+		}
+
+		if (useColumnWeights) {
+			buildColumnWeights(columns);
+		}
+		else {
+			sampleColumns(columns);
+		}
+	}
+
+	/*Replaces the column weights with a resampled copy of the bit strings. Does nothing if the replicate was already resampled.*/
+	void resampleColumns() {
+		if (weights.planes == NULL) {
+			return;
+		}
+
+		// Distances do not depend on the order of the columns, so each column is simply repeated as many times as it was drawn.
+		vector<unsigned int> columns;
+		columns.reserve(sequenceLength);
+		for (unsigned int c = 0; c < sequenceLength; c++) {
+			for (unsigned int p = 0; p < weights.planeCount; p++) {
+				if (isColumnInPlane(c, p)) {
+					columns.insert(columns.end(), 1u << p, c);
+				}
+			}
+		}
+
+		_mm_free(weights.planes);
+		weights.planes = NULL;
+		weights.planeCount = 0;
+		sampleColumns(columns);
+	}
+
+	/*Returns the column weights, or NULL if the bit strings have been resampled.*/
+	const columnWeights* getColumnWeights() {
+		return weights.planes != NULL ? &weights : NULL;
+	}
+
+	unsigned int** getBitStrings() {
+		if (weights.planes != NULL) {
+			return source->getBitStrings();
+		}
+		return &(*bitStrings)[0];
+	}
+
+	unsigned int** getGapFilters() {
+		if (weights.planes != NULL) {
+			return source->getGapFilters();
+		}
+		return &(*gapFilters)[0];
+	}
+
+	unsigned int getSequenceCount() {
+		return sequenceCount;
+	}
+
+	unsigned int getSequenceLength() {
+		return sequenceLength;
+	}
+
+	unsigned int getBitStringsCount() {
+		return bitStringsCount;
+	}
+
+	vector<string>* getSequenceNames() {
+		return sequenceNames;
+	}
+
+	vector<char*>* getSequences() {
+		return sequences;
+	}
+
+	void setSequences(vector<char*>* val) {
+		sequences = val;
+	}
+
+	~dataloaderBootstrap() {
+		if (weights.planes != NULL) {
+			_mm_free(weights.planes);
+		}
+		delete bitStrings;
+		delete gapFilters;
+		if (bitStringSlab != NULL) {
+			_mm_free(bitStringSlab);
+		}
+	}
+
+private:
+	// The names, and the bit strings when using column weights, are owned by the source dataloader.
+	dataloader* source;
+	vector<string>* sequenceNames;
+	columnWeights weights;
+	// Resampled bit strings of all the sequences, followed by their gap filters for DNA, in a single aligned allocation.
+	unsigned int* bitStringSlab;
+
+	// Positions per 32-bit word of the weight planes.
+	inline unsigned int positionsPerWord() {
+		return packedProteins ? 32 : type == DNA ? 16 : 4;
+	}
+
+	// Number of unsigned ints in each weight plane.
+	inline unsigned int weightPlaneSize() {
+		return packedProteins ? bitStringsCount / PACKED_PROTEIN_PLANES * 4 : bitStringsCount * 4;
+	}
+
+	inline bool isColumnInPlane(unsigned int column, unsigned int plane) {
+		unsigned int perWord = positionsPerWord();
+		unsigned int shift = (column % perWord) * (32 / perWord);
+		return ((weights.planes[plane * weightPlaneSize() + column / perWord] >> shift) & 1) != 0;
+	}
+
+	void buildColumnWeights(vector<unsigned int>& columns) {
+		vector<unsigned int> multiplicities(sequenceLength, 0);
+		unsigned int maxMultiplicity = 0;
+		for (unsigned int i = 0; i < sequenceLength; i++) {
+			maxMultiplicity = max(maxMultiplicity, ++multiplicities[columns[i]]);
+		}
+
+		weights.planeCount = 0;
+		while ((maxMultiplicity >> weights.planeCount) != 0) {
+			weights.planeCount++;
+		}
+
+		// Padding positions belong to no plane, so they are ignored like the columns that were not drawn.
+		unsigned int planeSize = weightPlaneSize();
+		weights.planes = (unsigned int*)_mm_malloc(max(weights.planeCount, 1u) * planeSize * sizeof(unsigned int), KERNEL_ALIGNMENT);
+		memset(weights.planes, 0, max(weights.planeCount, 1u) * planeSize * sizeof(unsigned int));
+
+		unsigned int perWord = positionsPerWord();
+		unsigned int positionMask = packedProteins ? 1u : type == DNA ? 3u : 255u;
+		for (unsigned int c = 0; c < sequenceLength; c++) {
+			unsigned int shift = (c % perWord) * (32 / perWord);
+			for (unsigned int p = 0; p < weights.planeCount; p++) {
+				if ((multiplicities[c] >> p) & 1) {
+					weights.planes[p * planeSize + c / perWord] |= positionMask << shift;
+				}
+			}
+		}
+	}
+
+	void sampleColumns(vector<unsigned int>& columns) {
+		unsigned int** sourceBitStrings = source->getBitStrings();
+		bitStrings = new vector<unsigned int*>;
+		bitStrings->reserve(sequenceCount);
+
+		size_t bitStringSize = (size_t)bitStringsCount * 4;
+		bitStringSlab = (unsigned int*)_mm_malloc(max((size_t)sequenceCount * bitStringSize * (type == DNA ? 2 : 1), (size_t)1) * sizeof(unsigned int), KERNEL_ALIGNMENT);
+
+		if (type == DNA) {
+			unsigned int** sourceGapFilters = source->getGapFilters();
+			gapFilters = new vector<unsigned int*>;
+			gapFilters->reserve(sequenceCount);
+			unsigned int* gapFilterSlab = bitStringSlab + (size_t)sequenceCount * bitStringSize;
+
+			for (unsigned int i = 0; i < sequenceCount; i++) {
+				unsigned int* bitString = bitStringSlab + i * bitStringSize;
+				unsigned int* gapFilter = gapFilterSlab + i * bitStringSize;
+				sampleDNASequence(bitString, gapFilter, sourceBitStrings[i], sourceGapFilters[i], columns);
+				bitStrings->push_back(bitString);
+				gapFilters->push_back(gapFilter);
+			}
+		}
+		else {
+			for (unsigned int i = 0; i < sequenceCount; i++) {
+				unsigned int* bitString = bitStringSlab + i * bitStringSize;
+				if (packedProteins) {
+					samplePackedProteinSequence(bitString, sourceBitStrings[i], columns);
+				}
+				else {
+					sampleProteinSequence(bitString, sourceBitStrings[i], columns);
+				}
+				bitStrings->push_back(bitString);
+			}
+		}
+	}
+
+	inline void sampleDNASequence(unsigned int* bitString, unsigned int* gapFilter, unsigned int* sourceBitString, unsigned int* sourceGapFilter, vector<unsigned int>& columns) {
+		// Padding positions must have an empty gap filter, so that they are ignored by the distance estimators.
+		memset(bitString, 0, bitStringsCount * 4 * sizeof(unsigned int));
+		memset(gapFilter, 0, bitStringsCount * 4 * sizeof(unsigned int));
+
+		for (unsigned int i = 0; i < sequenceLength; i++) {
+			unsigned int c = columns[i];
+			unsigned int sourceShift = (c % 16) * 2;
+			unsigned int shift = (i % 16) * 2;
+			bitString[i / 16] |= ((sourceBitString[c / 16] >> sourceShift) & 3) << shift;
+			gapFilter[i / 16] |= ((sourceGapFilter[c / 16] >> sourceShift) & 3) << shift;
+		}
+	}
+
+	inline void sampleProteinSequence(unsigned int* bitString, unsigned int* sourceBitString, vector<unsigned int>& columns) {
+		// Padding positions are encoded as gaps.
+		memset(bitString, '-', bitStringsCount * 4 * sizeof(unsigned int));
+
+		for (unsigned int i = 0; i < sequenceLength; i++) {
+			unsigned int c = columns[i];
+			unsigned int sourceShift = (c % 4) * 8;
+			unsigned int shift = (i % 4) * 8;
+			bitString[i / 4] = (bitString[i / 4] & ~(255u << shift)) | (((sourceBitString[c / 4] >> sourceShift) & 255) << shift);
+		}
+	}
+
+	inline void samplePackedProteinSequence(unsigned int* bitString, unsigned int* sourceBitString, vector<unsigned int>& columns) {
+		// Padding positions are encoded as gaps, which are code 0.
+		memset(bitString, 0, bitStringsCount * 4 * sizeof(unsigned int));
+
+		for (unsigned int i = 0; i < sequenceLength; i++) {
+			setPackedProteinCode(bitString, i, getPackedProteinCode(sourceBitString, columns[i]));
+		}
+	}
+};
+
+/*Returns the column weights of dl if it is a bootstrap replicate that uses them, NULL otherwise.*/
+inline const columnWeights* getColumnWeights(dataloader* dl) {
+	dataloaderBootstrap* replicate = dynamic_cast<dataloaderBootstrap*>(dl);
+	return replicate != NULL ? replicate->getColumnWeights() : NULL;
+}
+
+#endif
@@ -4,55 +4,89 @@
 #include "stdinclude.h"
 #include "dataloader.hpp"
 #include "bitStringUtils.hpp"
+#include "distanceKernels.h"
+#include "sequenceEncoder.hpp"
+#include "packedProteins.hpp"
+#include "workerPool.hpp"
 
-class dataloaderPointer : public dataloader {
+class dataloaderPointer;
+
+struct threadStateEncoder {
+	int nextSequence;
+	int sequenceCount;
+	dataloaderPointer* loader;
+	const char* const* sequenceData;
+	pthread_mutex_t mutex;
+};
+
+/*With packProteins, fastdist protein alignments that have at most 31 distinct residues are stored in the packed encoding of packedProteins.hpp, which can only be read by kernelDistance.*/
+class dataloaderPointer : public dataloader, public packedProteinSource {
 
 public:
-	dataloaderPointer(InputType sequenceType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData) {
-		sequences = NULL;
-		bitStrings = NULL;
-		gapFilters = NULL;
-		sequenceLength = 0;
-		sequenceCount = 0;
-		sequenceNames = new vector<string>;
+	dataloaderPointer(InputType sequenceType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, int numThreads = 1, bool packProteins = false) {
+		initialise(sequenceType, inputSequenceLength);
 
-		type = sequenceType;
-		sequenceLength = inputSequenceLength;
+		vector<const char*> sequenceData(inputSequenceData, inputSequenceData + inputSequenceCount);
+		if (packProteins) {
+			packSequences(inputSequenceCount, sequenceData);
+		}
+		storeSequences(inputSequenceCount, inputSequenceNamesLengths, inputSequenceNames, sequenceData, numThreads);
+	}
 
-		if (fastdist) {
-			bitStrings = new vector<unsigned int*>;
+	/*Encodes an alignment held in a single buffer, where sequence i starts at inputSequenceData + i * inputSequenceStride.*/
+	dataloaderPointer(InputType sequenceType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, const char* inputSequenceData, long long inputSequenceStride, int numThreads = 1, bool packProteins = false) {
+		initialise(sequenceType, inputSequenceLength);
 
-			if (type == DNA) {
-				bitStringsCount = sequenceLength / 64 + 6;
-				paddingLength = bitStringsCount * 64 - sequenceLength;
-				gapFilters = new vector<unsigned int*>;
-			}
-			else {
-				bitStringsCount = sequenceLength / 16 + 8;
-				paddingLength = bitStringsCount * 16 - sequenceLength;
-			}
+		vector<const char*> sequenceData(inputSequenceCount);
+		for (int i = 0; i < inputSequenceCount; i++) {
+			sequenceData[i] = inputSequenceData + i * inputSequenceStride;
 		}
-		else {
-			sequences = new vector<char*>;
+		if (packProteins) {
+			packSequences(inputSequenceCount, sequenceData);
 		}
+		storeSequences(inputSequenceCount, inputSequenceNamesLengths, inputSequenceNames, sequenceData, numThreads);
+	}
 
-		for (int i = 0; i < inputSequenceCount; i++)
-		{
-			int nameLength = inputSequenceNamesLengths[i];
+	/*Uses bit strings that have already been encoded by the caller, in place and without copying them. They must stay valid for the lifetime of the dataloader.
+	DNA sequences use 2 bits per nucleotide (A = 00, G = 01, T = 10, C = 11, 16 nucleotides per unsigned int from the least significant bits), and their gap filters hold 01 for each valid position and 00 for gaps and padding.
+	Protein sequences use one byte per residue (4 residues per unsigned int), with gaps and padding encoded as '-'.
+	Each bit string is made of inputBitStringsCount 128-bit blocks, 16-byte aligned, and inputBitStringsCount must be at least getMinimumBitStringsCount(sequenceType, inputSequenceLength).*/
+	dataloaderPointer(InputType sequenceType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, unsigned int** inputBitStrings, unsigned int** inputGapFilters, unsigned int inputBitStringsCount) {
+		fastdist = true;
+		initialise(sequenceType, inputSequenceLength);
+		ownsBitStrings = false;
 
-			string name(inputSequenceNames[i], inputSequenceNamesLengths[i]);
+		bitStringsCount = inputBitStringsCount;
+		paddingLength = bitStringsCount * (type == DNA ? 64 : 16) - sequenceLength;
 
-			storeSequence(&name, inputSequenceData[i]);
+		bitStrings->assign(inputBitStrings, inputBitStrings + inputSequenceCount);
+		if (type == DNA) {
+			gapFilters->assign(inputGapFilters, inputGapFilters + inputSequenceCount);
 		}
+
+		for (int i = 0; i < inputSequenceCount; i++) {
+			sequenceNames->push_back(string(inputSequenceNames[i], inputSequenceNamesLengths[i]));
+		}
+		sequenceCount = inputSequenceCount;
 	}
 
-	void storeSequence(string* name, char* characters)
+	/*Smallest number of 128-bit blocks that the bit strings of a sequence can have, including the padding required by the rapidNJ distance estimators.*/
+	static unsigned int getMinimumBitStringsCount(InputType sequenceType, unsigned int sequenceLength) {
+		if (sequenceType == DNA) {
+			return sequenceLength / 64 + 6;
+		}
+		else {
+			return sequenceLength / 16 + 8;
+		}
+	}
+
+	void storeSequence(string* name, const char* characters)
 	{
 		if (fastdist) {
-			unsigned int* bitString = (unsigned int*)_mm_malloc(bitStringsCount * 4 * sizeof(unsigned int), 16);
+			unsigned int* bitString = (unsigned int*)_mm_malloc(bitStringsCount * 4 * sizeof(unsigned int), KERNEL_ALIGNMENT);
 			if (type == DNA) {
 				unsigned int* gapFilter;
-				gapFilter = (unsigned int*)_mm_malloc(bitStringsCount * 4 * sizeof(unsigned int), 16);
+				gapFilter = (unsigned int*)_mm_malloc(bitStringsCount * 4 * sizeof(unsigned int), KERNEL_ALIGNMENT);
 				encodeDNASequence(bitString, gapFilter, characters);
 				gapFilters->push_back(gapFilter);
 			}
@@ -75,94 +109,47 @@ public:
 		}
 	}
 
-	void load(string filename) {
+	void load(string /*filename*/) {
 
 	}
 
 	inline char resolveChar(char c) {
 		//ignore positions with ambigious/unknown nucleotides
-		if (type == DNA) {
-			if (!(c == 'a' || c == 'A' || c == 'c' || c == 'C' || c == 'g' || c == 'G' || c == 't' || c == 'T' || c == 'u' || c == 'U')) {
-				return '-';
-			}
-			else {
-				return c;
-			}
+		return encoder->resolveChar(c);
+	}
+
+	inline void encodeProteinSequence(unsigned int* bitString, const char* data) {
+		if (packedProteins) {
+			encoder->encodePackedProteinSequence(bitString, data, sequenceLength, bitStringsCount, packedProteinCodes);
 		}
 		else {
-			if (c == '-' || c == '.' || c == 'X' || c == 'x' || c == 'z' || c == 'Z' || c == 'b' || c == 'B' || c == 'J' || c == 'j' || c == '?') {
-				return '-';
-			}
-			else {
-				return c;
-			}
+			encoder->encodeProteinSequence(bitString, data, sequenceLength, bitStringsCount);
 		}
 	}
 
-	inline void encodeProteinSequence(unsigned int* bitString, char* data) {
-		for (unsigned int i = 0; i < sequenceLength; i++) {
-			int offset = i % 4;
-			unsigned int bitStringIdx = i / 4;
-			if (offset == 0) {
-				bitString[bitStringIdx] = 0;
-			}
-			char c = resolveChar(data[i]);
-			bitString[bitStringIdx] += (c << (offset * 8));
-		}
-
-		for (unsigned int i = sequenceLength; i < paddingLength + sequenceLength; i++) {
-			int offset = i % 4;
-			unsigned int bitStringIdx = i / 4;
-			if (offset == 0) {
-				bitString[bitStringIdx] = 0;
-			}
-			char c = '-';
-			bitString[bitStringIdx] += (c << (offset * 8));
-		}
+	inline void encodeDNASequence(unsigned int* bitString, unsigned int* gapFilter, const char* data) {
+		encoder->encodeDNASequence(bitString, gapFilter, data, sequenceLength, bitStringsCount);
 	}
 
-	inline void encodeDNASequence(unsigned int* bitString, unsigned int* gapFilter, char* data) {
-		for (unsigned int i = 0; i < sequenceLength; i++) {
-			int offset = i % (BLOCK_SIZE / 2);
-			unsigned int bitStringIdx = i / (BLOCK_SIZE / 2);
-			if (offset == 0) {
-				bitString[bitStringIdx] = 0;
-				gapFilter[bitStringIdx] = 0;
-			}
-			char c = data[i];
-			switch (c) {
-				//Nothing is done for gaps and ambigious nucleotides
-			case 'A':
-			case 'a':
-				//A has value 00 so nothing is added to the bitStrings
-				gapFilter[bitStringIdx] += (Gbin << (offset * 2));
-				break;
-			case 'C':
-			case 'c':
-				bitString[bitStringIdx] += (Cbin << (offset * 2));
-				gapFilter[bitStringIdx] += (Gbin << (offset * 2));
-				break;
-			case 'G':
-			case 'g':
-				bitString[bitStringIdx] += (Gbin << (offset * 2));
-				gapFilter[bitStringIdx] += (Gbin << (offset * 2));
-				break;
-			case 'T':
-			case 't':
-				bitString[bitStringIdx] += (Tbin << (offset * 2));
-				gapFilter[bitStringIdx] += (Gbin << (offset * 2));
-				break;
-			default:
+	static void encodeTask(void* ptr, int /*workerIndex*/, int /*workerCount*/) {
+		threadStateEncoder* state = (threadStateEncoder*)ptr;
+		dataloaderPointer* loader = state->loader;
+
+		while (true) {
+			pthread_mutex_lock(&state->mutex);
+			int i = state->nextSequence;
+			state->nextSequence++;
+			pthread_mutex_unlock(&state->mutex);
+
+			if (i >= state->sequenceCount) {
 				break;
 			}
-		}
 
-		for (unsigned int i = sequenceLength; i < sequenceLength + paddingLength; i++) {
-			int offset = i % (BLOCK_SIZE / 2);
-			unsigned int bitStringIdx = i / (BLOCK_SIZE / 2);
-			if (offset == 0) {
-				bitString[bitStringIdx] = 0;
-				gapFilter[bitStringIdx] = 0;
+			if (loader->type == DNA) {
+				loader->encodeDNASequence(loader->bitStrings->at(i), loader->gapFilters->at(i), state->sequenceData[i]);
+			}
+			else {
+				loader->encodeProteinSequence(loader->bitStrings->at(i), state->sequenceData[i]);
 			}
 		}
 	}
@@ -210,22 +197,136 @@ public:
 			}
 			delete sequences;
 		}
+		// Bit strings stored in a slab or owned by the caller are not freed one by one.
+		bool freeBitStrings = ownsBitStrings && bitStringSlab == NULL;
 		if (bitStrings != NULL) {
-			for (unsigned int i = 0; i < bitStrings->size(); i++) {
-				_mm_free(bitStrings->at(i));
+			if (freeBitStrings) {
+				for (unsigned int i = 0; i < bitStrings->size(); i++) {
+					_mm_free(bitStrings->at(i));
+				}
 			}
 			delete bitStrings;
 		}
 		if (gapFilters != NULL) {
-			for (unsigned int i = 0; i < gapFilters->size(); i++) {
-				_mm_free(gapFilters->at(i));
+			if (freeBitStrings) {
+				for (unsigned int i = 0; i < gapFilters->size(); i++) {
+					_mm_free(gapFilters->at(i));
+				}
 			}
 			delete gapFilters;
 		}
+		if (bitStringSlab != NULL) {
+			_mm_free(bitStringSlab);
+		}
+		if (gapFilterSlab != NULL) {
+			_mm_free(gapFilterSlab);
+		}
+		delete encoder;
 	}
 
 private:
 	vector<string>* sequenceNames;
+	unsigned int* bitStringSlab;
+	unsigned int* gapFilterSlab;
+	bool ownsBitStrings;
+	sequenceEncoder* encoder;
+	// Code of each character in the packed protein encoding.
+	unsigned char packedProteinCodes[256];
+
+	/*Switches a fastdist protein alignment to the packed encoding, if its residues fit in it. Must be called before storeSequences.*/
+	void packSequences(int inputSequenceCount, vector<const char*>& sequenceData) {
+		if (!fastdist || type != PROTEIN || inputSequenceCount == 0) {
+			return;
+		}
+		if (encoder->buildPackedProteinCodes(&sequenceData[0], inputSequenceCount, sequenceLength, packedProteinCodes)) {
+			packedProteins = true;
+			bitStringsCount = getPackedProteinBitStringsCount(sequenceLength);
+			paddingLength = bitStringsCount / PACKED_PROTEIN_PLANES * PACKED_PROTEIN_CHUNK_LENGTH - sequenceLength;
+		}
+	}
+
+	/*Stores all the sequences at once. The fastdist bit strings are stored in a single aligned allocation, and each sequence is encoded independently on one of numThreads threads.*/
+	void storeSequences(int inputSequenceCount, int* inputSequenceNamesLengths, char** inputSequenceNames, vector<const char*>& sequenceData, int numThreads) {
+		if (!fastdist) {
+			for (int i = 0; i < inputSequenceCount; i++) {
+				string name(inputSequenceNames[i], inputSequenceNamesLengths[i]);
+				storeSequence(&name, sequenceData[i]);
+			}
+			return;
+		}
+
+		size_t bitStringSize = (size_t)bitStringsCount * 4;
+		bitStringSlab = (unsigned int*)_mm_malloc(inputSequenceCount * bitStringSize * sizeof(unsigned int), KERNEL_ALIGNMENT);
+		if (type == DNA) {
+			gapFilterSlab = (unsigned int*)_mm_malloc(inputSequenceCount * bitStringSize * sizeof(unsigned int), KERNEL_ALIGNMENT);
+		}
+
+		for (int i = 0; i < inputSequenceCount; i++) {
+			bitStrings->push_back(bitStringSlab + i * bitStringSize);
+			if (type == DNA) {
+				gapFilters->push_back(gapFilterSlab + i * bitStringSize);
+			}
+			sequenceNames->push_back(string(inputSequenceNames[i], inputSequenceNamesLengths[i]));
+		}
+		sequenceCount = inputSequenceCount;
+
+		if (inputSequenceCount == 0) {
+			return;
+		}
+
+		if (numThreads > inputSequenceCount) {
+			numThreads = inputSequenceCount;
+		}
+		if (numThreads < 1) {
+			numThreads = 1;
+		}
+
+		threadStateEncoder* state = new threadStateEncoder();
+		state->nextSequence = 0;
+		state->sequenceCount = inputSequenceCount;
+		state->loader = this;
+		state->sequenceData = &sequenceData[0];
+		pthread_mutex_init(&state->mutex, NULL);
+
+		workerPool pool(numThreads);
+		pool.run(encodeTask, (void*)state);
+
+		pthread_mutex_destroy(&state->mutex);
+		delete state;
+	}
+
+	void initialise(InputType sequenceType, int inputSequenceLength) {
+		sequences = NULL;
+		bitStrings = NULL;
+		gapFilters = NULL;
+		bitStringSlab = NULL;
+		gapFilterSlab = NULL;
+		ownsBitStrings = true;
+		encoder = new sequenceEncoder(sequenceType);
+		sequenceLength = 0;
+		sequenceCount = 0;
+		sequenceNames = new vector<string>;
+
+		type = sequenceType;
+		sequenceLength = inputSequenceLength;
+
+		if (fastdist) {
+			bitStrings = new vector<unsigned int*>;
+
+			// The bit strings are padded to a whole number of the widest vectors used by the distance kernels.
+			bitStringsCount = padBitStringsCount(getMinimumBitStringsCount(type, sequenceLength));
+			if (type == DNA) {
+				paddingLength = bitStringsCount * 64 - sequenceLength;
+				gapFilters = new vector<unsigned int*>;
+			}
+			else {
+				paddingLength = bitStringsCount * 16 - sequenceLength;
+			}
+		}
+		else {
+			sequences = new vector<char*>;
+		}
+	}
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,143 @@
+#ifndef DATALOADER_UNIQUE_H
+#define DATALOADER_UNIQUE_H
+
+#include "stdinclude.h"
+#include "dataloader.hpp"
+#include "treeExport.hpp"
+#include "packedProteins.hpp"
+#include <unordered_map>
+
+/*Holds one copy of each distinct sequence of a fastdist dataloader. Sequences are identical if their bit strings and gap filters are, in which case they are at distance 0
+from each other and at the same distance from all the other sequences, so the distances only need to be computed between the distinct ones. The bit strings and names are
+owned by the source dataloader.
+The leaves of a tree built from the distinct sequences are expanded back into one leaf per sequence of the source with expandTree.*/
+class dataloaderUnique : public dataloader, public packedProteinSource {
+
+public:
+	/*Returns the distinct sequences of source, or NULL if source is not a fastdist dataloader, if all its sequences are distinct, or if there are fewer than 3 distinct
+	sequences, which is too few for a tree to be built from them.*/
+	static dataloaderUnique* create(dataloader* source) {
+		if (!source->fastdist) {
+			return NULL;
+		}
+		dataloaderUnique* retVal = new dataloaderUnique(source);
+		if (retVal->getSequenceCount() == source->getSequenceCount() || retVal->getSequenceCount() < 3) {
+			delete retVal;
+			return NULL;
+		}
+		return retVal;
+	}
+
+	/*Returns a tree with one leaf per sequence of the source, in which the copies of each sequence are joined by branches of length 0. Bootstrap counts are kept, and the
+	branches between copies are supported by all the replicates. The leaves of tree must be in the order of the distinct sequences.*/
+	polytree* expandTree(polytree* tree) {
+		return expandPolytreeLeaves(tree, groups, source->getSequenceNames());
+	}
+
+	unsigned int** getBitStrings() {
+		return &bitStringPointers[0];
+	}
+
+	unsigned int** getGapFilters() {
+		return type == DNA ? &gapFilterPointers[0] : NULL;
+	}
+
+	unsigned int getSequenceCount() {
+		return sequenceCount;
+	}
+
+	unsigned int getSequenceLength() {
+		return sequenceLength;
+	}
+
+	unsigned int getBitStringsCount() {
+		return bitStringsCount;
+	}
+
+	vector<string>* getSequenceNames() {
+		return &sequenceNames;
+	}
+
+	vector<char*>* getSequences() {
+		return NULL;
+	}
+
+	void setSequences(vector<char*>* /*val*/) {
+	}
+
+private:
+	dataloader* source;
+	// Indices in the source of the copies of each distinct sequence. The first copy is the one whose bit strings are used.
+	vector<vector<int> > groups;
+	vector<unsigned int*> bitStringPointers;
+	vector<unsigned int*> gapFilterPointers;
+	vector<string> sequenceNames;
+
+	dataloaderUnique(dataloader* source) {
+		sequences = NULL;
+		bitStrings = NULL;
+		gapFilters = NULL;
+		dataloaderUnique::source = source;
+
+		type = source->type;
+		fastdist = source->fastdist;
+		sequenceLength = source->getSequenceLength();
+		bitStringsCount = source->getBitStringsCount();
+		packedProteins = hasPackedProteins(source);
+
+		unsigned int** sourceBitStrings = source->getBitStrings();
+		unsigned int** sourceGapFilters = type == DNA ? source->getGapFilters() : NULL;
+		vector<string>* sourceNames = source->getSequenceNames();
+		unsigned int sourceCount = source->getSequenceCount();
+		size_t words = (size_t)bitStringsCount * 4;
+
+		// Distinct sequences with each hash; a hash is almost always shared by copies of the same sequence only, but the bit strings are still compared.
+		unordered_map<unsigned long long, vector<int> > distinctByHash;
+		distinctByHash.reserve(sourceCount);
+
+		for (unsigned int i = 0; i < sourceCount; i++) {
+			unsigned long long hash = hashWords(sourceBitStrings[i], words, 0);
+			if (sourceGapFilters != NULL) {
+				hash = hashWords(sourceGapFilters[i], words, hash);
+			}
+
+			vector<int>& candidates = distinctByHash[hash];
+			int match = -1;
+			for (unsigned int c = 0; c < candidates.size() && match == -1; c++) {
+				int representative = groups[candidates[c]][0];
+				if (memcmp(sourceBitStrings[i], sourceBitStrings[representative], words * sizeof(unsigned int)) == 0 &&
+					(sourceGapFilters == NULL || memcmp(sourceGapFilters[i], sourceGapFilters[representative], words * sizeof(unsigned int)) == 0)) {
+					match = candidates[c];
+				}
+			}
+
+			if (match == -1) {
+				candidates.push_back((int)groups.size());
+				groups.push_back(vector<int>(1, (int)i));
+				bitStringPointers.push_back(sourceBitStrings[i]);
+				if (sourceGapFilters != NULL) {
+					gapFilterPointers.push_back(sourceGapFilters[i]);
+				}
+				sequenceNames.push_back((*sourceNames)[i]);
+			}
+			else {
+				groups[match].push_back((int)i);
+			}
+		}
+
+		sequenceCount = (unsigned int)groups.size();
+	}
+
+	// FNV-1a over 32-bit words, followed by the splitmix64 finaliser so that the low bits used by the hash table are well mixed.
+	static unsigned long long hashWords(const unsigned int* data, size_t count, unsigned long long seed) {
+		unsigned long long hash = 0xCBF29CE484222325ULL ^ seed;
+		for (size_t i = 0; i < count; i++) {
+			hash = (hash ^ data[i]) * 0x100000001B3ULL;
+		}
+		hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+		return hash ^ (hash >> 31);
+	}
+};
+
+#endif
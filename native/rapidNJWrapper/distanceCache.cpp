@@ -0,0 +1,191 @@
+#include "distanceCache.hpp"
+#include <list>
+
+struct cachedDistanceMatrix {
+	distanceCacheKey key;
+	// Row i of the lower triangle starts at element i * (i + 1) / 2. Shared so that it can be copied out after the mutex is released, even if it is dropped meanwhile.
+	shared_ptr<vector<distType> > lowerTriangle;
+};
+
+// All the state of the cache is protected by cacheMutex. The most recently used matrices come first.
+static pthread_mutex_t cacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static list<cachedDistanceMatrix> cacheEntries;
+static size_t cacheCapacity = 0;
+static size_t cacheSize = 0;
+
+static size_t getMatrixBytes(unsigned int sequenceCount) {
+	return (size_t)sequenceCount * (sequenceCount + 1) / 2 * sizeof(distType);
+}
+
+static bool equalKeys(const distanceCacheKey& a, const distanceCacheKey& b) {
+	return a.low == b.low && a.high == b.high && a.sequenceCount == b.sequenceCount && a.sequenceLength == b.sequenceLength && a.bitStringsCount == b.bitStringsCount &&
+		a.type == b.type && a.jukesCantor == b.jukesCantor && a.libraryDistances == b.libraryDistances;
+}
+
+/*MurmurHash3_x64_128 of a stream of 16-byte blocks, which is what the bit strings and gap filters are made of.*/
+struct murmurHash128 {
+	unsigned long long h1;
+	unsigned long long h2;
+	unsigned long long length;
+
+	murmurHash128(unsigned long long seed) {
+		h1 = seed;
+		h2 = seed;
+		length = 0;
+	}
+
+	static unsigned long long rotate(unsigned long long x, int bits) {
+		return (x << bits) | (x >> (64 - bits));
+	}
+
+	static unsigned long long finalize(unsigned long long x) {
+		x = (x ^ (x >> 33)) * 0xFF51AFD7ED558CCDULL;
+		x = (x ^ (x >> 33)) * 0xC4CEB9FE1A85EC53ULL;
+		return x ^ (x >> 33);
+	}
+
+	void addBlock(const unsigned int* words) {
+		const unsigned long long c1 = 0x87C37B91114253D5ULL;
+		const unsigned long long c2 = 0x4CF5AD432745937FULL;
+		unsigned long long k1 = words[0] | ((unsigned long long)words[1] << 32);
+		unsigned long long k2 = words[2] | ((unsigned long long)words[3] << 32);
+		h1 ^= rotate(k1 * c1, 31) * c2;
+		h1 = (rotate(h1, 27) + h2) * 5 + 0x52DCE729;
+		h2 ^= rotate(k2 * c2, 33) * c1;
+		h2 = (rotate(h2, 31) + h1) * 5 + 0x38495AB5;
+		length += 16;
+	}
+
+	void finish(unsigned long long& low, unsigned long long& high) {
+		h1 ^= length;
+		h2 ^= length;
+		h1 += h2;
+		h2 += h1;
+		h1 = finalize(h1);
+		h2 = finalize(h2);
+		h1 += h2;
+		h2 += h1;
+		low = h1;
+		high = h2;
+	}
+};
+
+// Must be called with cacheMutex held.
+static void evictEntries(size_t capacity) {
+	while (cacheSize > capacity && !cacheEntries.empty()) {
+		cacheSize -= cacheEntries.back().lowerTriangle->size() * sizeof(distType);
+		cacheEntries.pop_back();
+	}
+}
+
+// Must be called with cacheMutex held. Moves the entry to the front.
+static list<cachedDistanceMatrix>::iterator findEntry(const distanceCacheKey& key) {
+	for (list<cachedDistanceMatrix>::iterator it = cacheEntries.begin(); it != cacheEntries.end(); it++) {
+		if (equalKeys(it->key, key)) {
+			cacheEntries.splice(cacheEntries.begin(), cacheEntries, it);
+			return cacheEntries.begin();
+		}
+	}
+	return cacheEntries.end();
+}
+
+void setDistanceCacheCapacity(size_t bytes) {
+	pthread_mutex_lock(&cacheMutex);
+	cacheCapacity = bytes;
+	evictEntries(bytes);
+	pthread_mutex_unlock(&cacheMutex);
+}
+
+bool fitsDistanceCache(unsigned int sequenceCount) {
+	pthread_mutex_lock(&cacheMutex);
+	bool retVal = cacheCapacity > 0 && getMatrixBytes(sequenceCount) <= cacheCapacity;
+	pthread_mutex_unlock(&cacheMutex);
+	return retVal;
+}
+
+distanceCacheKey getDistanceCacheKey(dataloader* loader, bool jukesCantor, bool libraryDistances) {
+	distanceCacheKey key;
+	key.sequenceCount = loader->getSequenceCount();
+	key.sequenceLength = loader->getSequenceLength();
+	key.bitStringsCount = loader->getBitStringsCount();
+	key.type = loader->type;
+	key.jukesCantor = jukesCantor;
+	key.libraryDistances = libraryDistances;
+
+	// Every sequence has the same number of blocks, so the hash of the whole stream depends on where each sequence starts and on their order. Hashing is linear in the
+	// size of the alignment, which is negligible next to the distances.
+	unsigned int** bitStrings = loader->getBitStrings();
+	unsigned int** gapFilters = loader->type == DNA ? loader->getGapFilters() : NULL;
+	murmurHash128 hash(0);
+	for (unsigned int i = 0; i < key.sequenceCount; i++) {
+		for (unsigned int j = 0; j < key.bitStringsCount; j++) {
+			hash.addBlock(bitStrings[i] + (size_t)j * 4);
+		}
+		if (gapFilters != NULL) {
+			for (unsigned int j = 0; j < key.bitStringsCount; j++) {
+				hash.addBlock(gapFilters[i] + (size_t)j * 4);
+			}
+		}
+	}
+	hash.finish(key.low, key.high);
+	return key;
+}
+
+shared_ptr<const vector<distType> > findDistanceCache(const distanceCacheKey& key) {
+	shared_ptr<const vector<distType> > lowerTriangle;
+	pthread_mutex_lock(&cacheMutex);
+	list<cachedDistanceMatrix>::iterator it = findEntry(key);
+	if (it != cacheEntries.end()) {
+		lowerTriangle = it->lowerTriangle;
+	}
+	pthread_mutex_unlock(&cacheMutex);
+	return lowerTriangle;
+}
+
+bool readDistanceCache(const distanceCacheKey& key, distType** rows, bool halfMatrix) {
+	shared_ptr<const vector<distType> > lowerTriangle = findDistanceCache(key);
+	if (!lowerTriangle) {
+		return false;
+	}
+
+	const distType* data = &(*lowerTriangle)[0];
+	for (unsigned int i = 0; i < key.sequenceCount; i++) {
+		memcpy(rows[i], data + (size_t)i * (i + 1) / 2, (i + 1) * sizeof(distType));
+	}
+	if (!halfMatrix) {
+		for (unsigned int i = 0; i < key.sequenceCount; i++) {
+			for (unsigned int j = i + 1; j < key.sequenceCount; j++) {
+				rows[i][j] = rows[j][i];
+			}
+		}
+	}
+	return true;
+}
+
+void writeDistanceCache(const distanceCacheKey& key, distType** rows) {
+	size_t bytes = getMatrixBytes(key.sequenceCount);
+	pthread_mutex_lock(&cacheMutex);
+	bool store = bytes <= cacheCapacity && findEntry(key) == cacheEntries.end();
+	pthread_mutex_unlock(&cacheMutex);
+
+	if (!store) {
+		return;
+	}
+
+	cachedDistanceMatrix entry;
+	entry.key = key;
+	entry.lowerTriangle = shared_ptr<vector<distType> >(new vector<distType>(bytes / sizeof(distType)));
+	distType* data = &(*entry.lowerTriangle)[0];
+	for (unsigned int i = 0; i < key.sequenceCount; i++) {
+		memcpy(data + (size_t)i * (i + 1) / 2, rows[i], (i + 1) * sizeof(distType));
+	}
+
+	// Another call may have stored the same matrix, or changed the capacity, while this one was copied.
+	pthread_mutex_lock(&cacheMutex);
+	if (bytes <= cacheCapacity && findEntry(key) == cacheEntries.end()) {
+		evictEntries(cacheCapacity - bytes);
+		cacheEntries.push_front(entry);
+		cacheSize += bytes;
+	}
+	pthread_mutex_unlock(&cacheMutex);
+}
@@ -0,0 +1,47 @@
+#ifndef DISTANCE_CACHE_HPP
+#define DISTANCE_CACHE_HPP
+
+#include "stdinclude.h"
+#include "dataloader.hpp"
+#include <memory>
+
+/*Identifies the distance matrix of an alignment: a 128-bit MurmurHash3 of the bit strings and gap filters of all its sequences, in order, together with their number and
+length and everything else that the distances depend on.*/
+struct distanceCacheKey {
+	unsigned long long low;
+	unsigned long long high;
+	unsigned int sequenceCount;
+	unsigned int sequenceLength;
+	unsigned int bitStringsCount;
+	int type;
+	bool jukesCantor;
+	// Whether the distances were estimated by the library rather than by the distance kernels. Both use the same models, but they do not round the corrections in the
+	// same way, so their matrices are not interchangeable.
+	bool libraryDistances;
+};
+
+/*The distance matrices of the last alignments, shared by all the calls of the process, so that calls made with the same alignment skip the distance estimation.
+Matrices are kept in memory as their lower triangle, and the least recently used ones are dropped, rather than written to disk, once the matrices take more than the
+capacity. The cache is disabled until a capacity is set. All the functions can be called from several threads at once.*/
+
+/*Sets the number of bytes that the matrices can take, dropping the least recently used ones if they take more. 0 disables the cache and empties it.*/
+void setDistanceCacheCapacity(size_t bytes);
+
+/*Returns true if the distance matrix of sequenceCount sequences fits in the cache.*/
+bool fitsDistanceCache(unsigned int sequenceCount);
+
+/*Returns the key of the distance matrix of a fastdist dataloader. The column weights of bootstrap replicates are not part of the key, so it must not be used for them.*/
+distanceCacheKey getDistanceCacheKey(dataloader* loader, bool jukesCantor, bool libraryDistances);
+
+/*Returns the lower triangle of the cached matrix, in which row i starts at element i * (i + 1) / 2, or an empty pointer if the matrix is not in the cache. The matrix
+stays valid as long as the pointer is kept, even if it is dropped from the cache meanwhile.*/
+shared_ptr<const vector<distType> > findDistanceCache(const distanceCacheKey& key);
+
+/*Copies the cached matrix into rows, whose row i needs i + 1 elements if halfMatrix is set and sequenceCount elements otherwise. The upper triangle of full matrices
+is filled from the lower one. Returns false, without touching rows, if the matrix is not in the cache.*/
+bool readDistanceCache(const distanceCacheKey& key, distType** rows, bool halfMatrix);
+
+/*Copies the lower triangle of a matrix into the cache, if it fits.*/
+void writeDistanceCache(const distanceCacheKey& key, distType** rows);
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef DISTANCE_CORRECTIONS_HPP
+#define DISTANCE_CORRECTIONS_HPP
+
+#include "stdinclude.h"
+#include <cmath>
+
+/*JC and Kimura corrections of the counts of the distance kernels, giving the same distances as JCdistance and KimuraDistance. They are also compiled for the device by the
+CUDA backend, which passes its own copy of the Dayhoff table to kimuraProtein.*/
+#if defined __CUDACC__
+#define DISTANCE_CORRECTION __host__ __device__ inline
+#else
+#define DISTANCE_CORRECTION inline
+#endif
+
+// Dayhoff PAM distances (times 100) for protein identities between 75.0% and 93.0%, in steps of 0.1%, as used by the Kimura protein correction.
+const int DAYHOFF_PAM_COUNT = 181;
+static const int dayhoffPams[DAYHOFF_PAM_COUNT] = {
+	195, 196, 197, 198, 199, 200, 200, 201, 202, 203,
+	204, 205, 206, 207, 208, 209, 209, 210, 211, 212,
+	213, 214, 215, 216, 217, 218, 219, 220, 221, 222,
+	223, 224, 226, 227, 228, 229, 230, 231, 232, 233,
+	234, 236, 237, 238, 239, 240, 241, 243, 244, 245,
+	246, 248, 249, 250, 252, 253, 254, 255, 257, 258,
+	260, 261, 262, 264, 265, 267, 268, 270, 271, 273,
+	274, 276, 277, 279, 281, 282, 284, 285, 287, 289,
+	291, 292, 294, 296, 298, 299, 301, 303, 305, 307,
+	309, 311, 313, 315, 317, 319, 321, 323, 325, 328,
+	330, 332, 335, 337, 339, 342, 344, 347, 349, 352,
+	354, 357, 360, 362, 365, 368, 371, 374, 377, 380,
+	383, 386, 389, 393, 396, 399, 403, 407, 410, 414,
+	418, 422, 426, 430, 434, 438, 442, 447, 451, 456,
+	461, 466, 471, 476, 482, 487, 493, 498, 504, 511,
+	517, 524, 531, 538, 545, 553, 560, 569, 577, 586,
+	595, 605, 615, 626, 637, 649, 661, 675, 688, 703,
+	719, 736, 754, 775, 796, 819, 845, 874, 907, 945,
+	988
+};
+
+DISTANCE_CORRECTION distType jcDNA(unsigned long long ts, unsigned long long tv, unsigned long long length) {
+	distType p = (ts + tv) / (distType)length;
+	double temp = 1.0 - (4.0 / 3.0) * p;
+	if (length == 0 || temp <= 0) {
+		return -1;
+	}
+	return (distType)(-0.75 * log(temp));
+}
+
+DISTANCE_CORRECTION distType kimuraDNA(unsigned long long ts, unsigned long long tv, unsigned long long length) {
+	distType P = ts / (distType)length;
+	distType Q = tv / (distType)length;
+	double temp1 = 1.0 - 2.0 * P - Q;
+	double temp2 = 1.0 - 2.0 * Q;
+	if (length == 0 || temp1 <= 0 || temp2 <= 0) {
+		return -1;
+	}
+	return (distType)(-0.5 * log(temp1) - 0.25 * log(temp2));
+}
+
+DISTANCE_CORRECTION distType jcProtein(unsigned long long mismatches, unsigned long long length) {
+	distType p = mismatches / (distType)length;
+	double temp = 1.0 - (20.0 / 19.0) * p;
+	if (length == 0 || temp <= 0) {
+		return -1;
+	}
+	return (distType)(-(19.0 / 20.0) * log(temp));
+}
+
+DISTANCE_CORRECTION distType kimuraProtein(unsigned long long mismatches, unsigned long long length, const int* pams) {
+	if (length == 0) {
+		return -1;
+	}
+	distType p = mismatches / (distType)length;
+	if (p < 0.75) {
+		return (distType)(-log(1.0 - p - 0.2 * (p * p)));
+	}
+	if (p > 0.93) {
+		return 10;
+	}
+	int index = (int)(p * 1000 - 750);
+	if (index > 180) {
+		index = 180;
+	}
+	return (distType)(pams[index] / 100.0);
+}
+
+/*The corrections return -1 for pairs that are too far apart to be corrected and for pairs without any column in common. Like JCdistance and KimuraDistance, the callers
+replace these once all the distances are known, by twice the largest distance that could be corrected.*/
+DISTANCE_CORRECTION distType getSaturatedDistance(distType maxDistance) {
+	return 2 * maxDistance;
+}
+
+#endif
@@ -0,0 +1,386 @@
+#include "distanceKernels.h"
+#include <limits>
+
+#if defined RAPIDNJ_X86_KERNELS
+#if defined _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined RAPIDNJ_X86_KERNELS
+struct cpuFeatures {
+	bool popcnt;
+	bool avx2;
+	bool avx512;
+	bool avx512vpopcnt;
+};
+
+static unsigned long long readXCR0() {
+#if defined _MSC_VER
+	return _xgetbv(0);
+#else
+	unsigned int eax, edx;
+	__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+
+static void readCPUID(unsigned int leaf, unsigned int subLeaf, unsigned int* regs) {
+#if defined _MSC_VER
+	int info[4];
+	__cpuidex(info, leaf, subLeaf);
+	for (int i = 0; i < 4; i++) {
+		regs[i] = (unsigned int)info[i];
+	}
+#else
+	__cpuid_count(leaf, subLeaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static cpuFeatures detectCPUFeatures() {
+	cpuFeatures features;
+	features.popcnt = false;
+	features.avx2 = false;
+	features.avx512 = false;
+	features.avx512vpopcnt = false;
+
+	unsigned int regs[4];
+	readCPUID(0, 0, regs);
+	if (regs[0] < 7) {
+		return features;
+	}
+
+	readCPUID(1, 0, regs);
+	features.popcnt = (regs[2] & (1u << 23)) != 0;
+	bool osxsave = (regs[2] & (1u << 27)) != 0;
+	bool avx = (regs[2] & (1u << 28)) != 0;
+	if (!osxsave || !avx) {
+		return features;
+	}
+
+	// The OS must save the YMM registers (and the opmask and ZMM registers for AVX-512) on context switches.
+	unsigned long long xcr0 = readXCR0();
+	bool ymmEnabled = (xcr0 & 0x6) == 0x6;
+	bool zmmEnabled = (xcr0 & 0xE6) == 0xE6;
+
+	readCPUID(7, 0, regs);
+	features.avx2 = ymmEnabled && (regs[1] & (1u << 5)) != 0;
+	features.avx512 = zmmEnabled && (regs[1] & (1u << 16)) != 0 && (regs[1] & (1u << 30)) != 0;
+	features.avx512vpopcnt = features.avx512 && (regs[2] & (1u << 14)) != 0;
+	return features;
+}
+
+static const cpuFeatures& getCPUFeatures() {
+	static const cpuFeatures features = detectCPUFeatures();
+	return features;
+}
+#endif
+
+bool isDistanceKernelSupported(distanceKernelType type) {
+	switch (type) {
+	case KERNEL_LIBRARY:
+	case KERNEL_AUTO:
+	case KERNEL_SSE2:
+		return true;
+#if defined RAPIDNJ_X86_KERNELS
+	case KERNEL_AVX2:
+		return getCPUFeatures().avx2;
+	case KERNEL_AVX512:
+		return getCPUFeatures().avx512;
+	case KERNEL_POPCNT:
+		return getCPUFeatures().popcnt;
+	case KERNEL_AVX512_VPOPCNT:
+		return getCPUFeatures().avx512vpopcnt;
+#elif defined RAPIDNJ_NEON_KERNELS
+	case KERNEL_NEON:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+static distanceKernels makeKernels(distanceKernelType type, const char* name, dnaDistanceKernel dna, proteinDistanceKernel protein) {
+	distanceKernels kernels;
+	kernels.type = type;
+	kernels.name = name;
+	kernels.dna = dna;
+	kernels.protein = protein;
+	kernels.sortedRowScan = sortedRowScanSSE2;
+	kernels.sortedRowWidth = 4;
+#if defined RAPIDNJ_X86_KERNELS
+	if (type == KERNEL_AVX512 || type == KERNEL_AVX512_VPOPCNT) {
+		kernels.sortedRowScan = sortedRowScanAVX512;
+		kernels.sortedRowWidth = 16;
+	}
+	else if (type == KERNEL_AVX2) {
+		kernels.sortedRowScan = sortedRowScanAVX2;
+		kernels.sortedRowWidth = 8;
+	}
+	if (getCPUFeatures().popcnt) {
+		kernels.dnaWeighted = dnaWeightedDistancePOPCNT;
+		kernels.proteinWeighted = proteinWeightedDistancePOPCNT;
+		kernels.proteinPacked = proteinPackedDistancePOPCNT;
+		kernels.proteinPackedWeighted = proteinPackedWeightedDistancePOPCNT;
+		return kernels;
+	}
+#endif
+	kernels.dnaWeighted = dnaWeightedDistanceSSE2;
+	kernels.proteinWeighted = proteinWeightedDistanceSSE2;
+	kernels.proteinPacked = proteinPackedDistanceSSE2;
+	kernels.proteinPackedWeighted = proteinPackedWeightedDistanceSSE2;
+	return kernels;
+}
+
+distanceKernels getDistanceKernels(distanceKernelType type) {
+	if (type == KERNEL_LIBRARY || !isDistanceKernelSupported(type)) {
+		type = KERNEL_AUTO;
+	}
+
+	if (type == KERNEL_AUTO) {
+#if defined RAPIDNJ_X86_KERNELS
+		if (isDistanceKernelSupported(KERNEL_AVX512_VPOPCNT)) {
+			type = KERNEL_AVX512_VPOPCNT;
+		}
+		else if (isDistanceKernelSupported(KERNEL_AVX512)) {
+			type = KERNEL_AVX512;
+		}
+		else if (isDistanceKernelSupported(KERNEL_AVX2)) {
+			type = KERNEL_AVX2;
+		}
+		else if (isDistanceKernelSupported(KERNEL_POPCNT)) {
+			type = KERNEL_POPCNT;
+		}
+		else {
+			type = KERNEL_SSE2;
+		}
+#elif defined RAPIDNJ_NEON_KERNELS
+		type = KERNEL_NEON;
+#else
+		type = KERNEL_SSE2;
+#endif
+	}
+
+	switch (type) {
+#if defined RAPIDNJ_X86_KERNELS
+	case KERNEL_AVX512_VPOPCNT:
+		return makeKernels(KERNEL_AVX512_VPOPCNT, "AVX-512 VPOPCNTQ", dnaDistanceAVX512VPOPCNT, proteinDistanceAVX512VPOPCNT);
+	case KERNEL_AVX512:
+		return makeKernels(KERNEL_AVX512, "AVX-512", dnaDistanceAVX512, proteinDistanceAVX512);
+	case KERNEL_AVX2:
+		return makeKernels(KERNEL_AVX2, "AVX2", dnaDistanceAVX2, proteinDistanceAVX2);
+	case KERNEL_POPCNT:
+		return makeKernels(KERNEL_POPCNT, "POPCNT", dnaDistancePOPCNT, proteinDistancePOPCNT);
+#elif defined RAPIDNJ_NEON_KERNELS
+	case KERNEL_NEON:
+		return makeKernels(KERNEL_NEON, "NEON", dnaDistanceNEON, proteinDistanceNEON);
+#endif
+	default:
+		return makeKernels(KERNEL_SSE2, "SSE2", dnaDistanceSSE2, proteinDistanceSSE2);
+	}
+}
+
+// Number of set bits in each byte of x.
+static inline __m128i popcountBytesSSE2(__m128i x) {
+	const __m128i m1 = _mm_set1_epi8(0x55);
+	const __m128i m2 = _mm_set1_epi8(0x33);
+	const __m128i m4 = _mm_set1_epi8(0x0f);
+	x = _mm_sub_epi8(x, _mm_and_si128(_mm_srli_epi16(x, 1), m1));
+	x = _mm_add_epi8(_mm_and_si128(x, m2), _mm_and_si128(_mm_srli_epi16(x, 2), m2));
+	return _mm_and_si128(_mm_add_epi8(x, _mm_srli_epi16(x, 4)), m4);
+}
+
+static inline unsigned long long sumSSE2(__m128i acc) {
+	unsigned long long values[2];
+	_mm_storeu_si128((__m128i*)values, acc);
+	return values[0] + values[1];
+}
+
+void dnaDistanceSSE2(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, unsigned int blockCount, unsigned long long* retVal) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lowBits = _mm_set1_epi8(0x55);
+	__m128i transitions = zero;
+	__m128i transversions = zero;
+	__m128i length = zero;
+
+	for (unsigned int i = 0; i < blockCount; i++) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(bitString1 + i * 4));
+		__m128i b = _mm_loadu_si128((const __m128i*)(bitString2 + i * 4));
+		__m128i valid = _mm_and_si128(_mm_and_si128(_mm_loadu_si128((const __m128i*)(gapFilter1 + i * 4)), _mm_loadu_si128((const __m128i*)(gapFilter2 + i * 4))), lowBits);
+		__m128i diff = _mm_xor_si128(a, b);
+		// A transversion changes the high bit of a character, a transition only changes the low bit.
+		__m128i high = _mm_srli_epi32(diff, 1);
+		transversions = _mm_add_epi64(transversions, _mm_sad_epu8(popcountBytesSSE2(_mm_and_si128(high, valid)), zero));
+		transitions = _mm_add_epi64(transitions, _mm_sad_epu8(popcountBytesSSE2(_mm_and_si128(_mm_andnot_si128(high, diff), valid)), zero));
+		length = _mm_add_epi64(length, _mm_sad_epu8(popcountBytesSSE2(valid), zero));
+	}
+
+	retVal[0] = sumSSE2(transitions);
+	retVal[1] = sumSSE2(transversions);
+	retVal[2] = sumSSE2(length);
+}
+
+void proteinDistanceSSE2(const unsigned int* bitString1, const unsigned int* bitString2, unsigned int blockCount, unsigned long long* retVal) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+	const __m128i gap = _mm_set1_epi8('-');
+	__m128i mismatches = zero;
+	__m128i length = zero;
+
+	for (unsigned int i = 0; i < blockCount; i++) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(bitString1 + i * 4));
+		__m128i b = _mm_loadu_si128((const __m128i*)(bitString2 + i * 4));
+		__m128i gaps = _mm_or_si128(_mm_cmpeq_epi8(a, gap), _mm_cmpeq_epi8(b, gap));
+		__m128i equal = _mm_cmpeq_epi8(a, b);
+		length = _mm_add_epi64(length, _mm_sad_epu8(_mm_andnot_si128(gaps, one), zero));
+		mismatches = _mm_add_epi64(mismatches, _mm_sad_epu8(_mm_andnot_si128(_mm_or_si128(gaps, equal), one), zero));
+	}
+
+	retVal[0] = sumSSE2(mismatches);
+	retVal[1] = sumSSE2(length);
+}
+
+// Adds the number of bits of x that are set in each weight plane, times the weight of the plane.
+static inline __m128i weightedCountSSE2(__m128i acc, __m128i x, const unsigned int* weightPlanes, unsigned int planeCount, unsigned int planeStride) {
+	const __m128i zero = _mm_setzero_si128();
+	for (unsigned int p = 0; p < planeCount; p++) {
+		__m128i plane = _mm_loadu_si128((const __m128i*)(weightPlanes + p * planeStride));
+		__m128i count = _mm_sad_epu8(popcountBytesSSE2(_mm_and_si128(x, plane)), zero);
+		acc = _mm_add_epi64(acc, _mm_sll_epi64(count, _mm_cvtsi32_si128((int)p)));
+	}
+	return acc;
+}
+
+void dnaWeightedDistanceSSE2(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, const unsigned int* weightPlanes, unsigned int planeCount, unsigned int blockCount, unsigned long long* retVal) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lowBits = _mm_set1_epi8(0x55);
+	unsigned int planeStride = blockCount * 4;
+	__m128i transitions = zero;
+	__m128i transversions = zero;
+	__m128i length = zero;
+
+	for (unsigned int i = 0; i < blockCount; i++) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(bitString1 + i * 4));
+		__m128i b = _mm_loadu_si128((const __m128i*)(bitString2 + i * 4));
+		__m128i valid = _mm_and_si128(_mm_and_si128(_mm_loadu_si128((const __m128i*)(gapFilter1 + i * 4)), _mm_loadu_si128((const __m128i*)(gapFilter2 + i * 4))), lowBits);
+		__m128i diff = _mm_xor_si128(a, b);
+		__m128i high = _mm_srli_epi32(diff, 1);
+		const unsigned int* planes = weightPlanes + i * 4;
+		transversions = weightedCountSSE2(transversions, _mm_and_si128(high, valid), planes, planeCount, planeStride);
+		transitions = weightedCountSSE2(transitions, _mm_and_si128(_mm_andnot_si128(high, diff), valid), planes, planeCount, planeStride);
+		length = weightedCountSSE2(length, valid, planes, planeCount, planeStride);
+	}
+
+	retVal[0] = sumSSE2(transitions);
+	retVal[1] = sumSSE2(transversions);
+	retVal[2] = sumSSE2(length);
+}
+
+void proteinWeightedDistanceSSE2(const unsigned int* bitString1, const unsigned int* bitString2, const unsigned int* weightPlanes, unsigned int planeCount, unsigned int blockCount, unsigned long long* retVal) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+	const __m128i gap = _mm_set1_epi8('-');
+	unsigned int planeStride = blockCount * 4;
+	__m128i mismatches = zero;
+	__m128i length = zero;
+
+	for (unsigned int i = 0; i < blockCount; i++) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(bitString1 + i * 4));
+		__m128i b = _mm_loadu_si128((const __m128i*)(bitString2 + i * 4));
+		__m128i gaps = _mm_or_si128(_mm_cmpeq_epi8(a, gap), _mm_cmpeq_epi8(b, gap));
+		__m128i equal = _mm_cmpeq_epi8(a, b);
+		const unsigned int* planes = weightPlanes + i * 4;
+		length = weightedCountSSE2(length, _mm_andnot_si128(gaps, one), planes, planeCount, planeStride);
+		mismatches = weightedCountSSE2(mismatches, _mm_andnot_si128(_mm_or_si128(gaps, equal), one), planes, planeCount, planeStride);
+	}
+
+	retVal[0] = sumSSE2(mismatches);
+	retVal[1] = sumSSE2(length);
+}
+
+// Loads the planes of a packed protein chunk, and returns the positions that hold a residue and not a gap.
+static inline __m128i loadPackedChunkSSE2(const unsigned int* chunk, __m128i* planes) {
+	__m128i valid = _mm_setzero_si128();
+	for (unsigned int p = 0; p < PACKED_PROTEIN_PLANES; p++) {
+		planes[p] = _mm_loadu_si128((const __m128i*)(chunk + p * 4));
+		valid = _mm_or_si128(valid, planes[p]);
+	}
+	return valid;
+}
+
+// Positions of two packed protein chunks whose codes differ.
+static inline __m128i packedDifferencesSSE2(const __m128i* a, const __m128i* b) {
+	__m128i diff = _mm_setzero_si128();
+	for (unsigned int p = 0; p < PACKED_PROTEIN_PLANES; p++) {
+		diff = _mm_or_si128(diff, _mm_xor_si128(a[p], b[p]));
+	}
+	return diff;
+}
+
+void proteinPackedDistanceSSE2(const unsigned int* bitString1, const unsigned int* bitString2, unsigned int chunkCount, unsigned long long* retVal) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i mismatches = zero;
+	__m128i length = zero;
+	__m128i a[PACKED_PROTEIN_PLANES];
+	__m128i b[PACKED_PROTEIN_PLANES];
+
+	for (unsigned int i = 0; i < chunkCount; i++) {
+		__m128i valid = _mm_and_si128(loadPackedChunkSSE2(bitString1 + i * PACKED_PROTEIN_PLANES * 4, a), loadPackedChunkSSE2(bitString2 + i * PACKED_PROTEIN_PLANES * 4, b));
+		length = _mm_add_epi64(length, _mm_sad_epu8(popcountBytesSSE2(valid), zero));
+		mismatches = _mm_add_epi64(mismatches, _mm_sad_epu8(popcountBytesSSE2(_mm_and_si128(packedDifferencesSSE2(a, b), valid)), zero));
+	}
+
+	retVal[0] = sumSSE2(mismatches);
+	retVal[1] = sumSSE2(length);
+}
+
+void proteinPackedWeightedDistanceSSE2(const unsigned int* bitString1, const unsigned int* bitString2, const unsigned int* weightPlanes, unsigned int planeCount, unsigned int chunkCount, unsigned long long* retVal) {
+	const __m128i zero = _mm_setzero_si128();
+	unsigned int planeStride = chunkCount * 4;
+	__m128i mismatches = zero;
+	__m128i length = zero;
+	__m128i a[PACKED_PROTEIN_PLANES];
+	__m128i b[PACKED_PROTEIN_PLANES];
+
+	for (unsigned int i = 0; i < chunkCount; i++) {
+		__m128i valid = _mm_and_si128(loadPackedChunkSSE2(bitString1 + i * PACKED_PROTEIN_PLANES * 4, a), loadPackedChunkSSE2(bitString2 + i * PACKED_PROTEIN_PLANES * 4, b));
+		const unsigned int* planes = weightPlanes + i * 4;
+		length = weightedCountSSE2(length, valid, planes, planeCount, planeStride);
+		mismatches = weightedCountSSE2(mismatches, _mm_and_si128(packedDifferencesSSE2(a, b), valid), planes, planeCount, planeStride);
+	}
+
+	retVal[0] = sumSSE2(mismatches);
+	retVal[1] = sumSSE2(length);
+}
+
+int sortedRowScanSSE2(const distType* distances, const unsigned int* ids, const int* idToSlot, const distType* separations, distType separation, distType bound, distType best, int begin, int length, int* garbage) {
+	const __m128 separationVector = _mm_set1_ps(separation);
+	const __m128 bestVector = _mm_set1_ps(best);
+	int i = begin;
+	for (; i + 4 <= length; i += 4) {
+		if (distances[i] - bound > best) {
+			return i;
+		}
+		// SSE2 has no gathers, so the separations of the other clusters are gathered one by one. Dead clusters get an infinite value, which is never selected.
+		distType otherSeparations[4];
+		int dead = 0;
+		for (int j = 0; j < 4; j++) {
+			int other = idToSlot[ids[i + j]];
+			if (other < 0) {
+				dead++;
+				otherSeparations[j] = -numeric_limits<distType>::infinity();
+			}
+			else {
+				otherSeparations[j] = separations[other];
+			}
+		}
+		__m128 values = _mm_sub_ps(_mm_loadu_ps(distances + i), _mm_add_ps(separationVector, _mm_loadu_ps(otherSeparations)));
+		if (_mm_movemask_ps(_mm_cmple_ps(values, bestVector)) != 0) {
+			return i;
+		}
+		*garbage += dead;
+	}
+	return i;
+}
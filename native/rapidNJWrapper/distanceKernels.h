@@ -0,0 +1,110 @@
+#ifndef DISTANCE_KERNELS_H
+#define DISTANCE_KERNELS_H
+
+#include "stdinclude.h"
+
+// Number of 128-bit blocks in the widest vector used by the kernels (512 bits). Bit strings are padded to a multiple of this, so that no kernel has to deal with partial vectors.
+const unsigned int KERNEL_VECTOR_BLOCKS = 4;
+// Alignment of the bit strings, in bytes.
+const unsigned int KERNEL_ALIGNMENT = 64;
+
+inline unsigned int padBitStringsCount(unsigned int bitStringsCount) {
+	return (bitStringsCount + KERNEL_VECTOR_BLOCKS - 1) / KERNEL_VECTOR_BLOCKS * KERNEL_VECTOR_BLOCKS;
+}
+
+// Residues per chunk of the packed protein encoding, and number of 128-bit blocks per chunk: bit k of block p of a chunk is bit p of the code of residue k of the chunk.
+const unsigned int PACKED_PROTEIN_CHUNK_LENGTH = 128;
+const unsigned int PACKED_PROTEIN_PLANES = 5;
+
+enum distanceKernelType {
+	// Use the bitDistanceGap/bitDistanceProtein estimators of the rapidNJ library.
+	KERNEL_LIBRARY = 0,
+	// Use the fastest kernels supported by the current CPU.
+	KERNEL_AUTO = 1,
+	// Mask-and-add reduction on SSE2 registers; always available, and used when no faster kernel is supported.
+	KERNEL_SSE2 = 2,
+	KERNEL_AVX2 = 3,
+	KERNEL_AVX512 = 4,
+	KERNEL_NEON = 5,
+	// Scalar 64-bit POPCNT instruction.
+	KERNEL_POPCNT = 6,
+	// AVX-512 VPOPCNTQ instruction.
+	KERNEL_AVX512_VPOPCNT = 7
+};
+
+/*Counts the transitions (retVal[0]), transversions (retVal[1]) and non-gap positions (retVal[2]) between two DNA bit strings made of blockCount 128-bit blocks. blockCount must be a multiple of KERNEL_VECTOR_BLOCKS.*/
+typedef void (*dnaDistanceKernel)(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, unsigned int blockCount, unsigned long long* retVal);
+
+/*Counts the mismatches (retVal[0]) and non-gap positions (retVal[1]) between two protein bit strings made of blockCount 128-bit blocks. blockCount must be a multiple of KERNEL_VECTOR_BLOCKS.*/
+typedef void (*proteinDistanceKernel)(const unsigned int* bitString1, const unsigned int* bitString2, unsigned int blockCount, unsigned long long* retVal);
+
+/*Same as dnaDistanceKernel, but each position is counted as many times as its weight. The weights are given as planeCount bit planes of blockCount 128-bit blocks each, in the layout
+of the bit strings: a position is counted 2^p times for each plane p in which its bits are set.*/
+typedef void (*dnaWeightedDistanceKernel)(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, const unsigned int* weightPlanes, unsigned int planeCount, unsigned int blockCount, unsigned long long* retVal);
+
+/*Same as proteinDistanceKernel, with the weights of dnaWeightedDistanceKernel.*/
+typedef void (*proteinWeightedDistanceKernel)(const unsigned int* bitString1, const unsigned int* bitString2, const unsigned int* weightPlanes, unsigned int planeCount, unsigned int blockCount, unsigned long long* retVal);
+
+/*Same as proteinDistanceKernel, for protein sequences in the packed encoding of chunkCount chunks, where each residue is a 5-bit code and gaps and padding are code 0.*/
+typedef void (*packedProteinDistanceKernel)(const unsigned int* bitString1, const unsigned int* bitString2, unsigned int chunkCount, unsigned long long* retVal);
+
+/*Same as packedProteinDistanceKernel, with the weights of dnaWeightedDistanceKernel. Each weight plane holds one bit per column, so it is made of chunkCount 128-bit blocks.*/
+typedef void (*packedProteinWeightedDistanceKernel)(const unsigned int* bitString1, const unsigned int* bitString2, const unsigned int* weightPlanes, unsigned int planeCount, unsigned int chunkCount, unsigned long long* retVal);
+
+/*Scans a sorted row of the parallel NJ engine from entry begin, one block of the kernel's width at a time, for the pair to join. The value of an entry is its distance
+minus (separation + separations[idToSlot[id]]), rounded like that, and entries whose idToSlot is negative belong to dead clusters. Returns the start of the first block
+whose first distance minus bound is larger than best, or that holds a live entry with a value of at most best, or the start of the entries left over after the last
+complete block. The dead entries of the blocks skipped over are added to garbage.*/
+typedef int (*sortedRowScanKernel)(const distType* distances, const unsigned int* ids, const int* idToSlot, const distType* separations, distType separation, distType bound, distType best, int begin, int length, int* garbage);
+
+struct distanceKernels {
+	distanceKernelType type;
+	const char* name;
+	dnaDistanceKernel dna;
+	proteinDistanceKernel protein;
+	// The weighted and packed protein kernels are scalar POPCNT ones when the CPU supports it, and SSE2 ones otherwise.
+	dnaWeightedDistanceKernel dnaWeighted;
+	proteinWeightedDistanceKernel proteinWeighted;
+	packedProteinDistanceKernel proteinPacked;
+	packedProteinWeightedDistanceKernel proteinPackedWeighted;
+	// The row scan uses the widest vectors of the kernels; the POPCNT and NEON kernels use the SSE2 one. sortedRowWidth is the number of entries of its blocks.
+	sortedRowScanKernel sortedRowScan;
+	int sortedRowWidth;
+};
+
+bool isDistanceKernelSupported(distanceKernelType type);
+
+/*Returns the requested kernels, or the fastest supported ones if type is KERNEL_AUTO or is not supported by the current CPU.*/
+distanceKernels getDistanceKernels(distanceKernelType type);
+
+void dnaDistanceSSE2(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, unsigned int blockCount, unsigned long long* retVal);
+void proteinDistanceSSE2(const unsigned int* bitString1, const unsigned int* bitString2, unsigned int blockCount, unsigned long long* retVal);
+void dnaWeightedDistanceSSE2(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, const unsigned int* weightPlanes, unsigned int planeCount, unsigned int blockCount, unsigned long long* retVal);
+void proteinWeightedDistanceSSE2(const unsigned int* bitString1, const unsigned int* bitString2, const unsigned int* weightPlanes, unsigned int planeCount, unsigned int blockCount, unsigned long long* retVal);
+void proteinPackedDistanceSSE2(const unsigned int* bitString1, const unsigned int* bitString2, unsigned int chunkCount, unsigned long long* retVal);
+void proteinPackedWeightedDistanceSSE2(const unsigned int* bitString1, const unsigned int* bitString2, const unsigned int* weightPlanes, unsigned int planeCount, unsigned int chunkCount, unsigned long long* retVal);
+int sortedRowScanSSE2(const distType* distances, const unsigned int* ids, const int* idToSlot, const distType* separations, distType separation, distType bound, distType best, int begin, int length, int* garbage);
+
+#if defined _M_X64 || defined _M_I86 || defined __x86_64__
+#define RAPIDNJ_X86_KERNELS 1
+void dnaDistanceAVX2(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, unsigned int blockCount, unsigned long long* retVal);
+void proteinDistanceAVX2(const unsigned int* bitString1, const unsigned int* bitString2, unsigned int blockCount, unsigned long long* retVal);
+int sortedRowScanAVX2(const distType* distances, const unsigned int* ids, const int* idToSlot, const distType* separations, distType separation, distType bound, distType best, int begin, int length, int* garbage);
+void dnaDistanceAVX512(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, unsigned int blockCount, unsigned long long* retVal);
+void proteinDistanceAVX512(const unsigned int* bitString1, const unsigned int* bitString2, unsigned int blockCount, unsigned long long* retVal);
+int sortedRowScanAVX512(const distType* distances, const unsigned int* ids, const int* idToSlot, const distType* separations, distType separation, distType bound, distType best, int begin, int length, int* garbage);
+void dnaDistancePOPCNT(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, unsigned int blockCount, unsigned long long* retVal);
+void proteinDistancePOPCNT(const unsigned int* bitString1, const unsigned int* bitString2, unsigned int blockCount, unsigned long long* retVal);
+void dnaWeightedDistancePOPCNT(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, const unsigned int* weightPlanes, unsigned int planeCount, unsigned int blockCount, unsigned long long* retVal);
+void proteinWeightedDistancePOPCNT(const unsigned int* bitString1, const unsigned int* bitString2, const unsigned int* weightPlanes, unsigned int planeCount, unsigned int blockCount, unsigned long long* retVal);
+void proteinPackedDistancePOPCNT(const unsigned int* bitString1, const unsigned int* bitString2, unsigned int chunkCount, unsigned long long* retVal);
+void proteinPackedWeightedDistancePOPCNT(const unsigned int* bitString1, const unsigned int* bitString2, const unsigned int* weightPlanes, unsigned int planeCount, unsigned int chunkCount, unsigned long long* retVal);
+void dnaDistanceAVX512VPOPCNT(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, unsigned int blockCount, unsigned long long* retVal);
+void proteinDistanceAVX512VPOPCNT(const unsigned int* bitString1, const unsigned int* bitString2, unsigned int blockCount, unsigned long long* retVal);
+#elif defined __aarch64__ || defined _M_ARM64
+#define RAPIDNJ_NEON_KERNELS 1
+void dnaDistanceNEON(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, unsigned int blockCount, unsigned long long* retVal);
+void proteinDistanceNEON(const unsigned int* bitString1, const unsigned int* bitString2, unsigned int blockCount, unsigned long long* retVal);
+#endif
+
+#endif
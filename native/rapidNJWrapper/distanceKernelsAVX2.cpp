@@ -0,0 +1,90 @@
+#include "distanceKernels.h"
+#include <limits>
+
+// This file is compiled with AVX2 enabled; its functions must only be called after checking isDistanceKernelSupported(KERNEL_AVX2).
+#if defined RAPIDNJ_X86_KERNELS
+#include <immintrin.h>
+
+// Number of set bits in each byte of x, using a nibble lookup table.
+static inline __m256i popcountBytesAVX2(__m256i x) {
+	const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i lowNibbles = _mm256_set1_epi8(0x0f);
+	__m256i low = _mm256_shuffle_epi8(lookup, _mm256_and_si256(x, lowNibbles));
+	__m256i high = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(x, 4), lowNibbles));
+	return _mm256_add_epi8(low, high);
+}
+
+static inline unsigned long long sumAVX2(__m256i acc) {
+	unsigned long long values[4];
+	_mm256_storeu_si256((__m256i*)values, acc);
+	return values[0] + values[1] + values[2] + values[3];
+}
+
+void dnaDistanceAVX2(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, unsigned int blockCount, unsigned long long* retVal) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i lowBits = _mm256_set1_epi8(0x55);
+	__m256i transitions = zero;
+	__m256i transversions = zero;
+	__m256i length = zero;
+
+	for (unsigned int i = 0; i < blockCount; i += 2) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(bitString1 + i * 4));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(bitString2 + i * 4));
+		__m256i valid = _mm256_and_si256(_mm256_and_si256(_mm256_loadu_si256((const __m256i*)(gapFilter1 + i * 4)), _mm256_loadu_si256((const __m256i*)(gapFilter2 + i * 4))), lowBits);
+		__m256i diff = _mm256_xor_si256(a, b);
+		__m256i high = _mm256_srli_epi32(diff, 1);
+		transversions = _mm256_add_epi64(transversions, _mm256_sad_epu8(popcountBytesAVX2(_mm256_and_si256(high, valid)), zero));
+		transitions = _mm256_add_epi64(transitions, _mm256_sad_epu8(popcountBytesAVX2(_mm256_and_si256(_mm256_andnot_si256(high, diff), valid)), zero));
+		length = _mm256_add_epi64(length, _mm256_sad_epu8(popcountBytesAVX2(valid), zero));
+	}
+
+	retVal[0] = sumAVX2(transitions);
+	retVal[1] = sumAVX2(transversions);
+	retVal[2] = sumAVX2(length);
+}
+
+void proteinDistanceAVX2(const unsigned int* bitString1, const unsigned int* bitString2, unsigned int blockCount, unsigned long long* retVal) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi8(1);
+	const __m256i gap = _mm256_set1_epi8('-');
+	__m256i mismatches = zero;
+	__m256i length = zero;
+
+	for (unsigned int i = 0; i < blockCount; i += 2) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(bitString1 + i * 4));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(bitString2 + i * 4));
+		__m256i gaps = _mm256_or_si256(_mm256_cmpeq_epi8(a, gap), _mm256_cmpeq_epi8(b, gap));
+		__m256i equal = _mm256_cmpeq_epi8(a, b);
+		length = _mm256_add_epi64(length, _mm256_sad_epu8(_mm256_andnot_si256(gaps, one), zero));
+		mismatches = _mm256_add_epi64(mismatches, _mm256_sad_epu8(_mm256_andnot_si256(_mm256_or_si256(gaps, equal), one), zero));
+	}
+
+	retVal[0] = sumAVX2(mismatches);
+	retVal[1] = sumAVX2(length);
+}
+
+int sortedRowScanAVX2(const distType* distances, const unsigned int* ids, const int* idToSlot, const distType* separations, distType separation, distType bound, distType best, int begin, int length, int* garbage) {
+	const __m256 separationVector = _mm256_set1_ps(separation);
+	const __m256 bestVector = _mm256_set1_ps(best);
+	const __m256 deadSeparation = _mm256_set1_ps(-numeric_limits<distType>::infinity());
+	const __m256i minusOne = _mm256_set1_epi32(-1);
+	int i = begin;
+	for (; i + 8 <= length; i += 8) {
+		if (distances[i] - bound > best) {
+			return i;
+		}
+		// The separations of dead clusters are not gathered, and their infinite value is never selected. Cluster ids stay below 2^31, so they can be used as indices.
+		__m256i others = _mm256_i32gather_epi32(idToSlot, _mm256_loadu_si256((const __m256i*)(ids + i)), 4);
+		__m256 live = _mm256_castsi256_ps(_mm256_cmpgt_epi32(others, minusOne));
+		__m256 otherSeparations = _mm256_mask_i32gather_ps(deadSeparation, separations, others, live, 4);
+		__m256 values = _mm256_sub_ps(_mm256_loadu_ps(distances + i), _mm256_add_ps(separationVector, otherSeparations));
+		if (_mm256_movemask_ps(_mm256_cmp_ps(values, bestVector, _CMP_LE_OQ)) != 0) {
+			return i;
+		}
+		for (int dead = ~_mm256_movemask_ps(live) & 0xFF; dead != 0; dead &= dead - 1) {
+			(*garbage)++;
+		}
+	}
+	return i;
+}
+#endif
@@ -0,0 +1,84 @@
+#include "distanceKernels.h"
+#include <limits>
+
+// This file is compiled with AVX-512F and AVX-512BW enabled; its functions must only be called after checking isDistanceKernelSupported(KERNEL_AVX512).
+#if defined RAPIDNJ_X86_KERNELS
+#include <immintrin.h>
+
+// Number of set bits in each byte of x, using a nibble lookup table.
+static inline __m512i popcountBytesAVX512(__m512i x) {
+	const __m512i lookup = _mm512_set4_epi32(0x04030302, 0x03020201, 0x03020201, 0x02010100);
+	const __m512i lowNibbles = _mm512_set1_epi8(0x0f);
+	__m512i low = _mm512_shuffle_epi8(lookup, _mm512_and_si512(x, lowNibbles));
+	__m512i high = _mm512_shuffle_epi8(lookup, _mm512_and_si512(_mm512_srli_epi16(x, 4), lowNibbles));
+	return _mm512_add_epi8(low, high);
+}
+
+void dnaDistanceAVX512(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, unsigned int blockCount, unsigned long long* retVal) {
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i lowBits = _mm512_set1_epi8(0x55);
+	__m512i transitions = zero;
+	__m512i transversions = zero;
+	__m512i length = zero;
+
+	for (unsigned int i = 0; i < blockCount; i += 4) {
+		__m512i a = _mm512_loadu_si512((const void*)(bitString1 + i * 4));
+		__m512i b = _mm512_loadu_si512((const void*)(bitString2 + i * 4));
+		__m512i valid = _mm512_and_si512(_mm512_and_si512(_mm512_loadu_si512((const void*)(gapFilter1 + i * 4)), _mm512_loadu_si512((const void*)(gapFilter2 + i * 4))), lowBits);
+		__m512i diff = _mm512_xor_si512(a, b);
+		__m512i high = _mm512_srli_epi32(diff, 1);
+		transversions = _mm512_add_epi64(transversions, _mm512_sad_epu8(popcountBytesAVX512(_mm512_and_si512(high, valid)), zero));
+		transitions = _mm512_add_epi64(transitions, _mm512_sad_epu8(popcountBytesAVX512(_mm512_and_si512(_mm512_andnot_si512(high, diff), valid)), zero));
+		length = _mm512_add_epi64(length, _mm512_sad_epu8(popcountBytesAVX512(valid), zero));
+	}
+
+	retVal[0] = _mm512_reduce_add_epi64(transitions);
+	retVal[1] = _mm512_reduce_add_epi64(transversions);
+	retVal[2] = _mm512_reduce_add_epi64(length);
+}
+
+void proteinDistanceAVX512(const unsigned int* bitString1, const unsigned int* bitString2, unsigned int blockCount, unsigned long long* retVal) {
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i one = _mm512_set1_epi8(1);
+	const __m512i gap = _mm512_set1_epi8('-');
+	__m512i mismatches = zero;
+	__m512i length = zero;
+
+	for (unsigned int i = 0; i < blockCount; i += 4) {
+		__m512i a = _mm512_loadu_si512((const void*)(bitString1 + i * 4));
+		__m512i b = _mm512_loadu_si512((const void*)(bitString2 + i * 4));
+		__mmask64 valid = ~(_mm512_cmpeq_epi8_mask(a, gap) | _mm512_cmpeq_epi8_mask(b, gap));
+		__mmask64 different = valid & _mm512_cmpneq_epi8_mask(a, b);
+		length = _mm512_add_epi64(length, _mm512_sad_epu8(_mm512_maskz_mov_epi8(valid, one), zero));
+		mismatches = _mm512_add_epi64(mismatches, _mm512_sad_epu8(_mm512_maskz_mov_epi8(different, one), zero));
+	}
+
+	retVal[0] = _mm512_reduce_add_epi64(mismatches);
+	retVal[1] = _mm512_reduce_add_epi64(length);
+}
+
+int sortedRowScanAVX512(const distType* distances, const unsigned int* ids, const int* idToSlot, const distType* separations, distType separation, distType bound, distType best, int begin, int length, int* garbage) {
+	const __m512 separationVector = _mm512_set1_ps(separation);
+	const __m512 bestVector = _mm512_set1_ps(best);
+	const __m512 deadSeparation = _mm512_set1_ps(-numeric_limits<distType>::infinity());
+	const __m512i zero = _mm512_setzero_si512();
+	int i = begin;
+	for (; i + 16 <= length; i += 16) {
+		if (distances[i] - bound > best) {
+			return i;
+		}
+		// The separations of dead clusters are not gathered, and their infinite value is never selected. Cluster ids stay below 2^31, so they can be used as indices.
+		__m512i others = _mm512_i32gather_epi32(_mm512_loadu_si512((const void*)(ids + i)), idToSlot, 4);
+		__mmask16 live = _mm512_cmpge_epi32_mask(others, zero);
+		__m512 otherSeparations = _mm512_mask_i32gather_ps(deadSeparation, live, others, separations, 4);
+		__m512 values = _mm512_sub_ps(_mm512_loadu_ps(distances + i), _mm512_add_ps(separationVector, otherSeparations));
+		if (_mm512_cmp_ps_mask(values, bestVector, _CMP_LE_OQ) != 0) {
+			return i;
+		}
+		for (int dead = ~(int)live & 0xFFFF; dead != 0; dead &= dead - 1) {
+			(*garbage)++;
+		}
+	}
+	return i;
+}
+#endif
@@ -0,0 +1,48 @@
+#include "distanceKernels.h"
+
+// This file is compiled with AVX-512F, AVX-512BW and AVX-512 VPOPCNTDQ enabled; its functions must only be called after checking isDistanceKernelSupported(KERNEL_AVX512_VPOPCNT).
+#if defined RAPIDNJ_X86_KERNELS
+#include <immintrin.h>
+
+void dnaDistanceAVX512VPOPCNT(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, unsigned int blockCount, unsigned long long* retVal) {
+	const __m512i lowBits = _mm512_set1_epi8(0x55);
+	__m512i transitions = _mm512_setzero_si512();
+	__m512i transversions = _mm512_setzero_si512();
+	__m512i length = _mm512_setzero_si512();
+
+	for (unsigned int i = 0; i < blockCount; i += 4) {
+		__m512i a = _mm512_loadu_si512((const void*)(bitString1 + i * 4));
+		__m512i b = _mm512_loadu_si512((const void*)(bitString2 + i * 4));
+		__m512i valid = _mm512_and_si512(_mm512_and_si512(_mm512_loadu_si512((const void*)(gapFilter1 + i * 4)), _mm512_loadu_si512((const void*)(gapFilter2 + i * 4))), lowBits);
+		__m512i diff = _mm512_xor_si512(a, b);
+		__m512i high = _mm512_srli_epi32(diff, 1);
+		transversions = _mm512_add_epi64(transversions, _mm512_popcnt_epi64(_mm512_and_si512(high, valid)));
+		transitions = _mm512_add_epi64(transitions, _mm512_popcnt_epi64(_mm512_and_si512(_mm512_andnot_si512(high, diff), valid)));
+		length = _mm512_add_epi64(length, _mm512_popcnt_epi64(valid));
+	}
+
+	retVal[0] = _mm512_reduce_add_epi64(transitions);
+	retVal[1] = _mm512_reduce_add_epi64(transversions);
+	retVal[2] = _mm512_reduce_add_epi64(length);
+}
+
+void proteinDistanceAVX512VPOPCNT(const unsigned int* bitString1, const unsigned int* bitString2, unsigned int blockCount, unsigned long long* retVal) {
+	const __m512i gap = _mm512_set1_epi8('-');
+	__m512i mismatches = _mm512_setzero_si512();
+	__m512i length = _mm512_setzero_si512();
+
+	for (unsigned int i = 0; i < blockCount; i += 4) {
+		__m512i a = _mm512_loadu_si512((const void*)(bitString1 + i * 4));
+		__m512i b = _mm512_loadu_si512((const void*)(bitString2 + i * 4));
+		__mmask64 valid = ~(_mm512_cmpeq_epi8_mask(a, gap) | _mm512_cmpeq_epi8_mask(b, gap));
+		__mmask64 different = valid & _mm512_cmpneq_epi8_mask(a, b);
+		// Move the comparison masks to a vector register, so that they can be counted without leaving the vector unit.
+		length = _mm512_add_epi64(length, _mm512_popcnt_epi64(_mm512_movm_epi8(valid)));
+		mismatches = _mm512_add_epi64(mismatches, _mm512_popcnt_epi64(_mm512_movm_epi8(different)));
+	}
+
+	// Each selected byte contributes 8 set bits.
+	retVal[0] = _mm512_reduce_add_epi64(mismatches) / 8;
+	retVal[1] = _mm512_reduce_add_epi64(length) / 8;
+}
+#endif
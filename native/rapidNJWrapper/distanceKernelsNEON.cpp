@@ -0,0 +1,46 @@
+#include "distanceKernels.h"
+
+#if defined RAPIDNJ_NEON_KERNELS
+#include <arm_neon.h>
+
+void dnaDistanceNEON(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, unsigned int blockCount, unsigned long long* retVal) {
+	const uint8x16_t lowBits = vdupq_n_u8(0x55);
+	uint32x4_t transitions = vdupq_n_u32(0);
+	uint32x4_t transversions = vdupq_n_u32(0);
+	uint32x4_t length = vdupq_n_u32(0);
+
+	for (unsigned int i = 0; i < blockCount; i++) {
+		uint8x16_t a = vld1q_u8((const uint8_t*)(bitString1 + i * 4));
+		uint8x16_t b = vld1q_u8((const uint8_t*)(bitString2 + i * 4));
+		uint8x16_t valid = vandq_u8(vandq_u8(vld1q_u8((const uint8_t*)(gapFilter1 + i * 4)), vld1q_u8((const uint8_t*)(gapFilter2 + i * 4))), lowBits);
+		uint8x16_t diff = veorq_u8(a, b);
+		// Characters never straddle bytes, so the shift can be done per byte.
+		uint8x16_t high = vshrq_n_u8(diff, 1);
+		transversions = vpadalq_u16(transversions, vpaddlq_u8(vcntq_u8(vandq_u8(high, valid))));
+		transitions = vpadalq_u16(transitions, vpaddlq_u8(vcntq_u8(vandq_u8(vbicq_u8(diff, high), valid))));
+		length = vpadalq_u16(length, vpaddlq_u8(vcntq_u8(valid)));
+	}
+
+	retVal[0] = vaddvq_u32(transitions);
+	retVal[1] = vaddvq_u32(transversions);
+	retVal[2] = vaddvq_u32(length);
+}
+
+void proteinDistanceNEON(const unsigned int* bitString1, const unsigned int* bitString2, unsigned int blockCount, unsigned long long* retVal) {
+	const uint8x16_t gap = vdupq_n_u8('-');
+	uint32x4_t mismatches = vdupq_n_u32(0);
+	uint32x4_t length = vdupq_n_u32(0);
+
+	for (unsigned int i = 0; i < blockCount; i++) {
+		uint8x16_t a = vld1q_u8((const uint8_t*)(bitString1 + i * 4));
+		uint8x16_t b = vld1q_u8((const uint8_t*)(bitString2 + i * 4));
+		uint8x16_t gaps = vorrq_u8(vceqq_u8(a, gap), vceqq_u8(b, gap));
+		uint8x16_t equal = vceqq_u8(a, b);
+		length = vpadalq_u16(length, vpaddlq_u8(vshrq_n_u8(vmvnq_u8(gaps), 7)));
+		mismatches = vpadalq_u16(mismatches, vpaddlq_u8(vshrq_n_u8(vmvnq_u8(vorrq_u8(gaps, equal)), 7)));
+	}
+
+	retVal[0] = vaddvq_u32(mismatches);
+	retVal[1] = vaddvq_u32(length);
+}
+#endif
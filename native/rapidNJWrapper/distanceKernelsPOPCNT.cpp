@@ -0,0 +1,172 @@
+#include "distanceKernels.h"
+
+// This file is compiled with POPCNT enabled; its functions must only be called after checking isDistanceKernelSupported(KERNEL_POPCNT).
+#if defined RAPIDNJ_X86_KERNELS
+#if defined _MSC_VER
+#include <intrin.h>
+#define POPCOUNT64(x) __popcnt64(x)
+#else
+#include <nmmintrin.h>
+#define POPCOUNT64(x) _mm_popcnt_u64(x)
+#endif
+
+typedef unsigned long long word;
+
+static const word LOW_BITS = 0x5555555555555555ULL;
+static const word LOW_7_BITS = 0x7F7F7F7F7F7F7F7FULL;
+static const word GAPS = 0x2D2D2D2D2D2D2D2DULL;
+
+// Sets the high bit of each non-zero byte of x, and clears all the other bits.
+static inline word nonZeroBytes(word x) {
+	return (((x & LOW_7_BITS) + LOW_7_BITS) | x) & ~LOW_7_BITS;
+}
+
+void dnaDistancePOPCNT(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, unsigned int blockCount, unsigned long long* retVal) {
+	const word* a = (const word*)bitString1;
+	const word* b = (const word*)bitString2;
+	const word* ga = (const word*)gapFilter1;
+	const word* gb = (const word*)gapFilter2;
+	unsigned long long transitions = 0;
+	unsigned long long transversions = 0;
+	unsigned long long length = 0;
+
+	for (unsigned int i = 0; i < blockCount * 2; i++) {
+		word valid = ga[i] & gb[i] & LOW_BITS;
+		word diff = a[i] ^ b[i];
+		word high = diff >> 1;
+		transversions += POPCOUNT64(high & valid);
+		transitions += POPCOUNT64(diff & ~high & valid);
+		length += POPCOUNT64(valid);
+	}
+
+	retVal[0] = transitions;
+	retVal[1] = transversions;
+	retVal[2] = length;
+}
+
+void proteinDistancePOPCNT(const unsigned int* bitString1, const unsigned int* bitString2, unsigned int blockCount, unsigned long long* retVal) {
+	const word* a = (const word*)bitString1;
+	const word* b = (const word*)bitString2;
+	unsigned long long mismatches = 0;
+	unsigned long long length = 0;
+
+	for (unsigned int i = 0; i < blockCount * 2; i++) {
+		// A byte is valid if it is not a gap in either sequence.
+		word valid = nonZeroBytes(a[i] ^ GAPS) & nonZeroBytes(b[i] ^ GAPS);
+		mismatches += POPCOUNT64(valid & nonZeroBytes(a[i] ^ b[i]));
+		length += POPCOUNT64(valid);
+	}
+
+	retVal[0] = mismatches;
+	retVal[1] = length;
+}
+
+// Number of bits of x that are set in each weight plane, times the weight of the plane.
+static inline unsigned long long weightedCount(word x, const word* weightPlanes, unsigned int planeCount, unsigned int planeStride) {
+	unsigned long long count = 0;
+	for (unsigned int p = 0; p < planeCount; p++) {
+		count += (unsigned long long)POPCOUNT64(x & weightPlanes[p * planeStride]) << p;
+	}
+	return count;
+}
+
+void dnaWeightedDistancePOPCNT(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, const unsigned int* weightPlanes, unsigned int planeCount, unsigned int blockCount, unsigned long long* retVal) {
+	const word* a = (const word*)bitString1;
+	const word* b = (const word*)bitString2;
+	const word* ga = (const word*)gapFilter1;
+	const word* gb = (const word*)gapFilter2;
+	const word* w = (const word*)weightPlanes;
+	unsigned int planeStride = blockCount * 2;
+	unsigned long long transitions = 0;
+	unsigned long long transversions = 0;
+	unsigned long long length = 0;
+
+	for (unsigned int i = 0; i < blockCount * 2; i++) {
+		word valid = ga[i] & gb[i] & LOW_BITS;
+		word diff = a[i] ^ b[i];
+		word high = diff >> 1;
+		transversions += weightedCount(high & valid, w + i, planeCount, planeStride);
+		transitions += weightedCount(diff & ~high & valid, w + i, planeCount, planeStride);
+		length += weightedCount(valid, w + i, planeCount, planeStride);
+	}
+
+	retVal[0] = transitions;
+	retVal[1] = transversions;
+	retVal[2] = length;
+}
+
+void proteinWeightedDistancePOPCNT(const unsigned int* bitString1, const unsigned int* bitString2, const unsigned int* weightPlanes, unsigned int planeCount, unsigned int blockCount, unsigned long long* retVal) {
+	const word* a = (const word*)bitString1;
+	const word* b = (const word*)bitString2;
+	const word* w = (const word*)weightPlanes;
+	unsigned int planeStride = blockCount * 2;
+	unsigned long long mismatches = 0;
+	unsigned long long length = 0;
+
+	for (unsigned int i = 0; i < blockCount * 2; i++) {
+		word valid = nonZeroBytes(a[i] ^ GAPS) & nonZeroBytes(b[i] ^ GAPS);
+		mismatches += weightedCount(valid & nonZeroBytes(a[i] ^ b[i]), w + i, planeCount, planeStride);
+		length += weightedCount(valid, w + i, planeCount, planeStride);
+	}
+
+	retVal[0] = mismatches;
+	retVal[1] = length;
+}
+
+// Positions of half h of a packed protein chunk that hold a residue in both sequences, and those whose codes differ.
+static inline word packedValid(const word* a, const word* b, unsigned int h) {
+	word validA = 0;
+	word validB = 0;
+	for (unsigned int p = 0; p < PACKED_PROTEIN_PLANES; p++) {
+		validA |= a[p * 2 + h];
+		validB |= b[p * 2 + h];
+	}
+	return validA & validB;
+}
+
+static inline word packedDifferences(const word* a, const word* b, unsigned int h) {
+	word diff = 0;
+	for (unsigned int p = 0; p < PACKED_PROTEIN_PLANES; p++) {
+		diff |= a[p * 2 + h] ^ b[p * 2 + h];
+	}
+	return diff;
+}
+
+void proteinPackedDistancePOPCNT(const unsigned int* bitString1, const unsigned int* bitString2, unsigned int chunkCount, unsigned long long* retVal) {
+	unsigned long long mismatches = 0;
+	unsigned long long length = 0;
+
+	for (unsigned int i = 0; i < chunkCount; i++) {
+		const word* a = (const word*)(bitString1 + i * PACKED_PROTEIN_PLANES * 4);
+		const word* b = (const word*)(bitString2 + i * PACKED_PROTEIN_PLANES * 4);
+		for (unsigned int h = 0; h < 2; h++) {
+			word valid = packedValid(a, b, h);
+			mismatches += POPCOUNT64(valid & packedDifferences(a, b, h));
+			length += POPCOUNT64(valid);
+		}
+	}
+
+	retVal[0] = mismatches;
+	retVal[1] = length;
+}
+
+void proteinPackedWeightedDistancePOPCNT(const unsigned int* bitString1, const unsigned int* bitString2, const unsigned int* weightPlanes, unsigned int planeCount, unsigned int chunkCount, unsigned long long* retVal) {
+	const word* w = (const word*)weightPlanes;
+	unsigned int planeStride = chunkCount * 2;
+	unsigned long long mismatches = 0;
+	unsigned long long length = 0;
+
+	for (unsigned int i = 0; i < chunkCount; i++) {
+		const word* a = (const word*)(bitString1 + i * PACKED_PROTEIN_PLANES * 4);
+		const word* b = (const word*)(bitString2 + i * PACKED_PROTEIN_PLANES * 4);
+		for (unsigned int h = 0; h < 2; h++) {
+			word valid = packedValid(a, b, h);
+			mismatches += weightedCount(valid & packedDifferences(a, b, h), w + i * 2 + h, planeCount, planeStride);
+			length += weightedCount(valid, w + i * 2 + h, planeCount, planeStride);
+		}
+	}
+
+	retVal[0] = mismatches;
+	retVal[1] = length;
+}
+#endif
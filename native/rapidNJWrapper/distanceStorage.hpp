@@ -0,0 +1,126 @@
+#ifndef DISTANCE_STORAGE_HPP
+#define DISTANCE_STORAGE_HPP
+
+#include "stdinclude.h"
+
+/*Types used to store the distance matrix of rapidNJParallel. Distances are converted to and from distType when they are read or written, so all the
+computations are done in single or double precision and only the matrix itself is narrower.*/
+enum distanceStorageType {
+	// 32-bit distances, the same as the rest of the library.
+	DISTANCE_STORAGE_FLOAT = 0,
+	// IEEE 754 half precision: 11 significant bits, but distances above 65504 become infinite and distances below 6.1e-5 lose precision.
+	DISTANCE_STORAGE_HALF = 1,
+	// bfloat16: the range of a float with 8 significant bits.
+	DISTANCE_STORAGE_BFLOAT16 = 2
+};
+
+/*A distance stored in IEEE 754 half precision. Conversions round to the nearest representable value, ties to even.*/
+struct halfDistance {
+	unsigned short bits;
+
+	halfDistance() {}
+
+	halfDistance(distType value) {
+		unsigned int floatBits;
+		memcpy(&floatBits, &value, sizeof(floatBits));
+		unsigned int sign = (floatBits >> 16) & 0x8000u;
+		unsigned int absolute = floatBits & 0x7FFFFFFFu;
+
+		// Infinities and NaNs.
+		if (absolute >= 0x7F800000u) {
+			bits = (unsigned short)(sign | 0x7C00u | (absolute > 0x7F800000u ? 0x200u : 0));
+		}
+		// Values that round to 65520 or more overflow.
+		else if (absolute >= 0x477FF000u) {
+			bits = (unsigned short)(sign | 0x7C00u);
+		}
+		// Normal half precision values: the exponent is rebiased and the mantissa rounded to 10 bits.
+		else if (absolute >= 0x38800000u) {
+			unsigned int result = (absolute - 0x38000000u) >> 13;
+			unsigned int remainder = absolute & 0x1FFFu;
+			if (remainder > 0x1000u || (remainder == 0x1000u && (result & 1))) {
+				result++;
+			}
+			bits = (unsigned short)(sign | result);
+		}
+		// Values that round to zero.
+		else if (absolute <= 0x33000000u) {
+			bits = (unsigned short)sign;
+		}
+		// Subnormal half precision values, in units of 2^-24.
+		else {
+			unsigned int mantissa = (absolute & 0x7FFFFFu) | 0x800000u;
+			int shift = 126 - (int)(absolute >> 23);
+			unsigned int result = mantissa >> shift;
+			unsigned int remainder = mantissa & ((1u << shift) - 1);
+			unsigned int halfway = 1u << (shift - 1);
+			if (remainder > halfway || (remainder == halfway && (result & 1))) {
+				result++;
+			}
+			bits = (unsigned short)(sign | result);
+		}
+	}
+
+	operator distType() const {
+		unsigned int sign = (unsigned int)(bits & 0x8000u) << 16;
+		unsigned int exponent = (bits >> 10) & 0x1Fu;
+		unsigned int mantissa = bits & 0x3FFu;
+		unsigned int floatBits;
+
+		if (exponent == 0x1Fu) {
+			floatBits = sign | 0x7F800000u | (mantissa << 13);
+		}
+		else if (exponent != 0) {
+			floatBits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+		}
+		else {
+			// Subnormal values are exact in single precision.
+			distType value = mantissa * (1.0f / 16777216.0f);
+			return sign != 0 ? -value : value;
+		}
+
+		distType value;
+		memcpy(&value, &floatBits, sizeof(value));
+		return value;
+	}
+};
+
+/*A distance stored in bfloat16, i.e. the upper half of a float. Conversions round to the nearest representable value, ties to even.*/
+struct bfloat16Distance {
+	unsigned short bits;
+
+	bfloat16Distance() {}
+
+	bfloat16Distance(distType value) {
+		unsigned int floatBits;
+		memcpy(&floatBits, &value, sizeof(floatBits));
+		if ((floatBits & 0x7FFFFFFFu) > 0x7F800000u) {
+			// Keep NaNs quiet, rounding could turn them into infinities.
+			bits = (unsigned short)((floatBits >> 16) | 0x40u);
+		}
+		else {
+			bits = (unsigned short)((floatBits + 0x7FFFu + ((floatBits >> 16) & 1)) >> 16);
+		}
+	}
+
+	operator distType() const {
+		unsigned int floatBits = (unsigned int)bits << 16;
+		distType value;
+		memcpy(&value, &floatBits, sizeof(value));
+		return value;
+	}
+};
+
+/*Returns the size in bytes of one stored distance.*/
+inline int getDistanceStorageSize(distanceStorageType type) {
+	switch (type) {
+		case DISTANCE_STORAGE_HALF:
+			return sizeof(halfDistance);
+		case DISTANCE_STORAGE_BFLOAT16:
+			return sizeof(bfloat16Distance);
+		default:
+			return sizeof(distType);
+	}
+}
+
+#endif
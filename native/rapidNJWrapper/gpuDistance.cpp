@@ -0,0 +1,12 @@
+#include "gpuDistance.hpp"
+
+// Used when the wrapper is built without RAPIDNJ_ENABLE_CUDA; gpuDistanceCUDA.cu replaces these functions otherwise.
+#if !defined RAPIDNJ_CUDA
+bool isGPUDistanceAvailable() {
+	return false;
+}
+
+bool computeGPUDistanceMatrix(dataloader* /*loader*/, bool /*jukesCantor*/, distType** /*distMatrix*/, bool /*verbose*/) {
+	return false;
+}
+#endif
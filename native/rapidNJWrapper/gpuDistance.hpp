@@ -0,0 +1,16 @@
+#ifndef GPUDISTANCE_HPP
+#define GPUDISTANCE_HPP
+
+#include "stdinclude.h"
+#include "dataloader.hpp"
+
+/*Returns true if the wrapper was built with RAPIDNJ_ENABLE_CUDA and a CUDA device is present.*/
+bool isGPUDistanceAvailable();
+
+/*Computes the JC or Kimura distance matrix of a fastdist dataloader on the GPU, with the same distances as kernelDistance, into the rows of a full matrix. The lower triangle is
+split into blocks of rows, each of which is computed in square tiles and copied back while the next one is being computed.
+Returns false if there is no device, if the dataloader is a bootstrap replicate with column weights (which the GPU kernels do not apply), or if the device runs out of
+memory, in which case the matrix must be computed on the CPU.*/
+bool computeGPUDistanceMatrix(dataloader* loader, bool jukesCantor, distType** distMatrix, bool verbose);
+
+#endif
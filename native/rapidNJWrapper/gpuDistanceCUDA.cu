@@ -0,0 +1,307 @@
+#include "gpuDistance.hpp"
+#include "distanceCorrections.hpp"
+#include "dataLoaderBootstrap.hpp"
+#include "packedProteins.hpp"
+#include <cuda_runtime.h>
+
+// Sequences per side of the square tile computed by a thread block, with one thread per pair.
+const unsigned int GPU_TILE_SIZE = 16;
+// Words of the bit strings of each sequence of a tile that are staged in shared memory at a time: two chunks of the packed protein encoding.
+const unsigned int GPU_TILE_WORDS = 2 * PACKED_PROTEIN_PLANES * 4;
+// Size of each of the two buffers that hold a block of rows of the matrix, on the device and on the host.
+const size_t GPU_ROW_BLOCK_BYTES = 64 * 1024 * 1024;
+// Sequences copied to the device at a time.
+const unsigned int GPU_UPLOAD_BATCH = 1024;
+
+enum gpuEncoding {
+	GPU_DNA = 0,
+	GPU_PROTEIN = 1,
+	GPU_PROTEIN_PACKED = 2
+};
+
+__constant__ int dayhoffPamsGPU[DAYHOFF_PAM_COUNT];
+
+// Sets the high bit of each non-zero byte of x, and clears all the other bits.
+__device__ inline unsigned int nonZeroBytesGPU(unsigned int x) {
+	const unsigned int low7Bits = 0x7F7F7F7Fu;
+	return (((x & low7Bits) + low7Bits) | x) & ~low7Bits;
+}
+
+/*Computes the distances of the pairs of a tile below the diagonal, between rows [rowBegin, rowEnd) and all the sequences before them. Row i of the block is stored at
+rows + (i - rowBegin) * seqCount. The counts are those of the CPU kernels, and the corrections are those of kernelDistance.*/
+template <int encoding>
+__global__ void distanceTileKernel(const unsigned int* bitStrings, const unsigned int* gapFilters, unsigned int seqCount, unsigned int words, unsigned int rowBegin, unsigned int rowEnd, bool jukesCantor, distType* rows) {
+	__shared__ unsigned int rowBits[GPU_TILE_SIZE][GPU_TILE_WORDS + 1];
+	__shared__ unsigned int columnBits[GPU_TILE_SIZE][GPU_TILE_WORDS + 1];
+	__shared__ unsigned int rowGaps[GPU_TILE_SIZE][GPU_TILE_WORDS + 1];
+	__shared__ unsigned int columnGaps[GPU_TILE_SIZE][GPU_TILE_WORDS + 1];
+
+	unsigned int tx = threadIdx.x;
+	unsigned int ty = threadIdx.y;
+	unsigned int tileRow = rowBegin + blockIdx.y * GPU_TILE_SIZE;
+	unsigned int tileColumn = blockIdx.x * GPU_TILE_SIZE;
+	// Tiles above the diagonal have no pair to compute. The whole block returns, so it does not matter for __syncthreads.
+	if (tileColumn >= tileRow + GPU_TILE_SIZE) {
+		return;
+	}
+
+	unsigned int i = tileRow + ty;
+	unsigned int j = tileColumn + tx;
+	unsigned int counts[3] = { 0, 0, 0 };
+
+	for (unsigned int start = 0; start < words; start += GPU_TILE_WORDS) {
+		unsigned int count = min(GPU_TILE_WORDS, words - start);
+
+		// Each thread stages some of the words of row ty and column ty of the tile.
+		unsigned int stagedRow = tileRow + ty;
+		unsigned int stagedColumn = tileColumn + ty;
+		for (unsigned int k = tx; k < count; k += GPU_TILE_SIZE) {
+			rowBits[ty][k] = stagedRow < rowEnd ? bitStrings[(size_t)stagedRow * words + start + k] : 0;
+			columnBits[ty][k] = stagedColumn < seqCount ? bitStrings[(size_t)stagedColumn * words + start + k] : 0;
+			if (encoding == GPU_DNA) {
+				rowGaps[ty][k] = stagedRow < rowEnd ? gapFilters[(size_t)stagedRow * words + start + k] : 0;
+				columnGaps[ty][k] = stagedColumn < seqCount ? gapFilters[(size_t)stagedColumn * words + start + k] : 0;
+			}
+		}
+		__syncthreads();
+
+		if (encoding == GPU_DNA) {
+			for (unsigned int k = 0; k < count; k++) {
+				unsigned int valid = rowGaps[ty][k] & columnGaps[tx][k] & 0x55555555u;
+				unsigned int diff = rowBits[ty][k] ^ columnBits[tx][k];
+				unsigned int high = diff >> 1;
+				counts[0] += __popc(diff & ~high & valid);
+				counts[1] += __popc(high & valid);
+				counts[2] += __popc(valid);
+			}
+		}
+		else if (encoding == GPU_PROTEIN) {
+			const unsigned int gaps = 0x2D2D2D2Du;
+			for (unsigned int k = 0; k < count; k++) {
+				unsigned int a = rowBits[ty][k];
+				unsigned int b = columnBits[tx][k];
+				unsigned int valid = nonZeroBytesGPU(a ^ gaps) & nonZeroBytesGPU(b ^ gaps);
+				counts[0] += __popc(valid & nonZeroBytesGPU(a ^ b));
+				counts[1] += __popc(valid);
+			}
+		}
+		else {
+			// The staged words are whole chunks, whose planes are 4 words apart.
+			for (unsigned int chunk = 0; chunk < count; chunk += PACKED_PROTEIN_PLANES * 4) {
+				for (unsigned int w = 0; w < 4; w++) {
+					unsigned int validA = 0;
+					unsigned int validB = 0;
+					unsigned int diff = 0;
+					for (unsigned int p = 0; p < PACKED_PROTEIN_PLANES; p++) {
+						unsigned int a = rowBits[ty][chunk + p * 4 + w];
+						unsigned int b = columnBits[tx][chunk + p * 4 + w];
+						validA |= a;
+						validB |= b;
+						diff |= a ^ b;
+					}
+					unsigned int valid = validA & validB;
+					counts[0] += __popc(valid & diff);
+					counts[1] += __popc(valid);
+				}
+			}
+		}
+		__syncthreads();
+	}
+
+	if (i < rowEnd && j < i) {
+		distType distance;
+		if (encoding == GPU_DNA) {
+			distance = jukesCantor ? jcDNA(counts[0], counts[1], counts[2]) : kimuraDNA(counts[0], counts[1], counts[2]);
+		}
+		else {
+			distance = jukesCantor ? jcProtein(counts[0], counts[1]) : kimuraProtein(counts[0], counts[1], dayhoffPamsGPU);
+		}
+		rows[(size_t)(i - rowBegin) * seqCount + j] = distance;
+	}
+}
+
+bool isGPUDistanceAvailable() {
+	int deviceCount = 0;
+	return cudaGetDeviceCount(&deviceCount) == cudaSuccess && deviceCount > 0;
+}
+
+// Device and pinned host memory of computeGPUDistanceMatrix, released whatever the step that failed.
+struct gpuDistanceBuffers {
+	unsigned int* bitStrings;
+	unsigned int* gapFilters;
+	distType* rows[2];
+	distType* hostRows[2];
+	cudaStream_t streams[2];
+	bool streamsCreated[2];
+
+	gpuDistanceBuffers() {
+		bitStrings = NULL;
+		gapFilters = NULL;
+		for (int s = 0; s < 2; s++) {
+			rows[s] = NULL;
+			hostRows[s] = NULL;
+			streamsCreated[s] = false;
+		}
+	}
+
+	~gpuDistanceBuffers() {
+		for (int s = 0; s < 2; s++) {
+			if (streamsCreated[s]) {
+				cudaStreamSynchronize(streams[s]);
+				cudaStreamDestroy(streams[s]);
+			}
+			cudaFree(rows[s]);
+			cudaFreeHost(hostRows[s]);
+		}
+		cudaFree(bitStrings);
+		cudaFree(gapFilters);
+	}
+};
+
+// Copies the bit strings of all the sequences to a single device buffer, so that the sequences of a tile are read with coalesced loads.
+static bool uploadBitStrings(unsigned int** source, unsigned int seqCount, unsigned int words, unsigned int** device) {
+	if (cudaMalloc((void**)device, (size_t)seqCount * words * sizeof(unsigned int)) != cudaSuccess) {
+		*device = NULL;
+		return false;
+	}
+
+	vector<unsigned int> staging((size_t)min(seqCount, GPU_UPLOAD_BATCH) * words);
+	for (unsigned int first = 0; first < seqCount; first += GPU_UPLOAD_BATCH) {
+		unsigned int count = min(GPU_UPLOAD_BATCH, seqCount - first);
+		for (unsigned int k = 0; k < count; k++) {
+			memcpy(&staging[(size_t)k * words], source[first + k], words * sizeof(unsigned int));
+		}
+		if (cudaMemcpy(*device + (size_t)first * words, &staging[0], (size_t)count * words * sizeof(unsigned int), cudaMemcpyHostToDevice) != cudaSuccess) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Copies the pairs of a block of rows, which were computed below the diagonal, to both triangles of the matrix, keeping track of the largest distance and of the distances
+// that could not be corrected.
+static void storeRowBlock(const distType* hostRows, unsigned int seqCount, unsigned int rowBegin, unsigned int rowEnd, distType** distMatrix, distType& maxDistance, bool& saturated) {
+	for (unsigned int i = rowBegin; i < rowEnd; i++) {
+		const distType* row = hostRows + (size_t)(i - rowBegin) * seqCount;
+		for (unsigned int j = 0; j < i; j++) {
+			if (row[j] == -1) {
+				saturated = true;
+			}
+			else if (row[j] > maxDistance) {
+				maxDistance = row[j];
+			}
+			distMatrix[i][j] = row[j];
+			distMatrix[j][i] = row[j];
+		}
+		distMatrix[i][i] = 0;
+	}
+}
+
+// Replaces the distances that could not be corrected once they are all known, like kernelDistance.
+static void replaceSaturatedDistances(unsigned int seqCount, distType maxDistance, distType** distMatrix) {
+	distType substitute = getSaturatedDistance(maxDistance);
+	for (unsigned int i = 0; i < seqCount; i++) {
+		for (unsigned int j = 0; j < i; j++) {
+			if (distMatrix[i][j] == -1) {
+				distMatrix[i][j] = substitute;
+				distMatrix[j][i] = substitute;
+			}
+		}
+	}
+}
+
+static void launchTiles(int encoding, dim3 grid, dim3 threads, cudaStream_t stream, const gpuDistanceBuffers& buffers, int s, unsigned int seqCount, unsigned int words, unsigned int rowBegin, unsigned int rowEnd, bool jukesCantor) {
+	switch (encoding) {
+	case GPU_DNA:
+		distanceTileKernel<GPU_DNA><<<grid, threads, 0, stream>>>(buffers.bitStrings, buffers.gapFilters, seqCount, words, rowBegin, rowEnd, jukesCantor, buffers.rows[s]);
+		break;
+	case GPU_PROTEIN:
+		distanceTileKernel<GPU_PROTEIN><<<grid, threads, 0, stream>>>(buffers.bitStrings, NULL, seqCount, words, rowBegin, rowEnd, jukesCantor, buffers.rows[s]);
+		break;
+	default:
+		distanceTileKernel<GPU_PROTEIN_PACKED><<<grid, threads, 0, stream>>>(buffers.bitStrings, NULL, seqCount, words, rowBegin, rowEnd, jukesCantor, buffers.rows[s]);
+		break;
+	}
+}
+
+bool computeGPUDistanceMatrix(dataloader* loader, bool jukesCantor, distType** distMatrix, bool verbose) {
+	if (!loader->fastdist || (loader->type != DNA && loader->type != PROTEIN) || getColumnWeights(loader) != NULL || !isGPUDistanceAvailable()) {
+		return false;
+	}
+
+	unsigned int seqCount = loader->getSequenceCount();
+	unsigned int words = loader->getBitStringsCount() * 4;
+	int encoding = loader->type == DNA ? GPU_DNA : hasPackedProteins(loader) ? GPU_PROTEIN_PACKED : GPU_PROTEIN;
+	if (seqCount == 0) {
+		return true;
+	}
+
+	if (verbose) {
+		int device = 0;
+		cudaDeviceProp properties;
+		if (cudaGetDevice(&device) == cudaSuccess && cudaGetDeviceProperties(&properties, device) == cudaSuccess) {
+			cerr << "Computing distances on " << properties.name << endl;
+		}
+	}
+
+	gpuDistanceBuffers buffers;
+	if (!uploadBitStrings(loader->getBitStrings(), seqCount, words, &buffers.bitStrings)) {
+		return false;
+	}
+	if (encoding == GPU_DNA && !uploadBitStrings(loader->getGapFilters(), seqCount, words, &buffers.gapFilters)) {
+		return false;
+	}
+	if (cudaMemcpyToSymbol(dayhoffPamsGPU, dayhoffPams, sizeof(dayhoffPams)) != cudaSuccess) {
+		return false;
+	}
+
+	// Whole tiles of rows, as many as fit in a buffer.
+	unsigned int tileCount = (seqCount + GPU_TILE_SIZE - 1) / GPU_TILE_SIZE;
+	unsigned int rowsPerBlock = (unsigned int)(GPU_ROW_BLOCK_BYTES / ((size_t)seqCount * sizeof(distType)));
+	rowsPerBlock = min(max(rowsPerBlock / GPU_TILE_SIZE, 1u), tileCount) * GPU_TILE_SIZE;
+	size_t bufferBytes = (size_t)rowsPerBlock * seqCount * sizeof(distType);
+
+	for (int s = 0; s < 2; s++) {
+		if (cudaMalloc((void**)&buffers.rows[s], bufferBytes) != cudaSuccess || cudaMallocHost((void**)&buffers.hostRows[s], bufferBytes) != cudaSuccess) {
+			return false;
+		}
+		if (cudaStreamCreate(&buffers.streams[s]) != cudaSuccess) {
+			return false;
+		}
+		buffers.streamsCreated[s] = true;
+	}
+
+	// The two buffers are used in turn: a block of rows is stored in the matrix while the next one is being computed.
+	dim3 threads(GPU_TILE_SIZE, GPU_TILE_SIZE);
+	unsigned int blockCount = (seqCount + rowsPerBlock - 1) / rowsPerBlock;
+	distType maxDistance = 0;
+	bool saturated = false;
+	for (unsigned int b = 0; b < blockCount + 2; b++) {
+		int s = b % 2;
+		if (b >= 2) {
+			if (cudaStreamSynchronize(buffers.streams[s]) != cudaSuccess) {
+				return false;
+			}
+			unsigned int storedBegin = (b - 2) * rowsPerBlock;
+			storeRowBlock(buffers.hostRows[s], seqCount, storedBegin, min(storedBegin + rowsPerBlock, seqCount), distMatrix, maxDistance, saturated);
+		}
+
+		if (b < blockCount) {
+			unsigned int rowBegin = b * rowsPerBlock;
+			unsigned int rowEnd = min(rowBegin + rowsPerBlock, seqCount);
+			dim3 grid((rowEnd + GPU_TILE_SIZE - 1) / GPU_TILE_SIZE, (rowEnd - rowBegin + GPU_TILE_SIZE - 1) / GPU_TILE_SIZE);
+			launchTiles(encoding, grid, threads, buffers.streams[s], buffers, s, seqCount, words, rowBegin, rowEnd, jukesCantor);
+
+			// Only the columns before the end of the block hold distances.
+			size_t pitch = (size_t)seqCount * sizeof(distType);
+			if (cudaMemcpy2DAsync(buffers.hostRows[s], pitch, buffers.rows[s], pitch, rowEnd * sizeof(distType), rowEnd - rowBegin, cudaMemcpyDeviceToHost, buffers.streams[s]) != cudaSuccess || cudaGetLastError() != cudaSuccess) {
+				return false;
+			}
+		}
+	}
+
+	if (saturated) {
+		replaceSaturatedDistances(seqCount, maxDistance, distMatrix);
+	}
+	return true;
+}
@@ -0,0 +1,367 @@
+#include "kernelDistance.hpp"
+#include "distanceCorrections.hpp"
+
+kernelDistance::kernelDistance(bool verbose, bool jukesCantor, dataloader* loader, distanceKernels kernels) {
+	kernelDistance::verbose = verbose;
+	kernelDistance::jukesCantor = jukesCantor;
+	kernelDistance::loader = loader;
+	kernelDistance::kernels = kernels;
+	weights = getColumnWeights(loader);
+	packedProteins = hasPackedProteins(loader);
+	seqCount = loader->getSequenceCount();
+	halfMatrix = false;
+	progress = NULL;
+	distMatrix = new distType*[seqCount];
+	for (unsigned int i = 0; i < seqCount; i++) {
+		distMatrix[i] = new distType[seqCount];
+	}
+}
+
+kernelDistance::kernelDistance(bool verbose, bool jukesCantor, dataloader* loader, distanceKernels kernels, distType** matrixStorage) {
+	kernelDistance::verbose = verbose;
+	kernelDistance::jukesCantor = jukesCantor;
+	kernelDistance::loader = loader;
+	kernelDistance::kernels = kernels;
+	weights = getColumnWeights(loader);
+	packedProteins = hasPackedProteins(loader);
+	seqCount = loader->getSequenceCount();
+	halfMatrix = false;
+	progress = NULL;
+	distMatrix = matrixStorage;
+}
+
+bool kernelDistance::isSupported(dataloader* loader) {
+	if (hasPackedProteins(loader)) {
+		return loader->fastdist && loader->getBitStringsCount() % PACKED_PROTEIN_PLANES == 0;
+	}
+	return loader->fastdist && (loader->type == DNA || loader->type == PROTEIN) && loader->getBitStringsCount() % KERNEL_VECTOR_BLOCKS == 0;
+}
+
+distType kernelDistance::computeDistance(unsigned int i, unsigned int j) {
+	unsigned long long counts[3];
+	unsigned int** bitStrings = loader->getBitStrings();
+	unsigned int blockCount = loader->getBitStringsCount();
+
+	if (loader->type == DNA) {
+		unsigned int** gapFilters = loader->getGapFilters();
+		if (weights != NULL) {
+			kernels.dnaWeighted(bitStrings[i], gapFilters[i], bitStrings[j], gapFilters[j], weights->planes, weights->planeCount, blockCount, counts);
+		}
+		else {
+			kernels.dna(bitStrings[i], gapFilters[i], bitStrings[j], gapFilters[j], blockCount, counts);
+		}
+		if (jukesCantor) {
+			return jcDNA(counts[0], counts[1], counts[2]);
+		}
+		else {
+			return kimuraDNA(counts[0], counts[1], counts[2]);
+		}
+	}
+	else {
+		if (packedProteins) {
+			unsigned int chunkCount = blockCount / PACKED_PROTEIN_PLANES;
+			if (weights != NULL) {
+				kernels.proteinPackedWeighted(bitStrings[i], bitStrings[j], weights->planes, weights->planeCount, chunkCount, counts);
+			}
+			else {
+				kernels.proteinPacked(bitStrings[i], bitStrings[j], chunkCount, counts);
+			}
+		}
+		else if (weights != NULL) {
+			kernels.proteinWeighted(bitStrings[i], bitStrings[j], weights->planes, weights->planeCount, blockCount, counts);
+		}
+		else {
+			kernels.protein(bitStrings[i], bitStrings[j], blockCount, counts);
+		}
+		if (jukesCantor) {
+			return jcProtein(counts[0], counts[1]);
+		}
+		else {
+			return kimuraProtein(counts[0], counts[1], dayhoffPams);
+		}
+	}
+}
+
+unsigned int kernelDistance::getTileSize() {
+	// The bit strings and, for DNA, the gap filters of the two blocks of a tile.
+	unsigned int sequenceBytes = loader->getBitStringsCount() * 4 * sizeof(unsigned int) * (loader->type == DNA ? 2 : 1);
+	unsigned int tileSize = KERNEL_TILE_CACHE_BYTES / (2 * max(sequenceBytes, 1u));
+	return min(max(tileSize, KERNEL_MIN_TILE_SIZE), KERNEL_MAX_TILE_SIZE);
+}
+
+static unsigned long long packTileRange(unsigned int begin, unsigned int end) {
+	return ((unsigned long long)begin << 32) | end;
+}
+
+// Takes the first tile left to the thread.
+static bool takeTile(kernelTileQueue* queue, unsigned int& tile) {
+	unsigned long long range = queue->range.load();
+	while (true) {
+		unsigned int begin = (unsigned int)(range >> 32);
+		unsigned int end = (unsigned int)range;
+		if (begin >= end) {
+			return false;
+		}
+		if (queue->range.compare_exchange_weak(range, packTileRange(begin + 1, end))) {
+			tile = begin;
+			return true;
+		}
+	}
+}
+
+// Moves the back half of the tiles of another thread to the queue of the thread, which must be empty, and takes the first of them.
+// Returns false once all the queues are empty; the tiles that other threads are still computing do not need to be waited for.
+static bool stealTiles(threadStateKernel* state, int threadIndex, unsigned int& tile) {
+	for (int offset = 1; offset < state->threadCount; offset++) {
+		kernelTileQueue* victim = &state->queues[(threadIndex + offset) % state->threadCount];
+		unsigned long long range = victim->range.load();
+		while (true) {
+			unsigned int begin = (unsigned int)(range >> 32);
+			unsigned int end = (unsigned int)range;
+			if (begin >= end) {
+				break;
+			}
+			unsigned int stolenBegin = end - (end - begin + 1) / 2;
+			if (victim->range.compare_exchange_weak(range, packTileRange(begin, stolenBegin))) {
+				tile = stolenBegin;
+				state->queues[threadIndex].range.store(packTileRange(stolenBegin + 1, end));
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+static void computeTile(threadStateKernel* state, unsigned int tile, distType& maxDistance, bool& saturated) {
+	unsigned int rowBegin = state->tileRows[tile] * state->tileSize;
+	unsigned int rowEnd = min(rowBegin + state->tileSize, state->seqCount);
+	unsigned int columnBegin = state->tileColumns[tile] * state->tileSize;
+	unsigned int columnEnd = min(columnBegin + state->tileSize, state->seqCount);
+
+	for (unsigned int i = rowBegin; i < rowEnd; i++) {
+		// Tiles on the diagonal only contain the pairs below it.
+		unsigned int end = min(columnEnd, i);
+		for (unsigned int j = columnBegin; j < end; j++) {
+			distType distance = state->alg->computeDistance(i, j);
+			if (distance == -1) {
+				saturated = true;
+			}
+			else if (distance > maxDistance) {
+				maxDistance = distance;
+			}
+			state->distMatrix[i][j] = distance;
+			if (!state->halfMatrix) {
+				state->distMatrix[j][i] = distance;
+			}
+		}
+		if (columnEnd > i) {
+			state->distMatrix[i][i] = 0;
+		}
+	}
+}
+
+void kernelDistance::distTask(void* arg, int workerIndex, int /*workerCount*/) {
+	threadStateKernel* state = (threadStateKernel*)arg;
+
+	distType maxDistance = 0;
+	bool saturated = false;
+	unsigned int tile;
+	while (!state->alg->isCancelled() && (takeTile(&state->queues[workerIndex], tile) || stealTiles(state, workerIndex, tile))) {
+		computeTile(state, tile, maxDistance, saturated);
+	}
+	state->maxDistances[workerIndex] = maxDistance;
+	state->saturated[workerIndex] = saturated;
+}
+
+void kernelDistance::computeDistanceMatrix(int numThreads) {
+	if (verbose) {
+		cerr << "Using " << kernels.name << " distance kernels" << endl;
+	}
+
+	if (numThreads < 1) {
+		numThreads = 1;
+	}
+
+	threadStateKernel* state = new threadStateKernel();
+	state->seqCount = seqCount;
+	state->tileSize = getTileSize();
+	state->alg = this;
+	state->distMatrix = distMatrix;
+	state->threadCount = numThreads;
+	state->halfMatrix = halfMatrix;
+	state->maxDistances.resize(numThreads, 0);
+	state->saturated.resize(numThreads, 0);
+
+	// The tiles of a block row are consecutive, so that the bit strings of the row are shared by the tiles that a thread takes one after the other.
+	unsigned int blockCount = (seqCount + state->tileSize - 1) / state->tileSize;
+	for (unsigned int row = 0; row < blockCount; row++) {
+		for (unsigned int column = 0; column <= row; column++) {
+			state->tileRows.push_back(row);
+			state->tileColumns.push_back(column);
+		}
+	}
+
+	unsigned int tileCount = (unsigned int)state->tileRows.size();
+	state->queues = new kernelTileQueue[numThreads];
+	for (int i = 0; i < numThreads; i++) {
+		state->queues[i].range.store(packTileRange((unsigned int)((unsigned long long)tileCount * i / numThreads), (unsigned int)((unsigned long long)tileCount * (i + 1) / numThreads)));
+	}
+
+	if (verbose) {
+		cerr << "Computing " << tileCount << " tiles of " << state->tileSize << " x " << state->tileSize << " distances" << endl;
+	}
+
+	// A single worker computes the tiles on the calling thread, so that the many small matrices of a batch do not involve the shared threads.
+	workerPool pool(numThreads);
+	pool.run(kernelDistance::distTask, (void*)state);
+
+	distType maxDistance = 0;
+	bool saturated = false;
+	for (int i = 0; i < numThreads; i++) {
+		maxDistance = max(maxDistance, state->maxDistances[i]);
+		saturated = saturated || state->saturated[i] != 0;
+	}
+	if (saturated && !isCancelled()) {
+		postProcessDistanceMatrix(maxDistance);
+	}
+
+	delete[] state->queues;
+	delete state;
+}
+
+// Replaces the distances that could not be corrected, like the postProcessDistanceMatrix of JCdistance and KimuraDistance.
+void kernelDistance::postProcessDistanceMatrix(distType maxDistance) {
+	distType substitute = getSaturatedDistance(maxDistance);
+	for (unsigned int i = 0; i < seqCount; i++) {
+		for (unsigned int j = 0; j < i; j++) {
+			if (distMatrix[i][j] == -1) {
+				distMatrix[i][j] = substitute;
+				if (!halfMatrix) {
+					distMatrix[j][i] = substitute;
+				}
+			}
+		}
+	}
+}
+
+void kernelDistance::setHalfMatrix(bool halfMatrix) {
+	kernelDistance::halfMatrix = halfMatrix;
+}
+
+void kernelDistance::setProgress(callProgress* progress) {
+	kernelDistance::progress = progress;
+}
+
+bool kernelDistance::isCancelled() {
+	return progress != NULL && progress->isCancelled();
+}
+
+void kernelDistance::rowBlockTask(void* arg, int /*workerIndex*/, int /*workerCount*/) {
+	threadStateRowBlocks* state = (threadStateRowBlocks*)arg;
+	unsigned int blockSize = state->blockSize;
+	// The rows of a block are stored one after the other, so the buffer only grows to the size of the last block.
+	vector<distType> buffer;
+	vector<distType*> rows(blockSize);
+	distType maxDistance = 0;
+
+	while (!state->alg->isCancelled()) {
+		unsigned int block = state->nextBlock.fetch_add(1);
+		unsigned int rowBegin = block * blockSize;
+		if (rowBegin >= state->seqCount) {
+			break;
+		}
+		unsigned int rowEnd = min(rowBegin + blockSize, state->seqCount);
+		buffer.resize(((size_t)rowEnd * (rowEnd + 1) - (size_t)rowBegin * (rowBegin + 1)) / 2);
+		size_t offset = 0;
+		for (unsigned int i = rowBegin; i < rowEnd; i++) {
+			rows[i - rowBegin] = &buffer[offset];
+			offset += i + 1;
+		}
+
+		// The rows are computed one block of columns at a time, so that the bit strings of the columns are reused from the cache by all the rows, like in a tile.
+		bool saturated = false;
+		for (unsigned int columnBegin = 0; columnBegin < rowEnd; columnBegin += blockSize) {
+			unsigned int columnEnd = min(columnBegin + blockSize, rowEnd);
+			for (unsigned int i = rowBegin; i < rowEnd; i++) {
+				unsigned int end = min(columnEnd, i);
+				for (unsigned int j = columnBegin; j < end; j++) {
+					distType distance = state->alg->computeDistance(i, j);
+					if (distance == -1) {
+						saturated = true;
+					}
+					else if (distance > maxDistance) {
+						maxDistance = distance;
+					}
+					rows[i - rowBegin][j] = distance;
+				}
+				if (columnEnd > i) {
+					rows[i - rowBegin][i] = 0;
+				}
+			}
+		}
+
+		if (saturated) {
+			pthread_mutex_lock(&state->mutex);
+			state->deferredBlocks.push_back(kernelDeferredRowBlock());
+			kernelDeferredRowBlock& deferred = state->deferredBlocks.back();
+			deferred.firstRow = rowBegin;
+			deferred.rowCount = rowEnd - rowBegin;
+			deferred.distances.assign(buffer.begin(), buffer.begin() + offset);
+			pthread_mutex_unlock(&state->mutex);
+		}
+		else {
+			state->callback(state->arg, rowBegin, rowEnd - rowBegin, &rows[0]);
+		}
+	}
+
+	pthread_mutex_lock(&state->mutex);
+	state->maxDistance = max(state->maxDistance, maxDistance);
+	pthread_mutex_unlock(&state->mutex);
+}
+
+void kernelDistance::computeRowBlocks(int numThreads, kernelRowBlockCallback callback, void* arg) {
+	if (verbose) {
+		cerr << "Using " << kernels.name << " distance kernels" << endl;
+	}
+
+	threadStateRowBlocks* state = new threadStateRowBlocks();
+	state->alg = this;
+	state->seqCount = seqCount;
+	state->blockSize = getTileSize();
+	state->nextBlock.store(0);
+	state->callback = callback;
+	state->arg = arg;
+	state->maxDistance = 0;
+	pthread_mutex_init(&state->mutex, NULL);
+
+	unsigned int blockCount = (seqCount + state->blockSize - 1) / state->blockSize;
+	workerPool pool(min(max(numThreads, 1), (int)max(blockCount, 1u)));
+	pool.run(kernelDistance::rowBlockTask, (void*)state);
+
+	// The distances that could not be corrected need the largest distance of the whole matrix.
+	if (!isCancelled()) {
+		distType substitute = getSaturatedDistance(state->maxDistance);
+		vector<distType*> rows(state->blockSize);
+		for (size_t b = 0; b < state->deferredBlocks.size(); b++) {
+			kernelDeferredRowBlock& deferred = state->deferredBlocks[b];
+			for (size_t k = 0; k < deferred.distances.size(); k++) {
+				if (deferred.distances[k] == -1) {
+					deferred.distances[k] = substitute;
+				}
+			}
+			size_t offset = 0;
+			for (unsigned int k = 0; k < deferred.rowCount; k++) {
+				rows[k] = &deferred.distances[offset];
+				offset += deferred.firstRow + k + 1;
+			}
+			callback(arg, deferred.firstRow, deferred.rowCount, &rows[0]);
+		}
+	}
+
+	pthread_mutex_destroy(&state->mutex);
+	delete state;
+}
+
+distType** kernelDistance::getDistanceMatrix() {
+	return distMatrix;
+}
@@ -0,0 +1,114 @@
+#ifndef KERNELDISTANCE_HPP
+#define KERNELDISTANCE_HPP
+
+#include "stdinclude.h"
+#include "dataloader.hpp"
+#include "distanceKernels.h"
+#include "dataLoaderBootstrap.hpp"
+#include "packedProteins.hpp"
+#include "workerPool.hpp"
+#include "callProgress.hpp"
+#include <atomic>
+
+/*Bytes of bit strings that a tile of the distance matrix should keep in the cache: the tiles are made of the pairs between two blocks of sequences that fit in this
+amount together, which is about the size of a per-core L2 cache.*/
+const unsigned int KERNEL_TILE_CACHE_BYTES = 256 * 1024;
+const unsigned int KERNEL_MIN_TILE_SIZE = 16;
+const unsigned int KERNEL_MAX_TILE_SIZE = 256;
+
+/*Receives rows firstRow to firstRow + rowCount - 1 of the lower triangle of a distance matrix: rows[k] holds the distances between sequence firstRow + k and sequences 0 to
+firstRow + k. The rows are only valid during the call.*/
+typedef void (*kernelRowBlockCallback)(void* arg, unsigned int firstRow, unsigned int rowCount, distType** rows);
+
+/*Computes a JC or Kimura distance matrix from fastdist bit strings, using the vectorised kernels selected at runtime. The distances are the same as those computed by JCdistance and KimuraDistance.
+The column weights of bootstrap replicates are applied, so that their distances are the same as those of a resampled alignment. Protein sequences may use the packed encoding.
+The lower triangle of the matrix is split into square tiles, so that the bit strings of a tile are reused from the cache for all its pairs, and the tiles are spread
+between the threads, which steal them from each other once they run out.*/
+class kernelDistance {
+
+public:
+	kernelDistance(bool verbose, bool jukesCantor, dataloader* loader, distanceKernels kernels);
+	kernelDistance(bool verbose, bool jukesCantor, dataloader* loader, distanceKernels kernels, distType** matrixStorage);
+	static void distTask(void* arg, int workerIndex, int workerCount);
+	distType** getDistanceMatrix();
+	void computeDistanceMatrix(int numThreads);
+
+	/*Computes the lower triangle of the matrix one block of rows at a time, without storing it: each worker computes whole blocks in a buffer of its own and passes them to callback
+	as soon as they are finished, in no particular order. The callback can be called by several threads at once. The blocks that hold distances that could not be corrected
+	are kept until all the others are computed, and passed on by the calling thread once these distances are replaced like in computeDistanceMatrix.*/
+	void computeRowBlocks(int numThreads, kernelRowBlockCallback callback, void* arg);
+
+	/*If set, computeDistanceMatrix only writes the lower triangle, so row i of the matrix storage only needs i + 1 elements.*/
+	void setHalfMatrix(bool halfMatrix);
+
+	/*If set, the workers stop taking tiles and blocks of rows once the call is cancelled, leaving the rest of the matrix unset.*/
+	void setProgress(callProgress* progress);
+	distType computeDistance(unsigned int i, unsigned int j);
+
+	/*Returns the number of sequences in each block of a tile.*/
+	unsigned int getTileSize();
+
+	/*Returns true if the bit strings of the dataloader can be processed by the kernels.*/
+	static bool isSupported(dataloader* loader);
+
+private:
+	bool verbose;
+	bool jukesCantor;
+	unsigned int seqCount;
+	dataloader* loader;
+	distanceKernels kernels;
+	const columnWeights* weights;
+	bool packedProteins;
+	bool halfMatrix;
+	distType** distMatrix;
+	callProgress* progress;
+
+	bool isCancelled();
+	void postProcessDistanceMatrix(distType maxDistance);
+	static void rowBlockTask(void* arg, int workerIndex, int workerCount);
+};
+
+/*The tiles left to a thread, [begin, end) packed in the high and low 32 bits so that they can be updated with a single compare-and-swap. The owner takes them from
+the front, while the other threads steal the back half. Padded to a cache line so that the threads do not share one.*/
+struct kernelTileQueue {
+	std::atomic<unsigned long long> range;
+	char padding[64 - sizeof(std::atomic<unsigned long long>)];
+};
+
+struct threadStateKernel {
+	unsigned int seqCount;
+	unsigned int tileSize;
+	kernelDistance* alg;
+	distType** distMatrix;
+	// Block row and block column of each tile, in the order in which they are handed out.
+	vector<unsigned int> tileRows;
+	vector<unsigned int> tileColumns;
+	kernelTileQueue* queues;
+	int threadCount;
+	bool halfMatrix;
+	// The largest distance that could be corrected and whether some could not, for each worker.
+	vector<distType> maxDistances;
+	vector<char> saturated;
+};
+
+/*A block of rows of computeRowBlocks that holds distances that could not be corrected, with its rows stored one after the other.*/
+struct kernelDeferredRowBlock {
+	unsigned int firstRow;
+	unsigned int rowCount;
+	vector<distType> distances;
+};
+
+struct threadStateRowBlocks {
+	kernelDistance* alg;
+	unsigned int seqCount;
+	unsigned int blockSize;
+	std::atomic<unsigned int> nextBlock;
+	kernelRowBlockCallback callback;
+	void* arg;
+	// The largest distance of all the blocks and the deferred blocks, updated by the workers under the mutex.
+	distType maxDistance;
+	vector<kernelDeferredRowBlock> deferredBlocks;
+	pthread_mutex_t mutex;
+};
+
+#endif
@@ -0,0 +1,289 @@
+#include "mappedMatrix.hpp"
+
+#ifdef __WINDOWS__
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+mappedMatrix::mappedMatrix(string dataDir, int size, int elementSize) {
+	mappedMatrix::size = size;
+	mappedMatrix::elementSize = elementSize;
+	rows = NULL;
+	data = NULL;
+	firstRequest = 0;
+	requestCount = 0;
+	stopping = false;
+	threadStarted = false;
+	bytesPrefetched = 0;
+	bytesWrittenBehind = 0;
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&requestAvailable, NULL);
+	length = max(rowOffset(size), (unsigned long long)elementSize);
+
+	// The matrix must fit in the address space, which is not a given on 32-bit systems.
+	if (length > (unsigned long long)(size_t)-1) {
+		return;
+	}
+
+#ifdef __WINDOWS__
+	file = NULL;
+	mapping = NULL;
+
+	char directory[MAX_PATH + 1];
+	if (dataDir.empty()) {
+		if (GetTempPathA(MAX_PATH + 1, directory) == 0) {
+			return;
+		}
+	}
+	else {
+		strncpy(directory, dataDir.c_str(), MAX_PATH);
+		directory[MAX_PATH] = 0;
+	}
+
+	char fileName[MAX_PATH + 1];
+	if (GetTempFileNameA(directory, "rnj", 0, fileName) == 0) {
+		return;
+	}
+	HANDLE fileHandle = CreateFileA(fileName, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		DeleteFileA(fileName);
+		return;
+	}
+	file = fileHandle;
+
+	// Mapping more than the size of the file extends it.
+	HANDLE mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READWRITE, (DWORD)(length >> 32), (DWORD)(length & 0xFFFFFFFF), NULL);
+	if (mappingHandle == NULL) {
+		return;
+	}
+	mapping = mappingHandle;
+
+	data = (char*)MapViewOfFile(mappingHandle, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)length);
+	if (data == NULL) {
+		return;
+	}
+#else
+	string directory = dataDir;
+	if (directory.empty()) {
+		const char* temp = getenv("TMPDIR");
+		directory = (temp != NULL && temp[0] != 0) ? temp : "/tmp";
+	}
+	string nameTemplate = directory + "/rapidNJXXXXXX";
+	vector<char> fileName(nameTemplate.begin(), nameTemplate.end());
+	fileName.push_back(0);
+
+	int fd = mkstemp(&fileName[0]);
+	if (fd < 0) {
+		return;
+	}
+	// The file stays available until it is unmapped, and is cleaned up even if the process is killed.
+	unlink(&fileName[0]);
+
+#if defined __linux__
+	// Reserving the space up front turns a full disk into an error here, rather than a SIGBUS when a row is written.
+	bool allocated = posix_fallocate(fd, 0, (off_t)length) == 0;
+#else
+	bool allocated = ftruncate(fd, (off_t)length) == 0;
+#endif
+	if (!allocated) {
+		close(fd);
+		return;
+	}
+
+	void* address = mmap(NULL, (size_t)length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (address == MAP_FAILED) {
+		return;
+	}
+	data = (char*)address;
+#endif
+
+	rows = new char*[size];
+	for (int i = 0; i < size; i++) {
+		rows[i] = data + rowOffset(i);
+	}
+
+	threadStarted = pthread_create(&ioThread, NULL, mappedMatrix::ioThreadMain, (void*)this) == 0;
+}
+
+mappedMatrix::~mappedMatrix(void) {
+	// Pending requests are abandoned, the I/O thread must not touch the mapping once it is gone.
+	if (threadStarted) {
+		pthread_mutex_lock(&mutex);
+		stopping = true;
+		pthread_cond_signal(&requestAvailable);
+		pthread_mutex_unlock(&mutex);
+		pthread_join(ioThread, NULL);
+	}
+	pthread_cond_destroy(&requestAvailable);
+	pthread_mutex_destroy(&mutex);
+
+#ifdef __WINDOWS__
+	if (data != NULL) {
+		UnmapViewOfFile(data);
+	}
+	if (mapping != NULL) {
+		CloseHandle((HANDLE)mapping);
+	}
+	if (file != NULL) {
+		CloseHandle((HANDLE)file);
+	}
+#else
+	if (data != NULL) {
+		munmap(data, (size_t)length);
+	}
+#endif
+	delete[] rows;
+}
+
+bool mappedMatrix::isValid() {
+	return rows != NULL;
+}
+
+void* mappedMatrix::getRow(int row) {
+	return rows[row];
+}
+
+// Offset in bytes of the first element of a row of the half matrix.
+unsigned long long mappedMatrix::rowOffset(int row) {
+	return (unsigned long long)row * (row + 1) / 2 * elementSize;
+}
+
+void mappedMatrix::adviseSequential() {
+#ifndef __WINDOWS__
+	advise(data, length, MADV_SEQUENTIAL);
+#endif
+}
+
+void mappedMatrix::adviseRandom() {
+#ifndef __WINDOWS__
+	advise(data, length, MADV_RANDOM);
+#endif
+}
+
+void mappedMatrix::adviseWillNeed(int firstRow, int rowCount) {
+#ifndef __WINDOWS__
+	unsigned long long start = rowOffset(firstRow);
+	advise(data + start, rowOffset(firstRow + rowCount) - start, MADV_WILLNEED);
+#endif
+}
+
+void mappedMatrix::prefetchRows(int firstRow, int rowCount) {
+	queueRequest(firstRow, rowCount, false);
+}
+
+void mappedMatrix::writeBehind(int firstRow, int rowCount) {
+	queueRequest(firstRow, rowCount, true);
+}
+
+long long mappedMatrix::getBytesPrefetched() {
+	pthread_mutex_lock(&mutex);
+	long long retVal = bytesPrefetched;
+	pthread_mutex_unlock(&mutex);
+	return retVal;
+}
+
+long long mappedMatrix::getBytesWrittenBehind() {
+	pthread_mutex_lock(&mutex);
+	long long retVal = bytesWrittenBehind;
+	pthread_mutex_unlock(&mutex);
+	return retVal;
+}
+
+void mappedMatrix::queueRequest(int firstRow, int rowCount, bool write) {
+	if (!threadStarted || rowCount <= 0) {
+		return;
+	}
+	pthread_mutex_lock(&mutex);
+	if (requestCount < REQUEST_QUEUE_SIZE) {
+		mappedMatrixRequest* request = &requests[(firstRequest + requestCount) % REQUEST_QUEUE_SIZE];
+		request->firstRow = firstRow;
+		request->rowCount = rowCount;
+		request->write = write;
+		requestCount++;
+		pthread_cond_signal(&requestAvailable);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void* mappedMatrix::ioThreadMain(void* ptr) {
+	mappedMatrix* matrix = (mappedMatrix*)ptr;
+	while (true) {
+		pthread_mutex_lock(&matrix->mutex);
+		while (matrix->requestCount == 0 && !matrix->stopping) {
+			pthread_cond_wait(&matrix->requestAvailable, &matrix->mutex);
+		}
+		if (matrix->stopping) {
+			pthread_mutex_unlock(&matrix->mutex);
+			break;
+		}
+		mappedMatrixRequest request = matrix->requests[matrix->firstRequest];
+		matrix->firstRequest = (matrix->firstRequest + 1) % REQUEST_QUEUE_SIZE;
+		matrix->requestCount--;
+		long long requestBytes = (long long)(matrix->rowOffset(min(request.firstRow + request.rowCount, matrix->size)) - matrix->rowOffset(request.firstRow));
+		if (request.write) {
+			matrix->bytesWrittenBehind += requestBytes;
+		}
+		else {
+			matrix->bytesPrefetched += requestBytes;
+		}
+		pthread_mutex_unlock(&matrix->mutex);
+
+		matrix->processRequest(request);
+	}
+	return NULL;
+}
+
+void mappedMatrix::processRequest(mappedMatrixRequest request) {
+	unsigned long long start = rowOffset(request.firstRow);
+	unsigned long long end = rowOffset(min(request.firstRow + request.rowCount, size));
+	if (end <= start) {
+		return;
+	}
+#ifdef __WINDOWS__
+	SYSTEM_INFO systemInfo;
+	GetSystemInfo(&systemInfo);
+	unsigned long long pageSize = systemInfo.dwPageSize;
+#else
+	unsigned long long pageSize = (unsigned long long)sysconf(_SC_PAGESIZE);
+#endif
+	unsigned long long alignedStart = start - start % pageSize;
+
+	if (request.write) {
+		// Starts writing the modified pages without waiting for the writes to complete.
+#ifdef __WINDOWS__
+		FlushViewOfFile(data + alignedStart, (SIZE_T)(end - alignedStart));
+#else
+		msync(data + alignedStart, (size_t)(end - alignedStart), MS_ASYNC);
+#endif
+	}
+	else {
+#ifndef __WINDOWS__
+		madvise(data + alignedStart, (size_t)(end - alignedStart), MADV_WILLNEED);
+#endif
+		// Touching each page reads it in on this thread, rather than on the thread that will use it.
+		volatile char sink = 0;
+		for (unsigned long long offset = alignedStart; offset < end; offset += pageSize) {
+			sink += data[offset];
+		}
+		(void)sink;
+	}
+}
+
+// Windows has no equivalent of madvise for file mappings, so the hints are only used on other systems.
+void mappedMatrix::advise(char* start, unsigned long long adviceLength, int advice) {
+#ifndef __WINDOWS__
+	if (data == NULL || adviceLength == 0) {
+		return;
+	}
+	// madvise requires page aligned addresses.
+	unsigned long long pageSize = (unsigned long long)sysconf(_SC_PAGESIZE);
+	unsigned long long offset = (unsigned long long)(start - data);
+	unsigned long long alignedOffset = offset - offset % pageSize;
+	madvise(data + alignedOffset, (size_t)(adviceLength + offset - alignedOffset), advice);
+#endif
+}
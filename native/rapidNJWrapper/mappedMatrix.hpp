@@ -0,0 +1,78 @@
+#ifndef MAPPED_MATRIX_HPP
+#define MAPPED_MATRIX_HPP
+
+#include "stdinclude.h"
+
+/*A range of rows to be read or written by the I/O thread of a mappedMatrix.*/
+struct mappedMatrixRequest {
+	int firstRow;
+	int rowCount;
+	bool write;
+};
+
+/*A half distance matrix (row i holds columns 0 to i, each of elementSize bytes) stored in a memory-mapped temporary file. Rows are pointers into the mapping, so they are read and
+written without going through stream buffers, and the operating system decides which parts of the matrix stay in memory.
+The file is deleted when the matrix is destroyed.
+A background thread reads rows before they are needed and writes modified rows back to the file, so that the computations rarely wait for the disk.*/
+class mappedMatrix {
+
+public:
+	/*Creates the file in dataDir, or in the system temporary directory if dataDir is empty.*/
+	mappedMatrix(string dataDir, int size, int elementSize = sizeof(distType));
+	~mappedMatrix(void);
+
+	/*Returns false if the file could not be created or mapped, in which case the matrix must not be used.*/
+	bool isValid();
+	/*Returns the first element of a row.*/
+	void* getRow(int row);
+
+	/*Hints that the rows are about to be accessed in order, which enables aggressive read-ahead.*/
+	void adviseSequential();
+
+	/*Hints that the rows will be accessed in no particular order.*/
+	void adviseRandom();
+
+	/*Hints that the given rows will be needed soon, so that they can be read in the background.*/
+	void adviseWillNeed(int firstRow, int rowCount);
+
+	/*Queues a background read of the rows, so that they are in memory by the time they are needed. Can be called from any thread.*/
+	void prefetchRows(int firstRow, int rowCount);
+
+	/*Queues a background write of the rows to the file, so that modified pages are written progressively instead of all at once when memory runs out. Can be called from any thread.*/
+	void writeBehind(int firstRow, int rowCount);
+
+	/*Bytes read ahead and written behind by the I/O thread so far.*/
+	long long getBytesPrefetched();
+	long long getBytesWrittenBehind();
+
+private:
+	int size;
+	int elementSize;
+	char** rows;
+	char* data;
+	unsigned long long length;
+#ifdef __WINDOWS__
+	void* file;
+	void* mapping;
+#endif
+	unsigned long long rowOffset(int row);
+	void advise(char* start, unsigned long long adviceLength, int advice);
+
+	// Requests are hints, so they are dropped when the queue is full rather than blocking the caller.
+	static const int REQUEST_QUEUE_SIZE = 256;
+	mappedMatrixRequest requests[REQUEST_QUEUE_SIZE];
+	int firstRequest;
+	int requestCount;
+	bool stopping;
+	bool threadStarted;
+	long long bytesPrefetched;
+	long long bytesWrittenBehind;
+	pthread_t ioThread;
+	pthread_mutex_t mutex;
+	pthread_cond_t requestAvailable;
+	void queueRequest(int firstRow, int rowCount, bool write);
+	void processRequest(mappedMatrixRequest request);
+	static void* ioThreadMain(void* ptr);
+};
+
+#endif
@@ -0,0 +1,463 @@
+#include "matrixFile.hpp"
+#include "workerPool.hpp"
+#include <fstream>
+#include <sstream>
+#include <climits>
+
+#ifdef __WINDOWS__
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+distanceMatrixFile::distanceMatrixFile(string fileName, int numThreads) {
+	sequenceCount = 0;
+	halfMatrix = false;
+	slab = NULL;
+	mappedData = NULL;
+	mappedLength = 0;
+#ifdef __WINDOWS__
+	file = NULL;
+	mapping = NULL;
+#endif
+
+	ifstream in(fileName.c_str(), ios::in | ios::binary);
+	if (!in) {
+		error = "Could not open " + fileName;
+		return;
+	}
+
+	matrixFileHeader header;
+	in.read((char*)&header, sizeof(header));
+	if (in.gcount() == (streamsize)sizeof(header) && memcmp(header.magic, MATRIX_FILE_MAGIC, sizeof(MATRIX_FILE_MAGIC)) == 0) {
+		in.close();
+		readBinary(fileName, header);
+		return;
+	}
+
+	// Anything else is parsed as PHYLIP text, from a mapping of the file that is released once the rows have been read into the half matrix.
+	in.clear();
+	in.seekg(0, ios::end);
+	streamoff size = in.tellg();
+	in.close();
+	if (size <= 0) {
+		error = "The file is neither a binary matrix nor a PHYLIP distance matrix";
+		return;
+	}
+	if (!mapFile(fileName, (unsigned long long)size)) {
+		unmapFile();
+		error = "Could not read " + fileName;
+		return;
+	}
+	readPhylip(mappedData, mappedData + size, numThreads);
+	unmapFile();
+}
+
+distanceMatrixFile::~distanceMatrixFile() {
+	unmapFile();
+	delete[] slab;
+}
+
+void distanceMatrixFile::unmapFile() {
+#ifdef __WINDOWS__
+	if (mappedData != NULL) {
+		UnmapViewOfFile(mappedData);
+	}
+	if (mapping != NULL) {
+		CloseHandle((HANDLE)mapping);
+	}
+	if (file != NULL) {
+		CloseHandle((HANDLE)file);
+	}
+	mapping = NULL;
+	file = NULL;
+#else
+	if (mappedData != NULL) {
+		munmap(mappedData, (size_t)mappedLength);
+	}
+#endif
+	mappedData = NULL;
+	mappedLength = 0;
+}
+
+bool distanceMatrixFile::isValid() {
+	return error.empty() && (int)rows.size() == sequenceCount && sequenceCount > 0;
+}
+
+string distanceMatrixFile::getError() {
+	return error;
+}
+
+int distanceMatrixFile::getSequenceCount() {
+	return sequenceCount;
+}
+
+vector<string>* distanceMatrixFile::getSequenceNames() {
+	return &sequenceNames;
+}
+
+bool distanceMatrixFile::isHalfMatrix() {
+	return halfMatrix;
+}
+
+distType** distanceMatrixFile::getMatrix() {
+	return &rows[0];
+}
+
+bool distanceMatrixFile::isMapped() {
+	return mappedData != NULL;
+}
+
+void distanceMatrixFile::allocateHalfMatrix() {
+	halfMatrix = true;
+	slab = new distType[(size_t)sequenceCount * (sequenceCount + 1) / 2];
+	rows.resize(sequenceCount);
+	for (int i = 0; i < sequenceCount; i++) {
+		rows[i] = slab + (size_t)i * (i + 1) / 2;
+	}
+}
+
+bool distanceMatrixFile::readBinary(string fileName, const matrixFileHeader& header) {
+	if (header.version != MATRIX_FILE_VERSION || header.storage > MATRIX_FILE_LOWER_TRIANGLE || header.elementType > MATRIX_FILE_FLOAT64 ||
+		header.sequenceCount == 0 || header.sequenceCount > INT_MAX || header.namesBytes % 8 != 0) {
+		error = "Unsupported binary matrix header in " + fileName;
+		return false;
+	}
+
+	unsigned long long n = header.sequenceCount;
+	unsigned long long elementSize = header.elementType == MATRIX_FILE_FLOAT32 ? 4 : 8;
+	// n is at most INT_MAX, so only the sizes in bytes can overflow.
+	unsigned long long elementCount = header.storage == MATRIX_FILE_FULL ? n * n : n * (n + 1) / 2;
+	if (header.namesBytes > ULLONG_MAX - sizeof(matrixFileHeader) || elementCount > (ULLONG_MAX - sizeof(matrixFileHeader) - header.namesBytes) / elementSize) {
+		error = "Unsupported binary matrix header in " + fileName;
+		return false;
+	}
+	unsigned long long rowsOffset = sizeof(matrixFileHeader) + header.namesBytes;
+	unsigned long long length = rowsOffset + elementCount * elementSize;
+
+	ifstream in(fileName.c_str(), ios::in | ios::binary);
+	in.seekg(0, ios::end);
+	if (!in || (unsigned long long)in.tellg() < length) {
+		error = "Truncated binary matrix in " + fileName;
+		return false;
+	}
+
+	vector<char> names((size_t)header.namesBytes + sizeof(unsigned int));
+	in.seekg(sizeof(matrixFileHeader), ios::beg);
+	in.read(&names[0], (streamsize)header.namesBytes);
+	sequenceCount = (int)n;
+	size_t position = 0;
+	for (int i = 0; i < sequenceCount; i++) {
+		unsigned int nameLength;
+		if (position + sizeof(nameLength) > header.namesBytes) {
+			error = "Truncated names block in " + fileName;
+			return false;
+		}
+		memcpy(&nameLength, &names[position], sizeof(nameLength));
+		position += sizeof(nameLength);
+		if (position + nameLength > header.namesBytes) {
+			error = "Truncated names block in " + fileName;
+			return false;
+		}
+		sequenceNames.push_back(string(&names[position], nameLength));
+		position += nameLength;
+	}
+
+	// Rows of the type of the engines are used where they are, others are converted into a half matrix, as only the lower triangle is ever needed.
+	if (header.elementType == MATRIX_FILE_FLOAT32 && sizeof(distType) == 4 && mapFile(fileName, length)) {
+		halfMatrix = header.storage == MATRIX_FILE_LOWER_TRIANGLE;
+		rows.resize(sequenceCount);
+		for (int i = 0; i < sequenceCount; i++) {
+			unsigned long long offset = halfMatrix ? (unsigned long long)i * (i + 1) / 2 : (unsigned long long)i * n;
+			rows[i] = (distType*)(mappedData + rowsOffset + offset * elementSize);
+		}
+		return true;
+	}
+
+	allocateHalfMatrix();
+	in.seekg((streamoff)rowsOffset, ios::beg);
+	vector<char> row((size_t)(n * elementSize));
+	for (int i = 0; i < sequenceCount; i++) {
+		size_t rowLength = header.storage == MATRIX_FILE_FULL ? (size_t)n : (size_t)i + 1;
+		in.read(&row[0], (streamsize)(rowLength * elementSize));
+		for (int j = 0; j <= i; j++) {
+			if (header.elementType == MATRIX_FILE_FLOAT32) {
+				float value;
+				memcpy(&value, &row[j * 4], sizeof(value));
+				rows[i][j] = (distType)value;
+			}
+			else {
+				double value;
+				memcpy(&value, &row[j * 8], sizeof(value));
+				rows[i][j] = (distType)value;
+			}
+		}
+	}
+	if (!in) {
+		error = "Could not read " + fileName;
+		return false;
+	}
+	return true;
+}
+
+// The mapping is copy-on-write, so the engines can update the rows in place.
+bool distanceMatrixFile::mapFile(string fileName, unsigned long long length) {
+	if (length > (unsigned long long)(size_t)-1) {
+		return false;
+	}
+#ifdef __WINDOWS__
+	HANDLE fileHandle = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	file = fileHandle;
+	HANDLE mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if (mappingHandle == NULL) {
+		return false;
+	}
+	mapping = mappingHandle;
+	mappedData = (char*)MapViewOfFile(mappingHandle, FILE_MAP_COPY, 0, 0, (SIZE_T)length);
+#else
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	void* address = mmap(NULL, (size_t)length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	mappedData = address == MAP_FAILED ? NULL : (char*)address;
+#endif
+	mappedLength = length;
+	return mappedData != NULL;
+}
+
+static inline bool isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// The text is the mapped file, which is not terminated, so every scan stops at end.
+
+// Leaves position on the next character that is not a space, or on end.
+static inline const char* skipSpaces(const char* position, const char* end) {
+	while (position < end && isSpace(*position)) {
+		position++;
+	}
+	return position;
+}
+
+// Same as skipSpaces, but stops at the end of the line.
+static inline const char* skipLineSpaces(const char* position, const char* end) {
+	while (position < end && (*position == ' ' || *position == '\t' || *position == '\r')) {
+		position++;
+	}
+	return position;
+}
+
+static inline const char* skipToken(const char* position, const char* end) {
+	while (position < end && !isSpace(*position)) {
+		position++;
+	}
+	return position;
+}
+
+// Parses the number that starts at position, or returns NULL. strtod stops at the space that follows the number, so only a number that ends the file needs to be copied
+// to be terminated.
+static inline const char* parseNumber(const char* position, const char* end, double* value) {
+	const char* tokenEnd = skipToken(position, end);
+	char* numberEnd;
+	if (tokenEnd < end) {
+		*value = strtod(position, &numberEnd);
+		return numberEnd == position ? NULL : numberEnd;
+	}
+	char buffer[64];
+	size_t length = min((size_t)(tokenEnd - position), sizeof(buffer) - 1);
+	memcpy(buffer, position, length);
+	buffer[length] = 0;
+	*value = strtod(buffer, &numberEnd);
+	return numberEnd == buffer ? NULL : position + (numberEnd - buffer);
+}
+
+/*Rows of a PHYLIP file parsed by one worker. With rowsPerLine, row i starts at lineStarts[i] and holds valuesPerRow(i) values; otherwise a single worker reads all the
+rows in order, as full rows that may span several lines.*/
+struct threadStatePhylip {
+	const char* textEnd;
+	vector<const char*> lineStarts;
+	bool rowsPerLine;
+	// 0 = full rows, 1 = lower triangle without the diagonal, 2 = lower triangle with the diagonal.
+	int layout;
+	int sequenceCount;
+	vector<string>* sequenceNames;
+	distType** rows;
+	vector<int> failedRows;
+};
+
+static int getRowValueCount(int layout, int row, int sequenceCount) {
+	return layout == 0 ? sequenceCount : layout == 1 ? row : row + 1;
+}
+
+// Parses one row into rows[i], which has i + 1 elements. Returns NULL if the row is too short.
+static const char* parsePhylipRow(threadStatePhylip* state, int i, const char* position) {
+	const char* end = state->textEnd;
+	position = skipSpaces(position, end);
+	const char* nameEnd = skipToken(position, end);
+	if (nameEnd == position) {
+		return NULL;
+	}
+	(*state->sequenceNames)[i] = string(position, nameEnd - position);
+	position = nameEnd;
+
+	// Rows that have a line of their own must not run into the next one.
+	int valueCount = getRowValueCount(state->layout, i, state->sequenceCount);
+	for (int j = 0; j < valueCount; j++) {
+		position = state->rowsPerLine ? skipLineSpaces(position, end) : skipSpaces(position, end);
+		if (position == end || *position == '\n') {
+			return NULL;
+		}
+		// Only the lower triangle is kept, so the rest of a full row is skipped without being converted.
+		if (j <= i) {
+			double value;
+			position = parseNumber(position, end, &value);
+			if (position == NULL) {
+				return NULL;
+			}
+			state->rows[i][j] = (distType)value;
+		}
+		else {
+			position = skipToken(position, end);
+		}
+	}
+	if (state->layout == 1) {
+		state->rows[i][i] = 0;
+	}
+	return position;
+}
+
+static void parsePhylipTask(void* arg, int workerIndex, int workerCount) {
+	threadStatePhylip* state = (threadStatePhylip*)arg;
+	if (!state->rowsPerLine) {
+		const char* position = state->lineStarts[0];
+		for (int i = 0; i < state->sequenceCount && position != NULL; i++) {
+			position = parsePhylipRow(state, i, position);
+			if (position == NULL) {
+				state->failedRows[workerIndex] = i;
+			}
+		}
+		return;
+	}
+
+	int start = (int)((long long)state->sequenceCount * workerIndex / workerCount);
+	int end = (int)((long long)state->sequenceCount * (workerIndex + 1) / workerCount);
+	for (int i = start; i < end; i++) {
+		if (parsePhylipRow(state, i, state->lineStarts[i]) == NULL) {
+			state->failedRows[workerIndex] = i;
+			return;
+		}
+	}
+}
+
+bool distanceMatrixFile::readPhylip(const char* text, const char* textEnd, int numThreads) {
+	const char* position = skipSpaces(text, textEnd);
+	double count;
+	const char* end = parseNumber(position, textEnd, &count);
+	if (end == NULL || !(count >= 1 && count <= INT_MAX) || count != (int)count) {
+		error = "The file is neither a binary matrix nor a PHYLIP distance matrix";
+		return false;
+	}
+	sequenceCount = (int)count;
+
+	threadStatePhylip state;
+	state.textEnd = textEnd;
+	state.sequenceCount = sequenceCount;
+	state.sequenceNames = &sequenceNames;
+
+	// Lines that are not blank, after the one holding the number of sequences.
+	const char* lineStart = end;
+	for (const char* c = end; ; c++) {
+		if (c == textEnd || *c == '\n') {
+			if (skipSpaces(lineStart, c) < c) {
+				state.lineStarts.push_back(lineStart);
+			}
+			if (c == textEnd) {
+				break;
+			}
+			lineStart = c + 1;
+		}
+	}
+	if (state.lineStarts.empty()) {
+		error = "The PHYLIP matrix has no rows";
+		return false;
+	}
+
+	// The layout is told apart by the number of values of the first row, which holds either all the columns or only the first one or none of them.
+	state.rowsPerLine = (int)state.lineStarts.size() == sequenceCount;
+	state.layout = 0;
+	if (state.rowsPerLine && sequenceCount > 1) {
+		int tokenCount = 0;
+		const char* c = state.lineStarts[0];
+		while (true) {
+			c = skipLineSpaces(c, textEnd);
+			if (c == textEnd || *c == '\n') {
+				break;
+			}
+			tokenCount++;
+			c = skipToken(c, textEnd);
+		}
+		state.layout = tokenCount == 1 ? 1 : tokenCount == 2 ? 2 : 0;
+	}
+
+	sequenceNames.resize(sequenceCount);
+	allocateHalfMatrix();
+	state.rows = &rows[0];
+
+	int workers = state.rowsPerLine ? max(1, min(numThreads, sequenceCount)) : 1;
+	state.failedRows.assign(workers, -1);
+	workerPool pool(workers);
+	pool.run(parsePhylipTask, (void*)&state);
+
+	for (int i = 0; i < workers; i++) {
+		if (state.failedRows[i] >= 0) {
+			ostringstream message;
+			message << "Could not parse row " << (state.failedRows[i] + 1) << " of the PHYLIP matrix";
+			error = message.str();
+			return false;
+		}
+	}
+	return true;
+}
+
+bool distanceMatrixFile::write(string fileName, int sequenceCount, vector<string>* sequenceNames, bool halfMatrix, distType** matrix) {
+	ofstream out(fileName.c_str(), ios::out | ios::binary | ios::trunc);
+	if (!out) {
+		return false;
+	}
+
+	vector<char> names;
+	for (int i = 0; i < sequenceCount; i++) {
+		unsigned int nameLength = (unsigned int)(*sequenceNames)[i].length();
+		const char* lengthBytes = (const char*)&nameLength;
+		names.insert(names.end(), lengthBytes, lengthBytes + sizeof(nameLength));
+		names.insert(names.end(), (*sequenceNames)[i].begin(), (*sequenceNames)[i].end());
+	}
+	names.resize((names.size() + 7) / 8 * 8, 0);
+
+	matrixFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MATRIX_FILE_MAGIC, sizeof(MATRIX_FILE_MAGIC));
+	header.version = MATRIX_FILE_VERSION;
+	header.storage = halfMatrix ? MATRIX_FILE_LOWER_TRIANGLE : MATRIX_FILE_FULL;
+	header.elementType = sizeof(distType) == 4 ? MATRIX_FILE_FLOAT32 : MATRIX_FILE_FLOAT64;
+	header.sequenceCount = sequenceCount;
+	header.namesBytes = names.size();
+
+	out.write((const char*)&header, sizeof(header));
+	if (!names.empty()) {
+		out.write(&names[0], (streamsize)names.size());
+	}
+	for (int i = 0; i < sequenceCount; i++) {
+		out.write((const char*)matrix[i], (streamsize)((halfMatrix ? i + 1 : sequenceCount) * sizeof(distType)));
+	}
+	out.close();
+	return !out.fail();
+}
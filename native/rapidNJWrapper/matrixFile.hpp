@@ -0,0 +1,85 @@
+#ifndef MATRIX_FILE_HPP
+#define MATRIX_FILE_HPP
+
+#include "stdinclude.h"
+#include <vector>
+
+/*Layout of the rows of a binary distance matrix file.*/
+enum matrixFileStorage {
+	// Row i holds columns 0 to n - 1.
+	MATRIX_FILE_FULL = 0,
+	// Row i holds columns 0 to i, like the half matrices passed to ContextBuildTreeFromDistanceMatrix.
+	MATRIX_FILE_LOWER_TRIANGLE = 1
+};
+
+/*Type of the elements of a binary distance matrix file.*/
+enum matrixFileElement {
+	MATRIX_FILE_FLOAT32 = 0,
+	MATRIX_FILE_FLOAT64 = 1
+};
+
+const char MATRIX_FILE_MAGIC[8] = { 'R', 'N', 'J', 'M', 'A', 'T', 'R', 'X' };
+const unsigned int MATRIX_FILE_VERSION = 1;
+
+/*Start of a binary distance matrix file, in the byte order of the machine that wrote it. It is followed by the names block, made of the length of each name as an
+unsigned int followed by its characters and padded with zeros to namesBytes, and then by the rows, without any padding between them.*/
+struct matrixFileHeader {
+	char magic[8];
+	unsigned int version;
+	// A matrixFileStorage.
+	unsigned int storage;
+	// A matrixFileElement.
+	unsigned int elementType;
+	unsigned int reserved;
+	unsigned long long sequenceCount;
+	// A multiple of 8, so that the rows are aligned.
+	unsigned long long namesBytes;
+};
+
+/*A distance matrix read from a file, which is either a binary matrix file or a PHYLIP file. Binary files of float32 elements are mapped in memory, and their rows are handed
+to the engines without being copied; the mapping is private, so the changes that the engines make to the rows are never written back to the file. Other files are read
+into a half matrix, and PHYLIP files, which are mapped while they are parsed rather than read into memory, are parsed by several threads if they have one row per line.*/
+class distanceMatrixFile {
+
+public:
+	distanceMatrixFile(string fileName, int numThreads);
+	~distanceMatrixFile();
+
+	/*Returns false if the file could not be read, in which case the error says why and the matrix must not be used.*/
+	bool isValid();
+	string getError();
+
+	int getSequenceCount();
+	vector<string>* getSequenceNames();
+	/*True if row i of the matrix only holds columns 0 to i.*/
+	bool isHalfMatrix();
+	distType** getMatrix();
+	/*True if the rows are those of the mapped file.*/
+	bool isMapped();
+
+	/*Writes a matrix in the binary format, as a lower triangle if halfMatrix is set and as a full matrix otherwise. Returns false if the file could not be written.*/
+	static bool write(string fileName, int sequenceCount, vector<string>* sequenceNames, bool halfMatrix, distType** matrix);
+
+private:
+	string error;
+	int sequenceCount;
+	bool halfMatrix;
+	vector<string> sequenceNames;
+	vector<distType*> rows;
+	// Elements of the matrix when it is not mapped.
+	distType* slab;
+	char* mappedData;
+	unsigned long long mappedLength;
+#ifdef __WINDOWS__
+	void* file;
+	void* mapping;
+#endif
+
+	bool readBinary(string fileName, const matrixFileHeader& header);
+	bool mapFile(string fileName, unsigned long long length);
+	void unmapFile();
+	bool readPhylip(const char* text, const char* textEnd, int numThreads);
+	void allocateHalfMatrix();
+};
+
+#endif
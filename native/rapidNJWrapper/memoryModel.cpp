@@ -0,0 +1,224 @@
+#include "memoryModel.hpp"
+#include "cluster_pair.h"
+#include "distanceStorage.hpp"
+#include "bootstrapSupport.hpp"
+#include "rapidNJParallel.hpp"
+#include <list>
+
+// Square matrices are arrays of row pointers, with one allocation per row.
+static double fullMatrixBytes(double n, double elementSize) {
+	return n * n * elementSize + n * sizeof(void*);
+}
+
+static double halfMatrixBytes(double n, double elementSize) {
+	return n * (n + 1) / 2 * elementSize + n * sizeof(void*);
+}
+
+// polytree: branch lengths and parents of the 2n - 1 nodes, children of the n - 1 internal nodes, leaf names and bootstrap counts.
+static double treeBytes(double n) {
+	return (2 * n - 1) * (sizeof(double) + sizeof(int)) + (n - 1) * 2 * sizeof(int) + n * (sizeof(string) + sizeof(int));
+}
+
+// Hash table of the splits of the reference tree in bootstrapSupport, at most half full.
+static double referenceSplitBytes(double n) {
+	double slotCount = 16;
+	while (slotCount < 2 * (2 * n - 1)) {
+		slotCount *= 2;
+	}
+	return slotCount * (sizeof(int) + sizeof(splitHash)) + (2 * n - 1) * (sizeof(splitHash) + 1);
+}
+
+// Splits of a replicate, computed before they are looked up in the table.
+static double replicateSplitBytes(double n) {
+	return (2 * n - 1) * (sizeof(splitHash) + 1);
+}
+
+// Per-cluster arrays of rapidNJ and rapidNJMem: separation sums and separations, id maps, garbage flags, row lengths and pointers, and the redundancy lists.
+static double libraryClusterBytes(double n) {
+	return n * (9 * sizeof(int) + sizeof(cluster_pair*) + sizeof(list<int>));
+}
+
+// rapidNJDisk also keeps the whole of the current rows and update flags in memory.
+static double diskClusterBytes(double n) {
+	return libraryClusterBytes(n) + n * (2 * sizeof(distType) + 2 * sizeof(short) + sizeof(int));
+}
+
+// Per-cluster arrays of rapidNJParallel, including the new row and its merge buffer, and the rows and buffers of each worker. Relaxed joins also keep the best pair of each row.
+static double parallelClusterBytes(rapidNJContext* ctx, double n, double workers) {
+	double perCluster = sizeof(double) + sizeof(distType) + sizeof(distType*) + sizeof(unsigned int*) + sizeof(int) + 2 * sizeof(bool) + 4 * sizeof(int) + 2 * sizeof(cluster_pair) + sizeof(distType);
+	if (planUsesRelaxedNJ(ctx)) {
+		perCluster += sizeof(njCandidate) + sizeof(pair<pair<distType, unsigned long long>, int>) + sizeof(int) + sizeof(bool);
+	}
+	return n * perCluster + workers * 2 * n * sizeof(cluster_pair);
+}
+
+// The rows of rapidNJParallel start with min(i, k) entries; when they are widened later, they still fit in the entries of the initial rows.
+static double parallelSortedBytes(double n, double k) {
+	return min(n * k, n * (n - 1) / 2) * (sizeof(distType) + sizeof(unsigned int));
+}
+
+double getMemSize(rapidNJContext* ctx) {
+	return ctx->options.memSize * 1024.0 * 1024.0;
+}
+
+// True if the int arithmetic of the library engines could overflow.
+static bool exceedsLibraryLimits(int sequenceCount) {
+	return sequenceCount > LIBRARY_MAX_SEQUENCE_COUNT;
+}
+
+bool planUsesParallelNJ(rapidNJContext* ctx, int sequenceCount) {
+	return (ctx->options.njEngine != NJ_ENGINE_LIBRARY || exceedsLibraryLimits(sequenceCount)) && sequenceCount >= 3;
+}
+
+bool planUsesRelaxedNJ(rapidNJContext* ctx) {
+	return ctx->options.njEngine == NJ_ENGINE_RELAXED;
+}
+
+// The engine that runs rapidNJParallel.
+static int parallelNJEngine(rapidNJContext* ctx) {
+	return planUsesRelaxedNJ(ctx) ? NJ_ENGINE_RELAXED : NJ_ENGINE_PARALLEL;
+}
+
+bool planUsesFusedParallelNJ(rapidNJContext* ctx, treeInputDescription input) {
+	return planUsesParallelNJ(ctx, input.sequenceCount) && !ctx->distanceMatrixInput && !ctx->distanceMatrixFromPointer && input.distanceKernels;
+}
+
+bool planUsesMappedMatrix(rapidNJContext* ctx, treeInputDescription input) {
+	return (ctx->options.diskMatrixBackend == DISK_MATRIX_MAPPED || exceedsLibraryLimits(input.sequenceCount)) && input.sequenceCount >= 3 && !ctx->distanceMatrixInput && !ctx->distanceMatrixFromPointer && input.distanceKernels;
+}
+
+bool planExceedsLibraryLimits(rapidNJPlan plan, int sequenceCount) {
+	return exceedsLibraryLimits(sequenceCount) && plan.algorithm == TREE_ALGORITHM_RAPIDNJ_DISK && !plan.mappedMatrix;
+}
+
+static long long toBytes(double bytes) {
+	return (long long)max(bytes, 0.0);
+}
+
+rapidNJPlan planTree(rapidNJContext* ctx, treeInputDescription input) {
+	rapidNJPlan plan;
+	memset(&plan, 0, sizeof(plan));
+
+	int n = input.sequenceCount;
+	double matrixSized = (double)n;
+	double systemMemory = getMemSize(ctx);
+	double workers = max(ctx->numCores, 1);
+	bool parallel = planUsesParallelNJ(ctx, n);
+	bool fused = planUsesFusedParallelNJ(ctx, input);
+	bool alignment = !ctx->distanceMatrixInput && !ctx->distanceMatrixFromPointer;
+	bool autoDecide = !(ctx->options.rapidNJ || ctx->options.cacheDir != "" || ctx->options.percentageMemoryUsage != "" || ctx->options.simpleNJ);
+	double storedDistanceSize = getDistanceStorageSize((distanceStorageType)ctx->options.distanceStorage);
+	double tree = treeBytes(matrixSized);
+
+	// Matrices passed by pointer are used in place, distance matrix files and the library estimators allocate full matrices,
+	// and the parallel engine keeps the half matrix of the distances it computes, in the storage type of the context.
+	double callerMatrix = input.halfMatrix ? halfMatrixBytes(matrixSized, sizeof(distType)) : fullMatrixBytes(matrixSized, sizeof(distType));
+	double rapidNJMatrix = fused ? halfMatrixBytes(matrixSized, storedDistanceSize) : ctx->distanceMatrixFromPointer ? callerMatrix : fullMatrixBytes(matrixSized, sizeof(distType));
+	// Distance matrix files are read as half matrices by memory efficient RapidNJ.
+	double memoryEfficientMatrix = ctx->distanceMatrixInput ? halfMatrixBytes(matrixSized, sizeof(distType)) : rapidNJMatrix;
+
+	double rapidNJSorted = parallel ? parallelSortedBytes(matrixSized, matrixSized) : matrixSized * matrixSized * sizeof(cluster_pair);
+	double rapidNJWorkspace = (parallel ? parallelClusterBytes(ctx, matrixSized, workers) : libraryClusterBytes(matrixSized)) + tree;
+	// rapidNJMem also has a buffer for the new rows.
+	double memoryEfficientWorkspace = parallel ? rapidNJWorkspace : libraryClusterBytes(matrixSized) + matrixSized * sizeof(cluster_pair) + tree;
+
+	plan.inputMemory = toBytes(input.alignmentMemory);
+	plan.njEngine = NJ_ENGINE_LIBRARY;
+
+	if (ctx->options.rapidNJ || (autoDecide && input.alignmentMemory + rapidNJMatrix + rapidNJSorted + rapidNJWorkspace <= systemMemory)) {
+		plan.algorithm = TREE_ALGORITHM_RAPIDNJ;
+		plan.sortedMatrixSize = n;
+		plan.distanceMatrixMemory = toBytes(rapidNJMatrix);
+		plan.sortedMatrixMemory = toBytes(rapidNJSorted);
+		plan.workspaceMemory = toBytes(rapidNJWorkspace);
+	}
+	else {
+		// Largest sorted matrix that fits in what is left once everything else is allocated.
+		double fittingSortedMatrixSize = (systemMemory - input.alignmentMemory - memoryEfficientMatrix - memoryEfficientWorkspace) / (matrixSized * sizeof(cluster_pair));
+		int sortedMatrixSize = (int)min(max(fittingSortedMatrixSize, -1.0), matrixSized);
+
+		// Matrices passed by pointer that are too large for the library are always used in place by rapidNJParallel, however small its sorted matrix.
+		bool inPlaceOnly = exceedsLibraryLimits(n) && ctx->distanceMatrixFromPointer;
+		if (ctx->options.percentageMemoryUsage != "" || (autoDecide && sortedMatrixSize >= matrixSized * MIN_SORTED_MATRIX_SIZE) || inPlaceOnly) {
+			if (ctx->options.percentageMemoryUsage != "") {
+				int percentage = min(max(atoi(ctx->options.percentageMemoryUsage.data()), 0), 100);
+				sortedMatrixSize = (int)(matrixSized * (percentage / 100.0));
+			}
+			sortedMatrixSize = max(sortedMatrixSize, 1);
+
+			plan.algorithm = TREE_ALGORITHM_RAPIDNJ_MEMORY_EFFICIENT;
+			plan.sortedMatrixSize = sortedMatrixSize;
+			plan.distanceMatrixMemory = toBytes(memoryEfficientMatrix);
+			plan.sortedMatrixMemory = toBytes(parallel ? parallelSortedBytes(matrixSized, sortedMatrixSize) : matrixSized * sortedMatrixSize * sizeof(cluster_pair));
+			plan.workspaceMemory = toBytes(memoryEfficientWorkspace);
+		}
+		else if (ctx->options.simpleNJ && !exceedsLibraryLimits(n)) {
+			plan.algorithm = TREE_ALGORITHM_SIMPLE_NJ;
+			plan.sortedMatrixSize = 0;
+			plan.distanceMatrixMemory = toBytes(ctx->distanceMatrixFromPointer ? callerMatrix : fullMatrixBytes(matrixSized, sizeof(distType)));
+			plan.workspaceMemory = toBytes(matrixSized * 4 * sizeof(distType) + tree);
+			fused = false;
+		}
+		else {
+			plan.algorithm = TREE_ALGORITHM_RAPIDNJ_DISK;
+			bool mapped = planUsesMappedMatrix(ctx, input);
+			// The sorted matrix and the column cache of RapidDiskNJ get all the memory that is left.
+			double diskWorkspace = (mapped ? parallelClusterBytes(ctx, matrixSized, workers) : diskClusterBytes(matrixSized)) + tree;
+			double fittingDiskSortedMatrixSize = (systemMemory - input.alignmentMemory - diskWorkspace) / (matrixSized * (sizeof(cluster_pair) + sizeof(distType)));
+			int diskSortedMatrixSize = (int)min(max(fittingDiskSortedMatrixSize, 0.0), matrixSized);
+			diskSortedMatrixSize = max(diskSortedMatrixSize, min(5, n));
+
+			plan.sortedMatrixSize = diskSortedMatrixSize;
+			plan.mappedMatrix = mapped ? 1 : 0;
+			plan.workspaceMemory = toBytes(diskWorkspace);
+			if (mapped) {
+				plan.njEngine = parallelNJEngine(ctx);
+				plan.sortedMatrixMemory = toBytes(parallelSortedBytes(matrixSized, diskSortedMatrixSize));
+				plan.diskMemory = toBytes(halfMatrixBytes(matrixSized, storedDistanceSize) - matrixSized * sizeof(void*));
+			}
+			else {
+				plan.sortedMatrixMemory = toBytes(matrixSized * diskSortedMatrixSize * (sizeof(cluster_pair) + sizeof(distType)));
+				plan.diskMemory = toBytes(matrixSized * matrixSized * sizeof(distType));
+			}
+			fused = mapped;
+		}
+	}
+
+	if (parallel && (plan.algorithm == TREE_ALGORITHM_RAPIDNJ || plan.algorithm == TREE_ALGORITHM_RAPIDNJ_MEMORY_EFFICIENT)) {
+		plan.njEngine = parallelNJEngine(ctx);
+	}
+	plan.fusedDistances = fused ? 1 : 0;
+
+	double treeMemory = (double)(plan.distanceMatrixMemory + plan.sortedMatrixMemory + plan.workspaceMemory);
+
+	if (ctx->options.replicates > 0) {
+		// The reference tree keeps its splits for all the comparisons, and each replicate lists its own.
+		double comparison = tree + referenceSplitBytes(matrixSized);
+		// Replicates are resampled into their own copy of the alignment, or only store their column weights.
+		double replicateInput = input.columnWeightsMemory > 0 ? input.columnWeightsMemory : input.alignmentMemory;
+
+		// Concurrent replicates use RapidNJ, with the cores shared between them. See bootstrapTreeParallel.
+		if (ctx->options.parallelBootstrap && alignment && input.fastdist && autoDecide) {
+			double replicateWorkspace = (parallel ? parallelClusterBytes(ctx, matrixSized, 1) : libraryClusterBytes(matrixSized)) + tree + replicateSplitBytes(matrixSized);
+			double replicateMemUsage = replicateInput + rapidNJMatrix + rapidNJSorted + replicateWorkspace;
+			double concurrentReplicates = (systemMemory - input.alignmentMemory - comparison) / replicateMemUsage;
+
+			int concurrent = min(ctx->numCores, ctx->options.replicates);
+			if (concurrentReplicates < concurrent) {
+				concurrent = max(0, (int)concurrentReplicates);
+			}
+			if (concurrent >= 2) {
+				plan.concurrentReplicates = concurrent;
+				plan.bootstrapMemory = toBytes(comparison + concurrent * replicateMemUsage);
+			}
+		}
+
+		if (plan.concurrentReplicates == 0) {
+			// One replicate at a time, built while the reference tree and its splits are kept.
+			plan.bootstrapMemory = toBytes(comparison + replicateInput + max(treeMemory, tree + replicateSplitBytes(matrixSized)));
+		}
+	}
+
+	plan.peakMemory = plan.inputMemory + toBytes(max(treeMemory, (double)plan.bootstrapMemory));
+	return plan;
+}
@@ -0,0 +1,84 @@
+#ifndef MEMORY_MODEL_HPP
+#define MEMORY_MODEL_HPP
+
+#include "stdinclude.h"
+#include "rapidNJContext.h"
+
+/*Largest matrix that the engines of the library are given. They index the matrix, their sorted matrix and the files of diskMatrix with int products of the matrix
+size, which can overflow beyond sqrt(INT_MAX) sequences; larger matrices go to rapidNJParallel and mappedMatrix, which use 64-bit sizes and offsets.*/
+const int LIBRARY_MAX_SEQUENCE_COUNT = 46340;
+
+/*Algorithms that computeTree can choose from.*/
+enum treeAlgorithmType {
+	TREE_ALGORITHM_RAPIDNJ = 0,
+	TREE_ALGORITHM_RAPIDNJ_MEMORY_EFFICIENT = 1,
+	TREE_ALGORITHM_RAPIDNJ_DISK = 2,
+	TREE_ALGORITHM_SIMPLE_NJ = 3
+};
+
+/*What the memory model needs to know about the input of a tree. It can be filled before the input is loaded, so that a plan can be made without running anything.*/
+struct treeInputDescription {
+	int sequenceCount;
+	// Bytes used by the sequences or their bit strings, and by their names. 0 for distance matrices.
+	double alignmentMemory;
+	// True if the alignment is stored as bit strings, which is required to compute bootstrap replicates concurrently.
+	bool fastdist;
+	// True if the distances are computed by the wrapper's distance kernels.
+	bool distanceKernels;
+	// True if a distance matrix passed by pointer is a half matrix.
+	bool halfMatrix;
+	// Bytes used by the column weights of a bootstrap replicate; 0 if replicates are resampled copies of the alignment.
+	double columnWeightsMemory;
+};
+
+/*The algorithm chosen for a tree, and an estimate of the memory it uses. Memory amounts are in bytes; peakMemory is the largest amount used at any one time,
+including the input and, if bootstrapping is enabled, the replicates. All the allocations whose size depends on the input are accounted for, but not the overhead of
+the allocator nor the length of the sequence names.*/
+struct rapidNJPlan {
+	// A treeAlgorithmType.
+	int algorithm;
+	// The njEngineType that runs RapidNJ and memory efficient RapidNJ, or that keeps the mapped matrix of RapidDiskNJ.
+	int njEngine;
+	// 1 if the parallel engine computes the distances itself, so that no separate distance matrix is allocated.
+	int fusedDistances;
+	// 1 if RapidDiskNJ keeps the distance matrix in a memory-mapped file rather than going through the library's diskMatrix.
+	int mappedMatrix;
+	// Number of columns of the sorted matrix.
+	int sortedMatrixSize;
+	// Number of bootstrap replicates computed at the same time; 0 if replicates are computed one at a time, or if bootstrapping is disabled.
+	int concurrentReplicates;
+	long long peakMemory;
+	long long inputMemory;
+	long long distanceMatrixMemory;
+	long long sortedMatrixMemory;
+	// Per-cluster arrays, thread buffers and the tree.
+	long long workspaceMemory;
+	// Additional memory used while computing and comparing bootstrap replicates.
+	long long bootstrapMemory;
+	// Bytes written to temporary files.
+	long long diskMemory;
+};
+
+/*Returns the memory budget of the context, in bytes.*/
+double getMemSize(rapidNJContext* ctx);
+
+/*Chooses the algorithm and sorted matrix size for a tree, using the options and input flags of the context (distanceMatrixInput, distanceMatrixFromPointer). computeTree follows the plan.*/
+rapidNJPlan planTree(rapidNJContext* ctx, treeInputDescription input);
+
+/*Returns true if RapidNJ and memory efficient RapidNJ are run by rapidNJParallel, either because it was chosen or because the matrix is too large for the library.*/
+bool planUsesParallelNJ(rapidNJContext* ctx, int sequenceCount);
+
+/*Returns true if rapidNJParallel uses relaxed joins.*/
+bool planUsesRelaxedNJ(rapidNJContext* ctx);
+
+/*Returns true if rapidNJParallel computes the distances itself, which is possible for alignments that can be processed by the distance kernels.*/
+bool planUsesFusedParallelNJ(rapidNJContext* ctx, treeInputDescription input);
+
+/*Returns true if RapidDiskNJ is replaced by rapidNJParallel on a memory-mapped distance matrix, either because it was chosen or because the matrix is too large for the library.*/
+bool planUsesMappedMatrix(rapidNJContext* ctx, treeInputDescription input);
+
+/*Returns true if the plan cannot be run, because it gives a matrix larger than LIBRARY_MAX_SEQUENCE_COUNT to the library's RapidDiskNJ. planTree only does so if
+there is no other way to build the tree: naive NJ is replaced by the other algorithms, and matrices passed by pointer are used in place by memory efficient RapidNJ.*/
+bool planExceedsLibraryLimits(rapidNJPlan plan, int sequenceCount);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef PACKED_PROTEINS_HPP
+#define PACKED_PROTEINS_HPP
+
+#include "stdinclude.h"
+#include "dataloader.hpp"
+#include "distanceKernels.h"
+
+/*Protein alignments can be encoded with 5 bits per residue instead of one byte: the residues are split into chunks of PACKED_PROTEIN_CHUNK_LENGTH, and each chunk is made of
+PACKED_PROTEIN_PLANES 128-bit blocks holding one bit of the code of each residue. Only the distance kernels can read this encoding, so it is not used with the rapidNJ library.*/
+
+/*Number of 128-bit blocks of a packed protein bit string.*/
+inline unsigned int getPackedProteinBitStringsCount(unsigned int sequenceLength) {
+	unsigned int chunkCount = max((sequenceLength + PACKED_PROTEIN_CHUNK_LENGTH - 1) / PACKED_PROTEIN_CHUNK_LENGTH, 1u);
+	return chunkCount * PACKED_PROTEIN_PLANES;
+}
+
+inline unsigned int getPackedProteinCode(const unsigned int* bitString, unsigned int position) {
+	const unsigned int* chunk = bitString + position / PACKED_PROTEIN_CHUNK_LENGTH * PACKED_PROTEIN_PLANES * 4;
+	unsigned int word = (position % PACKED_PROTEIN_CHUNK_LENGTH) / 32;
+	unsigned int shift = position % 32;
+	unsigned int code = 0;
+	for (unsigned int p = 0; p < PACKED_PROTEIN_PLANES; p++) {
+		code |= ((chunk[p * 4 + word] >> shift) & 1) << p;
+	}
+	return code;
+}
+
+/*Sets the code of a position whose bits are all clear.*/
+inline void setPackedProteinCode(unsigned int* bitString, unsigned int position, unsigned int code) {
+	unsigned int* chunk = bitString + position / PACKED_PROTEIN_CHUNK_LENGTH * PACKED_PROTEIN_PLANES * 4;
+	unsigned int word = (position % PACKED_PROTEIN_CHUNK_LENGTH) / 32;
+	unsigned int shift = position % 32;
+	for (unsigned int p = 0; p < PACKED_PROTEIN_PLANES; p++) {
+		chunk[p * 4 + word] |= ((code >> p) & 1) << shift;
+	}
+}
+
+/*Inherited by the dataloaders of the wrapper, whose protein bit strings may use the packed encoding.*/
+class packedProteinSource {
+
+public:
+	packedProteinSource() {
+		packedProteins = false;
+	}
+
+	bool packedProteins;
+};
+
+/*Returns true if the bit strings of dl are packed protein sequences.*/
+inline bool hasPackedProteins(dataloader* dl) {
+	packedProteinSource* source = dynamic_cast<packedProteinSource*>(dl);
+	return source != NULL && source->packedProteins;
+}
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef RAPIDNJ_CONTEXT_H
+#define RAPIDNJ_CONTEXT_H
+
+#include "stdinclude.h"
+#include "distanceKernels.h"
+#include "distanceStorage.hpp"
+#include "callStatistics.hpp"
+#include "callProgress.hpp"
+#include <random>
+
+/*Implementations of the RapidNJ algorithm used for distance matrices that fit in memory.*/
+enum njEngineType {
+	// The single-threaded rapidNJ and rapidNJMem classes of the library. Replaced by NJ_ENGINE_PARALLEL for matrices larger than LIBRARY_MAX_SEQUENCE_COUNT.
+	NJ_ENGINE_LIBRARY = 0,
+	// rapidNJParallel, which spreads each iteration over all the cores.
+	NJ_ENGINE_PARALLEL = 1,
+	// rapidNJParallel with relaxed joins, which joins many pairs in each pass over the sorted rows. Much faster for very large matrices, but the trees can differ from those
+	// of canonical neighbor joining.
+	NJ_ENGINE_RELAXED = 2
+};
+
+/*Storage used for distance matrices that do not fit in memory.*/
+enum diskMatrixBackendType {
+	// Files read and written through streams by the library's RapidDiskNJ. Replaced by DISK_MATRIX_MAPPED, when possible, for matrices larger than LIBRARY_MAX_SEQUENCE_COUNT.
+	DISK_MATRIX_STREAM = 0,
+	// A memory-mapped file holding the half matrix of rapidNJParallel. Falls back to DISK_MATRIX_STREAM if the alignment cannot be processed by the distance kernels or the file cannot be mapped.
+	DISK_MATRIX_MAPPED = 1
+};
+
+/*Ways of computing the bootstrap replicates of fastdist alignments.*/
+enum bootstrapModeType {
+	// Each replicate is a resampled copy of the bit strings.
+	BOOTSTRAP_RESAMPLE = 0,
+	// Replicates share the bit strings of the alignment and only store how many times each column was drawn, which the distance kernels use as weights.
+	// Falls back to BOOTSTRAP_RESAMPLE if the alignment cannot be processed by the distance kernels.
+	BOOTSTRAP_COLUMN_WEIGHTS = 1
+};
+
+/*Encodings of the bit strings of fastdist protein alignments.*/
+enum proteinEncodingType {
+	// One byte per residue, as in the rapidNJ library.
+	PROTEIN_ENCODING_BYTES = 0,
+	// 5 bits per residue, read by the distance kernels only. Falls back to PROTEIN_ENCODING_BYTES for the library estimators and RapidDiskNJ, and for alignments with more than 31 distinct residues.
+	PROTEIN_ENCODING_PACKED = 1
+};
+
+/*Options used to build a tree. The default values match those of an unconfigured rapidNJ run.*/
+struct rapidNJOptions {
+	bool verbose;
+	string fileName;
+	int memSize;
+	int cores;
+	string cacheDir;
+	string percentageMemoryUsage;
+	string distMethod;
+	string inputFormat;
+	string outputFormat;
+	bool fastdist;
+	int replicates;
+	string inputtype;
+	bool rapidNJ;
+	bool simpleNJ;
+	bool gpu;
+	bool negative_branches;
+	string outputFile;
+	bool parallelBootstrap;
+	int distanceKernel;
+	int njEngine;
+	int diskMatrixBackend;
+	int distanceStorage;
+	int bootstrapMode;
+	bool collapseDuplicates;
+	int proteinEncoding;
+	// File in which the tree and the bootstrap counts are saved while the replicates are computed, or "" to disable checkpoints. See treeCheckpoint.
+	string checkpointFile;
+	// Number of replicates between two checkpoints.
+	int checkpointInterval;
+
+	rapidNJOptions() {
+		verbose = false;
+		memSize = 0;
+		cores = 0;
+		fastdist = false;
+		replicates = -1;
+		rapidNJ = false;
+		simpleNJ = false;
+		gpu = false;
+		negative_branches = false;
+		parallelBootstrap = false;
+		distanceKernel = KERNEL_LIBRARY;
+		njEngine = NJ_ENGINE_LIBRARY;
+		diskMatrixBackend = DISK_MATRIX_STREAM;
+		distanceStorage = DISTANCE_STORAGE_FLOAT;
+		bootstrapMode = BOOTSTRAP_RESAMPLE;
+		collapseDuplicates = false;
+		proteinEncoding = PROTEIN_ENCODING_BYTES;
+		checkpointInterval = 1;
+	}
+};
+
+class distanceMatrixBuffer;
+
+/*Holds all the state of a single call into the library, so that several trees can be built at the same time from different threads. A context must not be used by more than one call at a time.*/
+class rapidNJContext {
+public:
+	rapidNJOptions options;
+	bool distanceMatrixInput;
+	bool distanceMatrixFromPointer;
+	int matrixSize;
+	int numCores;
+	// NULL unless OPTION_COLLECT_STATISTICS is set, in which case phaseTimer does nothing.
+	statisticsCollector* statistics;
+	// NULL unless the context belongs to a worker of ContextBuildTreesFromAlignments, which owns it. See distanceMatrixBuffer.
+	distanceMatrixBuffer* matrixBuffer;
+	// Set by SetRapidNJContextProgress: the block of the caller, which may be NULL, and the minimum time between two calls of the progress callback, in seconds.
+	rapidNJProgress* progressBlock;
+	double progressInterval;
+	// The callProgress of the running call. NULL between calls, and for the calls that only compute distances.
+	callProgress* progress;
+	// Draws the seeds of the bootstrap replicates, see OPTION_BOOTSTRAP_SEED. Only used by the calls of this context, so it needs no lock.
+	std::mt19937_64 random;
+
+	rapidNJContext() {
+		distanceMatrixInput = true;
+		distanceMatrixFromPointer = false;
+		matrixSize = -1;
+		numCores = 1;
+		statistics = NULL;
+		matrixBuffer = NULL;
+		progressBlock = NULL;
+		progressInterval = 0;
+		progress = NULL;
+		random.seed(std::random_device()());
+	}
+
+	~rapidNJContext() {
+		delete statistics;
+	}
+};
+
+/*Options that can be set on a context through SetRapidNJContextOption.*/
+enum rapidNJContextOption {
+	// Maximum memory to use, in MB.
+	OPTION_MAX_MEMORY = 0,
+	// Evolution model used to compute distances: 0 = Jukes-Cantor, 1 = Kimura.
+	OPTION_DISTANCE = 1,
+	// Number of threads to use; values < 1 mean 1.
+	OPTION_NUM_CORES = 2,
+	// Number of bootstrap replicates; values < 1 disable bootstrapping.
+	OPTION_BOOTSTRAP_REPLICATES = 3,
+	// 0 = prevent negative branch lengths, any other value = allow them.
+	OPTION_ALLOW_NEGATIVE_BRANCHES = 4,
+	// 0 = silent, any other value = print diagnostic information to the standard error.
+	OPTION_VERBOSE = 5,
+	// 0 = compute bootstrap replicates one at a time, any other value = compute them concurrently when they fit in memory.
+	OPTION_PARALLEL_BOOTSTRAP = 6,
+	// Kernels used to compute distances from alignments (a distanceKernelType); unsupported kernels fall back to the fastest available ones.
+	OPTION_DISTANCE_KERNEL = 7,
+	// Implementation of RapidNJ and memory efficient RapidNJ (an njEngineType). RapidDiskNJ and naive NJ always use the library.
+	OPTION_NJ_ENGINE = 8,
+	// Storage of distance matrices that do not fit in memory (a diskMatrixBackendType).
+	OPTION_DISK_MATRIX_BACKEND = 9,
+	// Type of the distance matrix of rapidNJParallel when it computes the distances itself (a distanceStorageType). Other matrices are always stored as distType.
+	OPTION_DISTANCE_STORAGE = 10,
+	// How bootstrap replicates of fastdist alignments are computed (a bootstrapModeType).
+	OPTION_BOOTSTRAP_MODE = 11,
+	// 0 = do not collect statistics, any other value = time the phases of each call and count the work done by the engines, see GetRapidNJContextStatistics.
+	OPTION_COLLECT_STATISTICS = 12,
+	// 0 = use all the sequences, any other value = build the tree from one copy of each distinct sequence of fastdist alignments, and join the copies by branches of length 0.
+	OPTION_COLLAPSE_DUPLICATES = 13,
+	// Encoding of the bit strings of fastdist protein alignments given as characters (a proteinEncodingType).
+	OPTION_PROTEIN_ENCODING = 14,
+	// 0 = compute distances on the CPU, any other value = compute the distance matrices that would use the distance kernels on a CUDA device instead, if the wrapper was built
+	// with RAPIDNJ_ENABLE_CUDA and a device is present. The distances that rapidNJParallel computes itself are always computed on the CPU.
+	OPTION_GPU = 15,
+	// Seed of the random number generator of the context, which draws the columns of the bootstrap replicates of fastdist alignments. Setting it restarts the generator,
+	// so that the next call gives the same replicates for the same seed; the generator is otherwise seeded at random when the context is created. Replicates of other
+	// alignments are drawn by the library, which always uses the generator of the C library.
+	OPTION_BOOTSTRAP_SEED = 16
+};
+
+#endif
@@ -0,0 +1,1005 @@
+#include "rapidNJParallel.hpp"
+#include "treeExport.hpp"
+#include "distanceCorrections.hpp"
+#include <algorithm>
+#include <cmath>
+
+// Below this number of clusters per worker, the work done in each iteration is too small to be worth distributing.
+static const int MIN_CLUSTERS_PER_WORKER = 512;
+
+// Dead entries are only removed from a row once there are enough of them to slow down the searches.
+static const int MIN_GARBAGE_ENTRIES = 16;
+
+// Rows are handed out to the workers in blocks, so that the pages of the rows of a block are mostly touched by a single worker.
+static const int ROW_BLOCK_SIZE = 16;
+
+// Each relaxed pass checks the best pairs of the first max(MIN_RELAXED_CANDIDATES, RELAXED_CANDIDATE_SCALE * sqrt(n)) rows, in the order of their values, against each
+// other, which keeps the cost of the checks in line with the cost of the search.
+static const int MIN_RELAXED_CANDIDATES = 64;
+static const int RELAXED_CANDIDATE_SCALE = 4;
+
+// Truncated rows are widened once this many rows per cluster have been rebuilt since they last were: rebuilding a row reads the distances of all the clusters, and
+// widening all the rows about half as many, so the rows are only widened when that pays for itself.
+static const double WIDEN_ROWS_THRESHOLD = 0.5;
+
+// The matrix of the reader is used in place, so it must hold the storage type of the engine.
+template <>
+rapidNJParallel<distType>::rapidNJParallel(distMatrixReader* reader, int matrixSize, int sortedMatrixSize, bool negative_branches, ProgressBar* pb, int numThreads) {
+	matrix = reader->getMatrix();
+	matrixSlab = NULL;
+	sequenceNames = reader->getSequenceNames();
+	distances = NULL;
+	lowerTriangle = NULL;
+	storage = NULL;
+	ownsMatrix = false;
+	rapidNJParallel::matrixSize = matrixSize;
+	rapidNJParallel::sortedMatrixSize = max(1, min(sortedMatrixSize, matrixSize));
+	rapidNJParallel::negative_branches = negative_branches;
+	rapidNJParallel::pb = pb;
+	createDatastructures(numThreads);
+}
+
+template <class storageType>
+rapidNJParallel<storageType>::rapidNJParallel(kernelDistance* distances, vector<string>* sequenceNames, int matrixSize, int sortedMatrixSize, bool negative_branches, ProgressBar* pb, int numThreads, mappedMatrix* storage) {
+	rapidNJParallel::sequenceNames = sequenceNames;
+	rapidNJParallel::distances = distances;
+	lowerTriangle = NULL;
+	rapidNJParallel::storage = storage;
+	rapidNJParallel::matrixSize = matrixSize;
+	rapidNJParallel::sortedMatrixSize = max(1, min(sortedMatrixSize, matrixSize));
+	rapidNJParallel::negative_branches = negative_branches;
+	rapidNJParallel::pb = pb;
+	createMatrix();
+	createDatastructures(numThreads);
+}
+
+template <class storageType>
+rapidNJParallel<storageType>::rapidNJParallel(const distType* lowerTriangle, vector<string>* sequenceNames, int matrixSize, int sortedMatrixSize, bool negative_branches, ProgressBar* pb, int numThreads) {
+	rapidNJParallel::sequenceNames = sequenceNames;
+	distances = NULL;
+	rapidNJParallel::lowerTriangle = lowerTriangle;
+	storage = NULL;
+	rapidNJParallel::matrixSize = matrixSize;
+	rapidNJParallel::sortedMatrixSize = max(1, min(sortedMatrixSize, matrixSize));
+	rapidNJParallel::negative_branches = negative_branches;
+	rapidNJParallel::pb = pb;
+	createMatrix();
+	createDatastructures(numThreads);
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::createMatrix() {
+	// Only the lower triangle is ever used, so a half matrix is enough.
+	matrix = new storageType*[matrixSize];
+	matrixSlab = NULL;
+	if (storage != NULL) {
+		for (int i = 0; i < matrixSize; i++) {
+			matrix[i] = (storageType*)storage->getRow(i);
+		}
+		ownsMatrix = false;
+	}
+	else {
+		matrixSlab = new storageType[(size_t)matrixSize * (matrixSize + 1) / 2];
+		for (int i = 0; i < matrixSize; i++) {
+			matrix[i] = matrixSlab + (size_t)i * (i + 1) / 2;
+		}
+		ownsMatrix = true;
+	}
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::createDatastructures(int numThreads) {
+	mytree = NULL;
+	statistics = NULL;
+	progress = NULL;
+	relaxed = false;
+	rowCandidates = NULL;
+	rowRanks = NULL;
+	joinedInPass = NULL;
+	distanceKernels kernels = getDistanceKernels(KERNEL_AUTO);
+	sortedRowScan = kernels.sortedRowScan;
+	sortedRowWidth = kernels.sortedRowWidth;
+	pool = new workerPool(numThreads);
+	int workers = pool->getWorkerCount();
+
+	separationsums = new double[matrixSize];
+	separations = new distType[matrixSize];
+	row_distances = new distType*[matrixSize];
+	row_ids = new unsigned int*[matrixSize];
+	row_lengths = new int[matrixSize];
+	row_complete = new bool[matrixSize];
+	row_in_slab = new bool[matrixSize];
+	initialRowDistances = NULL;
+	initialRowIds = NULL;
+	initialRowEntries = 0;
+	widenRowsEnabled = false;
+	widenRowsRebuilt = 0;
+	slotToId = new int[matrixSize];
+	idToSlot = new int[(size_t)matrixSize * 2];
+	activeSlots = new int[matrixSize];
+
+	candidates = new njCandidate[workers];
+	workerCounters = new njWorkerCounters[workers];
+	memset(workerCounters, 0, workers * sizeof(njWorkerCounters));
+	partialMaxSeparations = new distType[workers];
+	partialMaxDistances = new distType[workers];
+	partialSaturated = new bool[workers];
+	runStarts = new int[workers];
+	runLengths = new int[workers];
+	mergedLengths = new int[workers];
+	newRow = new cluster_pair[matrixSize];
+	newRowBuffer = new cluster_pair[matrixSize];
+	newDistances = new distType[matrixSize];
+
+	workerRows = new cluster_pair*[workers];
+	workerBuffers = new cluster_pair*[workers];
+	for (int i = 0; i < workers; i++) {
+		workerRows[i] = new cluster_pair[matrixSize];
+		workerBuffers[i] = new cluster_pair[matrixSize];
+	}
+
+	for (int i = 0; i < matrixSize; i++) {
+		row_distances[i] = NULL;
+		row_ids[i] = NULL;
+		row_lengths[i] = 0;
+		row_in_slab[i] = false;
+	}
+}
+
+template <class storageType>
+rapidNJParallel<storageType>::~rapidNJParallel(void) {
+	int workers = pool->getWorkerCount();
+	for (int i = 0; i < workers; i++) {
+		delete[] workerRows[i];
+		delete[] workerBuffers[i];
+	}
+	delete[] workerBuffers;
+	delete[] workerRows;
+	for (int i = 0; i < matrixSize; i++) {
+		deleteRow(i);
+	}
+	delete[] initialRowIds;
+	delete[] initialRowDistances;
+	if (ownsMatrix) {
+		if (matrixSlab != NULL) {
+			delete[] matrixSlab;
+		}
+		else {
+			for (int i = 0; i < matrixSize; i++) {
+				delete[] matrix[i];
+			}
+		}
+		delete[] matrix;
+	}
+	else if (storage != NULL) {
+		// Only the row pointers belong to the engine.
+		delete[] matrix;
+	}
+
+	delete[] joinedInPass;
+	delete[] rowRanks;
+	delete[] rowCandidates;
+	delete[] newDistances;
+	delete[] newRowBuffer;
+	delete[] newRow;
+	delete[] mergedLengths;
+	delete[] runLengths;
+	delete[] runStarts;
+	delete[] partialMaxSeparations;
+	delete[] partialMaxDistances;
+	delete[] partialSaturated;
+	delete[] workerCounters;
+	delete[] candidates;
+	delete[] activeSlots;
+	delete[] idToSlot;
+	delete[] slotToId;
+	delete[] row_in_slab;
+	delete[] row_complete;
+	delete[] row_lengths;
+	delete[] row_ids;
+	delete[] row_distances;
+	delete[] separations;
+	delete[] separationsums;
+	delete pool;
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::setOwnsMatrix(bool ownsMatrix) {
+	rapidNJParallel::ownsMatrix = ownsMatrix;
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::setStatistics(statisticsCollector* statistics) {
+	rapidNJParallel::statistics = statistics;
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::setRelaxed(bool relaxed) {
+	rapidNJParallel::relaxed = relaxed;
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::setProgress(callProgress* progress) {
+	rapidNJParallel::progress = progress;
+}
+
+template <class storageType>
+polytree* rapidNJParallel<storageType>::run() {
+	initialize();
+
+	double lastProgress = 0;
+	int iterations = 0;
+	{
+		phaseTimer timer(statistics, &rapidNJStatistics::njIterations);
+		while (clusterCount > 2 && !isCancelled()) {
+			if (relaxed) {
+				iterations += joinRelaxed();
+			}
+			else {
+				findMin();
+				mergeMinNodes();
+				updateData();
+				iterations++;
+			}
+			if (widenRowsEnabled && getRowsRebuilt() - widenRowsRebuilt >= clusterCount * WIDEN_ROWS_THRESHOLD) {
+				widenRows();
+			}
+
+			double fraction = (matrixSize - clusterCount) / (double)(matrixSize - 2);
+			if (fraction - lastProgress >= 0.001) {
+				pb->setProgress(fraction);
+				lastProgress = fraction;
+			}
+		}
+	}
+
+	// The counters are kept by each worker during the iterations, and only gathered once they are finished.
+	if (statistics != NULL) {
+		statistics->addCount(&rapidNJStatistics::njIterationCount, iterations);
+		for (int i = 0; i < pool->getWorkerCount(); i++) {
+			statistics->addCount(&rapidNJStatistics::sortedEntriesScanned, workerCounters[i].entriesScanned);
+			statistics->addCount(&rapidNJStatistics::rowsRebuilt, workerCounters[i].rowsRebuilt);
+			statistics->addCount(&rapidNJStatistics::rowsCompacted, workerCounters[i].rowsCompacted);
+		}
+		if (storage != NULL) {
+			statistics->addCount(&rapidNJStatistics::mappedBytesPrefetched, storage->getBytesPrefetched());
+			statistics->addCount(&rapidNJStatistics::mappedBytesWrittenBehind, storage->getBytesWrittenBehind());
+		}
+	}
+
+	if (isCancelled()) {
+		delete mytree;
+		mytree = NULL;
+		return NULL;
+	}
+
+	// Join the two remaining clusters.
+	int slot1 = activeSlots[0];
+	int slot2 = activeSlots[1];
+	mytree->set_serialization_indices(slotToId[slot1], slotToId[slot2], getDist(slot1, slot2));
+	return mytree;
+}
+
+template <class storageType>
+int rapidNJParallel<storageType>::getWorkerCount() {
+	return max(1, min(pool->getWorkerCount(), clusterCount / MIN_CLUSTERS_PER_WORKER));
+}
+
+template <class storageType>
+bool rapidNJParallel<storageType>::isCancelled() {
+	return progress != NULL && progress->isCancelled();
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::initialize() {
+	mytree = createPolytree(matrixSize, sequenceNames);
+	clusterCount = matrixSize;
+	currentId = matrixSize;
+
+	for (int i = 0; i < matrixSize; i++) {
+		slotToId[i] = i;
+		idToSlot[i] = i;
+		activeSlots[i] = i;
+		separationsums[i] = 0;
+	}
+	for (int i = matrixSize; i < matrixSize * 2; i++) {
+		idToSlot[i] = -1;
+	}
+	if (relaxed && rowCandidates == NULL) {
+		rowCandidates = new njCandidate[matrixSize];
+		rowRanks = new int[matrixSize];
+		joinedInPass = new bool[matrixSize];
+		for (int i = 0; i < matrixSize; i++) {
+			joinedInPass[i] = false;
+		}
+	}
+
+	// The rows are built first, as they may also compute the distances needed by the separation sums.
+	int workers = getWorkerCount();
+	if (storage != NULL) {
+		storage->adviseSequential();
+	}
+	initialRowEntries = max(getRowOffset(matrixSize, sortedMatrixSize), (size_t)1);
+	initialRowDistances = new distType[initialRowEntries];
+	initialRowIds = new unsigned int[initialRowEntries];
+	{
+		phaseTimer timer(statistics, &rapidNJStatistics::sortedRowBuild);
+		pool->run(rapidNJParallel::initializeRowsTask, (void*)this, workers);
+	}
+	// The rows that were not built are left empty, and the rest of the matrix unset.
+	if (isCancelled()) {
+		return;
+	}
+	// The distances that could not be corrected are only known once they have all been computed, so the rows that hold them are built again, which is rarely needed.
+	distType maxDistance = 0;
+	bool saturated = false;
+	for (int i = 0; i < workers; i++) {
+		maxDistance = max(maxDistance, partialMaxDistances[i]);
+		saturated = saturated || partialSaturated[i];
+	}
+	if (saturated) {
+		phaseTimer timer(statistics, &rapidNJStatistics::sortedRowBuild);
+		saturatedDistance = getSaturatedDistance(maxDistance);
+		pool->run(rapidNJParallel::replaceSaturatedTask, (void*)this, workers);
+	}
+	phaseTimer timer(statistics, &rapidNJStatistics::matrixInitialization);
+	pool->run(rapidNJParallel::initializeSumsTask, (void*)this, workers);
+	// From now on, each iteration reads two rows and one column of the matrix.
+	if (storage != NULL) {
+		storage->adviseRandom();
+	}
+	// Rebuilding the rows reads the columns of the matrix, which is too slow for mapped files.
+	if (storage == NULL && sortedMatrixSize < matrixSize - 1) {
+		widenRowsEnabled = true;
+	}
+
+	max_separation = -numeric_limits<distType>::max();
+	for (int i = 0; i < matrixSize; i++) {
+		separations[i] = (distType)(separationsums[i] / (matrixSize - 2));
+		max_separation = max(max_separation, separations[i]);
+	}
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::initializeSumsTask(void* arg, int workerIndex, int workerCount) {
+	rapidNJParallel* nj = (rapidNJParallel*)arg;
+	storageType** matrix = nj->matrix;
+	double* separationsums = nj->separationsums;
+	int start = (int)((long long)nj->matrixSize * workerIndex / workerCount);
+	int end = (int)((long long)nj->matrixSize * (workerIndex + 1) / workerCount);
+
+	// Each worker computes the sums of a range of clusters, reading the lower triangle row by row. The terms of each sum are added in
+	// the same order whatever the number of workers, so the sums do not depend on it. Every cluster has n - 1 terms, so the ranges are balanced.
+	for (int i = start; i < end; i++) {
+		double sum = 0;
+		for (int j = 0; j < i; j++) {
+			sum += (distType)matrix[i][j];
+		}
+		separationsums[i] = sum;
+	}
+	for (int i = start + 1; i < nj->matrixSize; i++) {
+		int columnEnd = min(i, end);
+		for (int j = start; j < columnEnd; j++) {
+			separationsums[j] += (distType)matrix[i][j];
+		}
+	}
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::initializeRowsTask(void* arg, int workerIndex, int workerCount) {
+	rapidNJParallel* nj = (rapidNJParallel*)arg;
+	cluster_pair* row = nj->workerRows[workerIndex];
+	cluster_pair* buffer = nj->workerBuffers[workerIndex];
+	distType maxDistance = 0;
+	bool saturated = false;
+
+	// Each pair of clusters appears in the row of the cluster created last, so initially row i holds the clusters j < i.
+	// Blocks of rows are interleaved between the workers, which balances their lengths. Each row is first written by the worker that builds it, which places it on the
+	// memory node of that worker, and findMin then gives the same blocks to the same workers.
+	for (int block = workerIndex * ROW_BLOCK_SIZE; block < nj->matrixSize && !nj->isCancelled(); block += workerCount * ROW_BLOCK_SIZE) {
+		int blockEnd = min(block + ROW_BLOCK_SIZE, nj->matrixSize);
+		for (int i = block; i < blockEnd; i++) {
+			if (nj->distances != NULL) {
+				nj->matrix[i][i] = 0;
+				for (int j = 0; j < i; j++) {
+					distType distance = nj->distances->computeDistance(i, j);
+					if (distance == -1) {
+						saturated = true;
+					}
+					else if (distance > maxDistance) {
+						maxDistance = distance;
+					}
+					nj->matrix[i][j] = distance;
+				}
+			}
+			else if (nj->lowerTriangle != NULL) {
+				const distType* source = nj->lowerTriangle + (size_t)i * (i + 1) / 2;
+				for (int j = 0; j <= i; j++) {
+					nj->matrix[i][j] = source[j];
+				}
+			}
+			nj->buildInitialRow(i, row, buffer);
+		}
+	}
+	nj->partialMaxDistances[workerIndex] = maxDistance;
+	nj->partialSaturated[workerIndex] = saturated;
+}
+
+// Replaces the distances that could not be corrected in the rows of the worker and builds these rows again, like the distances of JCdistance and KimuraDistance.
+template <class storageType>
+void rapidNJParallel<storageType>::replaceSaturatedTask(void* arg, int workerIndex, int workerCount) {
+	rapidNJParallel* nj = (rapidNJParallel*)arg;
+	for (int block = workerIndex * ROW_BLOCK_SIZE; block < nj->matrixSize; block += workerCount * ROW_BLOCK_SIZE) {
+		int blockEnd = min(block + ROW_BLOCK_SIZE, nj->matrixSize);
+		for (int i = block; i < blockEnd; i++) {
+			bool replaced = false;
+			for (int j = 0; j < i; j++) {
+				if ((distType)nj->matrix[i][j] == -1) {
+					nj->matrix[i][j] = nj->saturatedDistance;
+					replaced = true;
+				}
+			}
+			if (replaced) {
+				nj->buildInitialRow(i, nj->workerRows[workerIndex], nj->workerBuffers[workerIndex]);
+			}
+		}
+	}
+}
+
+// Builds the initial sorted row of cluster i from the lower triangle of the matrix.
+template <class storageType>
+void rapidNJParallel<storageType>::buildInitialRow(int i, cluster_pair* row, cluster_pair* buffer) {
+	// The rows are built from the stored distances, so that they match the matrix when it is narrower than distType.
+	for (int j = 0; j < i; j++) {
+		row[j].id = j;
+		row[j].distance = matrix[i][j];
+	}
+	selectClusterPairs(row, buffer, i, sortedMatrixSize);
+
+	setInitialRow(i, row, min(i, sortedMatrixSize));
+	row_complete[i] = i <= sortedMatrixSize;
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::findMin() {
+	int workers = getWorkerCount();
+	for (int i = 0; i < workers; i++) {
+		resetCandidate(&candidates[i]);
+	}
+
+	pool->run(rapidNJParallel::findMinTask, (void*)this, workers);
+
+	njCandidate* best = &candidates[0];
+	for (int i = 1; i < workers; i++) {
+		if (candidates[i].value < best->value || (candidates[i].value == best->value && candidates[i].key < best->key)) {
+			best = &candidates[i];
+		}
+	}
+
+	// This can only happen if all the remaining distances are infinite or NaN.
+	if (best->slot1 < 0) {
+		best->slot1 = activeSlots[0];
+		best->slot2 = activeSlots[1];
+	}
+
+	// The pair can be found from either of its rows, so order it by id to get the same tree whatever the number of workers.
+	if (slotToId[best->slot1] < slotToId[best->slot2]) {
+		min1 = best->slot1;
+		min2 = best->slot2;
+	}
+	else {
+		min1 = best->slot2;
+		min2 = best->slot1;
+	}
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::findMinTask(void* arg, int workerIndex, int workerCount) {
+	rapidNJParallel* nj = (rapidNJParallel*)arg;
+	// Blocks of rows are interleaved between the workers, which spreads long and short rows evenly. Clusters keep their position until they are joined, apart from the
+	// new cluster and the one moved to make room for it, so most rows are searched by the worker that built them, on their memory node.
+	for (int block = workerIndex * ROW_BLOCK_SIZE; block < nj->clusterCount; block += workerCount * ROW_BLOCK_SIZE) {
+		int blockEnd = min(block + ROW_BLOCK_SIZE, nj->clusterCount);
+		for (int i = block; i < blockEnd; i++) {
+			nj->searchRow(i, workerIndex, &nj->candidates[workerIndex]);
+		}
+	}
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::findRowMinimaTask(void* arg, int workerIndex, int workerCount) {
+	rapidNJParallel* nj = (rapidNJParallel*)arg;
+	// Each row is only pruned with its own best pair, so its best pair is found whatever the other rows hold.
+	for (int block = workerIndex * ROW_BLOCK_SIZE; block < nj->clusterCount; block += workerCount * ROW_BLOCK_SIZE) {
+		int blockEnd = min(block + ROW_BLOCK_SIZE, nj->clusterCount);
+		for (int i = block; i < blockEnd; i++) {
+			nj->resetCandidate(&nj->rowCandidates[i]);
+			nj->searchRow(i, workerIndex, &nj->rowCandidates[i]);
+		}
+	}
+}
+
+// Returns the number of pairs joined.
+template <class storageType>
+int rapidNJParallel<storageType>::joinRelaxed() {
+	pool->run(rapidNJParallel::findRowMinimaTask, (void*)this, getWorkerCount());
+
+	rowOrder.clear();
+	for (int i = 0; i < clusterCount; i++) {
+		rowRanks[activeSlots[i]] = clusterCount;
+		if (rowCandidates[i].slot1 >= 0) {
+			rowOrder.push_back(make_pair(make_pair(rowCandidates[i].value, rowCandidates[i].key), i));
+		}
+	}
+	// This can only happen if all the remaining distances are infinite or NaN.
+	if (rowOrder.empty()) {
+		min1 = activeSlots[0];
+		min2 = activeSlots[1];
+		mergeMinNodes();
+		updateData();
+		return 1;
+	}
+	sort(rowOrder.begin(), rowOrder.end());
+	int candidateCount = min((int)rowOrder.size(), max(MIN_RELAXED_CANDIDATES, (int)(RELAXED_CANDIDATE_SCALE * sqrt((double)clusterCount))));
+	for (int rank = 0; rank < candidateCount; rank++) {
+		rowRanks[rowCandidates[rowOrder[rank].second].slot1] = rank;
+	}
+
+	// Each join leaves one cluster less, and the last two clusters are joined by run.
+	vector<pair<int, int> > joins;
+	int maxJoins = clusterCount - 2;
+	for (int rank = 0; rank < candidateCount && (int)joins.size() < maxJoins; rank++) {
+		if (isRelaxedJoin(rank)) {
+			njCandidate* candidate = &rowCandidates[rowOrder[rank].second];
+			joinedInPass[candidate->slot1] = true;
+			joinedInPass[candidate->slot2] = true;
+			joins.push_back(make_pair(candidate->slot1, candidate->slot2));
+		}
+	}
+
+	// The clusters that are not joined keep their slots, so the other pairs of the pass are still valid after each join.
+	for (unsigned int i = 0; i < joins.size(); i++) {
+		joinedInPass[joins[i].first] = false;
+		joinedInPass[joins[i].second] = false;
+		if (slotToId[joins[i].first] < slotToId[joins[i].second]) {
+			min1 = joins[i].first;
+			min2 = joins[i].second;
+		}
+		else {
+			min1 = joins[i].second;
+			min2 = joins[i].first;
+		}
+		mergeMinNodes();
+		updateData();
+	}
+	return (int)joins.size();
+}
+
+// The best pair of the row of the given rank can be joined if it is the best pair of both of its clusters. A better pair for one of them would have to be in a row whose
+// best pair is better still, so only the rows of lower rank need to be checked.
+template <class storageType>
+bool rapidNJParallel<storageType>::isRelaxedJoin(int rank) {
+	njCandidate* candidate = &rowCandidates[rowOrder[rank].second];
+	int slot1 = candidate->slot1;
+	int slot2 = candidate->slot2;
+	if (joinedInPass[slot1] || joinedInPass[slot2] || rowRanks[slot2] < rank) {
+		return false;
+	}
+	// Same rounding as the search of the rows.
+	for (int i = 0; i < rank; i++) {
+		int slot = rowCandidates[rowOrder[i].second].slot1;
+		if (slot == slot2) {
+			continue;
+		}
+		if (getDist(slot, slot1) - (separations[slot] + separations[slot1]) < candidate->value ||
+			getDist(slot, slot2) - (separations[slot] + separations[slot2]) < candidate->value) {
+			return false;
+		}
+	}
+	return true;
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::searchRow(int position, int workerIndex, njCandidate* candidate) {
+	int slot = activeSlots[position];
+	distType* distances = row_distances[slot];
+	unsigned int* ids = row_ids[slot];
+	int length = row_lengths[slot];
+	distType separation = separations[slot];
+	distType bound = separation + max_separation;
+	int garbage = 0;
+	bool stopped = false;
+
+	// The row scan kernel (SSE2, AVX2 or AVX-512, see getDistanceKernels) computes the values of whole blocks of entries at once, gathering the separations of the other
+	// clusters, and skips the blocks that cannot improve on the best pair. The entries of the blocks it stops at go through considerPair one at a time.
+	int i = 0;
+	while (true) {
+		i = sortedRowScan(distances, ids, idToSlot, separations, separation, bound, candidate->value, i, length, &garbage);
+		if (i + sortedRowWidth > length) {
+			break;
+		}
+		// The entries are sorted, so no later entry can improve on the best pair found so far. The entries of this block that are past
+		// the bound cannot be selected either, as their values are at least their distance minus the bound.
+		if (distances[i] - bound > candidate->value) {
+			stopped = true;
+			break;
+		}
+		for (int end = i + sortedRowWidth; i < end; i++) {
+			int other = idToSlot[ids[i]];
+			if (other < 0) {
+				garbage++;
+				continue;
+			}
+			// Same rounding as the kernel and the bound.
+			considerPair(candidate, distances[i] - (separation + separations[other]), slot, other);
+		}
+	}
+	for (; !stopped && i < length; i++) {
+		if (distances[i] - bound > candidate->value) {
+			stopped = true;
+			break;
+		}
+		int other = idToSlot[ids[i]];
+		if (other < 0) {
+			garbage++;
+			continue;
+		}
+		// Same rounding as the bound, so that the value can never be smaller than it.
+		considerPair(candidate, distances[i] - (separation + separations[other]), slot, other);
+	}
+
+	workerCounters[workerIndex].entriesScanned += i;
+
+	if (!stopped && !row_complete[slot]) {
+		searchFullRow(slot, workerIndex, candidate);
+		workerCounters[workerIndex].rowsRebuilt++;
+	}
+	else {
+		if (storage != NULL && !row_complete[slot] && i * 4 > length * 3) {
+			// The row is close to running out of entries and being rebuilt from the distance matrix, so it is read in the background in the meantime.
+			storage->prefetchRows(slot, 1);
+		}
+		if (garbage > MIN_GARBAGE_ENTRIES && garbage * 2 > i) {
+			int kept = 0;
+			for (int j = 0; j < length; j++) {
+				if (idToSlot[ids[j]] >= 0) {
+					distances[kept] = distances[j];
+					ids[kept] = ids[j];
+					kept++;
+				}
+			}
+			row_lengths[slot] = kept;
+			workerCounters[workerIndex].rowsCompacted++;
+		}
+	}
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::searchFullRow(int slot, int workerIndex, njCandidate* candidate) {
+	cluster_pair* buffer = workerRows[workerIndex];
+	distType separation = separations[slot];
+	int count = 0;
+
+	for (int i = 0; i < clusterCount; i++) {
+		int other = activeSlots[i];
+		if (other == slot) {
+			continue;
+		}
+		distType distance = getDist(slot, other);
+		considerPair(candidate, distance - (separation + separations[other]), slot, other);
+		buffer[count].id = slotToId[other];
+		buffer[count].distance = distance;
+		count++;
+	}
+
+	// Rebuild the row from the remaining clusters, so that the next searches can use it again.
+	selectClusterPairs(buffer, workerBuffers[workerIndex], count, sortedMatrixSize);
+	setRow(slot, buffer, min(count, sortedMatrixSize));
+	row_complete[slot] = count <= sortedMatrixSize;
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::mergeMinNodes() {
+	min1Distance = getDist(min1, min2);
+	double separationDifference = (separationsums[min1] - separationsums[min2]) / (clusterCount - 2);
+	double distance_left = (min1Distance + separationDifference) * 0.5;
+	double distance_right = min1Distance - distance_left;
+
+	// Negative branch lengths are moved to the sibling branch, which keeps the distance between the two clusters.
+	if (negative_branches) {
+		if (distance_left < 0) {
+			distance_right += distance_left;
+			distance_left = 0;
+		}
+		if (distance_right < 0) {
+			distance_left += distance_right;
+			distance_right = 0;
+		}
+		distance_left = max(distance_left, 0.0);
+	}
+
+	mytree->addInternalNode(distance_left, distance_right, slotToId[min1], slotToId[min2]);
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::updateData() {
+	idToSlot[slotToId[min1]] = -1;
+	idToSlot[slotToId[min2]] = -1;
+
+	// Remove min2 from the active clusters, and move the new cluster to the end so that the others are contiguous.
+	for (int i = 0; i < clusterCount; i++) {
+		if (activeSlots[i] == min2) {
+			activeSlots[i] = activeSlots[clusterCount - 1];
+			break;
+		}
+	}
+	clusterCount--;
+	for (int i = 0; i < clusterCount; i++) {
+		if (activeSlots[i] == min1) {
+			activeSlots[i] = activeSlots[clusterCount - 1];
+			activeSlots[clusterCount - 1] = min1;
+			break;
+		}
+	}
+
+	slotToId[min1] = currentId;
+	idToSlot[currentId] = min1;
+	currentId++;
+	deleteRow(min2);
+
+	if (clusterCount == 2) {
+		int other = activeSlots[0];
+		setDist(min1, other, (getDist(min1, other) + getDist(min2, other) - min1Distance) * 0.5f);
+		return;
+	}
+
+	if (storage != NULL) {
+		storage->adviseWillNeed(min1, 1);
+		storage->adviseWillNeed(min2, 1);
+	}
+
+	int workers = getWorkerCount();
+	pool->run(rapidNJParallel::updateTask, (void*)this, workers);
+
+	// Adding the distances in the order of the active clusters keeps the sum independent of the number of workers.
+	double sum = 0;
+	for (int i = 0; i < clusterCount - 1; i++) {
+		sum += newDistances[i];
+	}
+	max_separation = -numeric_limits<distType>::max();
+	for (int i = 0; i < workers; i++) {
+		max_separation = max(max_separation, partialMaxSeparations[i]);
+	}
+	separationsums[min1] = sum;
+	separations[min1] = (distType)(sum / (clusterCount - 2));
+	max_separation = max(max_separation, separations[min1]);
+
+	// The row of the new cluster is only read again from now on, so it can be written to the file right away.
+	if (storage != NULL) {
+		storage->writeBehind(min1, 1);
+	}
+
+	buildNewRow(workers);
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::updateTask(void* arg, int workerIndex, int workerCount) {
+	rapidNJParallel* nj = (rapidNJParallel*)arg;
+	// The new cluster is the last active one and is not part of its own row.
+	int otherClusters = nj->clusterCount - 1;
+	int start = (int)((long long)otherClusters * workerIndex / workerCount);
+	int end = (int)((long long)otherClusters * (workerIndex + 1) / workerCount);
+	double clusterScale = 1.0 / (nj->clusterCount - 2);
+	distType maxSeparation = -numeric_limits<distType>::max();
+
+	for (int i = start; i < end; i++) {
+		int slot = nj->activeSlots[i];
+		distType distance1 = nj->getDist(nj->min1, slot);
+		distType distance2 = nj->getDist(nj->min2, slot);
+		// Rounded to the storage type, so that the sums and the sorted row use the same value as the matrix.
+		distType distance = (distType)(storageType)((distance1 + distance2 - nj->min1Distance) * 0.5f);
+		// Each worker writes a different cell of the matrix, as min1 is not one of the slots.
+		nj->setDist(nj->min1, slot, distance);
+		nj->separationsums[slot] += distance - distance1 - distance2;
+		nj->separations[slot] = (distType)(nj->separationsums[slot] * clusterScale);
+		maxSeparation = max(maxSeparation, nj->separations[slot]);
+
+		nj->newDistances[i] = distance;
+		nj->newRow[i].id = nj->slotToId[slot];
+		nj->newRow[i].distance = distance;
+	}
+
+	// Each worker sorts its part of the new row, and the parts are then merged.
+	selectClusterPairs(nj->newRow + start, nj->newRowBuffer + start, end - start, nj->sortedMatrixSize);
+	nj->runStarts[workerIndex] = start;
+	nj->runLengths[workerIndex] = min(end - start, nj->sortedMatrixSize);
+	nj->partialMaxSeparations[workerIndex] = maxSeparation;
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::buildNewRow(int workers) {
+	runCount = workers;
+	while (runCount > 1) {
+		int mergedCount = (runCount + 1) / 2;
+		pool->run(rapidNJParallel::mergeRowTask, (void*)this, mergedCount);
+		for (int i = 0; i < mergedCount; i++) {
+			runStarts[i] = runStarts[i * 2];
+			runLengths[i] = mergedLengths[i];
+		}
+		runCount = mergedCount;
+		cluster_pair* temp = newRow;
+		newRow = newRowBuffer;
+		newRowBuffer = temp;
+	}
+
+	setRow(min1, newRow + runStarts[0], runLengths[0]);
+	row_complete[min1] = clusterCount - 1 <= sortedMatrixSize;
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::setRow(int slot, cluster_pair* pairs, int length) {
+	deleteRow(slot);
+	row_distances[slot] = new distType[length];
+	row_ids[slot] = new unsigned int[length];
+	for (int i = 0; i < length; i++) {
+		row_distances[slot][i] = pairs[i].distance;
+		row_ids[slot][i] = pairs[i].id;
+	}
+	row_lengths[slot] = length;
+}
+
+// Offset of row i in rows where each row j holds min(j, width) entries, like the rows built by initialize.
+template <class storageType>
+size_t rapidNJParallel<storageType>::getRowOffset(int rank, int width) {
+	size_t i = rank;
+	size_t k = width;
+	if (i <= k) {
+		return i * (i - 1) / 2;
+	}
+	return k * (k + 1) / 2 + (i - k - 1) * k;
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::setInitialRow(int slot, cluster_pair* pairs, int length) {
+	size_t offset = getRowOffset(slot, sortedMatrixSize);
+	row_distances[slot] = initialRowDistances + offset;
+	row_ids[slot] = initialRowIds + offset;
+	row_in_slab[slot] = true;
+	for (int i = 0; i < length; i++) {
+		row_distances[slot][i] = pairs[i].distance;
+		row_ids[slot][i] = pairs[i].id;
+	}
+	row_lengths[slot] = length;
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::deleteRow(int slot) {
+	if (!row_in_slab[slot]) {
+		delete[] row_distances[slot];
+		delete[] row_ids[slot];
+	}
+	row_in_slab[slot] = false;
+	row_distances[slot] = NULL;
+	row_ids[slot] = NULL;
+	row_lengths[slot] = 0;
+}
+
+template <class storageType>
+long long rapidNJParallel<storageType>::getRowsRebuilt() {
+	// Workers that are no longer used as clusters are joined keep their counts.
+	long long rowsRebuilt = 0;
+	for (int i = 0; i < pool->getWorkerCount(); i++) {
+		rowsRebuilt += workerCounters[i].rowsRebuilt;
+	}
+	return rowsRebuilt;
+}
+
+// The entries of the initial rows are only partly used once clusters have been joined, while the truncated rows need to be searched in the distance matrix more and
+// more often. Once enough of them have been rebuilt, all the rows are rebuilt from the distance matrix in place of the initial rows, as wide as their entries allow.
+// This also frees the rows that were built since then, so the rows never take more memory than before.
+template <class storageType>
+void rapidNJParallel<storageType>::widenRows() {
+	widenRowsRebuilt = getRowsRebuilt();
+
+	// Like the initial rows, each row holds the clusters created before its own, so the row of the i-th oldest cluster has i entries at most.
+	int low = sortedMatrixSize;
+	int high = clusterCount - 1;
+	while (low < high) {
+		int width = low + (high - low + 1) / 2;
+		if (getRowOffset(clusterCount, width) <= initialRowEntries) {
+			low = width;
+		}
+		else {
+			high = width - 1;
+		}
+	}
+	if (low <= sortedMatrixSize) {
+		return;
+	}
+	sortedMatrixSize = low;
+
+	widenOrder.assign(activeSlots, activeSlots + clusterCount);
+	for (int i = 0; i < clusterCount; i++) {
+		widenOrder[i] = slotToId[activeSlots[i]];
+	}
+	sort(widenOrder.begin(), widenOrder.end());
+	for (int i = 0; i < clusterCount; i++) {
+		widenOrder[i] = idToSlot[widenOrder[i]];
+	}
+	pool->run(rapidNJParallel::widenRowsTask, (void*)this, getWorkerCount());
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::widenRowsTask(void* arg, int workerIndex, int workerCount) {
+	rapidNJParallel* nj = (rapidNJParallel*)arg;
+	cluster_pair* buffer = nj->workerRows[workerIndex];
+	int width = nj->sortedMatrixSize;
+
+	for (int block = workerIndex * ROW_BLOCK_SIZE; block < nj->clusterCount; block += workerCount * ROW_BLOCK_SIZE) {
+		int blockEnd = min(block + ROW_BLOCK_SIZE, nj->clusterCount);
+		for (int rank = block; rank < blockEnd; rank++) {
+			int slot = nj->widenOrder[rank];
+			for (int i = 0; i < rank; i++) {
+				int other = nj->widenOrder[i];
+				buffer[i].id = nj->slotToId[other];
+				buffer[i].distance = nj->getDist(slot, other);
+			}
+			selectClusterPairs(buffer, nj->workerBuffers[workerIndex], rank, width);
+
+			// The rows are laid out in the order of the ids, so they do not overlap whatever the previous layout. The previous contents of the initial rows
+			// are not needed, as all the rows are rebuilt.
+			nj->deleteRow(slot);
+			size_t offset = getRowOffset(rank, width);
+			int length = min(rank, width);
+			nj->row_distances[slot] = nj->initialRowDistances + offset;
+			nj->row_ids[slot] = nj->initialRowIds + offset;
+			nj->row_in_slab[slot] = true;
+			for (int i = 0; i < length; i++) {
+				nj->row_distances[slot][i] = buffer[i].distance;
+				nj->row_ids[slot][i] = buffer[i].id;
+			}
+			nj->row_lengths[slot] = length;
+			nj->row_complete[slot] = rank <= width;
+		}
+	}
+}
+
+template <class storageType>
+void rapidNJParallel<storageType>::mergeRowTask(void* arg, int workerIndex, int /*workerCount*/) {
+	rapidNJParallel* nj = (rapidNJParallel*)arg;
+	int run1 = workerIndex * 2;
+	int run2 = run1 + 1;
+	cluster_pair* source1 = nj->newRow + nj->runStarts[run1];
+	cluster_pair* target = nj->newRowBuffer + nj->runStarts[run1];
+	int length1 = nj->runLengths[run1];
+
+	if (run2 >= nj->runCount) {
+		for (int i = 0; i < length1; i++) {
+			target[i] = source1[i];
+		}
+		nj->mergedLengths[workerIndex] = length1;
+		return;
+	}
+
+	// Merge the two runs, keeping at most sortedMatrixSize entries. The merged run fits before the start of the next pair of runs.
+	cluster_pair* source2 = nj->newRow + nj->runStarts[run2];
+	int length2 = nj->runLengths[run2];
+	int length = min(length1 + length2, nj->sortedMatrixSize);
+	int i1 = 0;
+	int i2 = 0;
+	for (int i = 0; i < length; i++) {
+		if (i2 >= length2 || (i1 < length1 && !(source2[i2] < source1[i1]))) {
+			target[i] = source1[i1];
+			i1++;
+		}
+		else {
+			target[i] = source2[i2];
+			i2++;
+		}
+	}
+	nj->mergedLengths[workerIndex] = length;
+}
+
+template class rapidNJParallel<distType>;
+template class rapidNJParallel<halfDistance>;
+template class rapidNJParallel<bfloat16Distance>;
@@ -0,0 +1,222 @@
+#ifndef RAPIDNJ_PARALLEL_HPP
+#define RAPIDNJ_PARALLEL_HPP
+
+#include "stdinclude.h"
+#include "polytree.h"
+#include "distMatrixReader.hpp"
+#include "cluster_pair.h"
+#include "ProgressBar.hpp"
+#include "workerPool.hpp"
+#include "clusterPairSort.hpp"
+#include "kernelDistance.hpp"
+#include "mappedMatrix.hpp"
+#include "distanceStorage.hpp"
+#include "callStatistics.hpp"
+#include "callProgress.hpp"
+#include <limits>
+
+/*Best pair of clusters found by a worker: the NJ criterion, the slots of the two clusters and a key made of their ids, used to break ties in the same way whatever the number of workers.*/
+struct njCandidate {
+	distType value;
+	int slot1;
+	int slot2;
+	unsigned long long key;
+};
+
+/*Counters of a worker of rapidNJParallel, padded to a cache line so that the workers do not share one.*/
+struct njWorkerCounters {
+	long long entriesScanned;
+	long long rowsRebuilt;
+	long long rowsCompacted;
+	char padding[64 - 3 * sizeof(long long)];
+};
+
+/*A multi-threaded implementation of the RapidNJ algorithm. Each iteration, the sorted rows are searched for the pair of clusters to join by all the workers of a pool, and the distances and sorted row of the new cluster are computed in parallel too.
+With sortedMatrixSize < matrixSize, only the smallest sortedMatrixSize entries of each row are kept, like in rapidNJMem; rows that run out of entries are searched in the distance matrix and rebuilt.
+As clusters are joined, the rows of matrices held in memory are widened from time to time so that they fill the entries of the initial rows again, see widenRows.
+The distance matrix is only accessed through its lower triangle, so it can be either a full or a half matrix. It is updated in place.
+The engine can also compute the distances itself from a kernelDistance: each row is then sorted by the worker that has just computed it, in a half matrix owned by the engine
+or, for matrices that do not fit in memory, in a mappedMatrix.
+storageType is the type of the elements of the distance matrix: distType, halfDistance or bfloat16Distance. The narrower types halve the memory used by the matrix,
+while all the computations are still done in single or double precision.
+With relaxed joins, see setRelaxed, each pass looks for the best pair of every row rather than for the best pair overall, and joins all the pairs that are the best pair
+of both of their clusters, like relaxed neighbor joining.*/
+template <class storageType>
+class rapidNJParallel {
+
+public:
+	/*Only available with distType storage, as the matrix of the reader is used in place.*/
+	rapidNJParallel(distMatrixReader* reader, int matrixSize, int sortedMatrixSize, bool negative_branches, ProgressBar* pb, int numThreads);
+	/*storage must have been created with elements of sizeof(storageType) bytes.*/
+	rapidNJParallel(kernelDistance* distances, vector<string>* sequenceNames, int matrixSize, int sortedMatrixSize, bool negative_branches, ProgressBar* pb, int numThreads, mappedMatrix* storage = NULL);
+	/*Copies the distances from a lower triangle, in which row i starts at element i * (i + 1) / 2, into a half matrix of its own instead of computing them. The lower
+	triangle is only read while the rows are built, and must be kept until run returns.*/
+	rapidNJParallel(const distType* lowerTriangle, vector<string>* sequenceNames, int matrixSize, int sortedMatrixSize, bool negative_branches, ProgressBar* pb, int numThreads);
+	~rapidNJParallel(void);
+	/*Returns NULL if the call was cancelled, see setProgress.*/
+	polytree* run();
+
+	/*If set, the distance matrix is freed together with the object.*/
+	void setOwnsMatrix(bool ownsMatrix);
+
+	/*If set, the time spent in each phase and the engine counters are added to the statistics.*/
+	void setStatistics(statisticsCollector* statistics);
+
+	/*If set, the pairs of clusters that are the best pair of both of their clusters are joined several at a time, which needs far fewer passes over the sorted rows than
+	canonical neighbor joining, at the cost of trees that can differ from the canonical ones. The joins of a pass are made in the order of their values, with the values of
+	the start of the pass. The first one is always the pair canonical neighbor joining would join.*/
+	void setRelaxed(bool relaxed);
+
+	/*If set, the engine polls the cancel flag of the call while the rows are built and before each iteration, and stops as soon as it is set.*/
+	void setProgress(callProgress* progress);
+
+private:
+	storageType** matrix;
+	// The half matrix owned by the engine, in a single allocation. NULL if the rows belong to the reader or to storage.
+	storageType* matrixSlab;
+	vector<string>* sequenceNames;
+	// The source of the distances of the matrix owned by the engine, if any.
+	kernelDistance* distances;
+	const distType* lowerTriangle;
+	mappedMatrix* storage;
+	polytree* mytree;
+	int matrixSize;
+	int sortedMatrixSize;
+	bool negative_branches;
+	bool ownsMatrix;
+	bool relaxed;
+	ProgressBar* pb;
+	workerPool* pool;
+	statisticsCollector* statistics;
+	callProgress* progress;
+	// The vector kernel of the CPU that skips the blocks of sorted rows that cannot hold the pair to join, see searchRow, and the number of entries of its blocks.
+	sortedRowScanKernel sortedRowScan;
+	int sortedRowWidth;
+
+	// Cluster data, indexed by slot. A new cluster takes the slot of one of the two clusters it replaces.
+	double* separationsums;
+	distType* separations;
+	distType max_separation;
+	// Sorted rows, stored as separate arrays of distances and ids so that several entries can be searched at once.
+	distType** row_distances;
+	unsigned int** row_ids;
+	int* row_lengths;
+	// Rows are complete if they hold all the clusters they are responsible for, otherwise they only hold the closest ones.
+	bool* row_complete;
+	// The rows built by initialize share two allocations; the rows built later, which replace them, are allocated one by one.
+	bool* row_in_slab;
+	distType* initialRowDistances;
+	unsigned int* initialRowIds;
+	size_t initialRowEntries;
+	// Whether the rows can be widened, and the number of rows rebuilt by the workers when they last were.
+	bool widenRowsEnabled;
+	long long widenRowsRebuilt;
+	// The active slots in the order of their ids, while the rows are widened.
+	vector<int> widenOrder;
+	// Cluster ids stay below 2 * matrixSize, so they are kept in 32 bits, like the row lengths, which are at most matrixSize. Only the products of two sizes, such as the
+	// offsets of rows in the half matrix and in the sorted rows, need 64 bits.
+	int* slotToId;
+	int* idToSlot;
+	int* activeSlots;
+	int clusterCount;
+	int currentId;
+
+	// Pair of clusters joined in the current iteration.
+	int min1;
+	int min2;
+	distType min1Distance;
+
+	// Per-worker results and scratch space.
+	njCandidate* candidates;
+	njWorkerCounters* workerCounters;
+	distType* partialMaxSeparations;
+	// The largest distance computed from the kernelDistance by each worker, and whether some could not be corrected, see getSaturatedDistance.
+	distType* partialMaxDistances;
+	bool* partialSaturated;
+	distType saturatedDistance;
+	cluster_pair** workerRows;
+	cluster_pair** workerBuffers;
+	distType* newDistances;
+	cluster_pair* newRow;
+	cluster_pair* newRowBuffer;
+	int* runStarts;
+	int* runLengths;
+	int* mergedLengths;
+	int runCount;
+
+	// Relaxed joins: the best pair of the row at each position of activeSlots, the rows ordered by the value of their best pair, the rank of each slot in that order,
+	// and the clusters joined in the current pass. Only allocated with relaxed joins.
+	njCandidate* rowCandidates;
+	vector<pair<pair<distType, unsigned long long>, int> > rowOrder;
+	int* rowRanks;
+	bool* joinedInPass;
+
+	void createMatrix();
+	void createDatastructures(int numThreads);
+	void initialize();
+	void findMin();
+	int joinRelaxed();
+	bool isRelaxedJoin(int rank);
+	void mergeMinNodes();
+	void updateData();
+	void buildNewRow(int workers);
+	void setRow(int slot, cluster_pair* pairs, int length);
+	void setInitialRow(int slot, cluster_pair* pairs, int length);
+	void buildInitialRow(int i, cluster_pair* row, cluster_pair* buffer);
+	static size_t getRowOffset(int rank, int width);
+	void deleteRow(int slot);
+	long long getRowsRebuilt();
+	void widenRows();
+	int getWorkerCount();
+	bool isCancelled();
+
+	static void initializeSumsTask(void* arg, int workerIndex, int workerCount);
+	static void initializeRowsTask(void* arg, int workerIndex, int workerCount);
+	static void replaceSaturatedTask(void* arg, int workerIndex, int workerCount);
+	static void findMinTask(void* arg, int workerIndex, int workerCount);
+	static void findRowMinimaTask(void* arg, int workerIndex, int workerCount);
+	static void updateTask(void* arg, int workerIndex, int workerCount);
+	static void mergeRowTask(void* arg, int workerIndex, int workerCount);
+	static void widenRowsTask(void* arg, int workerIndex, int workerCount);
+	void searchRow(int position, int workerIndex, njCandidate* candidate);
+	void searchFullRow(int slot, int workerIndex, njCandidate* candidate);
+
+	inline distType getDist(int i, int j) {
+		if (i >= j) {
+			return matrix[i][j];
+		}
+		else {
+			return matrix[j][i];
+		}
+	}
+
+	inline void setDist(int i, int j, distType value) {
+		if (i >= j) {
+			matrix[i][j] = value;
+		}
+		else {
+			matrix[j][i] = value;
+		}
+	}
+
+	inline void resetCandidate(njCandidate* candidate) {
+		candidate->value = numeric_limits<distType>::max();
+		candidate->slot1 = -1;
+		candidate->slot2 = -1;
+		candidate->key = ~0ULL;
+	}
+
+	inline void considerPair(njCandidate* candidate, distType value, int slot1, int slot2) {
+		unsigned long long id1 = (unsigned int)slotToId[slot1];
+		unsigned long long id2 = (unsigned int)slotToId[slot2];
+		unsigned long long key = id1 < id2 ? (id1 << 32) | id2 : (id2 << 32) | id1;
+		if (value < candidate->value || (value == candidate->value && key < candidate->key)) {
+			candidate->value = value;
+			candidate->slot1 = slot1;
+			candidate->slot2 = slot2;
+			candidate->key = key;
+		}
+	}
+};
+
+#endif
@@ -2,31 +2,6 @@
 
 using namespace std;
 
-bool distanceMatrixInput = true;
-bool distanceMatrixFromPointer = false;
-int matrixSize = -1;
-int numCores = 1;
-
-namespace options {
-	bool verbose;
-	string fileName;
-	int memSize;
-	int cores;
-	string cacheDir;
-	string percentageMemoryUsage;
-	string distMethod;
-	string inputFormat;
-	string outputFormat;
-	bool fastdist;
-	int replicates;
-	string inputtype;
-	bool rapidNJ;
-	bool simpleNJ;
-	bool gpu;
-	bool negative_branches;
-	string outputFile;
-};
-
 class distMatrixData {
 public:
 	distType** matrix;
@@ -34,44 +9,86 @@ public:
 	diskMatrix* dm;
 };
 
-// Helper functions
-
-void configureNumberOfCores() {
-	// Configure number of cores to use
+/*A full distance matrix that is kept from one tree to the next by a worker of ContextBuildTreesFromAlignments, so that the many small matrices of a batch do not each
+allocate their rows. The rows of a matrix of n sequences are the first n * n elements of a single allocation, which only grows.*/
+class distanceMatrixBuffer {
+public:
+	distanceMatrixBuffer() {
+		data = NULL;
+		capacity = 0;
+	}
 
-	if (options::cores > 0) {
-		numCores = options::cores;
+	~distanceMatrixBuffer() {
+		delete[] data;
 	}
-	if (numCores < 1) {
-		numCores = 1;
+
+	/*The previous matrix is overwritten.*/
+	distType** getMatrix(int size) {
+		size_t elements = (size_t)size * size;
+		if (elements > capacity) {
+			delete[] data;
+			data = new distType[elements];
+			capacity = elements;
+		}
+		rows.resize(size);
+		for (int i = 0; i < size; i++) {
+			rows[i] = data + (size_t)i * size;
+		}
+		return &rows[0];
 	}
-	if (options::verbose) {
-		cerr << "Using " << numCores << " core(s) for distance estimation" << endl;
+
+private:
+	distType* data;
+	size_t capacity;
+	vector<distType*> rows;
+};
+
+// Helper functions
+
+// Called at the start of each call that builds a tree or a distance matrix, so that the statistics only cover the last call.
+void resetStatistics(rapidNJContext* ctx) {
+	if (ctx->statistics != NULL) {
+		ctx->statistics->reset();
 	}
 }
 
-double getMemSize() {
-	return options::memSize * 1024.0 * 1024.0;
+// Returns true once the caller has cancelled the running call, see SetRapidNJContextProgress.
+bool isCallCancelled(rapidNJContext* ctx) {
+	return ctx->progress != NULL && ctx->progress->isCancelled();
+}
+
+// The number of cores that configureNumberOfCores sets.
+int getNumberOfCores(rapidNJContext* ctx) {
+	return ctx->options.cores > 0 ? ctx->options.cores : max(ctx->numCores, 1);
+}
+
+void configureNumberOfCores(rapidNJContext* ctx) {
+	// Configure number of cores to use
+
+	ctx->numCores = getNumberOfCores(ctx);
+	if (ctx->options.verbose) {
+		cerr << "Using " << ctx->numCores << " core(s) for distance estimation" << endl;
+	}
 }
 
-void printDistanceMatrix(ostream& out, distMatrixData* data) {
-	out << "\t" << matrixSize << endl;
-	for (int i = 0; i < matrixSize; i++) {
+void printDistanceMatrix(rapidNJContext* ctx, ostream& out, distMatrixData* data) {
+	out << "\t" << ctx->matrixSize << endl;
+	for (int i = 0; i < ctx->matrixSize; i++) {
 		out << (*data->sequenceNames)[i] << "\t";
-		for (int j = 0; j < matrixSize; j++) {
+		for (int j = 0; j < ctx->matrixSize; j++) {
 			out << setprecision(6) << fixed << data->matrix[i][j] << " ";
 		}
 		out << endl;
 	}
 }
 
-void printDistanceMatrixDisk(ostream& out, distMatrixData* data) {
-	out << "\t" << matrixSize << endl;
-	distType* row = new distType[matrixSize];
-	for (int i = 0; i < matrixSize; i++) {
+void printDistanceMatrixDisk(rapidNJContext* ctx, ostream& out, distMatrixData* data) {
+	out << "\t" << ctx->matrixSize << endl;
+	distType* row = new distType[ctx->matrixSize];
+	for (int i = 0; i < ctx->matrixSize; i++) {
 		out << (*data->sequenceNames)[i] << "\t";
-		for (int j = 0; j < matrixSize; j++) {
-			data->dm->readArray(row, i, matrixSize);
+		for (int j = 0; j < ctx->matrixSize; j++) {
+			data->dm->readArray(row, i, ctx->matrixSize);
 			out << setprecision(6) << fixed << row[j] << " ";
 		}
 		out << endl;
@@ -79,108 +96,282 @@ void printDistanceMatrixDisk(ostream& out, distMatrixData* data) {
 	delete[] row;
 }
 
-distMatrixData* computeDistanceMatrix(bool useDiskMatrix, ostream& out, bool printMatrix, dataloader* dl) {
-	/*if(options::gpu){
-	computeDistanceMatrixGPU();
-	return;
-	}*/
+// The wrapper's own vectorised kernels are used for in-memory fastdist matrices; everything else goes through the library estimators.
+bool useDistanceKernels(rapidNJContext* ctx, dataloader* dl, diskMatrix* dm) {
+	return dm == NULL && ctx->options.fastdist && ctx->options.distanceKernel != KERNEL_LIBRARY && kernelDistance::isSupported(dl);
+}
+
+// Column weights can only be used when all the distances of the replicates are computed by the distance kernels.
+bool useColumnWeights(rapidNJContext* ctx, dataloader* dl) {
+	return ctx->options.bootstrapMode == BOOTSTRAP_COLUMN_WEIGHTS && useDistanceKernels(ctx, dl, NULL);
+}
+
+// Describes the input of a tree for the memory model. dl is NULL for distance matrices.
+treeInputDescription describeTreeInput(rapidNJContext* ctx, dataloader* dl, bool halfMatrix) {
+	treeInputDescription input;
+	input.sequenceCount = ctx->matrixSize;
+	input.alignmentMemory = 0;
+	input.fastdist = false;
+	input.distanceKernels = false;
+	input.halfMatrix = halfMatrix;
+	input.columnWeightsMemory = 0;
+	if (dl != NULL && !ctx->distanceMatrixInput && !ctx->distanceMatrixFromPointer) {
+		double sequenceCount = dl->getSequenceCount();
+		input.sequenceCount = dl->getSequenceCount();
+		input.fastdist = dl->fastdist;
+		input.distanceKernels = useDistanceKernels(ctx, dl, NULL);
+		if (dl->fastdist) {
+			// Each bit string is made of 128-bit blocks, and DNA sequences also have a gap filter.
+			input.alignmentMemory = sequenceCount * dl->getBitStringsCount() * 4 * sizeof(unsigned int) * (dl->type == DNA ? 2 : 1);
+		}
+		else {
+			input.alignmentMemory = sequenceCount * dl->getSequenceLength();
+		}
+		input.alignmentMemory += sequenceCount * sizeof(string);
+		if (useColumnWeights(ctx, dl)) {
+			// The weight planes of packed protein sequences have one bit per column.
+			double planeBlocks = hasPackedProteins(dl) ? dl->getBitStringsCount() / PACKED_PROTEIN_PLANES : dl->getBitStringsCount();
+			input.columnWeightsMemory = (double)TYPICAL_COLUMN_WEIGHT_PLANES * planeBlocks * 4 * sizeof(unsigned int);
+		}
+	}
+	return input;
+}
+
+distType** computeKernelDistanceMatrix(rapidNJContext* ctx, bool verbose, dataloader* dl, distType** distMatrix, int cores) {
+	distanceKernels kernels = getDistanceKernels((distanceKernelType)ctx->options.distanceKernel);
+	bool jukesCantor = ctx->options.distMethod == "jc";
+
+	// The GPU fills the same full matrix as the kernels, which compute it instead if there is no device or it fails.
+	if (ctx->options.gpu && isGPUDistanceAvailable()) {
+		if (distMatrix == NULL) {
+			unsigned int seqCount = dl->getSequenceCount();
+			distMatrix = new distType*[seqCount];
+			for (unsigned int i = 0; i < seqCount; i++) {
+				distMatrix[i] = new distType[seqCount];
+			}
+		}
+		if (computeGPUDistanceMatrix(dl, jukesCantor, distMatrix, verbose)) {
+			return distMatrix;
+		}
+		if (verbose) {
+			cerr << "The distances could not be computed on the GPU, using the CPU instead" << endl;
+		}
+	}
+
+	kernelDistance* alg;
+	if (distMatrix == NULL) {
+		alg = new kernelDistance(verbose, jukesCantor, dl, kernels);
+	}
+	else {
+		alg = new kernelDistance(verbose, jukesCantor, dl, kernels, distMatrix);
+	}
+	alg->setProgress(ctx->progress);
+	alg->computeDistanceMatrix(cores);
+	distType** retVal = alg->getDistanceMatrix();
+	delete alg;
+	return retVal;
+}
+
+// The kernels can compute the lower triangle on their own; the GPU and the library estimators only fill full matrices.
+static bool useHalfMatrixKernels(rapidNJContext* ctx, dataloader* dl) {
+	return useDistanceKernels(ctx, dl, NULL) && !(ctx->options.gpu && isGPUDistanceAvailable());
+}
+
+static kernelDistance* createKernelDistance(rapidNJContext* ctx, dataloader* dl, distType** distMatrix) {
+	distanceKernels kernels = getDistanceKernels((distanceKernelType)ctx->options.distanceKernel);
+	kernelDistance* alg = new kernelDistance(ctx->options.verbose, ctx->options.distMethod == "jc", dl, kernels, distMatrix);
+	alg->setProgress(ctx->progress);
+	return alg;
+}
+
+static void deleteFullMatrix(distType** matrix, unsigned int seqCount) {
+	for (unsigned int i = 0; i < seqCount; i++) {
+		delete[] matrix[i];
+	}
+	delete[] matrix;
+}
+
+// The distance matrices of alignments are cached, but not those of bootstrap replicates, whose column weights are not part of the key, nor those that do not fit.
+static bool useDistanceCache(dataloader* dl) {
+	return dl->fastdist && dynamic_cast<dataloaderBootstrap*>(dl) == NULL && fitsDistanceCache(dl->getSequenceCount());
+}
+
+static distanceCacheKey getDistanceCacheKey(rapidNJContext* ctx, dataloader* dl) {
+	return getDistanceCacheKey(dl, ctx->options.distMethod == "jc", !useDistanceKernels(ctx, dl, NULL));
+}
+
+// Returns the cached matrix as a full matrix, in distMatrix if it is not NULL, or NULL if it is not in the cache. The matrix is only allocated once it is found.
+static distType** readCachedFullMatrix(const distanceCacheKey& key, distType** distMatrix) {
+	shared_ptr<const vector<distType> > lowerTriangle = findDistanceCache(key);
+	if (!lowerTriangle) {
+		return NULL;
+	}
+
+	distType** matrix = distMatrix;
+	if (matrix == NULL) {
+		matrix = new distType*[key.sequenceCount];
+		for (unsigned int i = 0; i < key.sequenceCount; i++) {
+			matrix[i] = new distType[key.sequenceCount];
+		}
+	}
+	const distType* data = &(*lowerTriangle)[0];
+	for (unsigned int i = 0; i < key.sequenceCount; i++) {
+		memcpy(matrix[i], data + (size_t)i * (i + 1) / 2, (i + 1) * sizeof(distType));
+		for (unsigned int j = 0; j < i; j++) {
+			matrix[j][i] = matrix[i][j];
+		}
+	}
+	return matrix;
+}
 
-	if (options::fastdist && options::verbose) {
+distMatrixData* computeDistanceMatrix(rapidNJContext* ctx, bool useDiskMatrix, ostream& out, bool printMatrix, dataloader* dl) {
+	if (ctx->options.fastdist && ctx->options.verbose) {
 		cerr << "Fastdist is enabled" << endl;
 	}
 
+	phaseTimer timer(ctx->statistics, &rapidNJStatistics::distanceEstimation);
 	distMatrixData* retVal = new distMatrixData();
 	if (useDiskMatrix) {
-		retVal->dm = new diskMatrix(options::cacheDir, matrixSize);
+		retVal->dm = new diskMatrix(ctx->options.cacheDir, ctx->matrixSize);
 	}
 
 	retVal->sequenceNames = dl->getSequenceNames();
-	matrixSize = dl->getSequenceCount();
+	ctx->matrixSize = dl->getSequenceCount();
+	bool cacheable = !useDiskMatrix && useDistanceCache(dl);
+	distanceCacheKey cacheKey;
+	if (cacheable) {
+		cacheKey = getDistanceCacheKey(ctx, dl);
+		retVal->matrix = readCachedFullMatrix(cacheKey, NULL);
+	}
 	// process data
-	if (options::distMethod == "jc") {
-		if (options::verbose) {
+	if (cacheable && retVal->matrix != NULL) {
+		if (ctx->options.verbose) {
+			cerr << "Using the cached distance matrix" << endl;
+		}
+		cacheable = false;
+	}
+	else if (ctx->options.distMethod == "jc") {
+		if (ctx->options.verbose) {
 			cerr << "Using JC algorithm to calculate distances" << endl;
 		}
-		JCdistance* alg = new JCdistance(options::verbose, options::fastdist, dl, retVal->dm);
-		alg->computeDistanceMatrix(numCores);
-		retVal->matrix = alg->getDistanceMatrix();
-		delete alg;
+		if (useDistanceKernels(ctx, dl, retVal->dm)) {
+			retVal->matrix = computeKernelDistanceMatrix(ctx, ctx->options.verbose, dl, NULL, ctx->numCores);
+		}
+		else {
+			JCdistance* alg = new JCdistance(ctx->options.verbose, ctx->options.fastdist, dl, retVal->dm);
+			alg->computeDistanceMatrix(ctx->numCores);
+			retVal->matrix = alg->getDistanceMatrix();
+			delete alg;
+		}
 	}
-	else if (options::distMethod == "kim" || options::distMethod == "") {
-		if (options::verbose) {
+	else if (ctx->options.distMethod == "kim" || ctx->options.distMethod == "") {
+		if (ctx->options.verbose) {
 			cerr << "Using Kimura algorithm to calculate distances" << endl;
 		}
-		KimuraDistance* alg = new KimuraDistance(options::verbose, options::fastdist, dl, retVal->dm);
-		alg->computeDistances(numCores);
-		retVal->matrix = alg->getDistanceMatrix();
-		delete alg;
+		if (useDistanceKernels(ctx, dl, retVal->dm)) {
+			retVal->matrix = computeKernelDistanceMatrix(ctx, ctx->options.verbose, dl, NULL, ctx->numCores);
+		}
+		else {
+			KimuraDistance* alg = new KimuraDistance(ctx->options.verbose, ctx->options.fastdist, dl, retVal->dm);
+			alg->computeDistances(ctx->numCores);
+			retVal->matrix = alg->getDistanceMatrix();
+			delete alg;
+		}
 	}
 	else {
 		cerr << "ERROR: Unknown sequence evolution model" << endl;
 		exit(1);
 	}
 
+	// The distance kernels leave the matrix unfinished when the call is cancelled.
+	if (cacheable && !isCallCancelled(ctx)) {
+		writeDistanceCache(cacheKey, retVal->matrix);
+	}
+
 	if (printMatrix) {
 		//Print the matrix
 		if (retVal->dm == NULL) {
-			printDistanceMatrix(out, retVal);
+			printDistanceMatrix(ctx, out, retVal);
 		}
 		else {
-			printDistanceMatrixDisk(out, retVal);
+			printDistanceMatrixDisk(ctx, out, retVal);
 			delete retVal->dm;
 		}
 	}
 	return retVal;
 }
 
-distMatrixData* computeDistanceMatrix(bool useDiskMatrix, ostream& out, bool printMatrix, dataloader* dl, distType** distMatrix) {
-	/*if(options::gpu){
-	computeDistanceMatrixGPU();
-	return;
-	}*/
-
-	if (options::fastdist && options::verbose) {
+distMatrixData* computeDistanceMatrix(rapidNJContext* ctx, bool useDiskMatrix, ostream& out, bool printMatrix, dataloader* dl, distType** distMatrix) {
+	if (ctx->options.fastdist && ctx->options.verbose) {
 		cerr << "Fastdist is enabled" << endl;
 	}
 
+	phaseTimer timer(ctx->statistics, &rapidNJStatistics::distanceEstimation);
 	distMatrixData* retVal = new distMatrixData();
 	if (useDiskMatrix) {
-		retVal->dm = new diskMatrix(options::cacheDir, matrixSize);
+		retVal->dm = new diskMatrix(ctx->options.cacheDir, ctx->matrixSize);
 	}
 
 	retVal->sequenceNames = dl->getSequenceNames();
-	matrixSize = dl->getSequenceCount();
+	ctx->matrixSize = dl->getSequenceCount();
+	bool cacheable = !useDiskMatrix && useDistanceCache(dl);
+	distanceCacheKey cacheKey;
+	if (cacheable) {
+		cacheKey = getDistanceCacheKey(ctx, dl);
+		retVal->matrix = readCachedFullMatrix(cacheKey, distMatrix);
+	}
 	// process data
-	if (options::distMethod == "jc") {
-		if (options::verbose) {
+	if (cacheable && retVal->matrix != NULL) {
+		if (ctx->options.verbose) {
+			cerr << "Using the cached distance matrix" << endl;
+		}
+		cacheable = false;
+	}
+	else if (ctx->options.distMethod == "jc") {
+		if (ctx->options.verbose) {
 			cerr << "Using JC algorithm to calculate distances" << endl;
 		}
-		JCdistance* alg = new JCdistance(options::verbose, options::fastdist, dl, retVal->dm, distMatrix);
-		alg->computeDistanceMatrix(numCores);
-		retVal->matrix = alg->getDistanceMatrix();
-		delete alg;
+		if (useDistanceKernels(ctx, dl, retVal->dm)) {
+			retVal->matrix = computeKernelDistanceMatrix(ctx, ctx->options.verbose, dl, distMatrix, ctx->numCores);
+		}
+		else {
+			JCdistance* alg = new JCdistance(ctx->options.verbose, ctx->options.fastdist, dl, retVal->dm, distMatrix);
+			alg->computeDistanceMatrix(ctx->numCores);
+			retVal->matrix = alg->getDistanceMatrix();
+			delete alg;
+		}
 	}
-	else if (options::distMethod == "kim" || options::distMethod == "") {
-		if (options::verbose) {
+	else if (ctx->options.distMethod == "kim" || ctx->options.distMethod == "") {
+		if (ctx->options.verbose) {
 			cerr << "Using Kimura algorithm to calculate distances" << endl;
 		}
-		KimuraDistance* alg = new KimuraDistance(options::verbose, options::fastdist, dl, distMatrix, retVal->dm);
-		alg->computeDistances(numCores);
-		retVal->matrix = alg->getDistanceMatrix();
-		delete alg;
+		if (useDistanceKernels(ctx, dl, retVal->dm)) {
+			retVal->matrix = computeKernelDistanceMatrix(ctx, ctx->options.verbose, dl, distMatrix, ctx->numCores);
+		}
+		else {
+			KimuraDistance* alg = new KimuraDistance(ctx->options.verbose, ctx->options.fastdist, dl, distMatrix, retVal->dm);
+			alg->computeDistances(ctx->numCores);
+			retVal->matrix = alg->getDistanceMatrix();
+			delete alg;
+		}
 	}
 	else {
 		cerr << "ERROR: Unknown sequence evolution model" << endl;
 		exit(1);
 	}
 
+	// The distance kernels leave the matrix unfinished when the call is cancelled.
+	if (cacheable && !isCallCancelled(ctx)) {
+		writeDistanceCache(cacheKey, retVal->matrix);
+	}
+
 	if (printMatrix) {
 		//Print the matrix
 		if (retVal->dm == NULL) {
-			printDistanceMatrix(out, retVal);
+			printDistanceMatrix(ctx, out, retVal);
 		}
 		else {
-			printDistanceMatrixDisk(out, retVal);
+			printDistanceMatrixDisk(ctx, out, retVal);
 			delete retVal->dm;
 		}
 	}
@@ -188,39 +379,148 @@ distMatrixData* computeDistanceMatrix(bool useDiskMatrix, ostream& out, bool pri
 }
 
 
-distMatrixReader* getDistanceMatrixData(ostream& out, bool halfMatrix, dataloader* dl, vector<string>* sequenceNames, distType** distanceMatrix) {
+distMatrixReader* getDistanceMatrixData(rapidNJContext* ctx, ostream& out, bool halfMatrix, dataloader* dl, vector<string>* sequenceNames, distType** distanceMatrix) {
 	distMatrixReader* reader;
-	if (distanceMatrixInput) {
-		reader = new distMatrixReader(options::verbose, options::fileName, matrixSize, halfMatrix);
-		if (options::verbose) {
+	if (ctx->distanceMatrixInput) {
+		reader = new distMatrixReader(ctx->options.verbose, ctx->options.fileName, ctx->matrixSize, halfMatrix);
+		if (ctx->options.verbose) {
 			cerr << "Reading distance matrix... \n";
 		}
 		reader->read_data(NULL);
 	}
 	else {
-		if (!distanceMatrixFromPointer)
+		if (!ctx->distanceMatrixFromPointer)
 		{
-			if (options::verbose) {
+			if (ctx->options.verbose) {
 				cerr << "Computing distance matrix... \n";
 			}
-			distMatrixData* matrixData = computeDistanceMatrix(false, out, false, dl);
-			reader = new distMatrixReader(options::verbose, matrixSize, halfMatrix, matrixData->sequenceNames, matrixData->matrix);
+			distMatrixData* matrixData = computeDistanceMatrix(ctx, false, out, false, dl);
+			phaseTimer timer(ctx->statistics, &rapidNJStatistics::matrixInitialization);
+			reader = new distMatrixReader(ctx->options.verbose, ctx->matrixSize, halfMatrix, matrixData->sequenceNames, matrixData->matrix);
 			reader->initializeData();
 			delete matrixData;
 		}
 		else
 		{
-			reader = new distMatrixReader(options::verbose, matrixSize, halfMatrix, sequenceNames, distanceMatrix);
+			reader = new distMatrixReader(ctx->options.verbose, ctx->matrixSize, halfMatrix, sequenceNames, distanceMatrix);
 		}
 	}
 	return reader;
 }
 
-polytree* runRapidNJ(int matrixSize, distMatrixReader* reader, ProgressBar* pb, bool deleteAfterwards) {
-	if (options::verbose) {
-		cerr << "Computing phylogetic tree... \n";
+bool useParallelNJ(rapidNJContext* ctx) {
+	return planUsesParallelNJ(ctx, ctx->matrixSize);
+}
+
+polytree* runParallelNJ(rapidNJContext* ctx, int sortedMatrixSize, distMatrixReader* reader, ProgressBar* pb, bool deleteAfterwards) {
+	if (ctx->options.verbose) {
+		cerr << "Computing phylogenetic tree using " << ctx->numCores << " core(s)... \n";
+	}
+	rapidNJParallel<distType>* nj = new rapidNJParallel<distType>(reader, ctx->matrixSize, sortedMatrixSize, ctx->options.negative_branches, pb, ctx->numCores);
+	nj->setOwnsMatrix(deleteAfterwards);
+	nj->setStatistics(ctx->statistics);
+	nj->setRelaxed(planUsesRelaxedNJ(ctx));
+	nj->setProgress(ctx->progress);
+	polytree* tree = nj->run();
+	delete nj;
+	return tree;
+}
+
+// Alignments that can be processed by the distance kernels are passed to the parallel engine directly, which sorts each row as soon as its distances are computed.
+bool useFusedParallelNJ(rapidNJContext* ctx, dataloader* dl) {
+	return planUsesFusedParallelNJ(ctx, describeTreeInput(ctx, dl, false));
+}
+
+template <class storageType>
+polytree* runFusedParallelNJEngine(rapidNJContext* ctx, int sortedMatrixSize, kernelDistance* alg, dataloader* dl, ProgressBar* pb, int cores, mappedMatrix* storage) {
+	rapidNJParallel<storageType>* nj = new rapidNJParallel<storageType>(alg, dl->getSequenceNames(), dl->getSequenceCount(), sortedMatrixSize, ctx->options.negative_branches, pb, cores, storage);
+	nj->setStatistics(ctx->statistics);
+	nj->setRelaxed(planUsesRelaxedNJ(ctx));
+	nj->setProgress(ctx->progress);
+	polytree* tree = nj->run();
+	delete nj;
+	return tree;
+}
+
+polytree* runFusedParallelNJ(rapidNJContext* ctx, int sortedMatrixSize, dataloader* dl, ProgressBar* pb, int cores, bool verbose, mappedMatrix* storage = NULL) {
+	distanceKernels kernels = getDistanceKernels((distanceKernelType)ctx->options.distanceKernel);
+	if (verbose) {
+		cerr << "Computing distances and phylogenetic tree using " << kernels.name << " distance kernels and " << cores << " core(s)... \n";
+	}
+	// The engine stores the distances in its own half matrix.
+	kernelDistance* alg = new kernelDistance(false, ctx->options.distMethod == "jc", dl, kernels, NULL);
+	polytree* tree;
+	switch (ctx->options.distanceStorage) {
+		case DISTANCE_STORAGE_HALF:
+			tree = runFusedParallelNJEngine<halfDistance>(ctx, sortedMatrixSize, alg, dl, pb, cores, storage);
+			break;
+		case DISTANCE_STORAGE_BFLOAT16:
+			tree = runFusedParallelNJEngine<bfloat16Distance>(ctx, sortedMatrixSize, alg, dl, pb, cores, storage);
+			break;
+		default:
+			tree = runFusedParallelNJEngine<distType>(ctx, sortedMatrixSize, alg, dl, pb, cores, storage);
+			break;
+	}
+	delete alg;
+	return tree;
+}
+
+// Matrices that do not fit in memory can be kept in a memory-mapped file by the parallel engine, instead of going through the stream based diskMatrix of RapidDiskNJ.
+// Returns NULL if the file could not be mapped.
+polytree* runMappedParallelNJ(rapidNJContext* ctx, int sortedMatrixSize, dataloader* dl, ProgressBar* pb) {
+	mappedMatrix* storage = new mappedMatrix(ctx->options.cacheDir, dl->getSequenceCount(), getDistanceStorageSize((distanceStorageType)ctx->options.distanceStorage));
+	if (!storage->isValid()) {
+		if (ctx->options.verbose) {
+			cerr << "Could not map the distance matrix to a file, falling back to RapidDiskNJ" << endl;
+		}
+		delete storage;
+		return NULL;
+	}
+	polytree* tree = runFusedParallelNJ(ctx, sortedMatrixSize, dl, pb, ctx->numCores, ctx->options.verbose, storage);
+	delete storage;
+	return tree;
+}
+
+// The parallel engine leaves the matrix of the reader to its owner, so the distances of the trees of a batch worker can be computed in the buffer of its context.
+// The library engines free the matrices they are given, thus they always use their own.
+bool useMatrixBuffer(rapidNJContext* ctx, rapidNJPlan plan, dataloader* dl) {
+	return ctx->matrixBuffer != NULL && dl != NULL && plan.njEngine != NJ_ENGINE_LIBRARY && !ctx->distanceMatrixInput && !ctx->distanceMatrixFromPointer;
+}
+
+polytree* runBufferedParallelNJ(rapidNJContext* ctx, int sortedMatrixSize, ostream& out, dataloader* dl, ProgressBar* pb) {
+	distType** matrix = ctx->matrixBuffer->getMatrix(dl->getSequenceCount());
+	distMatrixData* matrixData = computeDistanceMatrix(ctx, false, out, false, dl, matrix);
+	distMatrixReader* reader;
+	{
+		phaseTimer timer(ctx->statistics, &rapidNJStatistics::matrixInitialization);
+		reader = new distMatrixReader(false, ctx->matrixSize, false, matrixData->sequenceNames, matrixData->matrix);
+		reader->initializeData();
+	}
+	delete matrixData;
+	return runParallelNJ(ctx, sortedMatrixSize, reader, pb, false);
+}
+
+// The library engines cannot be interrupted, so cancelled calls stop before they start. Frees the matrix as the engine would have, and returns NULL like the
+// engines of the wrapper do when they are cancelled.
+polytree* skipLibraryEngine(distMatrixReader* reader, int matrixSize, bool deleteMatrix) {
+	if (deleteMatrix) {
+		deleteFullMatrix(reader->getMatrix(), matrixSize);
+	}
+	return NULL;
+}
+
+polytree* runRapidNJ(rapidNJContext* ctx, distMatrixReader* reader, ProgressBar* pb, bool deleteAfterwards) {
+	if (useParallelNJ(ctx)) {
+		return runParallelNJ(ctx, ctx->matrixSize, reader, pb, deleteAfterwards);
 	}
-	rapidNJ* sorted = new rapidNJ(reader, matrixSize, options::negative_branches, pb);
+	if (isCallCancelled(ctx)) {
+		return skipLibraryEngine(reader, ctx->matrixSize, deleteAfterwards);
+	}
+	if (ctx->options.verbose) {
+		cerr << "Computing phylogenetic tree... \n";
+	}
+	phaseTimer timer(ctx->statistics, &rapidNJStatistics::njIterations);
+	rapidNJ* sorted = new rapidNJ(reader, ctx->matrixSize, ctx->options.negative_branches, pb);
 	polytree* tree = sorted->run();
 
 	//TODO delete rd
@@ -233,18 +533,29 @@ polytree* runRapidNJ(int matrixSize, distMatrixReader* reader, ProgressBar* pb,
 	return tree;
 }
 
-polytree* runSimpleNJ(distMatrixReader* reader, ProgressBar* pb) {
-	simpleNJ* njs = new simpleNJ(reader, matrixSize, options::negative_branches, pb);
+polytree* runSimpleNJ(rapidNJContext* ctx, distMatrixReader* reader, ProgressBar* pb) {
+	if (isCallCancelled(ctx)) {
+		return skipLibraryEngine(reader, ctx->matrixSize, !ctx->distanceMatrixFromPointer);
+	}
+	phaseTimer timer(ctx->statistics, &rapidNJStatistics::njIterations);
+	simpleNJ* njs = new simpleNJ(reader, ctx->matrixSize, ctx->options.negative_branches, pb);
 	polytree* tree = njs->run();
 	delete njs;
 	return tree;
 }
 
-polytree* runRapidMNJ(int sortedMatrixSize, distMatrixReader* reader, ProgressBar* pb, bool deleteAfterwards) {
-	if (options::verbose) {
-		cerr << "Computing phylogetic tree... \n";
+polytree* runRapidMNJ(rapidNJContext* ctx, int sortedMatrixSize, distMatrixReader* reader, ProgressBar* pb, bool deleteAfterwards) {
+	if (useParallelNJ(ctx)) {
+		return runParallelNJ(ctx, sortedMatrixSize, reader, pb, deleteAfterwards);
+	}
+	if (isCallCancelled(ctx)) {
+		return skipLibraryEngine(reader, ctx->matrixSize, deleteAfterwards);
 	}
-	rapidNJMem* nj = new rapidNJMem(reader, matrixSize, sortedMatrixSize, options::verbose, options::negative_branches, pb);
+	if (ctx->options.verbose) {
+		cerr << "Computing phylogenetic tree... \n";
+	}
+	phaseTimer timer(ctx->statistics, &rapidNJStatistics::njIterations);
+	rapidNJMem* nj = new rapidNJMem(reader, ctx->matrixSize, sortedMatrixSize, ctx->options.verbose, ctx->options.negative_branches, pb);
 	polytree* tree = nj->run();
 
 	if (deleteAfterwards)
@@ -255,292 +566,1116 @@ polytree* runRapidMNJ(int sortedMatrixSize, distMatrixReader* reader, ProgressBa
 	return tree;
 }
 
-polytree* runDiskNJ(ostream& out, int datastructureSize, dataloader* dl, ProgressBar* pb) {
-	if (options::verbose) {
+polytree* runDiskNJ(rapidNJContext* ctx, ostream& out, int datastructureSize, dataloader* dl, ProgressBar* pb) {
+	if (ctx->options.verbose) {
 		cerr << "Reading data... \n";
 	}
 	rdDataInitialiser* reader;
 
-	if (distanceMatrixInput) {
-		reader = new rdDataInitialiser(options::verbose, datastructureSize, options::cacheDir, options::fileName);
+	if (ctx->distanceMatrixInput) {
+		phaseTimer timer(ctx->statistics, &rapidNJStatistics::matrixInitialization);
+		reader = new rdDataInitialiser(ctx->options.verbose, datastructureSize, ctx->options.cacheDir, ctx->options.fileName);
 		bool status = reader->read_data();
 		if (!status) {
-			cerr << "Could not read distance matrix in file " << options::fileName << endl;
+			cerr << "Could not read distance matrix in file " << ctx->options.fileName << endl;
 			exit(1);
 		}
 	}
 	else {
-		distMatrixData* matrixData = computeDistanceMatrix(true, out, false, dl);
-		reader = new rdDataInitialiser(options::verbose, datastructureSize, options::cacheDir, matrixSize);
+		// Packed protein sequences are never used with RapidDiskNJ, see usePackedProteins.
+		if (hasPackedProteins(dl)) {
+			cerr << "ERROR: RapidDiskNJ cannot read packed protein sequences" << endl;
+			exit(1);
+		}
+		// The library's estimators write the diskMatrix straight from the bit strings, without the column weights of the distance kernels.
+		dataloaderBootstrap* replicate = dynamic_cast<dataloaderBootstrap*>(dl);
+		if (replicate != NULL) {
+			replicate->resampleColumns();
+		}
+		distMatrixData* matrixData = computeDistanceMatrix(ctx, true, out, false, dl);
+		phaseTimer timer(ctx->statistics, &rapidNJStatistics::matrixInitialization);
+		reader = new rdDataInitialiser(ctx->options.verbose, datastructureSize, ctx->options.cacheDir, ctx->matrixSize);
 		reader->initializeFromExistingMatrix(matrixData->sequenceNames, matrixData->dm);
 		delete matrixData;
 	}
 
-	if (options::verbose) {
-		cerr << "Computing phylogetic tree... \n";
+	if (isCallCancelled(ctx)) {
+		delete reader;
+		return NULL;
+	}
+
+	if (ctx->options.verbose) {
+		cerr << "Computing phylogenetic tree... \n";
+	}
+	polytree* tree;
+	{
+		phaseTimer timer(ctx->statistics, &rapidNJStatistics::njIterations);
+		rapidNJDisk* rd = new rapidNJDisk(reader, ctx->options.verbose, ctx->options.negative_branches, pb);
+		tree = rd->run();
+		delete rd;
 	}
-	rapidNJDisk* rd = new rapidNJDisk(reader, options::verbose, options::negative_branches, pb);
-	polytree* tree = rd->run();
-	delete rd;
 	delete reader;
 	return tree;
 }
 
-polytree* computeTree(ostream& out, dataloader* dl, ProgressBar* pb, vector<string>* sequenceNames, distType** distanceMatrix, bool halfMatrix) {
-	// Compute the memory requirements for the three different algorithms.
-	bool autoDecide = true;
-	double matrixSized = (double)matrixSize;
-	double systemMemory = getMemSize();
-	double matrixMemUsage = ((double)sizeof(distType)) * matrixSized * matrixSized;
-	double sortedMatrixMemUsage = matrixSized * matrixSized * ((double)sizeof(cluster_pair));
-	int sortedMatrixSize = (int)((systemMemory - (matrixMemUsage / 2.0)) / (matrixSized * sizeof(cluster_pair)));
-	sortedMatrixSize = min(sortedMatrixSize, matrixSize);
-	int diskSortedMatrixSize = (int)(systemMemory / (distType)(matrixSize * (sizeof(cluster_pair) + sizeof(distType))));
-	diskSortedMatrixSize = min(diskSortedMatrixSize, matrixSize);
-	diskSortedMatrixSize = max(diskSortedMatrixSize, min(5, matrixSize));
-	polytree* tree;
+template <class storageType>
+polytree* runCachedParallelNJEngine(rapidNJContext* ctx, int sortedMatrixSize, const distType* lowerTriangle, dataloader* dl, ProgressBar* pb) {
+	rapidNJParallel<storageType>* nj = new rapidNJParallel<storageType>(lowerTriangle, dl->getSequenceNames(), dl->getSequenceCount(), sortedMatrixSize, ctx->options.negative_branches, pb, ctx->numCores);
+	nj->setStatistics(ctx->statistics);
+	nj->setRelaxed(planUsesRelaxedNJ(ctx));
+	nj->setProgress(ctx->progress);
+	polytree* tree = nj->run();
+	delete nj;
+	return tree;
+}
+
+// The other engines get their distances from computeDistanceMatrix, which caches them, but the fused engine computes them itself. A cached matrix is copied into
+// the matrix of the engine, in the storage it was planned with. A matrix that is not cached yet is computed as a half matrix by the distance kernels, cached, and
+// used in place by the engine if it stores distType; engines that store narrower distances compute them themselves and never cache them, as they never hold them
+// at full precision. Returns false, without building the tree, if the cache is not used.
+bool runCachedFusedParallelNJ(rapidNJContext* ctx, int sortedMatrixSize, dataloader* dl, ProgressBar* pb, polytree** tree) {
+	if (!useDistanceCache(dl)) {
+		return false;
+	}
+
+	distanceCacheKey key = getDistanceCacheKey(ctx, dl);
+	shared_ptr<const vector<distType> > lowerTriangle = findDistanceCache(key);
+	if (lowerTriangle) {
+		if (ctx->options.verbose) {
+			cerr << "Computing phylogenetic tree from the cached distance matrix using " << ctx->numCores << " core(s)... \n";
+		}
+		switch (ctx->options.distanceStorage) {
+			case DISTANCE_STORAGE_HALF:
+				*tree = runCachedParallelNJEngine<halfDistance>(ctx, sortedMatrixSize, &(*lowerTriangle)[0], dl, pb);
+				break;
+			case DISTANCE_STORAGE_BFLOAT16:
+				*tree = runCachedParallelNJEngine<bfloat16Distance>(ctx, sortedMatrixSize, &(*lowerTriangle)[0], dl, pb);
+				break;
+			default:
+				*tree = runCachedParallelNJEngine<distType>(ctx, sortedMatrixSize, &(*lowerTriangle)[0], dl, pb);
+				break;
+		}
+		return true;
+	}
+	if (ctx->options.distanceStorage != DISTANCE_STORAGE_FLOAT) {
+		return false;
+	}
+
+	// The rows are allocated one by one, as the engine frees them that way.
+	distType** matrix = new distType*[key.sequenceCount];
+	for (unsigned int i = 0; i < key.sequenceCount; i++) {
+		matrix[i] = new distType[i + 1];
+	}
+	{
+		phaseTimer timer(ctx->statistics, &rapidNJStatistics::distanceEstimation);
+		kernelDistance* alg = createKernelDistance(ctx, dl, matrix);
+		alg->setHalfMatrix(true);
+		alg->computeDistanceMatrix(ctx->numCores);
+		delete alg;
+	}
+	if (isCallCancelled(ctx)) {
+		deleteFullMatrix(matrix, key.sequenceCount);
+		*tree = NULL;
+		return true;
+	}
+	writeDistanceCache(key, matrix);
+
+	distMatrixReader* reader = new distMatrixReader(false, ctx->matrixSize, true, dl->getSequenceNames(), matrix);
+	*tree = runParallelNJ(ctx, sortedMatrixSize, reader, pb, true);
+	return true;
+}
 
+// Returns NULL if the call was cancelled.
+polytree* computeTree(rapidNJContext* ctx, ostream& out, dataloader* dl, ProgressBar* pb, vector<string>* sequenceNames, distType** distanceMatrix, bool halfMatrix) {
+	if (isCallCancelled(ctx)) {
+		return NULL;
+	}
 	// select which algorithm to use based on either parameters or memory requirements
-	if (options::rapidNJ || options::cacheDir != "" || options::percentageMemoryUsage != "" || options::simpleNJ) {
-		autoDecide = false;
+	if (ctx->options.percentageMemoryUsage != "") {
+		// try to use the user supplied argument
+		int percentage = atoi(ctx->options.percentageMemoryUsage.data());
+		if (percentage < 0 || percentage > 100) {
+			cerr << "The memory use percentage must be >=0 and <=100 " << endl;
+			exit(1);
+		}
+	}
+	double systemMemory = getMemSize(ctx);
+	rapidNJPlan plan = planTree(ctx, describeTreeInput(ctx, dl, distanceMatrix != NULL && halfMatrix));
+	int sortedMatrixSize = plan.sortedMatrixSize;
+	polytree* tree;
+
+	if (planExceedsLibraryLimits(plan, ctx->matrixSize)) {
+		cerr << "ERROR: the distance matrix is too large for RapidDiskNJ. Matrices of more than " << LIBRARY_MAX_SEQUENCE_COUNT << " sequences that do not fit in memory can only be built from alignments processed by the distance kernels." << endl;
+		exit(1);
 	}
-	if (options::verbose) {
-		cerr << "Matrix size: " << matrixSize << endl;
+
+	if (ctx->options.verbose) {
+		cerr << "Matrix size: " << ctx->matrixSize << endl;
 		cerr << (systemMemory / 1024 / 1024 / 0.8) << " MB of memory is available" << endl;
+		cerr << "Using " << (plan.distanceMatrixMemory / 1024 / 1024) << " MB for distance matrix" << endl;
+		cerr << "Using " << (plan.sortedMatrixMemory / 1024 / 1024) << " MB for sortedMatrix" << endl;
+		cerr << "Total memory consumption is " << (plan.peakMemory / 1024 / 1024) << " MB" << endl;
 	}
 
-	if (options::rapidNJ || (autoDecide && sortedMatrixMemUsage + matrixMemUsage <= systemMemory)) {
-		if (options::verbose) {
+	if (plan.algorithm == TREE_ALGORITHM_RAPIDNJ) {
+		if (ctx->options.verbose) {
 			cerr << "Using RapidNJ \n";
-			cerr << "Using " << (matrixMemUsage / 1024 / 1024) << " MB for distance matrix" << endl;
-			cerr << "Using " << (sortedMatrixMemUsage / 1024 / 1024) << " MB for sortedMatrix" << endl;
-			cerr << "Total memory consumption is " << (matrixMemUsage + sortedMatrixMemUsage) / 1024 / 1024 << " MB" << endl;
 		}
-		if (sortedMatrixMemUsage > systemMemory - matrixMemUsage) {
+		if (plan.peakMemory > systemMemory) {
 			cerr << "WARNING: There's not enough memory to use RapidNJ. Consider using another algorithm." << endl;
 		}
-		distMatrixReader* reader = getDistanceMatrixData(out, (distanceMatrix != NULL && halfMatrix), dl, sequenceNames, distanceMatrix);
-
-		if (distanceMatrix != NULL && halfMatrix)
-		{
-			tree = runRapidMNJ(matrixSize, reader, pb, !distanceMatrixFromPointer);
+		if (useMatrixBuffer(ctx, plan, dl)) {
+			tree = runBufferedParallelNJ(ctx, ctx->matrixSize, out, dl, pb);
 		}
-		else
-		{
-			tree = runRapidNJ(matrixSize, reader, pb, !distanceMatrixFromPointer);
+		else if (plan.fusedDistances) {
+			if (!runCachedFusedParallelNJ(ctx, ctx->matrixSize, dl, pb, &tree)) {
+				tree = runFusedParallelNJ(ctx, ctx->matrixSize, dl, pb, ctx->numCores, ctx->options.verbose);
+			}
+		}
+		else {
+			distMatrixReader* reader = getDistanceMatrixData(ctx, out, (distanceMatrix != NULL && halfMatrix), dl, sequenceNames, distanceMatrix);
+
+			if (distanceMatrix != NULL && halfMatrix)
+			{
+				tree = runRapidMNJ(ctx, ctx->matrixSize, reader, pb, !ctx->distanceMatrixFromPointer);
+			}
+			else
+			{
+				tree = runRapidNJ(ctx, reader, pb, !ctx->distanceMatrixFromPointer);
+			}
 		}
 	}
-	else if (options::percentageMemoryUsage != "" || (autoDecide && sortedMatrixSize >= matrixSize * MIN_SORTED_MATRIX_SIZE)) {
-		if (options::verbose) {
+	else if (plan.algorithm == TREE_ALGORITHM_RAPIDNJ_MEMORY_EFFICIENT) {
+		if (ctx->options.verbose) {
 			cerr << "Using Memory efficient RapidNJ \n";
 		}
-		if (options::percentageMemoryUsage != "") {
-			// try to use the user supplied argument
-			int percentage;
-			percentage = atoi(options::percentageMemoryUsage.data());
-			if (percentage < 0 || percentage > 100) {
-				cerr << "The memory use percentage must be >=0 and <=100 " << endl;
-				exit(1);
-			}
-			int tempSize = (int)(matrixSize * (percentage / 100.0));
-			if (tempSize > sortedMatrixSize) {
-				cerr << "WARNING: Not enough memory for " << percentage << "% of the sorted matrix. Reduce the size of the sorted matrix or use RapidDiskNJ." << endl;
-			}
-			sortedMatrixSize = tempSize;
+		if (ctx->options.percentageMemoryUsage != "" && plan.peakMemory > systemMemory) {
+			cerr << "WARNING: Not enough memory for " << ctx->options.percentageMemoryUsage << "% of the sorted matrix. Reduce the size of the sorted matrix or use RapidDiskNJ." << endl;
 		}
-		if (sortedMatrixSize < matrixSize * MIN_SORTED_MATRIX_SIZE) {
+		if (sortedMatrixSize < (double)ctx->matrixSize * MIN_SORTED_MATRIX_SIZE) {
 			cerr << "WARNING: the amount of available memory is too low for the memory efficient RapidNJ algorithm to run efficiently. Consider using RapidDiskNJ." << endl;
 		}
-		if (sortedMatrixSize < 1) {
-			sortedMatrixSize = 1;
-		}
-		if (options::verbose) {
+		if (ctx->options.verbose) {
 			cerr << "Sorted matrix has " << sortedMatrixSize << " columns" << endl;
 		}
-		distMatrixReader* reader = getDistanceMatrixData(out, true, dl, sequenceNames, distanceMatrix);
-		tree = runRapidMNJ(sortedMatrixSize, reader, pb, !distanceMatrixFromPointer);
+		if (useMatrixBuffer(ctx, plan, dl)) {
+			tree = runBufferedParallelNJ(ctx, sortedMatrixSize, out, dl, pb);
+		}
+		else if (plan.fusedDistances) {
+			if (!runCachedFusedParallelNJ(ctx, sortedMatrixSize, dl, pb, &tree)) {
+				tree = runFusedParallelNJ(ctx, sortedMatrixSize, dl, pb, ctx->numCores, ctx->options.verbose);
+			}
+		}
+		else {
+			distMatrixReader* reader = getDistanceMatrixData(ctx, out, true, dl, sequenceNames, distanceMatrix);
+			tree = runRapidMNJ(ctx, sortedMatrixSize, reader, pb, !ctx->distanceMatrixFromPointer);
+		}
 	}
-	else if (options::simpleNJ) {
-		if (options::verbose) {
+	else if (plan.algorithm == TREE_ALGORITHM_SIMPLE_NJ) {
+		if (ctx->options.verbose) {
 			cerr << "Using naive NJ \n";
 		}
-		distMatrixReader* reader = getDistanceMatrixData(out, (distanceMatrix != NULL && halfMatrix), dl, sequenceNames, distanceMatrix);
-		tree = runSimpleNJ(reader, pb);
+		distMatrixReader* reader = getDistanceMatrixData(ctx, out, (distanceMatrix != NULL && halfMatrix), dl, sequenceNames, distanceMatrix);
+		tree = runSimpleNJ(ctx, reader, pb);
 	}
 	else {
-		if (options::verbose) {
+		if (ctx->options.verbose) {
 			cerr << "Using RapidDiskNJ algorithm\n";
-			cerr << "Sorted matrix has " << diskSortedMatrixSize << " columns" << endl;
+			cerr << "Sorted matrix has " << sortedMatrixSize << " columns" << endl;
+		}
+		tree = NULL;
+		if (plan.mappedMatrix) {
+			if (ctx->options.verbose) {
+				cerr << "Using a memory-mapped distance matrix" << endl;
+			}
+			tree = runMappedParallelNJ(ctx, sortedMatrixSize, dl, pb);
+		}
+		if (tree == NULL && !isCallCancelled(ctx)) {
+			if (ctx->matrixSize > LIBRARY_MAX_SEQUENCE_COUNT) {
+				cerr << "ERROR: the distance matrix could not be mapped to a file and is too large for RapidDiskNJ." << endl;
+				exit(1);
+			}
+			tree = runDiskNJ(ctx, out, sortedMatrixSize, dl, pb);
 		}
-		tree = runDiskNJ(out, diskSortedMatrixSize, dl, pb);
 	}
 
 	return tree;
 }
 
-void bootstrapTree(ostream& out, polytree* tree, dataloader* dl, ProgressBar* pb) {
-	for (int i = 0; i < options::replicates; i++) {
-		dl->sample_sequences();
-		pb->childProgress(1.0 / (options::replicates + 1.0));
-		polytree* replicate = computeTree(out, dl, pb, NULL, NULL, false);
-		if (options::verbose) {
+// Returns the number of replicates already counted in the bootstrap counts of a tree restored from a checkpoint, and advances the progress bar past them.
+int skipCompletedReplicates(rapidNJContext* ctx, polytree* tree, ProgressBar* pb) {
+	int completed = tree->bootstrap_counts != NULL ? getBootstrapReplicateCount(tree) : 0;
+	for (int i = 0; i < completed; i++) {
+		pb->childProgress(1.0 / (ctx->options.replicates + 1.0));
+		pb->finish();
+	}
+	return completed;
+}
+
+void writeReplicateCheckpoint(rapidNJContext* ctx, treeCheckpoint* checkpoint, polytree* tree) {
+	if (checkpoint != NULL && !checkpoint->writeReplicates(tree) && ctx->options.verbose) {
+		cerr << "WARNING: could not write the checkpoint to " << ctx->options.checkpointFile << endl;
+	}
+}
+
+// The seeds of all the replicates are drawn before any is skipped, so that replicate i always has the same seed, whether or not the call resumes from a checkpoint.
+vector<unsigned int> drawReplicateSeeds(rapidNJContext* ctx) {
+	vector<unsigned int> seeds(max(ctx->options.replicates, 0));
+	for (unsigned int i = 0; i < seeds.size(); i++) {
+		seeds[i] = (unsigned int)ctx->random();
+	}
+	return seeds;
+}
+
+// Returns false if the call was cancelled before all the replicates were counted.
+bool bootstrapTree(rapidNJContext* ctx, ostream& out, polytree* tree, dataloader* dl, ProgressBar* pb, treeCheckpoint* checkpoint) {
+	vector<unsigned int> seeds = drawReplicateSeeds(ctx);
+	int completed = skipCompletedReplicates(ctx, tree, pb);
+	bootstrapSupport* support = new bootstrapSupport(tree);
+	bool retVal = true;
+	for (int i = completed; i < ctx->options.replicates; i++) {
+		pb->childProgress(1.0 / (ctx->options.replicates + 1.0));
+		polytree* replicate;
+		if (dl->fastdist) {
+			// Resampling into a separate dataloader leaves the bit strings untouched, which is required when they are owned by the caller.
+			dataloaderBootstrap* replicateDL;
+			{
+				phaseTimer timer(ctx->statistics, &rapidNJStatistics::bootstrapSampling);
+				replicateDL = new dataloaderBootstrap(dl, seeds[i], useColumnWeights(ctx, dl));
+			}
+			replicate = computeTree(ctx, out, replicateDL, pb, NULL, NULL, false);
+			delete replicateDL;
+		}
+		else {
+			{
+				phaseTimer timer(ctx->statistics, &rapidNJStatistics::bootstrapSampling);
+				dl->sample_sequences();
+			}
+			replicate = computeTree(ctx, out, dl, pb, NULL, NULL, false);
+		}
+		if (replicate == NULL) {
+			retVal = false;
+			break;
+		}
+		if (ctx->options.verbose) {
 			cerr << "Comparing trees..." << endl;
 		}
 		//cout << "---------------------" << i << "-------------------------" << endl;
-		tree->compareTreeBootstrap(replicate);
+		{
+			phaseTimer timer(ctx->statistics, &rapidNJStatistics::treeComparison);
+			support->addReplicate(replicate);
+		}
+		writeReplicateCheckpoint(ctx, checkpoint, tree);
 		delete replicate;
 	}
+	delete support;
 	//cout << endl;
+	return retVal;
 }
 
-// Actual methods
-
-extern "C"
-{
-
-	DLL_PUBLIC void BuildTreeFromAlignment(int maxMemory, int distance, int numCores, int bootstrapReplicates, int inputType, bool allowNegativeBranches, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, progress_callback callback, return_callback returnCallback, bool verbose)
-	{
-		options::fastdist = true;
-		distanceMatrixInput = false;
-		distanceMatrixFromPointer = false;
-		options::verbose = verbose;
+struct threadStateBootstrap {
+	rapidNJContext* ctx;
+	int nextReplicate;
+	int replicateCount;
+	int coresPerReplicate;
+	dataloader* loader;
+	polytree* tree;
+	bootstrapSupport* support;
+	ProgressBar* pb;
+	vector<unsigned int> seeds;
+	treeCheckpoint* checkpoint;
+	// Set once a worker has stopped because the call was cancelled.
+	bool cancelled;
+	pthread_mutex_t mutex;
+};
 
-		options::memSize = maxMemory;
+// Computes the distance matrix of a bootstrap replicate without touching the global state, so that it can be called from several threads at once.
+distMatrixData* computeReplicateDistanceMatrix(rapidNJContext* ctx, dataloader* dl, int cores) {
+	phaseTimer timer(ctx->statistics, &rapidNJStatistics::distanceEstimation);
+	distMatrixData* retVal = new distMatrixData();
+	retVal->sequenceNames = dl->getSequenceNames();
 
-		if (distance == 0)
-		{
-			options::distMethod = "jc";
+	if (ctx->options.distMethod == "jc") {
+		if (useDistanceKernels(ctx, dl, NULL)) {
+			retVal->matrix = computeKernelDistanceMatrix(ctx, false, dl, NULL, cores);
 		}
-		else
-		{
-			options::distMethod = "kim";
+		else {
+			JCdistance* alg = new JCdistance(false, ctx->options.fastdist, dl, NULL);
+			alg->computeDistanceMatrix(cores);
+			retVal->matrix = alg->getDistanceMatrix();
+			delete alg;
+		}
+	}
+	else {
+		if (useDistanceKernels(ctx, dl, NULL)) {
+			retVal->matrix = computeKernelDistanceMatrix(ctx, false, dl, NULL, cores);
+		}
+		else {
+			KimuraDistance* alg = new KimuraDistance(false, ctx->options.fastdist, dl, NULL);
+			alg->computeDistances(cores);
+			retVal->matrix = alg->getDistanceMatrix();
+			delete alg;
 		}
+	}
+	return retVal;
+}
 
-		
-		options::cores = numCores;
-		options::replicates = bootstrapReplicates;
+void bootstrapTask(void* ptr, int /*workerIndex*/, int /*workerCount*/) {
+	threadStateBootstrap* state = (threadStateBootstrap*)ptr;
+	rapidNJContext* ctx = state->ctx;
+	int replicateMatrixSize = state->loader->getSequenceCount();
+	// The progress bar of the call is also updated from this thread.
+	callProgress* previousProgress = callProgress::setCurrent(ctx->progress);
 
-		InputType type;
+	while (true) {
+		pthread_mutex_lock(&state->mutex);
+		int replicateIndex = state->nextReplicate;
+		state->nextReplicate++;
+		pthread_mutex_unlock(&state->mutex);
 
-		switch (inputType)
-		{
-		case 0:
-			type = DNA;
+		if (replicateIndex >= state->replicateCount) {
 			break;
-		case 1:
-			type = PROTEIN;
-			break;
-		default:
-			type = UNKNOWN;
+		}
+		if (isCallCancelled(ctx)) {
+			pthread_mutex_lock(&state->mutex);
+			state->cancelled = true;
+			pthread_mutex_unlock(&state->mutex);
 			break;
 		}
 
-		options::negative_branches = !allowNegativeBranches;
+		dataloaderBootstrap* replicateDL;
+		{
+			phaseTimer timer(ctx->statistics, &rapidNJStatistics::bootstrapSampling);
+			replicateDL = new dataloaderBootstrap(state->loader, state->seeds[replicateIndex], useColumnWeights(ctx, state->loader));
+		}
+		// Replicates report their progress as a whole, once they are finished.
+		ProgressBar* replicatePB = new ProgressBar();
 
-		configureNumberOfCores();
+		polytree* replicate;
+		if (useFusedParallelNJ(ctx, replicateDL)) {
+			replicate = runFusedParallelNJ(ctx, replicateMatrixSize, replicateDL, replicatePB, state->coresPerReplicate, false);
+		}
+		else {
+			distMatrixData* matrixData = computeReplicateDistanceMatrix(ctx, replicateDL, state->coresPerReplicate);
+			distMatrixReader* reader;
+			{
+				phaseTimer timer(ctx->statistics, &rapidNJStatistics::matrixInitialization);
+				reader = new distMatrixReader(false, replicateMatrixSize, false, matrixData->sequenceNames, matrixData->matrix);
+				reader->initializeData();
+			}
+			delete matrixData;
 
-		dataloaderPointer* pointerDL = new dataloaderPointer(type, inputSequenceCount, inputSequenceLength, inputSequenceNamesLengths, inputSequenceNames, inputSequenceData);
+			if (useParallelNJ(ctx)) {
+				rapidNJParallel<distType>* nj = new rapidNJParallel<distType>(reader, replicateMatrixSize, replicateMatrixSize, ctx->options.negative_branches, replicatePB, state->coresPerReplicate);
+				nj->setOwnsMatrix(true);
+				nj->setStatistics(ctx->statistics);
+				nj->setRelaxed(planUsesRelaxedNJ(ctx));
+				nj->setProgress(ctx->progress);
+				replicate = nj->run();
+				delete nj;
+			}
+			else if (isCallCancelled(ctx)) {
+				replicate = skipLibraryEngine(reader, replicateMatrixSize, true);
+			}
+			else {
+				phaseTimer timer(ctx->statistics, &rapidNJStatistics::njIterations);
+				rapidNJ* sorted = new rapidNJ(reader, replicateMatrixSize, ctx->options.negative_branches, replicatePB);
+				replicate = sorted->run();
+				delete sorted;
+			}
+		}
 
-		matrixSize = pointerDL->getSequenceCount();
+		if (replicate == NULL) {
+			pthread_mutex_lock(&state->mutex);
+			state->cancelled = true;
+			pthread_mutex_unlock(&state->mutex);
+			delete replicatePB;
+			delete replicateDL;
+			break;
+		}
 
-		ProgressBar* myPB = new ProgressBar(callback);
+		vector<splitHash> splits;
+		{
+			phaseTimer timer(ctx->statistics, &rapidNJStatistics::treeComparison);
+			splits = bootstrapSupport::getSplits(replicate);
+		}
 
-		if (options::replicates > -1)
+		// The split counts of the reference tree and the progress bar are shared between all the workers.
+		pthread_mutex_lock(&state->mutex);
+		if (ctx->options.verbose) {
+			cerr << "Comparing trees..." << endl;
+		}
 		{
-			myPB->childProgress(1.0 / (options::replicates + 1.0));
+			phaseTimer timer(ctx->statistics, &rapidNJStatistics::treeComparison);
+			state->support->addReplicate(splits);
 		}
+		// The counts only change while the mutex is held, so the checkpoint is consistent.
+		writeReplicateCheckpoint(ctx, state->checkpoint, state->tree);
+		state->pb->childProgress(1.0 / (state->replicateCount + 1.0));
+		state->pb->finish();
+		pthread_mutex_unlock(&state->mutex);
 
-		ostringstream myOut;
+		delete replicate;
+		delete replicatePB;
+		delete replicateDL;
+	}
+	callProgress::setCurrent(previousProgress);
+}
+
+// Number of bootstrap replicates that can be computed at the same time with RapidNJ within the memory budget.
+// Replicates can only be computed concurrently from fastdist alignments, when the algorithm is chosen automatically.
+int getConcurrentReplicateCount(rapidNJContext* ctx, dataloader* dl) {
+	return planTree(ctx, describeTreeInput(ctx, dl, false)).concurrentReplicates;
+}
+
+// Returns false if the call was cancelled before all the replicates were counted.
+bool bootstrapTreeParallel(rapidNJContext* ctx, ostream& out, polytree* tree, dataloader* dl, ProgressBar* pb, treeCheckpoint* checkpoint) {
+	int concurrentReplicates = getConcurrentReplicateCount(ctx, dl);
+
+	// Running a single replicate at a time is better handled by the sequential code, which can also fall back to the memory efficient algorithms.
+	if (concurrentReplicates < 2) {
+		return bootstrapTree(ctx, out, tree, dl, pb, checkpoint);
+	}
+
+	if (ctx->options.verbose) {
+		cerr << "Computing " << concurrentReplicates << " bootstrap replicates concurrently" << endl;
+	}
 
-		polytree* myTree = computeTree(myOut, pointerDL, myPB, NULL, NULL, false);
+	threadStateBootstrap* state = new threadStateBootstrap();
+	state->ctx = ctx;
+	state->nextReplicate = skipCompletedReplicates(ctx, tree, pb);
+	state->replicateCount = ctx->options.replicates;
+	state->coresPerReplicate = max(1, ctx->numCores / concurrentReplicates);
+	state->loader = dl;
+	state->tree = tree;
+	state->support = new bootstrapSupport(tree);
+	state->pb = pb;
+	state->checkpoint = checkpoint;
+	state->cancelled = false;
+	state->seeds = drawReplicateSeeds(ctx);
+	pthread_mutex_init(&state->mutex, NULL);
+
+	workerPool pool(concurrentReplicates);
+	pool.run(bootstrapTask, (void*)state);
+
+	bool retVal = !state->cancelled;
+	pthread_mutex_destroy(&state->mutex);
+	delete state->support;
+	delete state;
+	return retVal;
+}
+
+// Actual methods
 
-		if (options::replicates > -1)
+InputType getInputType(int inputType) {
+	switch (inputType) {
+	case 0:
+		return DNA;
+	case 1:
+		return PROTEIN;
+	default:
+		return UNKNOWN;
+	}
+}
+
+// Delivers the tree through the structured callback if one is given, otherwise as a Newick string.
+void returnTree(rapidNJContext* ctx, ostringstream& out, polytree* tree, vector<string>* sequenceNames, return_callback returnCallback, tree_callback treeCallback) {
+	// The time spent in the callbacks is not part of the serialization.
+	if (treeCallback != NULL) {
+		// Trees that were not bootstrapped by this call, such as those of ContextPlaceSequencesInTree, have no bootstrap counts.
+		exportTree(tree, sequenceNames, tree->bootstrap_counts != NULL ? ctx->options.replicates : 0, treeCallback, ctx->statistics);
+	}
+	else {
+		string treeString;
 		{
-			bootstrapTree(myOut, myTree, pointerDL, myPB);
-			myTree->serialize_tree(myOut);
+			phaseTimer timer(ctx->statistics, &rapidNJStatistics::serialization);
+			tree->serialize_tree(out);
+			treeString = out.str();
+		}
+		returnCallback(treeString.length(), treeString.c_str());
+	}
+}
+
+extern "C"
+{
+
+	DLL_PUBLIC rapidNJContext* CreateRapidNJContext()
+	{
+		rapidNJContext* ctx = new rapidNJContext();
+
+		ctx->options.fastdist = true;
+		ctx->options.memSize = INT_MAX;
+		ctx->options.distMethod = "kim";
+		ctx->options.parallelBootstrap = true;
+		ctx->options.distanceKernel = KERNEL_AUTO;
+
+		return ctx;
+	}
+
+	DLL_PUBLIC int SetRapidNJContextOption(rapidNJContext* ctx, int option, int value)
+	{
+		switch (option)
+		{
+		case OPTION_MAX_MEMORY:
+			ctx->options.memSize = value;
+			break;
+		case OPTION_DISTANCE:
+			if (value == 0)
+			{
+				ctx->options.distMethod = "jc";
+			}
+			else
+			{
+				ctx->options.distMethod = "kim";
+			}
+			break;
+		case OPTION_NUM_CORES:
+			ctx->options.cores = value;
+			break;
+		case OPTION_BOOTSTRAP_REPLICATES:
+			ctx->options.replicates = value > 0 ? value : -1;
+			break;
+		case OPTION_ALLOW_NEGATIVE_BRANCHES:
+			ctx->options.negative_branches = (value == 0);
+			break;
+		case OPTION_VERBOSE:
+			ctx->options.verbose = (value != 0);
+			break;
+		case OPTION_PARALLEL_BOOTSTRAP:
+			ctx->options.parallelBootstrap = (value != 0);
+			break;
+		case OPTION_DISTANCE_KERNEL:
+			if (value < KERNEL_LIBRARY || value > KERNEL_AVX512_VPOPCNT) {
+				return -1;
+			}
+			ctx->options.distanceKernel = value;
+			break;
+		case OPTION_NJ_ENGINE:
+			if (value < NJ_ENGINE_LIBRARY || value > NJ_ENGINE_RELAXED) {
+				return -1;
+			}
+			ctx->options.njEngine = value;
+			break;
+		case OPTION_DISK_MATRIX_BACKEND:
+			if (value < DISK_MATRIX_STREAM || value > DISK_MATRIX_MAPPED) {
+				return -1;
+			}
+			ctx->options.diskMatrixBackend = value;
+			break;
+		case OPTION_DISTANCE_STORAGE:
+			if (value < DISTANCE_STORAGE_FLOAT || value > DISTANCE_STORAGE_BFLOAT16) {
+				return -1;
+			}
+			ctx->options.distanceStorage = value;
+			break;
+		case OPTION_BOOTSTRAP_MODE:
+			if (value < BOOTSTRAP_RESAMPLE || value > BOOTSTRAP_COLUMN_WEIGHTS) {
+				return -1;
+			}
+			ctx->options.bootstrapMode = value;
+			break;
+		case OPTION_COLLAPSE_DUPLICATES:
+			ctx->options.collapseDuplicates = (value != 0);
+			break;
+		case OPTION_PROTEIN_ENCODING:
+			if (value < PROTEIN_ENCODING_BYTES || value > PROTEIN_ENCODING_PACKED) {
+				return -1;
+			}
+			ctx->options.proteinEncoding = value;
+			break;
+		case OPTION_GPU:
+			ctx->options.gpu = (value != 0);
+			break;
+		case OPTION_BOOTSTRAP_SEED:
+			ctx->random.seed((unsigned int)value);
+			break;
+		case OPTION_COLLECT_STATISTICS:
+			if (value != 0 && ctx->statistics == NULL) {
+				ctx->statistics = new statisticsCollector();
+			}
+			else if (value == 0 && ctx->statistics != NULL) {
+				delete ctx->statistics;
+				ctx->statistics = NULL;
+			}
+			break;
+		default:
+			return -1;
+		}
+
+		return 0;
+	}
+
+	DLL_PUBLIC void DestroyRapidNJContext(rapidNJContext* ctx)
+	{
+		delete ctx;
+	}
+
+	// Copies the statistics of the last call made with the context. Returns -1 if OPTION_COLLECT_STATISTICS is not set.
+	DLL_PUBLIC int GetRapidNJContextStatistics(rapidNJContext* ctx, rapidNJStatistics* statistics)
+	{
+		if (ctx->statistics == NULL)
+		{
+			return -1;
+		}
+		*statistics = ctx->statistics->get();
+		return 0;
+	}
+
+	// The state that a call would set on ctx before planning its tree, on a context of its own, so that planning never changes ctx or prints anything.
+	static void preparePlanContext(rapidNJContext* ctx, rapidNJContext* planCtx, int inputSequenceCount, bool distanceMatrixFromPointer)
+	{
+		planCtx->options = ctx->options;
+		planCtx->distanceMatrixInput = false;
+		planCtx->distanceMatrixFromPointer = distanceMatrixFromPointer;
+		planCtx->matrixSize = inputSequenceCount;
+		planCtx->numCores = getNumberOfCores(ctx);
+	}
+
+	// Fills plan with the algorithm and the memory that building a tree from an alignment would use, without building it. Returns -1 if the input type is unknown,
+	// or if the tree cannot be built because the plan exceeds the limits of the library, see planExceedsLibraryLimits.
+	DLL_PUBLIC int ContextPlanTreeFromAlignment(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, rapidNJPlan* plan)
+	{
+		InputType type = getInputType(inputType);
+		if (type == UNKNOWN)
+		{
+			return -1;
+		}
+
+		rapidNJContext planCtx;
+		preparePlanContext(ctx, &planCtx, inputSequenceCount, false);
+
+		// The same bit strings as those that dataloaderPointer would allocate, whose padding is always supported by the distance kernels.
+		// Packed protein sequences are assumed to have at most 31 distinct residues.
+		double sequenceCount = inputSequenceCount;
+		treeInputDescription input;
+		input.sequenceCount = inputSequenceCount;
+		input.fastdist = ctx->options.fastdist;
+		input.distanceKernels = ctx->options.fastdist && ctx->options.distanceKernel != KERNEL_LIBRARY && (type == DNA || type == PROTEIN);
+		input.halfMatrix = false;
+		input.columnWeightsMemory = 0;
+		if (ctx->options.fastdist) {
+			bool packed = input.distanceKernels && type == PROTEIN && ctx->options.proteinEncoding == PROTEIN_ENCODING_PACKED;
+			double bitStringBytes = (packed ? getPackedProteinBitStringsCount(inputSequenceLength) : padBitStringsCount(dataloaderPointer::getMinimumBitStringsCount(type, inputSequenceLength))) * 4 * sizeof(unsigned int);
+			input.alignmentMemory = sequenceCount * bitStringBytes * (type == DNA ? 2 : 1);
+			if (input.distanceKernels && ctx->options.bootstrapMode == BOOTSTRAP_COLUMN_WEIGHTS) {
+				input.columnWeightsMemory = TYPICAL_COLUMN_WEIGHT_PLANES * (packed ? bitStringBytes / PACKED_PROTEIN_PLANES : bitStringBytes);
+			}
+		}
+		else {
+			input.alignmentMemory = sequenceCount * inputSequenceLength;
+		}
+		input.alignmentMemory += sequenceCount * sizeof(string);
+
+		*plan = planTree(&planCtx, input);
+		return planExceedsLibraryLimits(*plan, inputSequenceCount) ? -1 : 0;
+	}
+
+	// Fills plan with the algorithm and the memory that building a tree from a distance matrix would use, without building it.
+	DLL_PUBLIC void ContextPlanTreeFromDistanceMatrix(rapidNJContext* ctx, int inputSequenceCount, bool halfMatrix, rapidNJPlan* plan)
+	{
+		rapidNJContext planCtx;
+		preparePlanContext(ctx, &planCtx, inputSequenceCount, true);
+
+		*plan = planTree(&planCtx, describeTreeInput(&planCtx, NULL, halfMatrix));
+	}
+
+	static void buildTreeFromLoader(rapidNJContext* ctx, dataloaderPointer* pointerDL, progress_callback callback, return_callback returnCallback, tree_callback treeCallback);
+	static polytree* buildLoaderTree(rapidNJContext* ctx, dataloaderPointer* pointerDL, ostringstream& myOut, ProgressBar* myPB);
+
+	// Packed protein sequences can only be read by the distance kernels, so they are not used if the tree would be built by RapidDiskNJ, which may need the library estimators.
+	static bool usePackedProteins(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, bool buildTree)
+	{
+		if (ctx->options.proteinEncoding != PROTEIN_ENCODING_PACKED || getInputType(inputType) != PROTEIN || !ctx->options.fastdist || ctx->options.distanceKernel == KERNEL_LIBRARY)
+		{
+			return false;
+		}
+		if (!buildTree)
+		{
+			return true;
+		}
+
+		rapidNJPlan plan;
+		ContextPlanTreeFromAlignment(ctx, inputType, inputSequenceCount, inputSequenceLength, &plan);
+		return plan.algorithm != TREE_ALGORITHM_RAPIDNJ_DISK;
+	}
+
+	// Builds a tree and passes it to returnCallback as a Newick string, or to treeCallback if it is not NULL.
+	static void buildTreeFromAlignment(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, progress_callback callback, return_callback returnCallback, tree_callback treeCallback)
+	{
+		ctx->distanceMatrixInput = false;
+		ctx->distanceMatrixFromPointer = false;
+
+		resetStatistics(ctx);
+		configureNumberOfCores(ctx);
+
+		bool packProteins = usePackedProteins(ctx, inputType, inputSequenceCount, inputSequenceLength, true);
+
+		dataloaderPointer* pointerDL;
+		{
+			phaseTimer timer(ctx->statistics, &rapidNJStatistics::encoding);
+			pointerDL = new dataloaderPointer(getInputType(inputType), inputSequenceCount, inputSequenceLength, inputSequenceNamesLengths, inputSequenceNames, inputSequenceData, ctx->numCores, packProteins);
+		}
+
+		buildTreeFromLoader(ctx, pointerDL, callback, returnCallback, treeCallback);
+
+		delete pointerDL;
+	}
+
+	static void buildTreeFromLoader(rapidNJContext* ctx, dataloaderPointer* pointerDL, progress_callback callback, return_callback returnCallback, tree_callback treeCallback)
+	{
+		callProgress progress(ctx->progressBlock, callback, ctx->progressInterval);
+		ctx->progress = &progress;
+		ProgressBar* myPB = new ProgressBar(progress.getCallback());
+		ostringstream myOut;
+
+		polytree* myTree = buildLoaderTree(ctx, pointerDL, myOut, myPB);
+
+		if (myTree != NULL)
+		{
+			returnTree(ctx, myOut, myTree, pointerDL->getSequenceNames(), returnCallback, treeCallback);
 		}
 		else
 		{
-			myTree->serialize_tree(myOut);
+			progress.setCancelled();
 		}
 
 		delete myTree;
 		delete myPB;
-		delete pointerDL;
-
-		string treeString = myOut.str();
+		ctx->progress = NULL;
+	}
 
-		returnCallback(treeString.length(), treeString.c_str());
+	// Options that change the tree or its replicates; the cores and the memory budget only change how they are computed.
+	static unsigned long long getCheckpointSettings(rapidNJContext* ctx)
+	{
+		int settings[] = { ctx->options.distMethod == "jc", ctx->options.negative_branches, ctx->options.njEngine, ctx->options.distanceStorage, ctx->options.bootstrapMode, ctx->options.collapseDuplicates };
+		unsigned long long hash = 0xCBF29CE484222325ULL;
+		for (unsigned int i = 0; i < sizeof(settings) / sizeof(settings[0]); i++)
+		{
+			hash = (hash ^ (unsigned int)settings[i]) * 0x100000001B3ULL;
+		}
+		return hash;
 	}
 
+	// Returns NULL if checkpoints are disabled, if there are no replicates to save, or if the alignment cannot be identified.
+	static treeCheckpoint* createTreeCheckpoint(rapidNJContext* ctx, dataloader* dl)
+	{
+		if (ctx->options.checkpointFile == "" || ctx->options.replicates < 1 || !dl->fastdist)
+		{
+			return NULL;
+		}
+		return new treeCheckpoint(ctx->options.checkpointFile, getDistanceCacheKey(ctx, dl), getCheckpointSettings(ctx), ctx->options.replicates, ctx->options.checkpointInterval);
+	}
 
-	DLL_PUBLIC void BuildDistanceMatrixFromAlignment(int maxMemory, int distance, int numCores, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, distType** outputMatrix, bool verbose)
+	// Builds the tree of the sequences of pointerDL, with its bootstrap replicates. Returns NULL if the call was cancelled, in which case the checkpoint is kept.
+	static polytree* buildLoaderTree(rapidNJContext* ctx, dataloaderPointer* pointerDL, ostringstream& myOut, ProgressBar* myPB)
 	{
-		options::fastdist = true;
-		distanceMatrixInput = false;
-		distanceMatrixFromPointer = false;
-		options::verbose = verbose;
+		// The tree and its replicates are built from the distinct sequences, and the copies are only added back to the final tree.
+		dataloaderUnique* uniqueDL = NULL;
+		if (ctx->options.collapseDuplicates)
+		{
+			phaseTimer timer(ctx->statistics, &rapidNJStatistics::encoding);
+			uniqueDL = dataloaderUnique::create(pointerDL);
+		}
+		dataloader* dl = uniqueDL != NULL ? (dataloader*)uniqueDL : (dataloader*)pointerDL;
 
-		options::memSize = maxMemory;
+		if (ctx->options.verbose && uniqueDL != NULL)
+		{
+			cerr << "Building the tree from " << uniqueDL->getSequenceCount() << " distinct sequences out of " << pointerDL->getSequenceCount() << endl;
+		}
 
-		if (distance == 0)
+		ctx->matrixSize = dl->getSequenceCount();
+
+		if (ctx->options.replicates > -1)
 		{
-			options::distMethod = "jc";
+			myPB->childProgress(1.0 / (ctx->options.replicates + 1.0));
+		}
+
+		treeCheckpoint* checkpoint = createTreeCheckpoint(ctx, dl);
+		polytree* myTree = checkpoint != NULL ? checkpoint->read(dl->getSequenceNames()) : NULL;
+
+		if (myTree != NULL)
+		{
+			if (ctx->options.verbose)
+			{
+				cerr << "Resuming from the checkpoint in " << ctx->options.checkpointFile << ", " << getBootstrapReplicateCount(myTree) << " replicate(s) already computed" << endl;
+			}
+			myPB->finish();
 		}
 		else
 		{
-			options::distMethod = "kim";
+			myTree = computeTree(ctx, myOut, dl, myPB, NULL, NULL, false);
+			if (myTree != NULL && checkpoint != NULL && !checkpoint->write(myTree) && ctx->options.verbose)
+			{
+				cerr << "WARNING: could not write the checkpoint to " << ctx->options.checkpointFile << endl;
+			}
+		}
+
+		if (myTree != NULL && ctx->options.replicates > -1)
+		{
+			bool completed;
+			if (ctx->options.parallelBootstrap)
+			{
+				completed = bootstrapTreeParallel(ctx, myOut, myTree, dl, myPB, checkpoint);
+			}
+			else
+			{
+				completed = bootstrapTree(ctx, myOut, myTree, dl, myPB, checkpoint);
+			}
+			if (!completed)
+			{
+				delete myTree;
+				myTree = NULL;
+			}
+		}
+
+		if (checkpoint != NULL)
+		{
+			// A cancelled call can be resumed from the checkpoint, like an interrupted one.
+			if (myTree != NULL)
+			{
+				checkpoint->remove();
+			}
+			delete checkpoint;
+		}
+
+		if (uniqueDL != NULL)
+		{
+			if (myTree != NULL)
+			{
+				polytree* expandedTree = uniqueDL->expandTree(myTree);
+				delete myTree;
+				myTree = expandedTree;
+			}
+			delete uniqueDL;
+		}
+
+		return myTree;
+	}
+
+	DLL_PUBLIC void ContextBuildTreeFromAlignment(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, progress_callback callback, return_callback returnCallback)
+	{
+		buildTreeFromAlignment(ctx, inputType, inputSequenceCount, inputSequenceLength, inputSequenceNamesLengths, inputSequenceNames, inputSequenceData, callback, returnCallback, NULL);
+	}
+
+	DLL_PUBLIC void ContextBuildStructuredTreeFromAlignment(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, progress_callback callback, tree_callback treeCallback)
+	{
+		buildTreeFromAlignment(ctx, inputType, inputSequenceCount, inputSequenceLength, inputSequenceNamesLengths, inputSequenceNames, inputSequenceData, callback, NULL, treeCallback);
+	}
+
+	DLL_PUBLIC void ContextBuildTreeFromContiguousAlignment(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, const char* inputSequenceData, long long inputSequenceStride, progress_callback callback, return_callback returnCallback, tree_callback treeCallback)
+	{
+		ctx->distanceMatrixInput = false;
+		ctx->distanceMatrixFromPointer = false;
+
+		resetStatistics(ctx);
+		configureNumberOfCores(ctx);
+
+		bool packProteins = usePackedProteins(ctx, inputType, inputSequenceCount, inputSequenceLength, true);
+
+		dataloaderPointer* pointerDL;
+		{
+			phaseTimer timer(ctx->statistics, &rapidNJStatistics::encoding);
+			pointerDL = new dataloaderPointer(getInputType(inputType), inputSequenceCount, inputSequenceLength, inputSequenceNamesLengths, inputSequenceNames, inputSequenceData, inputSequenceStride, ctx->numCores, packProteins);
 		}
 
+		buildTreeFromLoader(ctx, pointerDL, callback, returnCallback, treeCallback);
+
+		delete pointerDL;
+	}
 
-		options::cores = numCores;
-		options::replicates = -1;
+	DLL_PUBLIC int ContextBuildTreeFromEncodedAlignment(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, unsigned int** inputBitStrings, unsigned int** inputGapFilters, int inputBitStringsCount, progress_callback callback, return_callback returnCallback, tree_callback treeCallback)
+	{
+		InputType type = getInputType(inputType);
 
-		InputType type;
+		if (type == UNKNOWN || inputBitStringsCount < (int)dataloaderPointer::getMinimumBitStringsCount(type, inputSequenceLength) || (type == DNA && inputGapFilters == NULL))
+		{
+			return -1;
+		}
 
-		switch (inputType)
+		// Trees that RapidDiskNJ would have to build beyond the limits of the library are refused before anything is allocated.
+		rapidNJPlan plan;
+		if (ContextPlanTreeFromAlignment(ctx, inputType, inputSequenceCount, inputSequenceLength, &plan) != 0)
 		{
-		case 0:
-			type = DNA;
-			break;
-		case 1:
-			type = PROTEIN;
-			break;
-		default:
-			type = UNKNOWN;
-			break;
+			return -1;
+		}
+
+		ctx->distanceMatrixInput = false;
+		ctx->distanceMatrixFromPointer = false;
+
+		resetStatistics(ctx);
+		configureNumberOfCores(ctx);
+
+		dataloaderPointer* pointerDL;
+		{
+			phaseTimer timer(ctx->statistics, &rapidNJStatistics::encoding);
+			pointerDL = new dataloaderPointer(type, inputSequenceCount, inputSequenceLength, inputSequenceNamesLengths, inputSequenceNames, inputBitStrings, inputGapFilters, inputBitStringsCount);
 		}
 
-		configureNumberOfCores();
+		buildTreeFromLoader(ctx, pointerDL, callback, returnCallback, treeCallback);
+
+		delete pointerDL;
+
+		return 0;
+	}
+
+	static dataloaderPointer* loadDistanceAlignment(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData)
+	{
+		ctx->distanceMatrixInput = false;
+		ctx->distanceMatrixFromPointer = false;
+
+		InputType type = getInputType(inputType);
+
+		resetStatistics(ctx);
+		configureNumberOfCores(ctx);
+
+		// The distances of alignments are always computed in memory.
+		bool packProteins = usePackedProteins(ctx, inputType, inputSequenceCount, inputSequenceLength, false);
+
+		dataloaderPointer* pointerDL;
+		{
+			phaseTimer timer(ctx->statistics, &rapidNJStatistics::encoding);
+			pointerDL = new dataloaderPointer(type, inputSequenceCount, inputSequenceLength, inputSequenceNamesLengths, inputSequenceNames, inputSequenceData, ctx->numCores, packProteins);
+		}
 
-		dataloaderPointer* pointerDL = new dataloaderPointer(type, inputSequenceCount, inputSequenceLength, inputSequenceNamesLengths, inputSequenceNames, inputSequenceData);
+		ctx->matrixSize = pointerDL->getSequenceCount();
+		return pointerDL;
+	}
 
-		matrixSize = pointerDL->getSequenceCount();
+	DLL_PUBLIC void ContextBuildDistanceMatrixFromAlignment(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, distType** outputMatrix)
+	{
+		dataloaderPointer* pointerDL = loadDistanceAlignment(ctx, inputType, inputSequenceCount, inputSequenceLength, inputSequenceNamesLengths, inputSequenceNames, inputSequenceData);
 
 		ostream out(cout.rdbuf());
 
-		distMatrixData* computedMatrix = computeDistanceMatrix(false, out, false, pointerDL, outputMatrix);
+		distMatrixData* computedMatrix = computeDistanceMatrix(ctx, false, out, false, pointerDL, outputMatrix);
 
 		delete computedMatrix;
+		delete pointerDL;
 	}
 
-	DLL_PUBLIC void BuildTreeFromDistanceMatrix(int maxMemory, int numCores, bool allowNegativeBranches, int inputSequenceCount, int* inputSequenceNamesLengths, char** inputSequenceNames, bool halfMatrix, distType** distMatrix, progress_callback callback, return_callback returnCallback, bool verbose)
+	// Fills the lower triangle of outputMatrix, whose row i has i + 1 elements, like the half matrices accepted by ContextBuildTreeFromDistanceMatrix.
+	DLL_PUBLIC void ContextBuildHalfDistanceMatrixFromAlignment(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, distType** outputMatrix)
 	{
-		options::fastdist = true;
-		distanceMatrixInput = false;
-		distanceMatrixFromPointer = true;
-		options::verbose = verbose;
+		dataloaderPointer* pointerDL = loadDistanceAlignment(ctx, inputType, inputSequenceCount, inputSequenceLength, inputSequenceNamesLengths, inputSequenceNames, inputSequenceData);
 
-		options::memSize = maxMemory;
+		bool cacheable = useDistanceCache(pointerDL);
+		distanceCacheKey cacheKey;
+		if (cacheable) {
+			cacheKey = getDistanceCacheKey(ctx, pointerDL);
+		}
 
-		options::cores = numCores;
-		options::replicates = -1;
+		if (cacheable && readDistanceCache(cacheKey, outputMatrix, true)) {
+			if (ctx->options.verbose) {
+				cerr << "Using the cached distance matrix" << endl;
+			}
+		}
+		else if (useHalfMatrixKernels(ctx, pointerDL)) {
+			phaseTimer timer(ctx->statistics, &rapidNJStatistics::distanceEstimation);
+			kernelDistance* alg = createKernelDistance(ctx, pointerDL, outputMatrix);
+			alg->setHalfMatrix(true);
+			alg->computeDistanceMatrix(ctx->numCores);
+			delete alg;
+			if (cacheable) {
+				writeDistanceCache(cacheKey, outputMatrix);
+			}
+		}
+		else {
+			// The full matrix is only needed until its lower triangle is copied. computeDistanceMatrix caches it.
+			ostream out(cout.rdbuf());
+			distMatrixData* computedMatrix = computeDistanceMatrix(ctx, false, out, false, pointerDL);
+			unsigned int seqCount = pointerDL->getSequenceCount();
+			for (unsigned int i = 0; i < seqCount; i++) {
+				memcpy(outputMatrix[i], computedMatrix->matrix[i], (i + 1) * sizeof(distType));
+			}
+			deleteFullMatrix(computedMatrix->matrix, seqCount);
+			delete computedMatrix;
+		}
 
-		options::negative_branches = !allowNegativeBranches;
+		delete pointerDL;
+	}
+
+	struct threadStateRowStream {
+		distance_rows_callback callback;
+		pthread_mutex_t mutex;
+	};
+
+	// The blocks are passed on one at a time, so that the callback does not need to be thread safe.
+	static void streamRowBlock(void* arg, unsigned int firstRow, unsigned int rowCount, distType** rows)
+	{
+		threadStateRowStream* state = (threadStateRowStream*)arg;
+		pthread_mutex_lock(&state->mutex);
+		state->callback((int)firstRow, (int)rowCount, rows);
+		pthread_mutex_unlock(&state->mutex);
+	}
+
+	// Passes the lower triangle of the matrix to rowsCallback in blocks of rows. With the distance kernels, only one block per core is in memory at any time.
+	DLL_PUBLIC void ContextStreamDistanceMatrixFromAlignment(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, distance_rows_callback rowsCallback)
+	{
+		dataloaderPointer* pointerDL = loadDistanceAlignment(ctx, inputType, inputSequenceCount, inputSequenceLength, inputSequenceNamesLengths, inputSequenceNames, inputSequenceData);
+
+		if (useHalfMatrixKernels(ctx, pointerDL)) {
+			phaseTimer timer(ctx->statistics, &rapidNJStatistics::distanceEstimation);
+			threadStateRowStream* state = new threadStateRowStream();
+			state->callback = rowsCallback;
+			pthread_mutex_init(&state->mutex, NULL);
+
+			kernelDistance* alg = createKernelDistance(ctx, pointerDL, NULL);
+			alg->computeRowBlocks(ctx->numCores, streamRowBlock, (void*)state);
+			delete alg;
+
+			pthread_mutex_destroy(&state->mutex);
+			delete state;
+		}
+		else {
+			// The full matrix is computed first, and the first i + 1 elements of its row i are the lower triangle.
+			ostream out(cout.rdbuf());
+			distMatrixData* computedMatrix = computeDistanceMatrix(ctx, false, out, false, pointerDL);
+			unsigned int seqCount = pointerDL->getSequenceCount();
+			const unsigned int blockSize = 64;
+			for (unsigned int firstRow = 0; firstRow < seqCount; firstRow += blockSize) {
+				rowsCallback((int)firstRow, (int)min(blockSize, seqCount - firstRow), computedMatrix->matrix + firstRow);
+			}
+			deleteFullMatrix(computedMatrix->matrix, seqCount);
+			delete computedMatrix;
+		}
+
+		delete pointerDL;
+	}
+
+	// Builds a tree from a matrix that is used in place. resetStatistics and configureNumberOfCores must have been called.
+	static void buildTreeFromMatrix(rapidNJContext* ctx, vector<string>* sequenceNames, bool halfMatrix, distType** distMatrix, progress_callback callback, return_callback returnCallback, tree_callback treeCallback)
+	{
+		ctx->distanceMatrixInput = false;
+		ctx->distanceMatrixFromPointer = true;
+		ctx->matrixSize = (int)sequenceNames->size();
+
+		callProgress progress(ctx->progressBlock, callback, ctx->progressInterval);
+		ctx->progress = &progress;
+		ProgressBar* myPB = new ProgressBar(progress.getCallback());
+
+		ostringstream myOut;
+
+		polytree* myTree = computeTree(ctx, myOut, NULL, myPB, sequenceNames, distMatrix, halfMatrix);
+
+		if (myTree != NULL)
+		{
+			returnTree(ctx, myOut, myTree, sequenceNames, returnCallback, treeCallback);
+		}
+		else
+		{
+			progress.setCancelled();
+		}
 
-		configureNumberOfCores();
+		delete myTree;
+		delete myPB;
+		ctx->progress = NULL;
+	}
 
-		matrixSize = inputSequenceCount;
+	// Builds a tree and passes it to returnCallback as a Newick string, or to treeCallback if it is not NULL.
+	static void buildTreeFromDistanceMatrix(rapidNJContext* ctx, int inputSequenceCount, int* inputSequenceNamesLengths, char** inputSequenceNames, bool halfMatrix, distType** distMatrix, progress_callback callback, return_callback returnCallback, tree_callback treeCallback)
+	{
+		resetStatistics(ctx);
+		configureNumberOfCores(ctx);
 
 		vector<string>* sequenceNames = new vector<string>();
 
@@ -549,21 +1684,535 @@ extern "C"
 			sequenceNames->push_back(string(inputSequenceNames[i], inputSequenceNamesLengths[i]));
 		}
 
-		ProgressBar* myPB = new ProgressBar(callback);
+		buildTreeFromMatrix(ctx, sequenceNames, halfMatrix, distMatrix, callback, returnCallback, treeCallback);
 
-		ostringstream myOut;
+		delete sequenceNames;
+	}
+
+	DLL_PUBLIC void ContextBuildTreeFromDistanceMatrix(rapidNJContext* ctx, int inputSequenceCount, int* inputSequenceNamesLengths, char** inputSequenceNames, bool halfMatrix, distType** distMatrix, progress_callback callback, return_callback returnCallback)
+	{
+		buildTreeFromDistanceMatrix(ctx, inputSequenceCount, inputSequenceNamesLengths, inputSequenceNames, halfMatrix, distMatrix, callback, returnCallback, NULL);
+	}
+
+	DLL_PUBLIC void ContextBuildStructuredTreeFromDistanceMatrix(rapidNJContext* ctx, int inputSequenceCount, int* inputSequenceNamesLengths, char** inputSequenceNames, bool halfMatrix, distType** distMatrix, progress_callback callback, tree_callback treeCallback)
+	{
+		buildTreeFromDistanceMatrix(ctx, inputSequenceCount, inputSequenceNamesLengths, inputSequenceNames, halfMatrix, distMatrix, callback, NULL, treeCallback);
+	}
+
+	// Builds a tree from a matrix in a single buffer, in which row i starts at element i * rowStride. A half matrix with a rowStride of 0 is packed, with row i starting at
+	// element i * (i + 1) / 2. The rows are used in place and modified by the engines, unless preserveMatrix is true, in which case only the lower triangle is copied into
+	// a half matrix of the engine's own. The tree is passed to returnCallback as a Newick string, or to treeCallback if it is not NULL. Returns -1 if rows would overlap,
+	// that is if rowStride is shorter than the rows of a full matrix or than all but the last row of a half matrix, or is 0 for a full matrix.
+	DLL_PUBLIC int ContextBuildTreeFromStridedDistanceMatrix(rapidNJContext* ctx, int inputSequenceCount, int* inputSequenceNamesLengths, char** inputSequenceNames, bool halfMatrix, distType* distMatrix, long long rowStride, bool preserveMatrix, progress_callback callback, return_callback returnCallback, tree_callback treeCallback)
+	{
+		if (rowStride < 0 || (rowStride == 0 && !halfMatrix) || (rowStride > 0 && rowStride < (halfMatrix ? inputSequenceCount - 1 : inputSequenceCount)))
+		{
+			return -1;
+		}
+
+		resetStatistics(ctx);
+		configureNumberOfCores(ctx);
+
+		vector<string> sequenceNames;
+		for (int i = 0; i < inputSequenceCount; i++)
+		{
+			sequenceNames.push_back(string(inputSequenceNames[i], inputSequenceNamesLengths[i]));
+		}
+
+		distType** rows = new distType*[inputSequenceCount];
+		for (int i = 0; i < inputSequenceCount; i++)
+		{
+			rows[i] = distMatrix + (halfMatrix && rowStride == 0 ? (size_t)i * (i + 1) / 2 : (size_t)i * rowStride);
+		}
+
+		distType* scratch = NULL;
+		if (preserveMatrix)
+		{
+			phaseTimer timer(ctx->statistics, &rapidNJStatistics::matrixInitialization);
+			// All the engines accept half matrices, so the upper triangle of a full matrix is never copied.
+			scratch = new distType[(size_t)inputSequenceCount * (inputSequenceCount + 1) / 2];
+			for (int i = 0; i < inputSequenceCount; i++)
+			{
+				distType* row = scratch + (size_t)i * (i + 1) / 2;
+				memcpy(row, rows[i], (i + 1) * sizeof(distType));
+				rows[i] = row;
+			}
+			halfMatrix = true;
+		}
+
+		buildTreeFromMatrix(ctx, &sequenceNames, halfMatrix, rows, callback, returnCallback, treeCallback);
+
+		delete[] scratch;
+		delete[] rows;
+
+		return 0;
+	}
+
+	// Builds a tree from a binary matrix file written by WriteDistanceMatrixFile, whose rows are mapped rather than read, or from a PHYLIP file, which is parsed on the cores
+	// of the context. The tree is passed to returnCallback as a Newick string, or to treeCallback if it is not NULL. Returns -1 if the file could not be read.
+	DLL_PUBLIC int ContextBuildTreeFromDistanceMatrixFile(rapidNJContext* ctx, const char* fileName, progress_callback callback, return_callback returnCallback, tree_callback treeCallback)
+	{
+		resetStatistics(ctx);
+		configureNumberOfCores(ctx);
+
+		distanceMatrixFile* matrixFile;
+		{
+			phaseTimer timer(ctx->statistics, &rapidNJStatistics::matrixInitialization);
+			matrixFile = new distanceMatrixFile(fileName, ctx->numCores);
+		}
+		if (!matrixFile->isValid())
+		{
+			if (ctx->options.verbose)
+			{
+				cerr << matrixFile->getError() << endl;
+			}
+			delete matrixFile;
+			return -1;
+		}
+		if (ctx->options.verbose)
+		{
+			cerr << (matrixFile->isMapped() ? "Mapped " : "Read ") << matrixFile->getSequenceCount() << " x " << matrixFile->getSequenceCount() << " distance matrix" << endl;
+		}
+
+		buildTreeFromMatrix(ctx, matrixFile->getSequenceNames(), matrixFile->isHalfMatrix(), matrixFile->getMatrix(), callback, returnCallback, treeCallback);
+
+		delete matrixFile;
+		return 0;
+	}
+
+	// Writes a distance matrix in the binary format read by ContextBuildTreeFromDistanceMatrixFile, as a lower triangle if halfMatrix is set. Returns -1 if the file could not be written.
+	DLL_PUBLIC int WriteDistanceMatrixFile(const char* fileName, int inputSequenceCount, int* inputSequenceNamesLengths, char** inputSequenceNames, bool halfMatrix, distType** distMatrix)
+	{
+		vector<string> sequenceNames;
+		for (int i = 0; i < inputSequenceCount; i++)
+		{
+			sequenceNames.push_back(string(inputSequenceNames[i], inputSequenceNamesLengths[i]));
+		}
+		return distanceMatrixFile::write(fileName, inputSequenceCount, &sequenceNames, halfMatrix, distMatrix) ? 0 : -1;
+	}
+
+	// Places the sequences of pointerDL that are not leaves of tree, and passes the resulting tree to returnCallback or treeCallback.
+	static int placeSequencesInTree(rapidNJContext* ctx, dataloaderPointer* pointerDL, const rapidNJTree* tree, int rearrangementPasses, progress_callback callback, return_callback returnCallback, tree_callback treeCallback)
+	{
+		// Only the distance kernels can compute single distances, rather than whole matrices.
+		if (!kernelDistance::isSupported(pointerDL))
+		{
+			return -1;
+		}
+
+		int sequenceCount = pointerDL->getSequenceCount();
+		kernelDistance* alg = createKernelDistance(ctx, pointerDL, NULL);
+		treePlacement* placement = new treePlacement(tree, sequenceCount, alg, ctx->numCores);
+		if (!placement->isValid())
+		{
+			delete placement;
+			delete alg;
+			return -1;
+		}
+
+		if (ctx->options.verbose)
+		{
+			cerr << "Placing " << (sequenceCount - tree->leafCount) << " sequences in a tree of " << tree->leafCount << " leaves using " << ctx->numCores << " core(s)... \n";
+		}
 
-		polytree* myTree = computeTree(myOut, NULL, myPB, sequenceNames, distMatrix, halfMatrix);
+		callProgress progress(ctx->progressBlock, callback, ctx->progressInterval);
+		ctx->progress = &progress;
+		ProgressBar* myPB = new ProgressBar(progress.getCallback());
+		polytree* myTree = NULL;
+		{
+			// The distances of each sequence are computed right before it is placed, so they are part of the same phase.
+			phaseTimer timer(ctx->statistics, &rapidNJStatistics::njIterations);
+			int newSequenceCount = sequenceCount - tree->leafCount;
+			double steps = (double)newSequenceCount * (rearrangementPasses + 1);
+			bool cancelled = false;
+			for (int i = tree->leafCount; i < sequenceCount; i++)
+			{
+				if (isCallCancelled(ctx))
+				{
+					cancelled = true;
+					break;
+				}
+				placement->place(i);
+				myPB->setProgress((i - tree->leafCount + 1) / steps);
+			}
+			// The first sequences were placed without the ones that came after them, so each new sequence is placed again in the tree that has all the others.
+			for (int pass = 0; pass < rearrangementPasses && !cancelled; pass++)
+			{
+				for (int i = tree->leafCount; i < sequenceCount; i++)
+				{
+					if (isCallCancelled(ctx))
+					{
+						cancelled = true;
+						break;
+					}
+					placement->remove(i);
+					placement->place(i);
+					myPB->setProgress(((pass + 1.0) * newSequenceCount + i - tree->leafCount + 1) / steps);
+				}
+			}
+			if (!cancelled)
+			{
+				myTree = placement->getTree(pointerDL->getSequenceNames());
+			}
+		}
 
-		myTree->serialize_tree(myOut);
+		if (myTree != NULL)
+		{
+			myPB->finish();
+			ostringstream myOut;
+			returnTree(ctx, myOut, myTree, pointerDL->getSequenceNames(), returnCallback, treeCallback);
+		}
+		else
+		{
+			progress.setCancelled();
+		}
 
 		delete myTree;
 		delete myPB;
-		delete sequenceNames;
+		delete placement;
+		delete alg;
+		ctx->progress = NULL;
+		return 0;
+	}
 
-		string treeString = myOut.str();
+	// Adds sequences to a tree built earlier, instead of building a new tree from all of them. The first tree->leafCount sequences of the alignment are those of the tree,
+	// in the order given by tree->leafNameIndices, and the other ones are attached one after the other to the edges that fit their distances best, which takes time linear
+	// in the number of leaves for each of them. With rearrangementPasses > 0, the new sequences are then removed and placed again that many times, so that each of them
+	// also takes the ones placed after it into account. The branch lengths of the tree are kept, except for the edges to which sequences are attached, and the tree has
+	// no bootstrap counts. It is passed to returnCallback as a Newick string, or to treeCallback if it is not NULL.
+	// The distances are always computed by the distance kernels, even with KERNEL_LIBRARY. Returns -1 if the type of the alignment is unknown or the context does not use
+	// fastdist, or if tree is not a tree of the first sequences in the layout of a tree_callback.
+	DLL_PUBLIC int ContextPlaceSequencesInTree(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, const rapidNJTree* tree, int rearrangementPasses, progress_callback callback, return_callback returnCallback, tree_callback treeCallback)
+	{
+		if (getInputType(inputType) == UNKNOWN || !ctx->options.fastdist)
+		{
+			return -1;
+		}
 
-		returnCallback(treeString.length(), treeString.c_str());
+		dataloaderPointer* pointerDL = loadDistanceAlignment(ctx, inputType, inputSequenceCount, inputSequenceLength, inputSequenceNamesLengths, inputSequenceNames, inputSequenceData);
+		int retVal = placeSequencesInTree(ctx, pointerDL, tree, rearrangementPasses, callback, returnCallback, treeCallback);
+		delete pointerDL;
+		return retVal;
+	}
+
+	// Same as ContextPlaceSequencesInTree, with the bit strings of ContextBuildTreeFromEncodedAlignment, so that the sequences of the tree do not need to be encoded again.
+	// inputBitStringsCount must also be a multiple of 4.
+	DLL_PUBLIC int ContextPlaceEncodedSequencesInTree(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, unsigned int** inputBitStrings, unsigned int** inputGapFilters, int inputBitStringsCount, const rapidNJTree* tree, int rearrangementPasses, progress_callback callback, return_callback returnCallback, tree_callback treeCallback)
+	{
+		InputType type = getInputType(inputType);
+
+		if (type == UNKNOWN || inputBitStringsCount < (int)dataloaderPointer::getMinimumBitStringsCount(type, inputSequenceLength) || (type == DNA && inputGapFilters == NULL))
+		{
+			return -1;
+		}
+
+		resetStatistics(ctx);
+		configureNumberOfCores(ctx);
+
+		dataloaderPointer* pointerDL = new dataloaderPointer(type, inputSequenceCount, inputSequenceLength, inputSequenceNamesLengths, inputSequenceNames, inputBitStrings, inputGapFilters, inputBitStringsCount);
+		int retVal = placeSequencesInTree(ctx, pointerDL, tree, rearrangementPasses, callback, returnCallback, treeCallback);
+		delete pointerDL;
+		return retVal;
+	}
+
+	struct threadStateBatch {
+		rapidNJContext* ctx;
+		int alignmentCount;
+		int* inputTypes;
+		int* inputSequenceCounts;
+		int* inputSequenceLengths;
+		int** inputSequenceNamesLengths;
+		char*** inputSequenceNames;
+		char*** inputSequenceData;
+		batch_return_callback returnCallback;
+		// Alignments in the order in which they are taken by the workers.
+		vector<int> order;
+		// Seed of the generator of the worker for each alignment, so that the replicates of an alignment do not depend on the worker that builds its tree.
+		vector<unsigned long long> seeds;
+		int nextAlignment;
+		int finishedAlignments;
+		pthread_mutex_t mutex;
+	};
+
+	// Each worker builds whole trees one after the other, single-threaded, with its own copy of the options and a distance matrix that is kept from one tree to the next.
+	static void batchTask(void* arg, int /*workerIndex*/, int /*workerCount*/)
+	{
+		threadStateBatch* state = (threadStateBatch*)arg;
+
+		rapidNJContext* workerCtx = new rapidNJContext();
+		workerCtx->options = state->ctx->options;
+		workerCtx->options.cores = 1;
+		workerCtx->options.verbose = false;
+		// All the trees of the batch would share the same file.
+		workerCtx->options.checkpointFile = "";
+		workerCtx->numCores = 1;
+		workerCtx->distanceMatrixInput = false;
+		workerCtx->distanceMatrixFromPointer = false;
+		workerCtx->statistics = state->ctx->statistics;
+		// The workers stop when the batch is cancelled, but only report the progress of the batch as a whole.
+		workerCtx->progress = state->ctx->progress;
+		workerCtx->matrixBuffer = new distanceMatrixBuffer();
+
+		ProgressBar* workerPB = new ProgressBar();
+		ostringstream workerOut;
+
+		while (true)
+		{
+			pthread_mutex_lock(&state->mutex);
+			int position = state->nextAlignment;
+			state->nextAlignment++;
+			pthread_mutex_unlock(&state->mutex);
+
+			if (position >= state->alignmentCount || isCallCancelled(workerCtx))
+			{
+				break;
+			}
+
+			int index = state->order[position];
+			int inputType = state->inputTypes[index];
+			int sequenceCount = state->inputSequenceCounts[index];
+			int sequenceLength = state->inputSequenceLengths[index];
+
+			workerCtx->random.seed(state->seeds[index]);
+			bool packProteins = usePackedProteins(workerCtx, inputType, sequenceCount, sequenceLength, true);
+			workerCtx->distanceMatrixInput = false;
+			workerCtx->distanceMatrixFromPointer = false;
+
+			dataloaderPointer* pointerDL;
+			{
+				phaseTimer timer(workerCtx->statistics, &rapidNJStatistics::encoding);
+				pointerDL = new dataloaderPointer(getInputType(inputType), sequenceCount, sequenceLength, state->inputSequenceNamesLengths[index], state->inputSequenceNames[index], state->inputSequenceData[index], 1, packProteins);
+			}
+
+			workerOut.str("");
+			workerOut.clear();
+			polytree* tree = buildLoaderTree(workerCtx, pointerDL, workerOut, workerPB);
+			if (tree == NULL)
+			{
+				delete pointerDL;
+				break;
+			}
+
+			string treeString;
+			{
+				phaseTimer timer(workerCtx->statistics, &rapidNJStatistics::serialization);
+				tree->serialize_tree(workerOut);
+				treeString = workerOut.str();
+			}
+
+			// The callback is never called by two workers at the same time.
+			pthread_mutex_lock(&state->mutex);
+			state->returnCallback(index, treeString.length(), treeString.c_str());
+			state->finishedAlignments++;
+			state->ctx->progress->setProgress((double)state->finishedAlignments / state->alignmentCount);
+			pthread_mutex_unlock(&state->mutex);
+
+			delete tree;
+			delete pointerDL;
+		}
+
+		delete workerPB;
+		delete workerCtx->matrixBuffer;
+		workerCtx->matrixBuffer = NULL;
+		// The statistics belong to the context of the call.
+		workerCtx->statistics = NULL;
+		workerCtx->progress = NULL;
+		delete workerCtx;
+	}
+
+	// Builds the trees of many alignments, each with the options of the context. The trees are built concurrently on the cores of the context, one tree per core, and each is
+	// passed to returnCallback as a Newick string together with the index of its alignment, in the order in which they are finished. Bootstrap replicates are computed one at
+	// a time by the core that built the tree. The distance matrices are only reused from one tree to the next with NJ_ENGINE_PARALLEL
+	// and NJ_ENGINE_RELAXED.
+	// Returns -1 without building any tree if the type of an alignment is unknown.
+	DLL_PUBLIC int ContextBuildTreesFromAlignments(rapidNJContext* ctx, int alignmentCount, int* inputTypes, int* inputSequenceCounts, int* inputSequenceLengths, int** inputSequenceNamesLengths, char*** inputSequenceNames, char*** inputSequenceData, batch_return_callback returnCallback)
+	{
+		for (int i = 0; i < alignmentCount; i++)
+		{
+			if (getInputType(inputTypes[i]) == UNKNOWN)
+			{
+				return -1;
+			}
+		}
+
+		resetStatistics(ctx);
+		configureNumberOfCores(ctx);
+
+		if (alignmentCount < 1)
+		{
+			return 0;
+		}
+
+		threadStateBatch* state = new threadStateBatch();
+		state->ctx = ctx;
+		state->alignmentCount = alignmentCount;
+		state->inputTypes = inputTypes;
+		state->inputSequenceCounts = inputSequenceCounts;
+		state->inputSequenceLengths = inputSequenceLengths;
+		state->inputSequenceNamesLengths = inputSequenceNamesLengths;
+		state->inputSequenceNames = inputSequenceNames;
+		state->inputSequenceData = inputSequenceData;
+		state->returnCallback = returnCallback;
+		state->nextAlignment = 0;
+		state->finishedAlignments = 0;
+		pthread_mutex_init(&state->mutex, NULL);
+
+		// The largest alignments are started first, so that the last trees to finish are small ones and the workers stay busy until the end.
+		vector<pair<double, int> > work;
+		for (int i = 0; i < alignmentCount; i++)
+		{
+			work.push_back(make_pair(-(double)inputSequenceCounts[i] * inputSequenceCounts[i] * max(inputSequenceLengths[i], 1), i));
+		}
+		sort(work.begin(), work.end());
+		for (int i = 0; i < alignmentCount; i++)
+		{
+			state->order.push_back(work[i].second);
+			state->seeds.push_back(ctx->random());
+		}
+
+		int workers = min(ctx->numCores, alignmentCount);
+		if (ctx->options.verbose)
+		{
+			cerr << "Building " << alignmentCount << " trees on " << workers << " core(s)" << endl;
+		}
+
+		// The batch has no progress callback, so only the block of the context receives the progress.
+		callProgress progress(ctx->progressBlock, NULL, 0);
+		ctx->progress = &progress;
+
+		workerPool pool(workers);
+		pool.run(batchTask, (void*)state);
+
+		if (state->finishedAlignments < alignmentCount)
+		{
+			progress.setCancelled();
+		}
+		ctx->progress = NULL;
+
+		pthread_mutex_destroy(&state->mutex);
+		delete state;
+		return 0;
+	}
+
+	// Starts the threads shared by all the calls, instead of letting them start the first time they are needed. With threadCount threads, as many workers can run in
+	// addition to the threads calling the library; 0 runs everything on the calling threads. If cpuCount > 0, thread i is bound to the processor cpus[i % cpuCount] on
+	// Windows and Linux. Returns -1 if threadCount < 0.
+	DLL_PUBLIC int InitializeRapidNJThreadPool(int threadCount, int cpuCount, int* cpus)
+	{
+		if (threadCount < 0)
+		{
+			return -1;
+		}
+		vector<int> cpuList;
+		for (int i = 0; i < cpuCount; i++)
+		{
+			cpuList.push_back(cpus[i]);
+		}
+		startSharedWorkers(threadCount, cpuList);
+		return 0;
+	}
+
+	// Stops the shared threads once they are idle. They are started again by the next call that needs them. Must not be called from a callback.
+	DLL_PUBLIC void ShutdownRapidNJThreadPool()
+	{
+		stopSharedWorkers();
+	}
+
+	// Keeps the distance matrices of the last alignments used by any call, up to maxMemory MB in total, so that the next calls with the same alignment, model and type of
+	// sequences do not compute them again. The matrices of bootstrap replicates and those computed by RapidDiskNJ are never cached. The cache is disabled until this is
+	// called, and 0 disables it again and frees the matrices. Returns -1 if maxMemory < 0.
+	DLL_PUBLIC int SetRapidNJDistanceCacheSize(int maxMemory)
+	{
+		if (maxMemory < 0)
+		{
+			return -1;
+		}
+		setDistanceCacheCapacity((size_t)maxMemory * 1024 * 1024);
+		return 0;
+	}
+
+	// Saves the tree built from an alignment, and then the bootstrap counts every interval replicates, in fileName, so that a call interrupted while computing the replicates
+	// can be made again with the same alignment and options and resume from the last checkpoint. The file is deleted once the call has finished. Checkpoints require
+	// fastdist alignments, and are not used by ContextBuildTreesFromAlignments. NULL or an empty name disables them; values of interval < 1 mean 1.
+	DLL_PUBLIC int SetRapidNJContextCheckpoint(rapidNJContext* ctx, const char* fileName, int interval)
+	{
+		ctx->options.checkpointFile = fileName != NULL ? fileName : "";
+		ctx->options.checkpointInterval = max(interval, 1);
+		return 0;
+	}
+
+	// Makes the calls that build trees with the context write their progress to the block, which belongs to the caller and can be read from any thread while they
+	// run, and stop as soon as possible once its cancel flag is set: the distance kernels stop between two tiles, the wrapper's engines between two iterations, and
+	// bootstrapping and placement between two replicates or sequences. The engines and distance estimators of the library cannot be interrupted, so they are only
+	// skipped if the call is cancelled before they start. Cancelled calls free their memory and return without calling the result callbacks, and set the cancelled
+	// field of the block; the checkpoint of a cancelled call is kept, see SetRapidNJContextCheckpoint. The progress callbacks of the calls are called at most once every
+	// callbackInterval milliseconds, and always with the last progress. NULL disables the block. Returns -1 if callbackInterval < 0.
+	DLL_PUBLIC int SetRapidNJContextProgress(rapidNJContext* ctx, rapidNJProgress* progress, int callbackInterval)
+	{
+		if (callbackInterval < 0)
+		{
+			return -1;
+		}
+		ctx->progressBlock = progress;
+		ctx->progressInterval = callbackInterval / 1000.0;
+		return 0;
+	}
+
+	// Entry points with all the options passed at once. Each call uses its own context, thus they can be safely called from multiple threads.
+
+	// The context of the entry points that predate contexts, which keep the library distance estimators and compute bootstrap replicates one at a time, as they always did.
+	// The columns of the replicates are drawn by dataloaderBootstrap from the generator of the context, though, not by dataloader::sample_sequences: it resamples the
+	// bit strings in place with rand(), whose state is shared by all the calls of the process, and the bit strings of dataloaderPointer are not allocated one by one.
+	static rapidNJContext* createLegacyContext()
+	{
+		rapidNJContext* ctx = CreateRapidNJContext();
+		SetRapidNJContextOption(ctx, OPTION_DISTANCE_KERNEL, KERNEL_LIBRARY);
+		SetRapidNJContextOption(ctx, OPTION_PARALLEL_BOOTSTRAP, 0);
+		return ctx;
+	}
+
+	DLL_PUBLIC void BuildTreeFromAlignment(int maxMemory, int distance, int numCores, int bootstrapReplicates, int inputType, bool allowNegativeBranches, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, progress_callback callback, return_callback returnCallback, bool verbose)
+	{
+		rapidNJContext* ctx = createLegacyContext();
+
+		SetRapidNJContextOption(ctx, OPTION_MAX_MEMORY, maxMemory);
+		SetRapidNJContextOption(ctx, OPTION_DISTANCE, distance);
+		SetRapidNJContextOption(ctx, OPTION_NUM_CORES, numCores);
+		SetRapidNJContextOption(ctx, OPTION_ALLOW_NEGATIVE_BRANCHES, allowNegativeBranches);
+		SetRapidNJContextOption(ctx, OPTION_VERBOSE, verbose);
+		ctx->options.replicates = bootstrapReplicates;
+
+		ContextBuildTreeFromAlignment(ctx, inputType, inputSequenceCount, inputSequenceLength, inputSequenceNamesLengths, inputSequenceNames, inputSequenceData, callback, returnCallback);
+
+		DestroyRapidNJContext(ctx);
+	}
+
+	DLL_PUBLIC void BuildDistanceMatrixFromAlignment(int maxMemory, int distance, int numCores, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, distType** outputMatrix, bool verbose)
+	{
+		rapidNJContext* ctx = createLegacyContext();
+
+		SetRapidNJContextOption(ctx, OPTION_MAX_MEMORY, maxMemory);
+		SetRapidNJContextOption(ctx, OPTION_DISTANCE, distance);
+		SetRapidNJContextOption(ctx, OPTION_NUM_CORES, numCores);
+		SetRapidNJContextOption(ctx, OPTION_VERBOSE, verbose);
+
+		ContextBuildDistanceMatrixFromAlignment(ctx, inputType, inputSequenceCount, inputSequenceLength, inputSequenceNamesLengths, inputSequenceNames, inputSequenceData, outputMatrix);
+
+		DestroyRapidNJContext(ctx);
+	}
+
+	DLL_PUBLIC void BuildTreeFromDistanceMatrix(int maxMemory, int numCores, bool allowNegativeBranches, int inputSequenceCount, int* inputSequenceNamesLengths, char** inputSequenceNames, bool halfMatrix, distType** distMatrix, progress_callback callback, return_callback returnCallback, bool verbose)
+	{
+		rapidNJContext* ctx = createLegacyContext();
+
+		SetRapidNJContextOption(ctx, OPTION_MAX_MEMORY, maxMemory);
+		SetRapidNJContextOption(ctx, OPTION_NUM_CORES, numCores);
+		SetRapidNJContextOption(ctx, OPTION_ALLOW_NEGATIVE_BRANCHES, allowNegativeBranches);
+		SetRapidNJContextOption(ctx, OPTION_VERBOSE, verbose);
+
+		ContextBuildTreeFromDistanceMatrix(ctx, inputSequenceCount, inputSequenceNamesLengths, inputSequenceNames, halfMatrix, distMatrix, callback, returnCallback);
+
+		DestroyRapidNJContext(ctx);
 	}
 }
 
@@ -3,6 +3,8 @@
 
 #include "stdinclude.h"
 #include "dataLoaderPointer.hpp"
+#include "dataLoaderBootstrap.hpp"
+#include "dataLoaderUnique.hpp"
 #include "rapidNJ.h"
 #include "rapidNJ.h"
 #include "rapidNJDisk.h"
@@ -10,9 +12,22 @@
 #include "simpleNJ.h"
 #include "JCdistance.hpp"
 #include "KimuraDistance.hpp"
+#include "kernelDistance.hpp"
+#include "gpuDistance.hpp"
+#include "rapidNJParallel.hpp"
+#include "workerPool.hpp"
 #include "ProgressBar.hpp"
+#include "rapidNJContext.h"
+#include "treeExport.hpp"
+#include "memoryModel.hpp"
+#include "matrixFile.hpp"
+#include "bootstrapSupport.hpp"
+#include "treePlacement.hpp"
+#include "distanceCache.hpp"
+#include "treeCheckpoint.hpp"
 #include <iomanip>
 #include <sstream>
+#include <climits>
 
 #define BUILDING_DLL 1
 #define PTW32_STATIC_LIB 1
@@ -46,10 +61,42 @@
 #endif
 
 typedef void (*return_callback)(size_t, const char*);
+/*Receives the Newick string of the tree of one alignment of a batch, with the index of the alignment.*/
+typedef void (*batch_return_callback)(int, size_t, const char*);
+/*Receives rows firstRow to firstRow + rowCount - 1 of the lower triangle of a distance matrix, in no particular order: rows[k] holds the distances between sequence
+firstRow + k and sequences 0 to firstRow + k, and is only valid during the call.*/
+typedef void (*distance_rows_callback)(int, int, distType**);
 
 extern "C"
 {
+	DLL_PUBLIC rapidNJContext* CreateRapidNJContext();
+	DLL_PUBLIC int SetRapidNJContextOption(rapidNJContext* ctx, int option, int value);
+	DLL_PUBLIC void DestroyRapidNJContext(rapidNJContext* ctx);
+	DLL_PUBLIC int GetRapidNJContextStatistics(rapidNJContext* ctx, rapidNJStatistics* statistics);
+	DLL_PUBLIC int ContextPlanTreeFromAlignment(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, rapidNJPlan* plan);
+	DLL_PUBLIC void ContextPlanTreeFromDistanceMatrix(rapidNJContext* ctx, int inputSequenceCount, bool halfMatrix, rapidNJPlan* plan);
+	DLL_PUBLIC void ContextBuildTreeFromAlignment(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, progress_callback callback, return_callback returnCallback);
+	DLL_PUBLIC void ContextBuildDistanceMatrixFromAlignment(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, distType** outputMatrix);
+	DLL_PUBLIC void ContextBuildHalfDistanceMatrixFromAlignment(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, distType** outputMatrix);
+	DLL_PUBLIC void ContextStreamDistanceMatrixFromAlignment(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, distance_rows_callback rowsCallback);
+	DLL_PUBLIC void ContextBuildTreeFromDistanceMatrix(rapidNJContext* ctx, int inputSequenceCount, int* inputSequenceNamesLengths, char** inputSequenceNames, bool halfMatrix, distType** distMatrix, progress_callback callback, return_callback returnCallback);
+	DLL_PUBLIC void ContextBuildStructuredTreeFromAlignment(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, progress_callback callback, tree_callback treeCallback);
+	DLL_PUBLIC void ContextBuildTreeFromContiguousAlignment(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, const char* inputSequenceData, long long inputSequenceStride, progress_callback callback, return_callback returnCallback, tree_callback treeCallback);
+	DLL_PUBLIC int ContextBuildTreeFromEncodedAlignment(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, unsigned int** inputBitStrings, unsigned int** inputGapFilters, int inputBitStringsCount, progress_callback callback, return_callback returnCallback, tree_callback treeCallback);
+	DLL_PUBLIC void ContextBuildStructuredTreeFromDistanceMatrix(rapidNJContext* ctx, int inputSequenceCount, int* inputSequenceNamesLengths, char** inputSequenceNames, bool halfMatrix, distType** distMatrix, progress_callback callback, tree_callback treeCallback);
+	DLL_PUBLIC int ContextBuildTreeFromStridedDistanceMatrix(rapidNJContext* ctx, int inputSequenceCount, int* inputSequenceNamesLengths, char** inputSequenceNames, bool halfMatrix, distType* distMatrix, long long rowStride, bool preserveMatrix, progress_callback callback, return_callback returnCallback, tree_callback treeCallback);
+	DLL_PUBLIC int ContextBuildTreeFromDistanceMatrixFile(rapidNJContext* ctx, const char* fileName, progress_callback callback, return_callback returnCallback, tree_callback treeCallback);
+	DLL_PUBLIC int WriteDistanceMatrixFile(const char* fileName, int inputSequenceCount, int* inputSequenceNamesLengths, char** inputSequenceNames, bool halfMatrix, distType** distMatrix);
+	DLL_PUBLIC int ContextPlaceSequencesInTree(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, const rapidNJTree* tree, int rearrangementPasses, progress_callback callback, return_callback returnCallback, tree_callback treeCallback);
+	DLL_PUBLIC int ContextPlaceEncodedSequencesInTree(rapidNJContext* ctx, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, unsigned int** inputBitStrings, unsigned int** inputGapFilters, int inputBitStringsCount, const rapidNJTree* tree, int rearrangementPasses, progress_callback callback, return_callback returnCallback, tree_callback treeCallback);
+	DLL_PUBLIC int SetRapidNJDistanceCacheSize(int maxMemory);
+	DLL_PUBLIC int SetRapidNJContextCheckpoint(rapidNJContext* ctx, const char* fileName, int interval);
+	DLL_PUBLIC int SetRapidNJContextProgress(rapidNJContext* ctx, rapidNJProgress* progress, int callbackInterval);
+	DLL_PUBLIC int InitializeRapidNJThreadPool(int threadCount, int cpuCount, int* cpus);
+	DLL_PUBLIC void ShutdownRapidNJThreadPool();
+	DLL_PUBLIC int ContextBuildTreesFromAlignments(rapidNJContext* ctx, int alignmentCount, int* inputTypes, int* inputSequenceCounts, int* inputSequenceLengths, int** inputSequenceNamesLengths, char*** inputSequenceNames, char*** inputSequenceData, batch_return_callback returnCallback);
+
 	DLL_PUBLIC void BuildTreeFromAlignment(int maxMemory, int distance, int numCores, int bootstrapReplicates, int inputType, bool allowNegativeBranches, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, progress_callback callback, return_callback returnCallback, bool verbose);
 	DLL_PUBLIC void BuildDistanceMatrixFromAlignment(int maxMemory, int distance, int numCores, int inputType, int inputSequenceCount, int inputSequenceLength, int* inputSequenceNamesLengths, char** inputSequenceNames, char** inputSequenceData, distType** outputMatrix, bool verbose);
 	DLL_PUBLIC void BuildTreeFromDistanceMatrix(int maxMemory, int numCores, bool allowNegativeBranches, int inputSequenceCount, int* inputSequenceNamesLengths, char** inputSequenceNames, bool halfMatrix, distType** distMatrix, progress_callback callback, return_callback returnCallback, bool verbose);
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -0,0 +1,173 @@
+#ifndef SEQUENCE_ENCODER_HPP
+#define SEQUENCE_ENCODER_HPP
+
+#include "stdinclude.h"
+#include "distanceKernels.h"
+
+/*Table-driven encoding of aligned sequences into fastdist bit strings. The encoding is the same as that of the rapidNJ dataloaders, without any branch in the inner loops.
+The encoder is immutable once constructed, so a single instance can be shared by several threads.*/
+class sequenceEncoder {
+
+public:
+	sequenceEncoder(InputType type) {
+		for (int c = 0; c < 256; c++) {
+			dnaCodes[c] = 0;
+			resolvedChars[c] = (char)c;
+		}
+
+		// Bits 0-1 hold the nucleotide, bit 2 is set for valid positions. Everything else (including U) is treated as a gap, like in the rapidNJ dataloaders.
+		dnaCodes['A'] = dnaCodes['a'] = 4 | Abin;
+		dnaCodes['C'] = dnaCodes['c'] = 4 | Cbin;
+		dnaCodes['G'] = dnaCodes['g'] = 4 | Gbin;
+		dnaCodes['T'] = dnaCodes['t'] = 4 | Tbin;
+
+		if (type == DNA) {
+			for (int c = 0; c < 256; c++) {
+				resolvedChars[c] = '-';
+			}
+			const char* valid = "aAcCgGtTuU";
+			for (int i = 0; valid[i] != 0; i++) {
+				resolvedChars[(unsigned char)valid[i]] = valid[i];
+			}
+		}
+		else {
+			const char* gaps = "-.XxzZbBJj?";
+			for (int i = 0; gaps[i] != 0; i++) {
+				resolvedChars[(unsigned char)gaps[i]] = '-';
+			}
+		}
+	}
+
+	/*Replaces ambiguous or unknown characters with gaps.*/
+	inline char resolveChar(char c) const {
+		return resolvedChars[(unsigned char)c];
+	}
+
+	/*Encodes a DNA sequence into a bit string and gap filter of bitStringsCount 128-bit blocks. The padding is cleared.*/
+	void encodeDNASequence(unsigned int* bitString, unsigned int* gapFilter, const char* data, unsigned int sequenceLength, unsigned int bitStringsCount) const {
+		const unsigned char* chars = (const unsigned char*)data;
+		unsigned int words = bitStringsCount * 4;
+		unsigned int fullWords = sequenceLength / 16;
+
+		for (unsigned int w = 0; w < fullWords; w++) {
+			unsigned int bits = 0;
+			unsigned int valid = 0;
+			for (unsigned int k = 0; k < 16; k++) {
+				unsigned int code = dnaCodes[chars[w * 16 + k]];
+				bits |= (code & 3) << (k * 2);
+				valid |= (code >> 2) << (k * 2);
+			}
+			bitString[w] = bits;
+			gapFilter[w] = valid;
+		}
+
+		unsigned int w = fullWords;
+		if (sequenceLength % 16 != 0) {
+			unsigned int bits = 0;
+			unsigned int valid = 0;
+			for (unsigned int k = 0; k < sequenceLength % 16; k++) {
+				unsigned int code = dnaCodes[chars[w * 16 + k]];
+				bits |= (code & 3) << (k * 2);
+				valid |= (code >> 2) << (k * 2);
+			}
+			bitString[w] = bits;
+			gapFilter[w] = valid;
+			w++;
+		}
+
+		for (; w < words; w++) {
+			bitString[w] = 0;
+			gapFilter[w] = 0;
+		}
+	}
+
+	/*Encodes a protein sequence into a bit string of bitStringsCount 128-bit blocks. The padding is filled with gaps.*/
+	void encodeProteinSequence(unsigned int* bitString, const char* data, unsigned int sequenceLength, unsigned int bitStringsCount) const {
+		const unsigned char* chars = (const unsigned char*)data;
+		unsigned int words = bitStringsCount * 4;
+		unsigned int fullWords = sequenceLength / 4;
+
+		for (unsigned int w = 0; w < fullWords; w++) {
+			const unsigned char* c = chars + w * 4;
+			bitString[w] = (unsigned char)resolvedChars[c[0]] | ((unsigned char)resolvedChars[c[1]] << 8) | ((unsigned char)resolvedChars[c[2]] << 16) | ((unsigned int)(unsigned char)resolvedChars[c[3]] << 24);
+		}
+
+		unsigned int w = fullWords;
+		if (sequenceLength % 4 != 0) {
+			unsigned int word = 0;
+			for (unsigned int k = 0; k < 4; k++) {
+				unsigned char c = k < sequenceLength % 4 ? (unsigned char)resolvedChars[chars[w * 4 + k]] : (unsigned char)'-';
+				word |= (unsigned int)c << (k * 8);
+			}
+			bitString[w] = word;
+			w++;
+		}
+
+		const unsigned int gapWord = 0x2D2D2D2Du;
+		for (; w < words; w++) {
+			bitString[w] = gapWord;
+		}
+	}
+
+	/*Assigns the codes 1 to 31 of the packed protein encoding to the residues found in the sequences, and 0 to gaps. Residues are the characters left by resolveChar,
+	so that the packed sequences are at the same distances as those of encodeProteinSequence. Returns false if there are more than 31 distinct residues, which cannot be packed.*/
+	bool buildPackedProteinCodes(const char* const* data, unsigned int sequenceCount, unsigned int sequenceLength, unsigned char* codes) const {
+		bool present[256];
+		memset(present, 0, sizeof(present));
+		for (unsigned int i = 0; i < sequenceCount; i++) {
+			const unsigned char* chars = (const unsigned char*)data[i];
+			for (unsigned int k = 0; k < sequenceLength; k++) {
+				present[chars[k]] = true;
+			}
+		}
+
+		memset(codes, 0, 256);
+		unsigned int codeCount = 0;
+		for (int c = 0; c < 256; c++) {
+			unsigned char resolved = (unsigned char)resolvedChars[c];
+			if (present[c] && resolved != '-' && codes[resolved] == 0) {
+				if (++codeCount >= (1u << PACKED_PROTEIN_PLANES)) {
+					return false;
+				}
+				codes[resolved] = (unsigned char)codeCount;
+			}
+		}
+
+		// Characters that resolve to the same residue get its code.
+		for (int c = 0; c < 256; c++) {
+			codes[c] = codes[(unsigned char)resolvedChars[c]];
+		}
+		return true;
+	}
+
+	/*Encodes a protein sequence into the packed encoding of bitStringsCount 128-bit blocks, a multiple of PACKED_PROTEIN_PLANES, using the codes of buildPackedProteinCodes.
+	The padding is filled with gaps.*/
+	void encodePackedProteinSequence(unsigned int* bitString, const char* data, unsigned int sequenceLength, unsigned int bitStringsCount, const unsigned char* codes) const {
+		const unsigned char* chars = (const unsigned char*)data;
+		unsigned int chunkCount = bitStringsCount / PACKED_PROTEIN_PLANES;
+
+		for (unsigned int chunk = 0; chunk < chunkCount; chunk++) {
+			unsigned int* planes = bitString + chunk * PACKED_PROTEIN_PLANES * 4;
+			for (unsigned int w = 0; w < 4; w++) {
+				unsigned int words[PACKED_PROTEIN_PLANES] = { 0 };
+				unsigned int start = chunk * PACKED_PROTEIN_CHUNK_LENGTH + w * 32;
+				unsigned int end = min(start + 32, sequenceLength);
+				for (unsigned int i = start; i < end; i++) {
+					unsigned int code = codes[chars[i]];
+					for (unsigned int p = 0; p < PACKED_PROTEIN_PLANES; p++) {
+						words[p] |= ((code >> p) & 1) << (i - start);
+					}
+				}
+				for (unsigned int p = 0; p < PACKED_PROTEIN_PLANES; p++) {
+					planes[p * 4 + w] = words[p];
+				}
+			}
+		}
+	}
+
+private:
+	unsigned char dnaCodes[256];
+	char resolvedChars[256];
+};
+
+#endif
@@ -0,0 +1,2344 @@
+/*Tests of the engines and entry points of rapidNJWrapper on small synthetic alignments and distance matrices.
+
+Each test is registered with CTest under its own name, see CMakeLists.txt. The executable runs the tests named on its command line, or all of them without
+arguments, and returns 0 if they all pass, or 77 if they were all skipped because the machine cannot run them, which CTest reports as skipped. Failed checks are
+written to the standard error, with their file and line.
+
+Usage: rapidNJTests [test...]*/
+
+#include "rapidNJWrapper.h"
+#include "distanceCorrections.hpp"
+#include <random>
+#include <set>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <climits>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cctype>
+
+// Reports a failed check and makes the test return false.
+#define CHECK(condition) \
+	if (!(condition)) { \
+		cerr << __FILE__ << ":" << __LINE__ << ": check failed: " << #condition << endl; \
+		return false; \
+	}
+
+// Reports that the test cannot run on this machine and makes it return without checking anything.
+#define SKIP(reason) \
+	{ \
+		cerr << "skipping: " << reason << endl; \
+		testSkipped = true; \
+		return true; \
+	}
+
+typedef bool (*testFunction)();
+
+// Set by SKIP for the test being run.
+static bool testSkipped = false;
+
+/*A random alignment that evolved along a random tree, with the pointers expected by the entry points.*/
+struct testAlignment {
+	int sequenceCount;
+	int sequenceLength;
+	vector<string> names;
+	vector<int> nameLengths;
+	vector<char*> namePointers;
+	vector<string> sequences;
+	vector<char*> sequencePointers;
+};
+
+static const char dnaAlphabet[] = "ACGT";
+
+static void makeNames(int sequenceCount, vector<string>& names, vector<int>& nameLengths, vector<char*>& namePointers) {
+	names.resize(sequenceCount);
+	nameLengths.resize(sequenceCount);
+	namePointers.resize(sequenceCount);
+	for (int i = 0; i < sequenceCount; i++) {
+		ostringstream name;
+		name << "t" << i;
+		names[i] = name.str();
+	}
+	// The pointers are taken once all the names are stored, so that they cannot be invalidated.
+	for (int i = 0; i < sequenceCount; i++) {
+		nameLengths[i] = (int)names[i].length();
+		namePointers[i] = &names[i][0];
+	}
+}
+
+// Sets the pointers to the sequences, once they are all stored.
+static void updateSequencePointers(testAlignment& alignment) {
+	alignment.sequencePointers.resize(alignment.sequenceCount);
+	for (int i = 0; i < alignment.sequenceCount; i++) {
+		alignment.sequencePointers[i] = &alignment.sequences[i][0];
+	}
+}
+
+/*Makes a DNA alignment in which each sequence is a mutated copy of one of the previous ones.*/
+static void makeAlignment(int sequenceCount, int sequenceLength, unsigned int seed, testAlignment& alignment) {
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+	alignment.sequenceCount = sequenceCount;
+	alignment.sequenceLength = sequenceLength;
+	makeNames(sequenceCount, alignment.names, alignment.nameLengths, alignment.namePointers);
+	alignment.sequences.resize(sequenceCount);
+
+	alignment.sequences[0].resize(sequenceLength);
+	for (int j = 0; j < sequenceLength; j++) {
+		alignment.sequences[0][j] = dnaAlphabet[rng() % 4];
+	}
+	for (int i = 1; i < sequenceCount; i++) {
+		string& sequence = alignment.sequences[i];
+		sequence = alignment.sequences[rng() % i];
+		double substitutionRate = 0.01 + 0.09 * uniform(rng);
+		for (int j = 0; j < sequenceLength; j++) {
+			double draw = uniform(rng);
+			if (draw < 0.002) {
+				sequence[j] = '-';
+			}
+			else if (draw < substitutionRate || sequence[j] == '-') {
+				sequence[j] = dnaAlphabet[rng() % 4];
+			}
+		}
+	}
+	updateSequencePointers(alignment);
+}
+
+/*Makes a DNA alignment without gaps that evolved along a random binary tree, in which every branch has substitutions, so that the tree can be found from long enough
+sequences.*/
+static void makeTreeAlignment(int sequenceCount, int sequenceLength, unsigned int seed, testAlignment& alignment) {
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+	alignment.sequenceCount = sequenceCount;
+	alignment.sequenceLength = sequenceLength;
+	makeNames(sequenceCount, alignment.names, alignment.nameLengths, alignment.namePointers);
+	alignment.sequences.assign(1, string(sequenceLength, 'A'));
+	for (int j = 0; j < sequenceLength; j++) {
+		alignment.sequences[0][j] = dnaAlphabet[rng() % 4];
+	}
+	// A random lineage splits in two until there are enough of them, and both of its descendants are mutated.
+	while ((int)alignment.sequences.size() < sequenceCount) {
+		int lineage = rng() % alignment.sequences.size();
+		alignment.sequences.push_back(alignment.sequences[lineage]);
+		for (int copy = 0; copy < 2; copy++) {
+			string& sequence = copy == 0 ? alignment.sequences[lineage] : alignment.sequences.back();
+			double substitutionRate = 0.02 + 0.04 * uniform(rng);
+			for (int j = 0; j < sequenceLength; j++) {
+				if (uniform(rng) < substitutionRate) {
+					sequence[j] = dnaAlphabet[rng() % 4];
+				}
+			}
+		}
+	}
+	updateSequencePointers(alignment);
+}
+
+/*Makes an alignment of 101 columns whose last two sequences have distances that cannot be corrected: every column of the first is a transversion of sequence 0, and the
+second is made of gaps only. The last column is made of gaps only too.*/
+static void makeSaturatedAlignment(int sequenceCount, unsigned int seed, testAlignment& alignment) {
+	makeTreeAlignment(sequenceCount, 101, seed, alignment);
+	string& transversions = alignment.sequences[sequenceCount - 2];
+	transversions = alignment.sequences[0];
+	for (size_t k = 0; k < transversions.length(); k++) {
+		char base = transversions[k];
+		transversions[k] = base == 'A' ? 'C' : base == 'C' ? 'A' : base == 'G' ? 'T' : 'G';
+	}
+	alignment.sequences[sequenceCount - 1].assign(101, '-');
+	for (int i = 0; i < sequenceCount; i++) {
+		alignment.sequences[i][100] = '-';
+	}
+	updateSequencePointers(alignment);
+}
+
+static distType** allocateMatrix(int sequenceCount) {
+	distType** matrix = new distType*[sequenceCount];
+	for (int i = 0; i < sequenceCount; i++) {
+		matrix[i] = new distType[sequenceCount];
+	}
+	return matrix;
+}
+
+static void deleteMatrix(distType** matrix, int sequenceCount) {
+	for (int i = 0; i < sequenceCount; i++) {
+		delete[] matrix[i];
+	}
+	delete[] matrix;
+}
+
+static void noProgress(double /*progress*/) {
+}
+
+// The callbacks of the entry points take no argument to find the caller with, so the Newick string of each thread is stored where its test points to.
+static thread_local string* newickOutput = NULL;
+
+static void storeNewick(size_t length, const char* tree) {
+	newickOutput->assign(tree, length);
+}
+
+/*The calls of the concurrent_contexts test: the legacy entry points, which RapidNJ.cs calls from any thread, and a context with the parallel engine and seeded
+bootstrap replicates, whose results are reproducible too.*/
+enum concurrentCall {
+	CONCURRENT_LEGACY_TREE = 0,
+	CONCURRENT_LEGACY_MATRIX = 1,
+	CONCURRENT_LEGACY_MATRIX_TREE = 2,
+	CONCURRENT_CONTEXT_BOOTSTRAP = 3,
+	CONCURRENT_CALL_COUNT = 4
+};
+
+/*Input of the concurrent calls, shared by all the threads, and the results of the calls made on a single thread.*/
+struct concurrentInput {
+	const testAlignment* alignment;
+	distType** matrix;
+	vector<string> expected;
+};
+
+/*A thread of the concurrent_contexts test.*/
+struct concurrentThread {
+	const concurrentInput* input;
+	int firstCall;
+	int rounds;
+	bool passed;
+};
+
+// Returns the result of a call: a Newick string, or the bytes of the distance matrix.
+static string runConcurrentCall(const concurrentInput* input, int call) {
+	const testAlignment& alignment = *input->alignment;
+	int* nameLengths = (int*)&alignment.nameLengths[0];
+	char** names = (char**)&alignment.namePointers[0];
+	char** sequences = (char**)&alignment.sequencePointers[0];
+	string result;
+	newickOutput = &result;
+
+	switch (call) {
+	case CONCURRENT_LEGACY_TREE:
+		BuildTreeFromAlignment(1024, 0, 2, -1, 0, false, alignment.sequenceCount, alignment.sequenceLength, nameLengths, names, sequences, noProgress, storeNewick, false);
+		break;
+	case CONCURRENT_LEGACY_MATRIX: {
+		distType** matrix = allocateMatrix(alignment.sequenceCount);
+		BuildDistanceMatrixFromAlignment(1024, 1, 2, 0, alignment.sequenceCount, alignment.sequenceLength, nameLengths, names, sequences, matrix, false);
+		for (int i = 0; i < alignment.sequenceCount; i++) {
+			result.append((const char*)matrix[i], alignment.sequenceCount * sizeof(distType));
+		}
+		deleteMatrix(matrix, alignment.sequenceCount);
+		break;
+	}
+	case CONCURRENT_LEGACY_MATRIX_TREE:
+		BuildTreeFromDistanceMatrix(1024, 2, false, alignment.sequenceCount, nameLengths, names, false, input->matrix, noProgress, storeNewick, false);
+		break;
+	default: {
+		rapidNJContext* ctx = CreateRapidNJContext();
+		SetRapidNJContextOption(ctx, OPTION_NUM_CORES, 2);
+		SetRapidNJContextOption(ctx, OPTION_NJ_ENGINE, NJ_ENGINE_PARALLEL);
+		SetRapidNJContextOption(ctx, OPTION_BOOTSTRAP_REPLICATES, 5);
+		SetRapidNJContextOption(ctx, OPTION_BOOTSTRAP_SEED, 11);
+		ContextBuildTreeFromAlignment(ctx, 0, alignment.sequenceCount, alignment.sequenceLength, nameLengths, names, sequences, noProgress, storeNewick);
+		DestroyRapidNJContext(ctx);
+		break;
+	}
+	}
+
+	newickOutput = NULL;
+	return result;
+}
+
+static void* runConcurrentThread(void* arg) {
+	concurrentThread* thread = (concurrentThread*)arg;
+	thread->passed = true;
+	for (int round = 0; round < thread->rounds; round++) {
+		int call = (thread->firstCall + round) % CONCURRENT_CALL_COUNT;
+		if (runConcurrentCall(thread->input, call) != thread->input->expected[call]) {
+			thread->passed = false;
+		}
+	}
+	return NULL;
+}
+
+/*Makes the calls of concurrentCall from several threads at once, each with its own context, and checks that they give the same results as on a single thread.*/
+static bool testConcurrentContexts() {
+	const int threadCount = 8;
+	testAlignment alignment;
+	makeAlignment(150, 400, 1, alignment);
+
+	concurrentInput input;
+	input.alignment = &alignment;
+	input.matrix = allocateMatrix(alignment.sequenceCount);
+	// The trees of the matrix calls are built from the matrix of the legacy entry point, which RapidNJ.cs passes back the same way.
+	BuildDistanceMatrixFromAlignment(1024, 1, 2, 0, alignment.sequenceCount, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0], input.matrix, false);
+	for (int call = 0; call < CONCURRENT_CALL_COUNT; call++) {
+		input.expected.push_back(runConcurrentCall(&input, call));
+	}
+
+	vector<concurrentThread> threads(threadCount);
+	vector<pthread_t> handles(threadCount);
+	for (int i = 0; i < threadCount; i++) {
+		threads[i].input = &input;
+		threads[i].firstCall = i;
+		threads[i].rounds = CONCURRENT_CALL_COUNT;
+		pthread_create(&handles[i], NULL, runConcurrentThread, (void*)&threads[i]);
+	}
+	bool passed = true;
+	for (int i = 0; i < threadCount; i++) {
+		pthread_join(handles[i], NULL);
+		passed = passed && threads[i].passed;
+	}
+	deleteMatrix(input.matrix, alignment.sequenceCount);
+
+	for (int call = 0; call < CONCURRENT_CALL_COUNT; call++) {
+		CHECK(input.expected[call].length() > 0);
+	}
+	CHECK(passed);
+	return true;
+}
+
+/*The non-trivial splits of an unrooted tree, each given by the leaves on the side that does not contain leaf 0. Leaves are identified by the index of their name.*/
+typedef set<vector<char> > splitSet;
+
+// Returns the split between the leaves flagged in side and the other leaves, given by the side that does not contain leaf 0.
+static vector<char> normalizeSplit(vector<char> side) {
+	if (side[0]) {
+		for (size_t i = 0; i < side.size(); i++) {
+			side[i] = !side[i];
+		}
+	}
+	return side;
+}
+
+// Whether the split separates fewer than 2 leaves from the others, which all the trees have.
+static bool isTrivialSplit(const vector<char>& side) {
+	int count = 0;
+	for (size_t i = 0; i < side.size(); i++) {
+		count += side[i];
+	}
+	return count < 2 || count > (int)side.size() - 2;
+}
+
+static void addSplit(splitSet& splits, const vector<char>& side) {
+	if (!isTrivialSplit(side)) {
+		splits.insert(normalizeSplit(side));
+	}
+}
+
+// Returns the leaves below each node of the tree.
+static vector<vector<char> > getNodeLeaves(const rapidNJTree* tree) {
+	vector<vector<char> > leaves(tree->nodeCount, vector<char>(tree->leafCount, 0));
+	for (int i = 0; i < tree->leafCount; i++) {
+		leaves[i][tree->leafNameIndices[i]] = 1;
+	}
+	// Internal nodes are created after their children.
+	for (int i = tree->leafCount; i < tree->nodeCount; i++) {
+		const vector<char>& left = leaves[tree->leftChildIndices[i - tree->leafCount]];
+		const vector<char>& right = leaves[tree->rightChildIndices[i - tree->leafCount]];
+		for (int j = 0; j < tree->leafCount; j++) {
+			leaves[i][j] = left[j] | right[j];
+		}
+	}
+	return leaves;
+}
+
+static splitSet getTreeSplits(const rapidNJTree* tree) {
+	splitSet splits;
+	vector<vector<char> > leaves = getNodeLeaves(tree);
+	for (int i = 0; i < tree->nodeCount; i++) {
+		addSplit(splits, leaves[i]);
+	}
+	return splits;
+}
+
+// The splits of the trees passed to storeSplits, on the thread of the test.
+static thread_local splitSet* splitsOutput = NULL;
+
+static void storeSplits(const rapidNJTree* tree) {
+	*splitsOutput = getTreeSplits(tree);
+}
+
+static splitSet getPolytreeSplits(polytree* tree, vector<string>* sequenceNames) {
+	splitSet splits;
+	splitsOutput = &splits;
+	exportTree(tree, sequenceNames, 0, storeSplits);
+	splitsOutput = NULL;
+	return splits;
+}
+
+/*A distance matrix that is exactly additive on a random binary tree, whose branches are long enough for all the engines, whatever their storage, to find the tree.*/
+struct additiveMatrix {
+	int sequenceCount;
+	vector<string> names;
+	vector<int> nameLengths;
+	vector<char*> namePointers;
+	// Full matrix, as a single array of rows.
+	vector<distType> distances;
+	splitSet splits;
+};
+
+static void makeAdditiveMatrix(int sequenceCount, unsigned int seed, additiveMatrix& matrix) {
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<double> branchLength(0.05, 0.15);
+
+	matrix.sequenceCount = sequenceCount;
+	makeNames(sequenceCount, matrix.names, matrix.nameLengths, matrix.namePointers);
+	matrix.distances.assign((size_t)sequenceCount * sequenceCount, 0);
+	matrix.splits.clear();
+
+	// Random clusters are joined until two are left, and each leaf keeps its distance to the root of its cluster.
+	vector<vector<int> > clusters(sequenceCount);
+	vector<double> depths(sequenceCount, 0);
+	for (int i = 0; i < sequenceCount; i++) {
+		clusters[i].push_back(i);
+	}
+	while (clusters.size() > 1) {
+		int a = rng() % clusters.size();
+		int b = rng() % (clusters.size() - 1);
+		b += b >= a ? 1 : 0;
+		double lengthA = branchLength(rng);
+		double lengthB = clusters.size() == 2 ? 0 : branchLength(rng);
+		for (size_t i = 0; i < clusters[a].size(); i++) {
+			for (size_t j = 0; j < clusters[b].size(); j++) {
+				int x = clusters[a][i];
+				int y = clusters[b][j];
+				double distance = depths[x] + lengthA + lengthB + depths[y];
+				matrix.distances[(size_t)x * sequenceCount + y] = matrix.distances[(size_t)y * sequenceCount + x] = (distType)distance;
+			}
+		}
+		for (size_t i = 0; i < clusters[a].size(); i++) {
+			depths[clusters[a][i]] += lengthA;
+		}
+		for (size_t j = 0; j < clusters[b].size(); j++) {
+			depths[clusters[b][j]] += lengthB;
+		}
+		clusters[a].insert(clusters[a].end(), clusters[b].begin(), clusters[b].end());
+		clusters.erase(clusters.begin() + b);
+
+		vector<char> side(sequenceCount, 0);
+		for (size_t i = 0; i < clusters[a < b ? a : a - 1].size(); i++) {
+			side[clusters[a < b ? a : a - 1][i]] = 1;
+		}
+		addSplit(matrix.splits, side);
+	}
+}
+
+static vector<distType> getLowerTriangle(const additiveMatrix& matrix) {
+	vector<distType> lowerTriangle;
+	for (int i = 0; i < matrix.sequenceCount; i++) {
+		for (int j = 0; j <= i; j++) {
+			lowerTriangle.push_back(matrix.distances[(size_t)i * matrix.sequenceCount + j]);
+		}
+	}
+	return lowerTriangle;
+}
+
+template <class storageType>
+static splitSet buildParallelSplits(additiveMatrix& matrix, int sortedMatrixSize, bool relaxed, int threads) {
+	vector<distType> lowerTriangle = getLowerTriangle(matrix);
+	ProgressBar pb(noProgress);
+	rapidNJParallel<storageType>* nj = new rapidNJParallel<storageType>(&lowerTriangle[0], &matrix.names, matrix.sequenceCount, sortedMatrixSize, false, &pb, threads);
+	nj->setRelaxed(relaxed);
+	polytree* tree = nj->run();
+	delete nj;
+	splitSet splits = getPolytreeSplits(tree, &matrix.names);
+	delete tree;
+	return splits;
+}
+
+static int countCommonSplits(const splitSet& splits, const splitSet& otherSplits) {
+	int count = 0;
+	for (splitSet::const_iterator it = splits.begin(); it != splits.end(); ++it) {
+		count += (int)otherSplits.count(*it);
+	}
+	return count;
+}
+
+template <class storageType>
+static bool checkParallelEngine(additiveMatrix& matrix, int sortedMatrixSize) {
+	CHECK(buildParallelSplits<storageType>(matrix, sortedMatrixSize, false, 1) == matrix.splits);
+	CHECK(buildParallelSplits<storageType>(matrix, sortedMatrixSize, false, 4) == matrix.splits);
+	// Relaxed joins can join clusters that are not neighbors in the tree, even on additive matrices, but they give the same tree whatever the number of workers.
+	splitSet relaxedSplits = buildParallelSplits<storageType>(matrix, sortedMatrixSize, true, 1);
+	CHECK(buildParallelSplits<storageType>(matrix, sortedMatrixSize, true, 4) == relaxedSplits);
+	CHECK(countCommonSplits(relaxedSplits, matrix.splits) >= 0.95 * matrix.splits.size());
+	return true;
+}
+
+/*Algorithms and engines of the parallel_engine test that are run through a context.*/
+struct contextEngine {
+	int algorithm;
+	int njEngine;
+};
+
+static const contextEngine contextEngines[] = {
+	{ TREE_ALGORITHM_RAPIDNJ, NJ_ENGINE_LIBRARY },
+	{ TREE_ALGORITHM_RAPIDNJ, NJ_ENGINE_PARALLEL },
+	{ TREE_ALGORITHM_RAPIDNJ_MEMORY_EFFICIENT, NJ_ENGINE_LIBRARY },
+	{ TREE_ALGORITHM_RAPIDNJ_MEMORY_EFFICIENT, NJ_ENGINE_PARALLEL },
+	{ TREE_ALGORITHM_SIMPLE_NJ, NJ_ENGINE_LIBRARY }
+};
+
+// The options that force an algorithm are not exposed through SetRapidNJContextOption, so they are set directly, like in the benchmark.
+static splitSet buildContextSplits(additiveMatrix& matrix, contextEngine engine) {
+	rapidNJContext* ctx = CreateRapidNJContext();
+	SetRapidNJContextOption(ctx, OPTION_NUM_CORES, 4);
+	SetRapidNJContextOption(ctx, OPTION_NJ_ENGINE, engine.njEngine);
+	if (engine.algorithm == TREE_ALGORITHM_RAPIDNJ) {
+		ctx->options.rapidNJ = true;
+	}
+	else if (engine.algorithm == TREE_ALGORITHM_RAPIDNJ_MEMORY_EFFICIENT) {
+		ctx->options.percentageMemoryUsage = "20";
+	}
+	else {
+		ctx->options.simpleNJ = true;
+	}
+
+	// The engines update the matrix in place.
+	distType** rows = allocateMatrix(matrix.sequenceCount);
+	for (int i = 0; i < matrix.sequenceCount; i++) {
+		memcpy(rows[i], &matrix.distances[(size_t)i * matrix.sequenceCount], matrix.sequenceCount * sizeof(distType));
+	}
+	splitSet splits;
+	splitsOutput = &splits;
+	ContextBuildStructuredTreeFromDistanceMatrix(ctx, matrix.sequenceCount, &matrix.nameLengths[0], &matrix.namePointers[0], false, rows, noProgress, storeSplits);
+	splitsOutput = NULL;
+	deleteMatrix(rows, matrix.sequenceCount);
+	DestroyRapidNJContext(ctx);
+	return splits;
+}
+
+/*Checks that rapidNJParallel finds the tree of additive matrices, like the library engines do, with each storage type, with complete and truncated sorted rows,
+and with one or several workers. Relaxed joins are only checked to be reproducible and close to the tree.*/
+static bool testParallelEngine() {
+	for (unsigned int seed = 1; seed <= 3; seed++) {
+		additiveMatrix matrix;
+		makeAdditiveMatrix(120, seed, matrix);
+		CHECK(matrix.splits.size() == (size_t)matrix.sequenceCount - 3);
+
+		int sortedMatrixSizes[] = { matrix.sequenceCount, 6 };
+		for (int k = 0; k < 2; k++) {
+			CHECK(checkParallelEngine<distType>(matrix, sortedMatrixSizes[k]));
+			CHECK(checkParallelEngine<halfDistance>(matrix, sortedMatrixSizes[k]));
+			CHECK(checkParallelEngine<bfloat16Distance>(matrix, sortedMatrixSizes[k]));
+		}
+
+		for (size_t e = 0; e < sizeof(contextEngines) / sizeof(contextEngines[0]); e++) {
+			CHECK(buildContextSplits(matrix, contextEngines[e]) == matrix.splits);
+		}
+	}
+	return true;
+}
+
+/*The joins of a random binary tree, as passed to addInternalNode: internal node leafCount + i joins leftChildren[i] and rightChildren[i], and the last two nodes are
+joined by the root edge.*/
+struct joinOrder {
+	int leafCount;
+	vector<int> leftChildren;
+	vector<int> rightChildren;
+	int rootLeftIndex;
+	int rootRightIndex;
+};
+
+static void makeJoinOrder(int leafCount, std::mt19937& rng, joinOrder& order) {
+	order.leafCount = leafCount;
+	order.leftChildren.clear();
+	order.rightChildren.clear();
+	vector<int> clusters(leafCount);
+	for (int i = 0; i < leafCount; i++) {
+		clusters[i] = i;
+	}
+	while (clusters.size() > 2) {
+		int a = rng() % clusters.size();
+		int b = rng() % (clusters.size() - 1);
+		b += b >= a ? 1 : 0;
+		order.leftChildren.push_back(clusters[a]);
+		order.rightChildren.push_back(clusters[b]);
+		clusters[a] = leafCount + (int)order.leftChildren.size() - 1;
+		clusters.erase(clusters.begin() + b);
+	}
+	order.rootLeftIndex = clusters[0];
+	order.rootRightIndex = clusters[1];
+}
+
+// Node of the tree built by buildPolytree for a node of the join order.
+static int getPolytreeNode(const joinOrder& order, const vector<int>& leafIndices, int node) {
+	return node < order.leafCount ? leafIndices[node] : node;
+}
+
+/*Builds the tree of the join order, in which leaf i of the join order is the leaf of sequence leafIndices[i].*/
+static polytree* buildPolytree(const joinOrder& order, const vector<int>& leafIndices, vector<string>* sequenceNames) {
+	polytree* tree = createPolytree(order.leafCount, sequenceNames);
+	for (size_t i = 0; i < order.leftChildren.size(); i++) {
+		tree->addInternalNode(0.1, 0.1, getPolytreeNode(order, leafIndices, order.leftChildren[i]), getPolytreeNode(order, leafIndices, order.rightChildren[i]));
+	}
+	tree->set_serialization_indices(getPolytreeNode(order, leafIndices, order.rootLeftIndex), getPolytreeNode(order, leafIndices, order.rootRightIndex), (distType)0.1);
+	return tree;
+}
+
+/*A tree passed to a tree_callback, with the leaves below each of its nodes.*/
+struct storedTree {
+	vector<vector<char> > nodeLeaves;
+	vector<double> branchLengths;
+	vector<int> bootstrapCounts;
+	vector<int> parentIndices;
+	vector<int> leftChildIndices;
+	vector<int> rightChildIndices;
+	vector<int> leafNameIndices;
+	int rootLeftIndex;
+	int rootRightIndex;
+	double rootBranchLength;
+};
+
+// The tree passed to storeTree, on the thread of the test.
+static thread_local storedTree* treeOutput = NULL;
+
+static void storeTree(const rapidNJTree* tree) {
+	treeOutput->nodeLeaves = getNodeLeaves(tree);
+	treeOutput->branchLengths.assign(tree->branchLengths, tree->branchLengths + tree->nodeCount);
+	if (tree->bootstrapCounts != NULL) {
+		treeOutput->bootstrapCounts.assign(tree->bootstrapCounts, tree->bootstrapCounts + tree->nodeCount);
+	}
+	treeOutput->parentIndices.assign(tree->parentIndices, tree->parentIndices + tree->nodeCount);
+	treeOutput->leftChildIndices.assign(tree->leftChildIndices, tree->leftChildIndices + tree->nodeCount - tree->leafCount);
+	treeOutput->rightChildIndices.assign(tree->rightChildIndices, tree->rightChildIndices + tree->nodeCount - tree->leafCount);
+	treeOutput->leafNameIndices.assign(tree->leafNameIndices, tree->leafNameIndices + tree->leafCount);
+	treeOutput->rootLeftIndex = tree->rootLeftIndex;
+	treeOutput->rootRightIndex = tree->rootRightIndex;
+	treeOutput->rootBranchLength = tree->rootBranchLength;
+}
+
+// Returns the stored tree in the layout of the tree_callback, pointing to the arrays of tree.
+static rapidNJTree getRapidNJTree(const storedTree& tree) {
+	rapidNJTree retVal;
+	retVal.leafCount = (int)tree.leafNameIndices.size();
+	retVal.nodeCount = (int)tree.nodeLeaves.size();
+	retVal.parentIndices = &tree.parentIndices[0];
+	retVal.leftChildIndices = &tree.leftChildIndices[0];
+	retVal.rightChildIndices = &tree.rightChildIndices[0];
+	retVal.branchLengths = &tree.branchLengths[0];
+	retVal.bootstrapCounts = tree.bootstrapCounts.empty() ? NULL : &tree.bootstrapCounts[0];
+	retVal.bootstrapReplicates = 0;
+	retVal.leafNameIndices = &tree.leafNameIndices[0];
+	retVal.rootLeftIndex = tree.rootLeftIndex;
+	retVal.rootRightIndex = tree.rootRightIndex;
+	retVal.rootBranchLength = tree.rootBranchLength;
+	return retVal;
+}
+
+/*Checks the bootstrap counts of bootstrapSupport against the splits of each replicate, counted one by one, and against polytree::compareTreeBootstrap. The
+replicates are either the reference tree with a few leaves swapped, or unrelated trees, which are rooted elsewhere.*/
+static bool testBootstrapSupport() {
+	const int replicateCount = 20;
+	std::mt19937 rng(5);
+	int leafCounts[] = { 8, 60 };
+	for (int c = 0; c < 2; c++) {
+		int leafCount = leafCounts[c];
+		vector<string> names;
+		vector<int> nameLengths;
+		vector<char*> namePointers;
+		makeNames(leafCount, names, nameLengths, namePointers);
+		joinOrder referenceOrder;
+		makeJoinOrder(leafCount, rng, referenceOrder);
+		vector<int> identity(leafCount);
+		for (int i = 0; i < leafCount; i++) {
+			identity[i] = i;
+		}
+
+		polytree* reference = buildPolytree(referenceOrder, identity, &names);
+		polytree* libraryReference = buildPolytree(referenceOrder, identity, &names);
+		bootstrapSupport* support = new bootstrapSupport(reference);
+		vector<splitSet> replicateSplits;
+		for (int r = 0; r < replicateCount; r++) {
+			joinOrder order = referenceOrder;
+			vector<int> leafIndices = identity;
+			if (r % 5 == 4) {
+				makeJoinOrder(leafCount, rng, order);
+			}
+			else {
+				for (int s = 0; s < r % 5; s++) {
+					swap(leafIndices[rng() % leafCount], leafIndices[rng() % leafCount]);
+				}
+			}
+			polytree* replicate = buildPolytree(order, leafIndices, &names);
+			replicateSplits.push_back(getPolytreeSplits(replicate, &names));
+			support->addReplicate(replicate);
+			libraryReference->compareTreeBootstrap(replicate);
+			delete replicate;
+		}
+		delete support;
+		CHECK(getBootstrapReplicateCount(reference) == replicateCount);
+
+		storedTree tree;
+		treeOutput = &tree;
+		exportTree(reference, &names, replicateCount, storeTree);
+		treeOutput = NULL;
+		for (size_t i = 0; i < tree.nodeLeaves.size(); i++) {
+			// Both nodes of the root edge have its split.
+			vector<char> split = normalizeSplit(tree.nodeLeaves[i]);
+			int expected = 0;
+			for (int r = 0; r < replicateCount; r++) {
+				expected += isTrivialSplit(split) || replicateSplits[r].count(split) != 0 ? 1 : 0;
+			}
+			CHECK(tree.bootstrapCounts[i] == expected);
+		}
+
+		ostringstream out;
+		ostringstream libraryOut;
+		reference->serialize_tree(out);
+		libraryReference->serialize_tree(libraryOut);
+		CHECK(out.str() == libraryOut.str());
+		delete reference;
+		delete libraryReference;
+	}
+	return true;
+}
+
+static const int collapseReplicates = 5;
+
+/*Builds the tree of an alignment with seeded bootstrap replicates, with or without collapsing its duplicate sequences.*/
+static storedTree buildCollapsedTree(testAlignment& alignment, bool collapseDuplicates) {
+	rapidNJContext* ctx = CreateRapidNJContext();
+	SetRapidNJContextOption(ctx, OPTION_NUM_CORES, 2);
+	SetRapidNJContextOption(ctx, OPTION_NJ_ENGINE, NJ_ENGINE_PARALLEL);
+	SetRapidNJContextOption(ctx, OPTION_BOOTSTRAP_REPLICATES, collapseReplicates);
+	SetRapidNJContextOption(ctx, OPTION_BOOTSTRAP_SEED, 7);
+	SetRapidNJContextOption(ctx, OPTION_COLLAPSE_DUPLICATES, collapseDuplicates ? 1 : 0);
+	storedTree tree;
+	treeOutput = &tree;
+	ContextBuildStructuredTreeFromAlignment(ctx, 0, alignment.sequenceCount, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0],
+		&alignment.sequencePointers[0], noProgress, storeTree);
+	treeOutput = NULL;
+	DestroyRapidNJContext(ctx);
+	return tree;
+}
+
+/*Checks that collapsing the copies of duplicate sequences gives a tree with one leaf per sequence, in which the copies of each sequence form a clade joined by branches of
+length 0, and which is otherwise the tree of the distinct sequences, with the same bootstrap counts.*/
+static bool testCollapseDuplicates() {
+	const int distinctCount = 40;
+	testAlignment distinct;
+	makeAlignment(distinctCount, 300, 21, distinct);
+	set<string> distinctSequences(distinct.sequences.begin(), distinct.sequences.end());
+	CHECK((int)distinctSequences.size() == distinctCount);
+
+	// Copies of the first 10 sequences are mixed with the others, so that the groups of copies have various sizes and are not contiguous.
+	std::mt19937 rng(22);
+	vector<int> sourceIndices;
+	for (int i = 0; i < distinctCount; i++) {
+		sourceIndices.push_back(i);
+	}
+	for (int i = 0; i < 30; i++) {
+		sourceIndices.push_back(rng() % 10);
+	}
+	shuffle(sourceIndices.begin(), sourceIndices.end(), rng);
+	int sequenceCount = (int)sourceIndices.size();
+	vector<int> groupSizes(distinctCount, 0);
+	testAlignment duplicated;
+	duplicated.sequenceCount = sequenceCount;
+	duplicated.sequenceLength = distinct.sequenceLength;
+	makeNames(sequenceCount, duplicated.names, duplicated.nameLengths, duplicated.namePointers);
+	for (int i = 0; i < sequenceCount; i++) {
+		duplicated.sequences.push_back(distinct.sequences[sourceIndices[i]]);
+		groupSizes[sourceIndices[i]]++;
+	}
+	updateSequencePointers(duplicated);
+
+	storedTree collapsed = buildCollapsedTree(duplicated, true);
+	storedTree reference = buildCollapsedTree(distinct, false);
+	CHECK((int)collapsed.nodeLeaves.size() == 2 * sequenceCount - 2);
+	CHECK((int)reference.nodeLeaves.size() == 2 * distinctCount - 2);
+
+	// Each sequence is a single leaf.
+	vector<char> allLeaves(sequenceCount, 0);
+	for (int i = 0; i < sequenceCount; i++) {
+		int count = 0;
+		for (int j = 0; j < sequenceCount; j++) {
+			count += collapsed.nodeLeaves[i][j];
+			allLeaves[j] |= collapsed.nodeLeaves[i][j];
+		}
+		CHECK(count == 1);
+	}
+	CHECK(count(allLeaves.begin(), allLeaves.end(), 1) == sequenceCount);
+
+	map<vector<char>, int> referenceCounts;
+	splitSet referenceSplits;
+	for (size_t i = 0; i < reference.nodeLeaves.size(); i++) {
+		referenceCounts[normalizeSplit(reference.nodeLeaves[i])] = reference.bootstrapCounts[i];
+		addSplit(referenceSplits, reference.nodeLeaves[i]);
+	}
+
+	splitSet projectedSplits;
+	vector<char> groupFound(distinctCount, 0);
+	for (size_t i = 0; i < collapsed.nodeLeaves.size(); i++) {
+		vector<int> copies(distinctCount, 0);
+		for (int j = 0; j < sequenceCount; j++) {
+			copies[sourceIndices[j]] += collapsed.nodeLeaves[i][j];
+		}
+		vector<char> projected(distinctCount, 0);
+		int groups = 0;
+		bool wholeGroups = true;
+		for (int d = 0; d < distinctCount; d++) {
+			projected[d] = copies[d] != 0;
+			groups += projected[d];
+			wholeGroups = wholeGroups && (copies[d] == 0 || copies[d] == groupSizes[d]);
+		}
+
+		if (!wholeGroups) {
+			// Nodes between the copies of a sequence.
+			CHECK(groups == 1);
+			CHECK(collapsed.branchLengths[i] == 0);
+			CHECK(collapsed.bootstrapCounts[i] == collapseReplicates);
+			continue;
+		}
+		for (int d = 0; d < distinctCount; d++) {
+			if (groups == 1 && projected[d]) {
+				groupFound[d] = 1;
+			}
+		}
+		addSplit(projectedSplits, projected);
+		int expected = isTrivialSplit(projected) ? collapseReplicates : referenceCounts[normalizeSplit(projected)];
+		CHECK(collapsed.bootstrapCounts[i] == expected);
+	}
+	CHECK(count(groupFound.begin(), groupFound.end(), 1) == distinctCount);
+	CHECK(projectedSplits == referenceSplits);
+	return true;
+}
+
+// Files written by the tests, in the working directory, which CTest sets to the build directory.
+static const char matrixFileName[] = "rapidNJTests_matrix.tmp";
+
+static void writeFileBytes(const string& bytes) {
+	ofstream out(matrixFileName, ios::out | ios::binary | ios::trunc);
+	out.write(bytes.data(), (streamsize)bytes.size());
+}
+
+static string readFileBytes() {
+	ifstream in(matrixFileName, ios::in | ios::binary);
+	ostringstream bytes;
+	bytes << in.rdbuf();
+	return bytes.str();
+}
+
+// Checks that the file holds the lower triangle of matrix, which is a full matrix, and its names.
+static bool checkMatrixFile(const additiveMatrix& matrix, bool halfMatrix, bool mapped) {
+	distanceMatrixFile file(matrixFileName, 2);
+	CHECK(file.isValid());
+	CHECK(file.getSequenceCount() == matrix.sequenceCount);
+	CHECK(*file.getSequenceNames() == matrix.names);
+	CHECK(file.isHalfMatrix() == halfMatrix);
+	CHECK(file.isMapped() == mapped);
+	distType** rows = file.getMatrix();
+	for (int i = 0; i < matrix.sequenceCount; i++) {
+		for (int j = 0; j <= i; j++) {
+			CHECK(rows[i][j] == matrix.distances[(size_t)i * matrix.sequenceCount + j]);
+		}
+	}
+	return true;
+}
+
+static bool checkInvalidMatrixFile() {
+	distanceMatrixFile file(matrixFileName, 2);
+	CHECK(!file.isValid());
+	CHECK(!file.getError().empty());
+	return true;
+}
+
+// Writes the matrix as a PHYLIP file, with the given layout of threadStatePhylip; full rows are split over several lines if wrapRows is set.
+static void writePhylipFile(const additiveMatrix& matrix, int layout, bool wrapRows) {
+	ostringstream text;
+	text.precision(9);
+	text << "  " << matrix.sequenceCount << "\n";
+	for (int i = 0; i < matrix.sequenceCount; i++) {
+		text << matrix.names[i];
+		int valueCount = layout == 0 ? matrix.sequenceCount : layout == 1 ? i : i + 1;
+		for (int j = 0; j < valueCount; j++) {
+			text << (wrapRows && j % 10 == 9 ? "\n" : " ") << matrix.distances[(size_t)i * matrix.sequenceCount + j];
+		}
+		text << (i % 2 == 0 ? "\r\n" : "\n");
+	}
+	writeFileBytes(text.str());
+}
+
+/*Checks that binary matrix files are read back as WriteDistanceMatrixFile wrote them, in both layouts and in double precision, that the layouts of PHYLIP files are told
+apart, and that truncated files and headers whose sizes overflow are rejected.*/
+static bool testMatrixFile() {
+	additiveMatrix matrix;
+	makeAdditiveMatrix(37, 4, matrix);
+	int n = matrix.sequenceCount;
+	vector<distType*> fullRows(n);
+	vector<distType> lowerTriangle = getLowerTriangle(matrix);
+	vector<distType*> halfRows(n);
+	for (int i = 0; i < n; i++) {
+		fullRows[i] = &matrix.distances[(size_t)i * n];
+		halfRows[i] = &lowerTriangle[(size_t)i * (i + 1) / 2];
+	}
+
+	CHECK(WriteDistanceMatrixFile(matrixFileName, n, &matrix.nameLengths[0], &matrix.namePointers[0], false, &fullRows[0]) == 0);
+	CHECK(checkMatrixFile(matrix, false, sizeof(distType) == 4));
+	CHECK(WriteDistanceMatrixFile(matrixFileName, n, &matrix.nameLengths[0], &matrix.namePointers[0], true, &halfRows[0]) == 0);
+	CHECK(checkMatrixFile(matrix, true, sizeof(distType) == 4));
+	string bytes = readFileBytes();
+
+	// The same lower triangle in double precision, which is converted rather than mapped.
+	matrixFileHeader header;
+	memcpy(&header, bytes.data(), sizeof(header));
+	string rowsBytes = bytes.substr(0, (size_t)(sizeof(header) + header.namesBytes));
+	header.elementType = sizeof(distType) == 4 ? MATRIX_FILE_FLOAT64 : MATRIX_FILE_FLOAT32;
+	memcpy(&rowsBytes[0], &header, sizeof(header));
+	for (size_t i = 0; i < lowerTriangle.size(); i++) {
+		if (sizeof(distType) == 4) {
+			double value = lowerTriangle[i];
+			rowsBytes.append((const char*)&value, sizeof(value));
+		}
+		else {
+			float value = (float)lowerTriangle[i];
+			rowsBytes.append((const char*)&value, sizeof(value));
+		}
+	}
+	writeFileBytes(rowsBytes);
+	if (sizeof(distType) == 4) {
+		CHECK(checkMatrixFile(matrix, true, false));
+	}
+
+	writeFileBytes(bytes.substr(0, bytes.size() - 1));
+	CHECK(checkInvalidMatrixFile());
+	writeFileBytes(bytes.substr(0, sizeof(header) + 6));
+	CHECK(checkInvalidMatrixFile());
+	memcpy(&header, bytes.data(), sizeof(header));
+	header.sequenceCount = (unsigned long long)INT_MAX + 1;
+	writeFileBytes(string((const char*)&header, sizeof(header)) + bytes.substr(sizeof(header)));
+	CHECK(checkInvalidMatrixFile());
+	header.sequenceCount = INT_MAX;
+	header.storage = MATRIX_FILE_FULL;
+	header.elementType = MATRIX_FILE_FLOAT64;
+	writeFileBytes(string((const char*)&header, sizeof(header)) + bytes.substr(sizeof(header)));
+	CHECK(checkInvalidMatrixFile());
+	memcpy(&header, bytes.data(), sizeof(header));
+	header.namesBytes = ~7ULL;
+	writeFileBytes(string((const char*)&header, sizeof(header)) + bytes.substr(sizeof(header)));
+	CHECK(checkInvalidMatrixFile());
+
+	for (int layout = 0; layout < 3; layout++) {
+		writePhylipFile(matrix, layout, false);
+		CHECK(checkMatrixFile(matrix, true, false));
+	}
+	writePhylipFile(matrix, 0, true);
+	CHECK(checkMatrixFile(matrix, true, false));
+	string text = readFileBytes();
+	writeFileBytes(text.substr(0, text.size() - 20));
+	CHECK(checkInvalidMatrixFile());
+	writePhylipFile(matrix, 2, false);
+	text = readFileBytes();
+	size_t lastRow = text.rfind(matrix.names[n - 1]);
+	writeFileBytes(text.substr(0, text.find(' ', text.find(' ', lastRow) + 1)) + "\n");
+	CHECK(checkInvalidMatrixFile());
+
+	remove(matrixFileName);
+	return true;
+}
+
+static rapidNJContext* createPlacementContext() {
+	rapidNJContext* ctx = CreateRapidNJContext();
+	SetRapidNJContextOption(ctx, OPTION_NUM_CORES, 2);
+	SetRapidNJContextOption(ctx, OPTION_NJ_ENGINE, NJ_ENGINE_PARALLEL);
+	return ctx;
+}
+
+/*Checks that the sequences placed in a tree leave the tree of the other sequences as it was, with or without rearrangement passes, that they are placed where the tree
+built again from all the sequences has them when the alignment has a clear tree, and that trees that do not match the alignment are refused.*/
+static bool testPlacement() {
+	const int sequenceCount = 100;
+	const int treeSequenceCount = 80;
+	testAlignment alignment;
+	makeTreeAlignment(sequenceCount, 2000, 31, alignment);
+	int* nameLengths = &alignment.nameLengths[0];
+	char** names = &alignment.namePointers[0];
+	char** sequences = &alignment.sequencePointers[0];
+
+	rapidNJContext* ctx = createPlacementContext();
+	storedTree rebuilt;
+	treeOutput = &rebuilt;
+	ContextBuildStructuredTreeFromAlignment(ctx, 0, sequenceCount, alignment.sequenceLength, nameLengths, names, sequences, noProgress, storeTree);
+	storedTree tree;
+	treeOutput = &tree;
+	ContextBuildStructuredTreeFromAlignment(ctx, 0, treeSequenceCount, alignment.sequenceLength, nameLengths, names, sequences, noProgress, storeTree);
+	treeOutput = NULL;
+	CHECK((int)rebuilt.nodeLeaves.size() == 2 * sequenceCount - 2);
+	CHECK((int)tree.nodeLeaves.size() == 2 * treeSequenceCount - 2);
+	rapidNJTree input = getRapidNJTree(tree);
+	splitSet treeSplits;
+	for (size_t i = 0; i < tree.nodeLeaves.size(); i++) {
+		addSplit(treeSplits, tree.nodeLeaves[i]);
+	}
+	splitSet rebuiltSplits;
+	for (size_t i = 0; i < rebuilt.nodeLeaves.size(); i++) {
+		addSplit(rebuiltSplits, rebuilt.nodeLeaves[i]);
+	}
+
+	for (int passes = 0; passes < 3; passes++) {
+		storedTree placed;
+		treeOutput = &placed;
+		CHECK(ContextPlaceSequencesInTree(ctx, 0, sequenceCount, alignment.sequenceLength, nameLengths, names, sequences, &input, passes, noProgress, NULL, storeTree) == 0);
+		treeOutput = NULL;
+		CHECK((int)placed.nodeLeaves.size() == 2 * sequenceCount - 2);
+		CHECK(placed.bootstrapCounts.empty());
+
+		splitSet placedSplits;
+		splitSet projectedSplits;
+		for (size_t i = 0; i < placed.nodeLeaves.size(); i++) {
+			addSplit(placedSplits, placed.nodeLeaves[i]);
+			addSplit(projectedSplits, vector<char>(placed.nodeLeaves[i].begin(), placed.nodeLeaves[i].begin() + treeSequenceCount));
+		}
+		CHECK(projectedSplits == treeSplits);
+		CHECK(placedSplits == rebuiltSplits);
+	}
+
+	// The tree must have fewer leaves than the alignment, and a leaf for each of the first sequences.
+	CHECK(ContextPlaceSequencesInTree(ctx, 0, treeSequenceCount - 1, alignment.sequenceLength, nameLengths, names, sequences, &input, 0, noProgress, NULL, storeTree) == -1);
+	tree.leafNameIndices[0] = tree.leafNameIndices[1];
+	CHECK(ContextPlaceSequencesInTree(ctx, 0, sequenceCount, alignment.sequenceLength, nameLengths, names, sequences, &input, 0, noProgress, NULL, storeTree) == -1);
+	DestroyRapidNJContext(ctx);
+	return true;
+}
+
+/*Checks that the sequences whose distances to the tree cannot be corrected are placed as sequences far from all the others, on longer branches than any other leaf,
+rather than as sequences at distance -1.*/
+static bool testSaturatedPlacement() {
+	const int sequenceCount = 40;
+	const int treeSequenceCount = 30;
+	testAlignment alignment;
+	makeSaturatedAlignment(sequenceCount, 37, alignment);
+	int* nameLengths = &alignment.nameLengths[0];
+	char** names = &alignment.namePointers[0];
+	char** sequences = &alignment.sequencePointers[0];
+
+	rapidNJContext* ctx = createPlacementContext();
+	storedTree tree;
+	treeOutput = &tree;
+	ContextBuildStructuredTreeFromAlignment(ctx, 0, treeSequenceCount, alignment.sequenceLength, nameLengths, names, sequences, noProgress, storeTree);
+	rapidNJTree input = getRapidNJTree(tree);
+	storedTree placed;
+	treeOutput = &placed;
+	CHECK(ContextPlaceSequencesInTree(ctx, 0, sequenceCount, alignment.sequenceLength, nameLengths, names, sequences, &input, 0, noProgress, NULL, storeTree) == 0);
+	treeOutput = NULL;
+	DestroyRapidNJContext(ctx);
+	CHECK((int)placed.nodeLeaves.size() == 2 * sequenceCount - 2);
+
+	// The leaves are the first nodes of the tree.
+	vector<double> leafBranches(sequenceCount);
+	for (int i = 0; i < sequenceCount; i++) {
+		leafBranches[placed.leafNameIndices[i]] = placed.branchLengths[i];
+	}
+	double longestOtherBranch = *max_element(leafBranches.begin(), leafBranches.end() - 2);
+	CHECK(leafBranches[sequenceCount - 2] > longestOtherBranch);
+	CHECK(leafBranches[sequenceCount - 1] > longestOtherBranch);
+	return true;
+}
+
+static distanceCacheKey getAlignmentCacheKey(testAlignment& alignment, int sequenceCount, bool jukesCantor, bool libraryDistances = false) {
+	updateSequencePointers(alignment);
+	dataloaderPointer loader(DNA, sequenceCount, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0]);
+	return getDistanceCacheKey(&loader, jukesCantor, libraryDistances);
+}
+
+static bool equalCacheKeys(const distanceCacheKey& a, const distanceCacheKey& b) {
+	return a.low == b.low && a.high == b.high && a.sequenceCount == b.sequenceCount && a.sequenceLength == b.sequenceLength && a.bitStringsCount == b.bitStringsCount &&
+		a.type == b.type && a.jukesCantor == b.jukesCantor && a.libraryDistances == b.libraryDistances;
+}
+
+// A key of a matrix of the cache test, which is not the key of any alignment.
+static distanceCacheKey makeCacheKey(unsigned long long low, unsigned int sequenceCount) {
+	distanceCacheKey key;
+	memset(&key, 0, sizeof(key));
+	key.low = low;
+	key.sequenceCount = sequenceCount;
+	return key;
+}
+
+static bool checkCachedMatrix(const distanceCacheKey& key, const additiveMatrix& matrix) {
+	int n = matrix.sequenceCount;
+	CHECK(getLowerTriangle(matrix) == *findDistanceCache(key));
+	distType** fullRows = allocateMatrix(n);
+	bool read = readDistanceCache(key, fullRows, false);
+	bool equal = true;
+	for (int i = 0; i < n; i++) {
+		equal = equal && memcmp(fullRows[i], &matrix.distances[(size_t)i * n], n * sizeof(distType)) == 0;
+	}
+	deleteMatrix(fullRows, n);
+	CHECK(read && equal);
+	return true;
+}
+
+/*Checks that the key of an alignment changes with its sequences, their order and number, the distance model and the source of the distances, and that the cache finds the matrices it was given and
+drops the least recently used ones once they take more than its capacity. The distance matrix of an alignment is then cached by the entry points.*/
+static bool testDistanceCache() {
+	testAlignment alignment;
+	makeAlignment(30, 200, 41, alignment);
+	distanceCacheKey key = getAlignmentCacheKey(alignment, 30, false);
+	testAlignment copy = alignment;
+	CHECK(equalCacheKeys(getAlignmentCacheKey(copy, 30, false), key));
+	CHECK(!equalCacheKeys(getAlignmentCacheKey(copy, 30, true), key));
+	CHECK(!equalCacheKeys(getAlignmentCacheKey(copy, 30, false, true), key));
+	CHECK(!equalCacheKeys(getAlignmentCacheKey(copy, 29, false), key));
+	swap(copy.sequences[3], copy.sequences[4]);
+	CHECK(!equalCacheKeys(getAlignmentCacheKey(copy, 30, false), key));
+	copy = alignment;
+	copy.sequences[29][199] = copy.sequences[29][199] == 'A' ? 'C' : 'A';
+	CHECK(!equalCacheKeys(getAlignmentCacheKey(copy, 30, false), key));
+	copy = alignment;
+	copy.sequences[0][0] = '-';
+	CHECK(!equalCacheKeys(getAlignmentCacheKey(copy, 30, false), key));
+
+	// The cache holds two matrices of 30 sequences.
+	const int n = 30;
+	additiveMatrix matrices[3];
+	vector<distType*> rows[3];
+	distanceCacheKey keys[3];
+	for (int m = 0; m < 3; m++) {
+		makeAdditiveMatrix(n, 50 + m, matrices[m]);
+		for (int i = 0; i < n; i++) {
+			rows[m].push_back(&matrices[m].distances[(size_t)i * n]);
+		}
+		keys[m] = makeCacheKey(m + 1, n);
+	}
+	setDistanceCacheCapacity(2 * getLowerTriangle(matrices[0]).size() * sizeof(distType));
+	CHECK(fitsDistanceCache(n));
+	CHECK(!fitsDistanceCache(2 * n));
+
+	writeDistanceCache(keys[0], &rows[0][0]);
+	CHECK(checkCachedMatrix(keys[0], matrices[0]));
+	CHECK(!findDistanceCache(keys[1]));
+	CHECK(!readDistanceCache(keys[1], &rows[1][0], false));
+	writeDistanceCache(keys[1], &rows[1][0]);
+	CHECK(checkCachedMatrix(keys[0], matrices[0]));
+	writeDistanceCache(keys[2], &rows[2][0]);
+	CHECK(!findDistanceCache(keys[1]));
+	CHECK(checkCachedMatrix(keys[0], matrices[0]));
+	CHECK(checkCachedMatrix(keys[2], matrices[2]));
+
+	// Matrices that are dropped stay valid for the calls that use them.
+	shared_ptr<const vector<distType> > kept = findDistanceCache(keys[2]);
+	setDistanceCacheCapacity(0);
+	CHECK(!findDistanceCache(keys[0]));
+	CHECK(!findDistanceCache(keys[2]));
+	CHECK(*kept == getLowerTriangle(matrices[2]));
+	CHECK(!fitsDistanceCache(n));
+
+	CHECK(SetRapidNJDistanceCacheSize(-1) == -1);
+	CHECK(SetRapidNJDistanceCacheSize(16) == 0);
+	rapidNJContext* ctx = CreateRapidNJContext();
+	SetRapidNJContextOption(ctx, OPTION_NUM_CORES, 2);
+	distType** matrix = allocateMatrix(n);
+	distType** cachedMatrix = allocateMatrix(n);
+	ContextBuildDistanceMatrixFromAlignment(ctx, 0, n, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0], matrix);
+	bool cached = readDistanceCache(key, cachedMatrix, false);
+	ContextBuildDistanceMatrixFromAlignment(ctx, 0, n, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0], cachedMatrix);
+	bool equal = true;
+	for (int i = 0; i < n; i++) {
+		equal = equal && memcmp(matrix[i], cachedMatrix[i], n * sizeof(distType)) == 0;
+	}
+	deleteMatrix(matrix, n);
+	deleteMatrix(cachedMatrix, n);
+	DestroyRapidNJContext(ctx);
+	SetRapidNJDistanceCacheSize(0);
+	CHECK(cached && equal);
+	return true;
+}
+
+static const char checkpointFileName[] = "rapidNJTests_checkpoint.tmp";
+static const int checkpointReplicates = 10;
+
+// Returns the number of replicates saved in the checkpoint, or -1 if there is none.
+static int getCheckpointReplicates() {
+	ifstream in(checkpointFileName, ios::in | ios::binary);
+	treeCheckpointHeader header;
+	in.read((char*)&header, sizeof(header));
+	return in.gcount() == (streamsize)sizeof(header) ? header.completedReplicates : -1;
+}
+
+// The progress block of the call whose progress is passed to cancelAfterReplicates. The workers that compute replicates concurrently report their progress from
+// their own threads, so it is shared by all the threads.
+static rapidNJProgress* cancelledBlock = NULL;
+
+// Cancels the call once the checkpoint holds a few replicates, whatever the share of the progress they are given.
+static void cancelAfterReplicates(double /*progress*/) {
+	if (getCheckpointReplicates() >= 3) {
+		cancelledBlock->cancel = 1;
+	}
+}
+
+/*Builds the tree of the alignment with seeded bootstrap replicates and a checkpoint, and cancels the call part-way through the replicates if cancel is set. Returns
+false if the call returned no tree.*/
+static bool buildCheckpointedTree(testAlignment& alignment, bool parallelBootstrap, bool cancel, storedTree& tree) {
+	rapidNJContext* ctx = CreateRapidNJContext();
+	SetRapidNJContextOption(ctx, OPTION_NUM_CORES, 2);
+	SetRapidNJContextOption(ctx, OPTION_NJ_ENGINE, NJ_ENGINE_PARALLEL);
+	SetRapidNJContextOption(ctx, OPTION_PARALLEL_BOOTSTRAP, parallelBootstrap ? 1 : 0);
+	SetRapidNJContextOption(ctx, OPTION_BOOTSTRAP_REPLICATES, checkpointReplicates);
+	SetRapidNJContextOption(ctx, OPTION_BOOTSTRAP_SEED, 13);
+	SetRapidNJContextCheckpoint(ctx, checkpointFileName, 1);
+	rapidNJProgress block;
+	memset(&block, 0, sizeof(block));
+	SetRapidNJContextProgress(ctx, &block, 0);
+	cancelledBlock = &block;
+	tree.nodeLeaves.clear();
+	treeOutput = &tree;
+	ContextBuildStructuredTreeFromAlignment(ctx, 0, alignment.sequenceCount, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0],
+		&alignment.sequencePointers[0], cancel ? cancelAfterReplicates : noProgress, storeTree);
+	treeOutput = NULL;
+	cancelledBlock = NULL;
+	DestroyRapidNJContext(ctx);
+	return block.cancelled == 0 && !tree.nodeLeaves.empty();
+}
+
+/*Checks that a call cancelled while it computes the bootstrap replicates keeps its checkpoint, and that the call made again resumes from it and gives the same tree and
+bootstrap counts as a call that was never interrupted, with the replicates computed one at a time and concurrently.*/
+static bool testCheckpointResume() {
+	testAlignment alignment;
+	makeAlignment(60, 300, 61, alignment);
+	remove(checkpointFileName);
+	for (int parallelBootstrap = 0; parallelBootstrap < 2; parallelBootstrap++) {
+		storedTree uninterrupted;
+		CHECK(buildCheckpointedTree(alignment, parallelBootstrap != 0, false, uninterrupted));
+		CHECK(getCheckpointReplicates() == -1);
+
+		storedTree cancelled;
+		CHECK(!buildCheckpointedTree(alignment, parallelBootstrap != 0, true, cancelled));
+		CHECK(cancelled.nodeLeaves.empty());
+		int completedReplicates = getCheckpointReplicates();
+		CHECK(completedReplicates >= 3 && completedReplicates < checkpointReplicates);
+
+		storedTree resumed;
+		CHECK(buildCheckpointedTree(alignment, parallelBootstrap != 0, false, resumed));
+		CHECK(getCheckpointReplicates() == -1);
+		CHECK(resumed.nodeLeaves == uninterrupted.nodeLeaves);
+		CHECK(resumed.bootstrapCounts == uninterrupted.bootstrapCounts);
+	}
+	return true;
+}
+
+static const int sharedWorkersJobWorkers = 4;
+
+// Each worker counts itself, so that workers that were skipped or run twice are found.
+static void countWorkerTask(void* arg, int workerIndex, int /*workerCount*/) {
+	((int*)arg)[workerIndex]++;
+}
+
+/*A thread that submits jobs to its own pool until the test is over.*/
+struct sharedWorkersSubmitter {
+	std::atomic<bool> stop;
+	std::atomic<int> jobCount;
+	std::atomic<bool> passed;
+};
+
+static void* submitSharedWorkersJobs(void* arg) {
+	sharedWorkersSubmitter* submitter = (sharedWorkersSubmitter*)arg;
+	workerPool pool(sharedWorkersJobWorkers);
+	while (!submitter->stop) {
+		int counts[sharedWorkersJobWorkers] = { 0 };
+		pool.run(countWorkerTask, counts);
+		for (int i = 0; i < sharedWorkersJobWorkers; i++) {
+			if (counts[i] != 1) {
+				submitter->passed = false;
+			}
+		}
+		submitter->jobCount++;
+	}
+	return NULL;
+}
+
+// Returns false if the submitter does not finish 2 more jobs within 10 seconds.
+static bool waitForJobs(sharedWorkersSubmitter& submitter) {
+	int target = submitter.jobCount + 2;
+	for (int i = 0; i < 10000 && submitter.jobCount < target; i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return submitter.jobCount >= target;
+}
+
+/*Checks that the shared threads can be started again and stopped while another thread submits jobs: every job must finish, with each of its workers run once. Once the
+threads are stopped, the jobs must be finished by the thread that submits them, even if it was waiting for the workers of the threads being stopped, as there are fewer
+threads than workers.*/
+static bool testSharedWorkers() {
+	sharedWorkersSubmitter submitter;
+	submitter.stop = false;
+	submitter.jobCount = 0;
+	submitter.passed = true;
+	pthread_t thread;
+	pthread_create(&thread, NULL, submitSharedWorkersJobs, &submitter);
+	bool finished = true;
+	for (int i = 0; i < 1000 && finished; i++) {
+		startSharedWorkers(1 + i % 3, vector<int>());
+		finished = waitForJobs(submitter);
+		if (i % 2 == 1) {
+			stopSharedWorkers();
+			finished = finished && waitForJobs(submitter);
+		}
+	}
+	// Starting threads again releases a submitter that is stuck, so that the test can end.
+	startSharedWorkers(1, vector<int>());
+	submitter.stop = true;
+	pthread_join(thread, NULL);
+	stopSharedWorkers();
+	CHECK(finished);
+	CHECK(submitter.passed);
+	return true;
+}
+
+static bool isPurine(char base) {
+	return base == 'A' || base == 'G';
+}
+
+// Returns the nucleotide of a DNA character in upper case, or 0 for the characters that the encoders treat as gaps.
+static char resolveNucleotide(char c) {
+	c = (char)toupper((unsigned char)c);
+	return c == 'A' || c == 'C' || c == 'G' || c == 'T' ? c : 0;
+}
+
+// Counts the transitions, transversions and columns without gaps of two DNA sequences one column at a time, as a reference for the distance kernels. Each column is
+// counted as many times as its weight, if there are weights.
+static void countDNAPair(const string& sequence1, const string& sequence2, const vector<unsigned int>* weights, unsigned long long counts[3]) {
+	counts[0] = counts[1] = counts[2] = 0;
+	for (size_t k = 0; k < sequence1.length(); k++) {
+		char a = resolveNucleotide(sequence1[k]);
+		char b = resolveNucleotide(sequence2[k]);
+		if (a == 0 || b == 0) {
+			continue;
+		}
+		unsigned long long weight = weights != NULL ? (*weights)[k] : 1;
+		counts[2] += weight;
+		if (a != b) {
+			counts[isPurine(a) == isPurine(b) ? 0 : 1] += weight;
+		}
+	}
+}
+
+static bool isProteinGap(char c) {
+	return c == 0 || strchr("-.XxzZbBJj?", c) != NULL;
+}
+
+// Counts the mismatches and columns without gaps of two protein sequences like countDNAPair. Residues only match if they are the same character.
+static void countProteinPair(const string& sequence1, const string& sequence2, const vector<unsigned int>* weights, unsigned long long counts[2]) {
+	counts[0] = counts[1] = 0;
+	for (size_t k = 0; k < sequence1.length(); k++) {
+		if (isProteinGap(sequence1[k]) || isProteinGap(sequence2[k])) {
+			continue;
+		}
+		unsigned long long weight = weights != NULL ? (*weights)[k] : 1;
+		counts[1] += weight;
+		if (sequence1[k] != sequence2[k]) {
+			counts[0] += weight;
+		}
+	}
+}
+
+/*Computes the distance matrix of a DNA alignment from the reference counts, replacing the distances that cannot be corrected like JCdistance and KimuraDistance.*/
+static void getReferenceDistances(const testAlignment& alignment, bool jukesCantor, vector<distType>& distances) {
+	int n = alignment.sequenceCount;
+	distances.assign((size_t)n * n, 0);
+	distType maxDistance = 0;
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < i; j++) {
+			unsigned long long counts[3];
+			countDNAPair(alignment.sequences[i], alignment.sequences[j], NULL, counts);
+			distType distance = jukesCantor ? jcDNA(counts[0], counts[1], counts[2]) : kimuraDNA(counts[0], counts[1], counts[2]);
+			distances[(size_t)i * n + j] = distances[(size_t)j * n + i] = distance;
+			maxDistance = max(maxDistance, distance);
+		}
+	}
+	for (size_t k = 0; k < distances.size(); k++) {
+		if (distances[k] == -1) {
+			distances[k] = getSaturatedDistance(maxDistance);
+		}
+	}
+}
+
+/*Checks that the distance kernels replace the distances of pairs too far apart to be corrected, and of pairs without any column in common, by twice the largest
+distance, in full and half matrices and with both models. The full matrices are also computed on the GPU if there is one.*/
+static bool testSaturatedDistances() {
+	const int n = 12;
+	testAlignment alignment;
+	makeSaturatedAlignment(n, 61, alignment);
+
+	for (int k = 0; k < (isGPUDistanceAvailable() ? 4 : 2); k++) {
+		int model = k % 2;
+		vector<distType> expected;
+		getReferenceDistances(alignment, model == 0, expected);
+		CHECK(expected[10] == expected[11] && expected[10] > 0);
+
+		rapidNJContext* ctx = CreateRapidNJContext();
+		SetRapidNJContextOption(ctx, OPTION_NUM_CORES, 2);
+		SetRapidNJContextOption(ctx, OPTION_DISTANCE, model);
+		SetRapidNJContextOption(ctx, OPTION_DISTANCE_KERNEL, KERNEL_AUTO);
+		SetRapidNJContextOption(ctx, OPTION_GPU, k / 2);
+		distType** matrix = allocateMatrix(n);
+		distType** halfMatrix = allocateMatrix(n);
+		ContextBuildDistanceMatrixFromAlignment(ctx, 0, n, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0], matrix);
+		ContextBuildHalfDistanceMatrixFromAlignment(ctx, 0, n, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0], halfMatrix);
+		bool equal = true;
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < n; j++) {
+				equal = equal && matrix[i][j] == expected[(size_t)i * n + j] && (j > i || halfMatrix[i][j] == expected[(size_t)i * n + j]);
+			}
+		}
+		deleteMatrix(matrix, n);
+		deleteMatrix(halfMatrix, n);
+		DestroyRapidNJContext(ctx);
+		CHECK(equal);
+	}
+	return true;
+}
+
+static splitSet buildFusedSplits(testAlignment& alignment, bool jukesCantor, int sortedMatrixSize, int threads) {
+	dataloaderPointer loader(DNA, alignment.sequenceCount, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0]);
+	kernelDistance distances(false, jukesCantor, &loader, getDistanceKernels(KERNEL_AUTO), NULL);
+	ProgressBar pb(noProgress);
+	rapidNJParallel<distType>* nj = new rapidNJParallel<distType>(&distances, &alignment.names, alignment.sequenceCount, sortedMatrixSize, false, &pb, threads);
+	polytree* tree = nj->run();
+	delete nj;
+	splitSet splits = getPolytreeSplits(tree, &alignment.names);
+	delete tree;
+	return splits;
+}
+
+static splitSet buildReferenceSplits(testAlignment& alignment, bool jukesCantor, int sortedMatrixSize, int threads) {
+	int n = alignment.sequenceCount;
+	vector<distType> distances;
+	getReferenceDistances(alignment, jukesCantor, distances);
+	vector<distType> lowerTriangle;
+	for (int i = 0; i < n; i++) {
+		lowerTriangle.insert(lowerTriangle.end(), distances.begin() + (size_t)i * n, distances.begin() + (size_t)i * n + i + 1);
+	}
+	ProgressBar pb(noProgress);
+	rapidNJParallel<distType>* nj = new rapidNJParallel<distType>(&lowerTriangle[0], &alignment.names, n, sortedMatrixSize, false, &pb, threads);
+	polytree* tree = nj->run();
+	delete nj;
+	splitSet splits = getPolytreeSplits(tree, &alignment.names);
+	delete tree;
+	return splits;
+}
+
+/*Checks that rapidNJParallel, computing the distances itself, replaces the distances that cannot be corrected like the distance kernels, so that it builds the tree of
+the reference matrix, with complete and truncated sorted rows and with one or several workers.*/
+static bool testFusedDistances() {
+	testAlignment alignment;
+	makeSaturatedAlignment(40, 67, alignment);
+	for (int model = 0; model < 2; model++) {
+		int sortedMatrixSizes[] = { alignment.sequenceCount, 6 };
+		for (int k = 0; k < 2; k++) {
+			splitSet expected = buildReferenceSplits(alignment, model == 0, sortedMatrixSizes[k], 1);
+			CHECK(buildFusedSplits(alignment, model == 0, sortedMatrixSizes[k], 1) == expected);
+			CHECK(buildFusedSplits(alignment, model == 0, sortedMatrixSizes[k], 4) == expected);
+		}
+	}
+	return true;
+}
+
+// The lower triangle received by storeStreamedRows, with the number of times each row was received. The rows are passed on one block at a time, but not always from
+// the thread of the test.
+static vector<distType>* streamedDistances = NULL;
+static vector<int>* streamedRowCounts = NULL;
+
+static void storeStreamedRows(int firstRow, int rowCount, distType** rows) {
+	for (int k = 0; k < rowCount; k++) {
+		int i = firstRow + k;
+		memcpy(&(*streamedDistances)[(size_t)i * (i + 1) / 2], rows[k], (i + 1) * sizeof(distType));
+		(*streamedRowCounts)[i]++;
+	}
+}
+
+/*Checks that the streamed lower triangle holds every row once, with the distances that cannot be corrected replaced like in the full matrices, although the blocks that
+hold them are computed before the largest distance is known. The first blocks have no such distances, so they are passed on at once.*/
+static bool testStreamedDistances() {
+	const int n = 300;
+	testAlignment alignment;
+	makeSaturatedAlignment(n, 71, alignment);
+	for (int model = 0; model < 2; model++) {
+		vector<distType> expected;
+		getReferenceDistances(alignment, model == 0, expected);
+		vector<distType> distances((size_t)n * (n + 1) / 2, -2);
+		vector<int> rowCounts(n, 0);
+		streamedDistances = &distances;
+		streamedRowCounts = &rowCounts;
+
+		rapidNJContext* ctx = CreateRapidNJContext();
+		SetRapidNJContextOption(ctx, OPTION_NUM_CORES, 3);
+		SetRapidNJContextOption(ctx, OPTION_DISTANCE, model);
+		SetRapidNJContextOption(ctx, OPTION_DISTANCE_KERNEL, KERNEL_AUTO);
+		ContextStreamDistanceMatrixFromAlignment(ctx, 0, n, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0], storeStreamedRows);
+		DestroyRapidNJContext(ctx);
+		streamedDistances = NULL;
+		streamedRowCounts = NULL;
+
+		bool equal = true;
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j <= i; j++) {
+				equal = equal && distances[(size_t)i * (i + 1) / 2 + j] == expected[(size_t)i * n + j];
+			}
+		}
+		CHECK(rowCounts == vector<int>(n, 1));
+		CHECK(equal);
+	}
+	return true;
+}
+
+// Characters of the alignments of the kernel tests, including lower case and ambiguous characters, and all the characters that the encoders treat as gaps. The protein
+// residues fit in the packed encoding.
+static const char kernelDNACharacters[] = "ACGTACGTACGTACGTacgtNnU-";
+static const char kernelProteinCharacters[] = "ARNDCQEGHILKMFPSTWYVARNDCQEGHILKMFPSTWYVarndX-.?xzZbBJj";
+
+// Lengths of the alignments of the kernel tests: a DNA block holds 64 columns and a protein block 16, a packed protein chunk 128, and the widest kernels process
+// KERNEL_VECTOR_BLOCKS blocks at a time. The lengths around these sizes leave tails of every length.
+static const int kernelTestLengths[] = { 1, 3, 15, 16, 17, 63, 64, 65, 127, 129, 255, 256, 257, 1000, 4097 };
+static const int kernelTestLengthCount = sizeof(kernelTestLengths) / sizeof(kernelTestLengths[0]);
+
+/*Makes an alignment of random characters in which each sequence is a mutated copy of the previous one, so that the pairs have all sorts of distances. The last sequence
+is made of gaps only, and the middle column too.*/
+static void makeKernelAlignment(const char* characters, int sequenceCount, int sequenceLength, unsigned int seed, testAlignment& alignment) {
+	std::mt19937 rng(seed);
+	size_t characterCount = strlen(characters);
+	alignment.sequenceCount = sequenceCount;
+	alignment.sequenceLength = sequenceLength;
+	makeNames(sequenceCount, alignment.names, alignment.nameLengths, alignment.namePointers);
+	alignment.sequences.assign(sequenceCount, string(sequenceLength, '-'));
+	for (int i = 0; i < sequenceCount - 1; i++) {
+		for (int k = 0; k < sequenceLength; k++) {
+			bool mutated = i == 0 || rng() % 100 < 5 + 10 * (unsigned int)i;
+			alignment.sequences[i][k] = mutated ? characters[rng() % characterCount] : alignment.sequences[i - 1][k];
+		}
+	}
+	for (int i = 0; i < sequenceCount; i++) {
+		alignment.sequences[i][sequenceLength / 2] = '-';
+	}
+	updateSequencePointers(alignment);
+}
+
+/*Checks that the DNA and protein kernels of an instruction set give the counts of the reference for all the pairs of alignments of every test length. Skips the test
+if the CPU does not support the instruction set, or if the wrapper was built without it.*/
+static bool checkDistanceKernels(distanceKernelType type) {
+	if (!isDistanceKernelSupported(type)) {
+		SKIP("the CPU does not support these kernels");
+	}
+	distanceKernels kernels = getDistanceKernels(type);
+	CHECK(kernels.type == type);
+
+	for (int l = 0; l < kernelTestLengthCount; l++) {
+		testAlignment alignment;
+		makeKernelAlignment(kernelDNACharacters, 8, kernelTestLengths[l], 100 + l, alignment);
+		dataloaderPointer loader(DNA, alignment.sequenceCount, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0]);
+		unsigned int** bitStrings = loader.getBitStrings();
+		unsigned int** gapFilters = loader.getGapFilters();
+		for (int i = 0; i < alignment.sequenceCount; i++) {
+			for (int j = 0; j <= i; j++) {
+				unsigned long long expected[3];
+				unsigned long long counts[3];
+				countDNAPair(alignment.sequences[i], alignment.sequences[j], NULL, expected);
+				kernels.dna(bitStrings[i], gapFilters[i], bitStrings[j], gapFilters[j], loader.getBitStringsCount(), counts);
+				CHECK(counts[0] == expected[0] && counts[1] == expected[1] && counts[2] == expected[2]);
+			}
+		}
+
+		makeKernelAlignment(kernelProteinCharacters, 8, kernelTestLengths[l], 200 + l, alignment);
+		dataloaderPointer proteinLoader(PROTEIN, alignment.sequenceCount, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0]);
+		bitStrings = proteinLoader.getBitStrings();
+		for (int i = 0; i < alignment.sequenceCount; i++) {
+			for (int j = 0; j <= i; j++) {
+				unsigned long long expected[2];
+				unsigned long long counts[2];
+				countProteinPair(alignment.sequences[i], alignment.sequences[j], NULL, expected);
+				kernels.protein(bitStrings[i], bitStrings[j], proteinLoader.getBitStringsCount(), counts);
+				CHECK(counts[0] == expected[0] && counts[1] == expected[1]);
+			}
+		}
+	}
+	return true;
+}
+
+static bool testKernelsSSE2() {
+	return checkDistanceKernels(KERNEL_SSE2);
+}
+
+static bool testKernelsAVX2() {
+	return checkDistanceKernels(KERNEL_AVX2);
+}
+
+static bool testKernelsAVX512() {
+	return checkDistanceKernels(KERNEL_AVX512);
+}
+
+static bool testKernelsNEON() {
+	return checkDistanceKernels(KERNEL_NEON);
+}
+
+static bool testKernelsPOPCNT() {
+	return checkDistanceKernels(KERNEL_POPCNT);
+}
+
+static bool testKernelsAVX512VPOPCNT() {
+	return checkDistanceKernels(KERNEL_AVX512_VPOPCNT);
+}
+
+// Returns how many times each column is drawn by the replicate of dataloaderBootstrap with the given seed.
+static vector<unsigned int> getReplicateColumnCounts(unsigned int sequenceLength, unsigned int seed) {
+	vector<unsigned int> counts(sequenceLength, 0);
+	std::mt19937 rng(seed);
+	std::uniform_int_distribution<unsigned int> column(0, sequenceLength - 1);
+	for (unsigned int i = 0; i < sequenceLength; i++) {
+		counts[column(rng)]++;
+	}
+	return counts;
+}
+
+/*Checks that weighted DNA and protein kernels give the counts of the reference, weighted by the column weights of bootstrap replicates of alignments of every test length.*/
+static bool checkWeightedKernels(dnaWeightedDistanceKernel dna, proteinWeightedDistanceKernel protein) {
+	for (int l = 0; l < kernelTestLengthCount; l++) {
+		testAlignment alignment;
+		makeKernelAlignment(kernelDNACharacters, 8, kernelTestLengths[l], 500 + l, alignment);
+		dataloaderPointer loader(DNA, alignment.sequenceCount, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0]);
+		dataloaderBootstrap replicate(&loader, 600 + l, true);
+		const columnWeights* weights = replicate.getColumnWeights();
+		CHECK(weights != NULL);
+		vector<unsigned int> columnCounts = getReplicateColumnCounts(alignment.sequenceLength, 600 + l);
+		unsigned int** bitStrings = replicate.getBitStrings();
+		unsigned int** gapFilters = replicate.getGapFilters();
+		for (int i = 0; i < alignment.sequenceCount; i++) {
+			for (int j = 0; j <= i; j++) {
+				unsigned long long expected[3];
+				unsigned long long counts[3];
+				countDNAPair(alignment.sequences[i], alignment.sequences[j], &columnCounts, expected);
+				dna(bitStrings[i], gapFilters[i], bitStrings[j], gapFilters[j], weights->planes, weights->planeCount, replicate.getBitStringsCount(), counts);
+				CHECK(counts[0] == expected[0] && counts[1] == expected[1] && counts[2] == expected[2]);
+			}
+		}
+
+		makeKernelAlignment(kernelProteinCharacters, 8, kernelTestLengths[l], 700 + l, alignment);
+		dataloaderPointer proteinLoader(PROTEIN, alignment.sequenceCount, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0]);
+		dataloaderBootstrap proteinReplicate(&proteinLoader, 800 + l, true);
+		weights = proteinReplicate.getColumnWeights();
+		CHECK(weights != NULL);
+		columnCounts = getReplicateColumnCounts(alignment.sequenceLength, 800 + l);
+		bitStrings = proteinReplicate.getBitStrings();
+		for (int i = 0; i < alignment.sequenceCount; i++) {
+			for (int j = 0; j <= i; j++) {
+				unsigned long long expected[2];
+				unsigned long long counts[2];
+				countProteinPair(alignment.sequences[i], alignment.sequences[j], &columnCounts, expected);
+				protein(bitStrings[i], bitStrings[j], weights->planes, weights->planeCount, proteinReplicate.getBitStringsCount(), counts);
+				CHECK(counts[0] == expected[0] && counts[1] == expected[1]);
+			}
+		}
+	}
+	return true;
+}
+
+static bool testWeightedKernelsSSE2() {
+	return checkWeightedKernels(dnaWeightedDistanceSSE2, proteinWeightedDistanceSSE2);
+}
+
+static bool testWeightedKernelsPOPCNT() {
+#if defined RAPIDNJ_X86_KERNELS
+	if (isDistanceKernelSupported(KERNEL_POPCNT)) {
+		return checkWeightedKernels(dnaWeightedDistancePOPCNT, proteinWeightedDistancePOPCNT);
+	}
+#endif
+	SKIP("the CPU does not support these kernels");
+}
+
+/*Checks that the packed protein kernels, unweighted and weighted by the column weights of bootstrap replicates, give the counts of the reference for alignments of
+every test length.*/
+static bool checkPackedKernels(packedProteinDistanceKernel packed, packedProteinWeightedDistanceKernel packedWeighted) {
+	for (int l = 0; l < kernelTestLengthCount; l++) {
+		testAlignment alignment;
+		makeKernelAlignment(kernelProteinCharacters, 8, kernelTestLengths[l], 900 + l, alignment);
+		dataloaderPointer loader(PROTEIN, alignment.sequenceCount, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0], 1, true);
+		CHECK(hasPackedProteins(&loader));
+		unsigned int chunkCount = loader.getBitStringsCount() / PACKED_PROTEIN_PLANES;
+		dataloaderBootstrap replicate(&loader, 1000 + l, true);
+		const columnWeights* weights = replicate.getColumnWeights();
+		CHECK(hasPackedProteins(&replicate) && weights != NULL);
+		vector<unsigned int> columnCounts = getReplicateColumnCounts(alignment.sequenceLength, 1000 + l);
+		unsigned int** bitStrings = loader.getBitStrings();
+		for (int i = 0; i < alignment.sequenceCount; i++) {
+			for (int j = 0; j <= i; j++) {
+				unsigned long long expected[2];
+				unsigned long long counts[2];
+				countProteinPair(alignment.sequences[i], alignment.sequences[j], NULL, expected);
+				packed(bitStrings[i], bitStrings[j], chunkCount, counts);
+				CHECK(counts[0] == expected[0] && counts[1] == expected[1]);
+				countProteinPair(alignment.sequences[i], alignment.sequences[j], &columnCounts, expected);
+				packedWeighted(bitStrings[i], bitStrings[j], weights->planes, weights->planeCount, chunkCount, counts);
+				CHECK(counts[0] == expected[0] && counts[1] == expected[1]);
+			}
+		}
+	}
+	return true;
+}
+
+static bool testPackedKernelsSSE2() {
+	return checkPackedKernels(proteinPackedDistanceSSE2, proteinPackedWeightedDistanceSSE2);
+}
+
+static bool testPackedKernelsPOPCNT() {
+#if defined RAPIDNJ_X86_KERNELS
+	if (isDistanceKernelSupported(KERNEL_POPCNT)) {
+		return checkPackedKernels(proteinPackedDistancePOPCNT, proteinPackedWeightedDistancePOPCNT);
+	}
+#endif
+	SKIP("the CPU does not support these kernels");
+}
+
+/*Checks that the packed protein encoder gives each residue a code of its own, and code 0 to gaps and to the padding up to a whole number of chunks.*/
+static bool testPackedEncoder() {
+	for (int l = 0; l < kernelTestLengthCount; l++) {
+		testAlignment alignment;
+		makeKernelAlignment(kernelProteinCharacters, 4, kernelTestLengths[l], 1100 + l, alignment);
+		dataloaderPointer loader(PROTEIN, alignment.sequenceCount, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0], 1, true);
+		CHECK(hasPackedProteins(&loader));
+		CHECK(loader.getBitStringsCount() == getPackedProteinBitStringsCount(alignment.sequenceLength));
+		unsigned int positions = loader.getBitStringsCount() / PACKED_PROTEIN_PLANES * PACKED_PROTEIN_CHUNK_LENGTH;
+		map<char, unsigned int> codes;
+		set<unsigned int> usedCodes;
+		for (int i = 0; i < alignment.sequenceCount; i++) {
+			for (unsigned int k = 0; k < positions; k++) {
+				unsigned int code = getPackedProteinCode(loader.getBitStrings()[i], k);
+				char c = k < (unsigned int)alignment.sequenceLength ? alignment.sequences[i][k] : '-';
+				if (isProteinGap(c)) {
+					CHECK(code == 0);
+				}
+				else if (codes.count(c) == 0) {
+					CHECK(code != 0 && usedCodes.count(code) == 0);
+					codes[c] = code;
+					usedCodes.insert(code);
+				}
+				else {
+					CHECK(codes[c] == code);
+				}
+			}
+		}
+	}
+
+	// More than 31 distinct residues cannot be packed, and are left in the byte encoding.
+	testAlignment alignment;
+	makeKernelAlignment("ABCDEFGHIKLMNOPQRSTUVWYabcdefghiklmn", 4, 300, 1200, alignment);
+	dataloaderPointer loader(PROTEIN, alignment.sequenceCount, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0], 1, true);
+	CHECK(!hasPackedProteins(&loader));
+	return true;
+}
+
+/*Checks the layout of the bit strings of the encoders, which the kernels rely on: every position holds the code of its character, and the padding up to a whole
+number of the widest vectors is made of gaps, so that the kernels do not need to handle partial vectors.*/
+static bool testSequenceEncoders() {
+	const char dnaCodes[] = "AGTC";
+	for (int l = 0; l < kernelTestLengthCount; l++) {
+		testAlignment alignment;
+		makeKernelAlignment(kernelDNACharacters, 4, kernelTestLengths[l], 300 + l, alignment);
+		dataloaderPointer loader(DNA, alignment.sequenceCount, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0]);
+		unsigned int blockCount = loader.getBitStringsCount();
+		CHECK(blockCount % KERNEL_VECTOR_BLOCKS == 0);
+		CHECK(blockCount * 64 >= (unsigned int)alignment.sequenceLength);
+		for (int i = 0; i < alignment.sequenceCount; i++) {
+			const unsigned int* bitString = loader.getBitStrings()[i];
+			const unsigned int* gapFilter = loader.getGapFilters()[i];
+			CHECK((size_t)bitString % 16 == 0 && (size_t)gapFilter % 16 == 0);
+			for (unsigned int k = 0; k < blockCount * 64; k++) {
+				unsigned int code = (bitString[k / 16] >> (k % 16 * 2)) & 3;
+				unsigned int valid = (gapFilter[k / 16] >> (k % 16 * 2)) & 3;
+				char nucleotide = k < (unsigned int)alignment.sequenceLength ? resolveNucleotide(alignment.sequences[i][k]) : 0;
+				CHECK(valid == (nucleotide != 0 ? 1u : 0u));
+				CHECK(code == (nucleotide != 0 ? (unsigned int)(strchr(dnaCodes, nucleotide) - dnaCodes) : 0u));
+			}
+		}
+
+		makeKernelAlignment(kernelProteinCharacters, 4, kernelTestLengths[l], 400 + l, alignment);
+		dataloaderPointer proteinLoader(PROTEIN, alignment.sequenceCount, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0]);
+		blockCount = proteinLoader.getBitStringsCount();
+		CHECK(blockCount % KERNEL_VECTOR_BLOCKS == 0);
+		for (int i = 0; i < alignment.sequenceCount; i++) {
+			const unsigned char* residues = (const unsigned char*)proteinLoader.getBitStrings()[i];
+			for (unsigned int k = 0; k < blockCount * 16; k++) {
+				char c = k < (unsigned int)alignment.sequenceLength ? alignment.sequences[i][k] : '-';
+				CHECK(residues[k] == (isProteinGap(c) ? '-' : (unsigned char)c));
+			}
+		}
+	}
+	return true;
+}
+
+// Scalar version of sortedRowScanKernel for blocks of width entries.
+static int scanSortedRowReference(int width, const vector<distType>& distances, const vector<unsigned int>& ids, const vector<int>& idToSlot, const vector<distType>& separations,
+	distType separation, distType bound, distType best, int begin, int* garbage) {
+	int length = (int)distances.size();
+	int i = begin;
+	for (; i + width <= length; i += width) {
+		if (distances[i] - bound > best) {
+			return i;
+		}
+		int dead = 0;
+		for (int j = i; j < i + width; j++) {
+			int other = idToSlot[ids[j]];
+			if (other < 0) {
+				dead++;
+			}
+			else if (distances[j] - (separation + separations[other]) <= best) {
+				return i;
+			}
+		}
+		*garbage += dead;
+	}
+	return i;
+}
+
+/*Checks the sorted row scan of the kernels against a scalar scan, on rows of every test length with a third of dead clusters, from several entries and with best pairs
+that stop the scan anywhere from the first block to the end of the row.*/
+static bool checkSortedRowScan(distanceKernelType type) {
+	if (!isDistanceKernelSupported(type)) {
+		SKIP("the CPU does not support these kernels");
+	}
+	distanceKernels kernels = getDistanceKernels(type);
+	CHECK(kernels.type == type);
+
+	const int slotCount = 500;
+	std::mt19937 rng(73);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	vector<distType> separations(slotCount);
+	distType maxSeparation = 0;
+	for (int i = 0; i < slotCount; i++) {
+		separations[i] = (distType)uniform(rng);
+		maxSeparation = max(maxSeparation, separations[i]);
+	}
+	vector<int> idToSlot(slotCount * 2);
+	for (int i = 0; i < slotCount * 2; i++) {
+		idToSlot[i] = uniform(rng) < 1.0 / 3 ? -1 : (int)(uniform(rng) * slotCount);
+	}
+
+	for (int l = 0; l < kernelTestLengthCount; l++) {
+		int length = kernelTestLengths[l];
+		vector<distType> distances(length);
+		vector<unsigned int> ids(length);
+		for (int i = 0; i < length; i++) {
+			distances[i] = (distType)(uniform(rng) * 4);
+			ids[i] = (unsigned int)(uniform(rng) * slotCount * 2);
+		}
+		sort(distances.begin(), distances.end());
+		distType separation = separations[l];
+		distType bound = separation + maxSeparation;
+
+		const int begins[] = { 0, 1, kernels.sortedRowWidth, length / 2 };
+		const distType bests[] = { -3.0f, -1.5f, -1.0f, 0.0f, 1.0f, 3.0f, numeric_limits<distType>::infinity() };
+		for (int b = 0; b < 4; b++) {
+			for (int v = 0; v < 7; v++) {
+				int garbage = 0;
+				int expectedGarbage = 0;
+				int scanned = kernels.sortedRowScan(&distances[0], &ids[0], &idToSlot[0], &separations[0], separation, bound, bests[v], begins[b], length, &garbage);
+				int expected = scanSortedRowReference(kernels.sortedRowWidth, distances, ids, idToSlot, separations, separation, bound, bests[v], begins[b], &expectedGarbage);
+				CHECK(scanned == expected);
+				CHECK(garbage == expectedGarbage);
+			}
+		}
+	}
+	return true;
+}
+
+static bool testSortedRowScanSSE2() {
+	return checkSortedRowScan(KERNEL_SSE2);
+}
+
+static bool testSortedRowScanAVX2() {
+	return checkSortedRowScan(KERNEL_AVX2);
+}
+
+static bool testSortedRowScanAVX512() {
+	return checkSortedRowScan(KERNEL_AVX512);
+}
+
+// State of the counting kernel of testTileStealing: the sequence of each bit string and, for each pair of sequences, the number of times its distance was computed and
+// the worker that computed it. Workers are numbered in the order in which they first call the kernel in each run.
+static map<const unsigned int*, int> tileTestSequences;
+static int tileTestSequenceCount;
+static std::atomic<int>* tileTestCounts;
+static std::atomic<int>* tileTestWorkers;
+static int tileTestSlowRows;
+static int tileTestRun;
+static std::atomic<int> tileTestNextWorker;
+static thread_local int tileTestWorker;
+static thread_local int tileTestWorkerRun = -1;
+
+static void countingDNADistance(const unsigned int* bitString1, const unsigned int* gapFilter1, const unsigned int* bitString2, const unsigned int* gapFilter2, unsigned int blockCount, unsigned long long* retVal) {
+	if (tileTestWorkerRun != tileTestRun) {
+		tileTestWorker = tileTestNextWorker++;
+		tileTestWorkerRun = tileTestRun;
+	}
+	int i = tileTestSequences.find(bitString1)->second;
+	int j = tileTestSequences.find(bitString2)->second;
+	size_t pair = (size_t)i * tileTestSequenceCount + j;
+	tileTestCounts[pair]++;
+	tileTestWorkers[pair] = tileTestWorker;
+	// The first rows are slow, so that the other workers run out of tiles while the worker that starts with them is still computing them, and steal them.
+	if (i < tileTestSlowRows && j == 0) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	}
+	dnaDistanceSSE2(bitString1, gapFilter1, bitString2, gapFilter2, blockCount, retVal);
+}
+
+/*Checks that the tiles of a kernel distance matrix cover each pair of sequences exactly once with one or several threads, also when the first rows are slow enough for
+the other threads to steal them, and that every distance of the matrix is the distance of its pair.*/
+static bool testTileStealing() {
+	const int n = 700;
+	testAlignment alignment;
+	makeKernelAlignment(kernelDNACharacters, n, 4096, 91, alignment);
+	dataloaderPointer loader(DNA, n, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0]);
+	tileTestSequences.clear();
+	for (int i = 0; i < n; i++) {
+		tileTestSequences[loader.getBitStrings()[i]] = i;
+	}
+	tileTestSequenceCount = n;
+	tileTestCounts = new std::atomic<int>[(size_t)n * n];
+	tileTestWorkers = new std::atomic<int>[(size_t)n * n];
+	distanceKernels kernels = getDistanceKernels(KERNEL_SSE2);
+	kernels.dna = countingDNADistance;
+
+	bool passed = true;
+	const int threadCounts[] = { 1, 3, 8 };
+	for (int t = 0; t < 3 && passed; t++) {
+		for (size_t k = 0; k < (size_t)n * n; k++) {
+			tileTestCounts[k] = 0;
+			tileTestWorkers[k] = -1;
+		}
+		tileTestRun++;
+		tileTestNextWorker = 0;
+		distType** matrix = allocateMatrix(n);
+		kernelDistance alg(false, false, &loader, kernels, matrix);
+		unsigned int tileSize = alg.getTileSize();
+		tileTestSlowRows = threadCounts[t] > 1 ? 3 * tileSize : 0;
+		alg.computeDistanceMatrix(threadCounts[t]);
+		tileTestSlowRows = 0;
+
+		bool once = true;
+		set<int> slowWorkers;
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < n; j++) {
+				once = once && tileTestCounts[(size_t)i * n + j] == (j < i ? 1 : 0);
+				if (j < i && (unsigned int)i < 3 * tileSize) {
+					slowWorkers.insert(tileTestWorkers[(size_t)i * n + j]);
+				}
+			}
+		}
+		bool correct = true;
+		for (int i = 0; i < n; i++) {
+			correct = correct && matrix[i][i] == 0;
+			for (int j = 0; j < i; j++) {
+				// The distances that cannot be corrected are replaced, see testSaturatedDistances.
+				distType distance = alg.computeDistance(i, j);
+				correct = correct && (matrix[i][j] == distance || distance == -1) && matrix[j][i] == matrix[i][j];
+			}
+		}
+		deleteMatrix(matrix, n);
+		passed = (unsigned int)n > 4 * tileSize && once && correct && (threadCounts[t] == 1 || slowWorkers.size() > 1);
+		if (!passed) {
+			cerr << threadCounts[t] << " thread(s): tile size " << tileSize << ", each pair once " << once << ", distances " << correct << ", workers of the slow rows " << slowWorkers.size() << endl;
+		}
+	}
+	delete[] tileTestCounts;
+	delete[] tileTestWorkers;
+	CHECK(passed);
+	return true;
+}
+
+/*Layouts of the buffers of the strided_matrix test: the stride of their rows, in elements, with 0 for packed lower triangles.*/
+struct stridedLayout {
+	bool halfMatrix;
+	int extraStride;
+	bool packed;
+};
+
+/*Checks that ContextBuildTreeFromStridedDistanceMatrix finds the tree of an additive matrix stored as a full matrix, a half matrix with padded rows or a packed lower
+triangle, that preserveMatrix leaves every element of the buffer of the caller untouched, padding included, and that strides too short for the rows are rejected.*/
+static bool testStridedMatrix() {
+	additiveMatrix matrix;
+	makeAdditiveMatrix(90, 17, matrix);
+	int n = matrix.sequenceCount;
+	const stridedLayout layouts[] = { { false, 3, false }, { false, 0, false }, { true, 5, false }, { true, -1, false }, { true, 0, true } };
+
+	for (int l = 0; l < 5; l++) {
+		long long stride = layouts[l].packed ? 0 : n + layouts[l].extraStride;
+		size_t size = layouts[l].packed ? (size_t)n * (n + 1) / 2 : (size_t)(n - 1) * stride + n;
+		// Padding and, in half matrices, the upper triangle hold a value that would change the tree if it were read.
+		vector<distType> buffer(size, -7);
+		for (int i = 0; i < n; i++) {
+			size_t rowStart = layouts[l].packed ? (size_t)i * (i + 1) / 2 : (size_t)i * stride;
+			int rowLength = layouts[l].halfMatrix ? i + 1 : n;
+			memcpy(&buffer[rowStart], &matrix.distances[(size_t)i * n], rowLength * sizeof(distType));
+		}
+
+		for (int preserve = 1; preserve >= 0; preserve--) {
+			vector<distType> input = buffer;
+			rapidNJContext* ctx = CreateRapidNJContext();
+			SetRapidNJContextOption(ctx, OPTION_NUM_CORES, 2);
+			SetRapidNJContextOption(ctx, OPTION_NJ_ENGINE, NJ_ENGINE_PARALLEL);
+			splitSet splits;
+			splitsOutput = &splits;
+			int result = ContextBuildTreeFromStridedDistanceMatrix(ctx, n, &matrix.nameLengths[0], &matrix.namePointers[0], layouts[l].halfMatrix, &input[0], stride, preserve != 0, noProgress, NULL, storeSplits);
+			splitsOutput = NULL;
+			DestroyRapidNJContext(ctx);
+			CHECK(result == 0);
+			CHECK(splits == matrix.splits);
+			if (preserve != 0) {
+				CHECK(memcmp(&input[0], &buffer[0], size * sizeof(distType)) == 0);
+			}
+		}
+	}
+
+	rapidNJContext* ctx = CreateRapidNJContext();
+	vector<distType> buffer((size_t)n * n, 0);
+	CHECK(ContextBuildTreeFromStridedDistanceMatrix(ctx, n, &matrix.nameLengths[0], &matrix.namePointers[0], false, &buffer[0], n - 1, true, noProgress, NULL, storeSplits) == -1);
+	CHECK(ContextBuildTreeFromStridedDistanceMatrix(ctx, n, &matrix.nameLengths[0], &matrix.namePointers[0], false, &buffer[0], 0, true, noProgress, NULL, storeSplits) == -1);
+	CHECK(ContextBuildTreeFromStridedDistanceMatrix(ctx, n, &matrix.nameLengths[0], &matrix.namePointers[0], true, &buffer[0], n - 2, true, noProgress, NULL, storeSplits) == -1);
+	DestroyRapidNJContext(ctx);
+	return true;
+}
+
+/*Checks that relaxed joins build a binary tree of all the sequences of a matrix that is far from additive, with one or several workers and with complete and truncated
+sorted rows, and that the tree has the cherry of the first pair that canonical neighbor joining joins, which relaxed joins always join first.*/
+static bool testRelaxedJoins() {
+	additiveMatrix matrix;
+	makeAdditiveMatrix(150, 29, matrix);
+	int n = matrix.sequenceCount;
+	std::mt19937 rng(31);
+	std::uniform_real_distribution<double> noise(0.7, 1.3);
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < i; j++) {
+			matrix.distances[(size_t)i * n + j] = matrix.distances[(size_t)j * n + i] = (distType)(matrix.distances[(size_t)i * n + j] * noise(rng));
+		}
+	}
+
+	// The pair with the smallest neighbor joining criterion, which must be clear of the second one so that rounding cannot change it.
+	vector<double> sums(n, 0);
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			sums[i] += matrix.distances[(size_t)i * n + j];
+		}
+	}
+	double best = numeric_limits<double>::max();
+	double secondBest = numeric_limits<double>::max();
+	int best1 = -1;
+	int best2 = -1;
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < i; j++) {
+			double value = matrix.distances[(size_t)i * n + j] - (sums[i] + sums[j]) / (n - 2);
+			if (value < best) {
+				secondBest = best;
+				best = value;
+				best1 = i;
+				best2 = j;
+			}
+			else if (value < secondBest) {
+				secondBest = value;
+			}
+		}
+	}
+	CHECK(secondBest - best > 1e-3);
+	vector<char> cherry(n, 0);
+	cherry[best1] = 1;
+	cherry[best2] = 1;
+	vector<char> firstJoin = normalizeSplit(cherry);
+
+	int sortedMatrixSizes[] = { n, 6 };
+	for (int k = 0; k < 2; k++) {
+		splitSet canonicalSplits = buildParallelSplits<distType>(matrix, sortedMatrixSizes[k], false, 1);
+		CHECK(canonicalSplits.count(firstJoin) == 1);
+		splitSet relaxedSplits = buildParallelSplits<distType>(matrix, sortedMatrixSizes[k], true, 1);
+		CHECK(relaxedSplits.size() == (size_t)n - 3);
+		CHECK(relaxedSplits.count(firstJoin) == 1);
+		CHECK(buildParallelSplits<distType>(matrix, sortedMatrixSizes[k], true, 4) == relaxedSplits);
+	}
+	return true;
+}
+
+// Adds noise to the distances of an additive matrix, so that the pairs that neighbor joining picks are no longer obvious and truncated sorted rows run out of entries.
+static void addMatrixNoise(additiveMatrix& matrix, double amount, unsigned int seed) {
+	int n = matrix.sequenceCount;
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<double> noise(1 - amount, 1 + amount);
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < i; j++) {
+			matrix.distances[(size_t)i * n + j] = matrix.distances[(size_t)j * n + i] = (distType)(matrix.distances[(size_t)i * n + j] * noise(rng));
+		}
+	}
+}
+
+/*Checks that rapidNJParallel builds the same tree from truncated sorted rows as from complete ones on a matrix that is far from additive, with one or several workers.
+The rows run out of entries often enough to be widened during the run: once n / 2 rows have been rebuilt, the rows are always widened.*/
+static bool testWidenRows() {
+	additiveMatrix matrix;
+	makeAdditiveMatrix(300, 37, matrix);
+	addMatrixNoise(matrix, 0.3, 41);
+	int n = matrix.sequenceCount;
+	splitSet fullSplits = buildParallelSplits<distType>(matrix, n, false, 1);
+	CHECK(fullSplits.size() == (size_t)n - 3);
+
+	vector<distType> lowerTriangle = getLowerTriangle(matrix);
+	const int sortedMatrixSizes[] = { 2, 3 };
+	for (int k = 0; k < 2; k++) {
+		for (int threads = 1; threads <= 4; threads += 3) {
+			statisticsCollector statistics;
+			ProgressBar pb(noProgress);
+			rapidNJParallel<distType>* nj = new rapidNJParallel<distType>(&lowerTriangle[0], &matrix.names, n, sortedMatrixSizes[k], false, &pb, threads);
+			nj->setStatistics(&statistics);
+			polytree* tree = nj->run();
+			delete nj;
+			splitSet splits = getPolytreeSplits(tree, &matrix.names);
+			delete tree;
+			CHECK(splits == fullSplits);
+			CHECK(statistics.get().rowsRebuilt >= n / 2);
+		}
+	}
+	return true;
+}
+
+// Number of blocks allocated with operator new and not yet deleted, counted while countAllocations is set, so that a call can be checked to free everything it allocates.
+static std::atomic<long long> liveAllocations(0);
+static std::atomic<bool> countAllocations(false);
+// The blocks are freed through a pointer, so that compilers that inline operator delete do not take free for a mismatched deallocation of memory from operator new.
+static void (*volatile freeBlock)(void*) = free;
+
+void* operator new(size_t size) {
+	void* retVal = malloc(size > 0 ? size : 1);
+	if (retVal == NULL) {
+		throw std::bad_alloc();
+	}
+	if (countAllocations) {
+		liveAllocations++;
+	}
+	return retVal;
+}
+
+void operator delete(void* pointer) noexcept {
+	if (pointer != NULL && countAllocations) {
+		liveAllocations--;
+	}
+	freeBlock(pointer);
+}
+
+void operator delete(void* pointer, size_t /*size*/) noexcept {
+	operator delete(pointer);
+}
+
+// The progress block of the call that cancelAtProgress cancels, and the progress from which it does.
+static rapidNJProgress* cancelBlock = NULL;
+static double cancelProgress = 0;
+
+static void cancelAtProgress(double progress) {
+	if (progress >= cancelProgress) {
+		cancelBlock->cancel = 1;
+	}
+}
+
+/*Checks that calls cancelled before they start, while the distances and sorted rows are computed, and part-way through the NJ iterations return no tree, mark the block
+as cancelled and free everything they allocated, both through rapidNJParallel and through the entry points. The calls made again with the same context give the tree.*/
+static bool testCancellation() {
+	additiveMatrix matrix;
+	makeAdditiveMatrix(200, 43, matrix);
+	vector<distType> lowerTriangle = getLowerTriangle(matrix);
+	int n = matrix.sequenceCount;
+	const double cancelProgresses[] = { 0, 0.3, 0.9 };
+
+	for (int k = 0; k < 3; k++) {
+		rapidNJProgress block;
+		memset(&block, 0, sizeof(block));
+		cancelBlock = &block;
+		cancelProgress = cancelProgresses[k];
+		block.cancel = cancelProgress == 0;
+		liveAllocations = 0;
+		countAllocations = true;
+		{
+			callProgress progress(&block, cancelAtProgress, 0);
+			ProgressBar pb(progress.getCallback());
+			rapidNJParallel<distType>* nj = new rapidNJParallel<distType>(&lowerTriangle[0], &matrix.names, n, 8, false, &pb, 4);
+			nj->setProgress(&progress);
+			polytree* tree = nj->run();
+			delete nj;
+			CHECK(tree == NULL);
+		}
+		countAllocations = false;
+		CHECK(liveAllocations == 0);
+	}
+
+	testAlignment alignment;
+	makeAlignment(150, 400, 47, alignment);
+	rapidNJContext* ctx = CreateRapidNJContext();
+	SetRapidNJContextOption(ctx, OPTION_NUM_CORES, 2);
+	SetRapidNJContextOption(ctx, OPTION_NJ_ENGINE, NJ_ENGINE_PARALLEL);
+	rapidNJProgress block;
+	memset(&block, 0, sizeof(block));
+	SetRapidNJContextProgress(ctx, &block, 0);
+	cancelBlock = &block;
+	storedTree tree;
+	treeOutput = &tree;
+	// The first call allocates what the context keeps from one call to the next.
+	cancelProgress = 2;
+	ContextBuildStructuredTreeFromAlignment(ctx, 0, alignment.sequenceCount, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0],
+		&alignment.sequencePointers[0], cancelAtProgress, storeTree);
+	CHECK(block.cancelled == 0);
+	CHECK(!tree.nodeLeaves.empty());
+	storedTree uncancelled = tree;
+
+	for (int k = 0; k < 3; k++) {
+		cancelProgress = cancelProgresses[k];
+		block.cancel = cancelProgress == 0;
+		tree.nodeLeaves.clear();
+		liveAllocations = 0;
+		countAllocations = true;
+		ContextBuildStructuredTreeFromAlignment(ctx, 0, alignment.sequenceCount, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0],
+			&alignment.sequencePointers[0], cancelAtProgress, storeTree);
+		countAllocations = false;
+		CHECK(block.cancelled == 1);
+		CHECK(tree.nodeLeaves.empty());
+		CHECK(liveAllocations == 0);
+	}
+
+	block.cancel = 0;
+	cancelProgress = 2;
+	ContextBuildStructuredTreeFromAlignment(ctx, 0, alignment.sequenceCount, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0],
+		&alignment.sequencePointers[0], cancelAtProgress, storeTree);
+	CHECK(block.cancelled == 0);
+	CHECK(tree.nodeLeaves == uncancelled.nodeLeaves);
+	treeOutput = NULL;
+	cancelBlock = NULL;
+	DestroyRapidNJContext(ctx);
+	return true;
+}
+
+// Builds the tree of an alignment with rapidNJParallel computing the distances itself, with the half matrix in memory or in a mappedMatrix, and returns the statistics of the call.
+template <class storageType>
+static splitSet buildMappedSplits(testAlignment& alignment, int sortedMatrixSize, int threads, bool mapped, rapidNJStatistics& statistics) {
+	dataloaderPointer loader(DNA, alignment.sequenceCount, alignment.sequenceLength, &alignment.nameLengths[0], &alignment.namePointers[0], &alignment.sequencePointers[0]);
+	kernelDistance distances(false, true, &loader, getDistanceKernels(KERNEL_AUTO), NULL);
+	mappedMatrix* storage = mapped ? new mappedMatrix("", alignment.sequenceCount, sizeof(storageType)) : NULL;
+	splitSet splits;
+	if (storage == NULL || storage->isValid()) {
+		statisticsCollector collector;
+		ProgressBar pb(noProgress);
+		rapidNJParallel<storageType>* nj = new rapidNJParallel<storageType>(&distances, &alignment.names, alignment.sequenceCount, sortedMatrixSize, false, &pb, threads, storage);
+		nj->setStatistics(&collector);
+		polytree* tree = nj->run();
+		delete nj;
+		splits = getPolytreeSplits(tree, &alignment.names);
+		delete tree;
+		statistics = collector.get();
+	}
+	delete storage;
+	return splits;
+}
+
+template <class storageType>
+static bool checkMappedMatrix(testAlignment& alignment) {
+	int sortedMatrixSizes[] = { alignment.sequenceCount, 6 };
+	for (int k = 0; k < 2; k++) {
+		for (int threads = 1; threads <= 4; threads += 3) {
+			rapidNJStatistics statistics;
+			splitSet expected = buildMappedSplits<storageType>(alignment, sortedMatrixSizes[k], threads, false, statistics);
+			CHECK(expected.size() == (size_t)alignment.sequenceCount - 3);
+			CHECK(statistics.mappedBytesPrefetched == 0 && statistics.mappedBytesWrittenBehind == 0);
+			CHECK(buildMappedSplits<storageType>(alignment, sortedMatrixSizes[k], threads, true, statistics) == expected);
+			CHECK(statistics.mappedBytesWrittenBehind > 0);
+		}
+	}
+	return true;
+}
+
+/*Checks that rapidNJParallel builds the same tree with its half matrix in a memory-mapped file as in memory, with each storage type, with complete and truncated sorted
+rows and with one or several workers, and that the I/O thread of the file writes the joined rows behind the iterations.*/
+static bool testMappedMatrix() {
+	testAlignment alignment;
+	makeAlignment(300, 500, 53, alignment);
+	CHECK(checkMappedMatrix<distType>(alignment));
+	CHECK(checkMappedMatrix<halfDistance>(alignment));
+	CHECK(checkMappedMatrix<bfloat16Distance>(alignment));
+	return true;
+}
+
+/*A test, and the name it is registered with in CMakeLists.txt.*/
+struct testCase {
+	const char* name;
+	testFunction function;
+};
+
+static const testCase testCases[] = {
+	{ "concurrent_contexts", testConcurrentContexts },
+	{ "parallel_engine", testParallelEngine },
+	{ "bootstrap_support", testBootstrapSupport },
+	{ "collapse_duplicates", testCollapseDuplicates },
+	{ "matrix_file", testMatrixFile },
+	{ "placement", testPlacement },
+	{ "distance_cache", testDistanceCache },
+	{ "checkpoint_resume", testCheckpointResume },
+	{ "shared_workers", testSharedWorkers },
+	{ "saturated_distances", testSaturatedDistances },
+	{ "fused_distances", testFusedDistances },
+	{ "streamed_distances", testStreamedDistances },
+	{ "saturated_placement", testSaturatedPlacement },
+	{ "kernels_sse2", testKernelsSSE2 },
+	{ "kernels_avx2", testKernelsAVX2 },
+	{ "kernels_avx512", testKernelsAVX512 },
+	{ "kernels_neon", testKernelsNEON },
+	{ "kernels_popcnt", testKernelsPOPCNT },
+	{ "kernels_avx512_vpopcnt", testKernelsAVX512VPOPCNT },
+	{ "sequence_encoders", testSequenceEncoders },
+	{ "weighted_kernels_sse2", testWeightedKernelsSSE2 },
+	{ "weighted_kernels_popcnt", testWeightedKernelsPOPCNT },
+	{ "packed_kernels_sse2", testPackedKernelsSSE2 },
+	{ "packed_kernels_popcnt", testPackedKernelsPOPCNT },
+	{ "packed_encoder", testPackedEncoder },
+	{ "sorted_row_scan_sse2", testSortedRowScanSSE2 },
+	{ "sorted_row_scan_avx2", testSortedRowScanAVX2 },
+	{ "sorted_row_scan_avx512", testSortedRowScanAVX512 },
+	{ "tile_stealing", testTileStealing },
+	{ "strided_matrix", testStridedMatrix },
+	{ "relaxed_joins", testRelaxedJoins },
+	{ "widen_rows", testWidenRows },
+	{ "cancellation", testCancellation },
+	{ "mapped_matrix", testMappedMatrix }
+};
+
+static const int testCount = sizeof(testCases) / sizeof(testCases[0]);
+
+int main(int argc, char** argv) {
+	vector<const testCase*> selected;
+	for (int i = 1; i < argc; i++) {
+		const testCase* found = NULL;
+		for (int j = 0; j < testCount; j++) {
+			if (string(argv[i]) == testCases[j].name) {
+				found = &testCases[j];
+			}
+		}
+		if (found == NULL) {
+			cerr << "Unknown test " << argv[i] << endl;
+			return 1;
+		}
+		selected.push_back(found);
+	}
+	if (selected.empty()) {
+		for (int j = 0; j < testCount; j++) {
+			selected.push_back(&testCases[j]);
+		}
+	}
+
+	int failed = 0;
+	int skipped = 0;
+	for (size_t i = 0; i < selected.size(); i++) {
+		testSkipped = false;
+		bool passed = selected[i]->function();
+		if (passed && testSkipped) {
+			cerr << "skipped " << selected[i]->name << endl;
+			skipped++;
+		}
+		else {
+			cerr << (passed ? "passed " : "FAILED ") << selected[i]->name << endl;
+		}
+		if (!passed) {
+			failed++;
+		}
+	}
+	if (failed > 0) {
+		return 1;
+	}
+	return skipped == (int)selected.size() ? 77 : 0;
+}
@@ -0,0 +1,155 @@
+#include "treeCheckpoint.hpp"
+#include "treeExport.hpp"
+#include <fstream>
+#include <cstdio>
+
+#ifdef __WINDOWS__
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+treeCheckpoint::treeCheckpoint(string fileName, distanceCacheKey input, unsigned long long settings, int replicateCount, int interval) {
+	treeCheckpoint::fileName = fileName;
+	treeCheckpoint::input = input;
+	treeCheckpoint::settings = settings;
+	treeCheckpoint::replicateCount = replicateCount;
+	treeCheckpoint::interval = max(interval, 1);
+}
+
+polytree* treeCheckpoint::read(vector<string>* sequenceNames) {
+	ifstream in(fileName.c_str(), ios::in | ios::binary);
+	if (!in) {
+		return NULL;
+	}
+
+	treeCheckpointHeader header;
+	in.read((char*)&header, sizeof(header));
+	int n = (int)input.sequenceCount;
+	if (in.gcount() != (streamsize)sizeof(header) || memcmp(header.magic, TREE_CHECKPOINT_MAGIC, sizeof(TREE_CHECKPOINT_MAGIC)) != 0 || header.version != TREE_CHECKPOINT_VERSION ||
+		header.inputLow != input.low || header.inputHigh != input.high || header.settings != settings || header.sequenceCount != n || header.replicateCount != replicateCount ||
+		header.nodeCount < n || header.nodeCount > 2 * n || header.completedReplicates < 0 || header.completedReplicates > replicateCount) {
+		return NULL;
+	}
+
+	int internalCount = header.nodeCount - n;
+	vector<int> leftChildren(internalCount);
+	vector<int> rightChildren(internalCount);
+	vector<double> branchLengths(header.nodeCount);
+	vector<int> bootstrapCounts(header.nodeCount);
+	if (internalCount > 0) {
+		in.read((char*)&leftChildren[0], (streamsize)(internalCount * sizeof(int)));
+		in.read((char*)&rightChildren[0], (streamsize)(internalCount * sizeof(int)));
+	}
+	in.read((char*)&branchLengths[0], (streamsize)(header.nodeCount * sizeof(double)));
+	in.read((char*)&bootstrapCounts[0], (streamsize)(header.nodeCount * sizeof(int)));
+	if (!in) {
+		return NULL;
+	}
+
+	// The children of each node were created before it, which is also the order in which they are created again.
+	for (int i = 0; i < internalCount; i++) {
+		if (leftChildren[i] < 0 || leftChildren[i] >= n + i || rightChildren[i] < 0 || rightChildren[i] >= n + i) {
+			return NULL;
+		}
+	}
+	if (header.rootLeftIndex < 0 || header.rootLeftIndex >= header.nodeCount || header.rootRightIndex < 0 || header.rootRightIndex >= header.nodeCount) {
+		return NULL;
+	}
+
+	polytree* tree = createPolytree(n, sequenceNames);
+	for (int i = 0; i < internalCount; i++) {
+		tree->addInternalNode(branchLengths[leftChildren[i]], branchLengths[rightChildren[i]], leftChildren[i], rightChildren[i]);
+	}
+	tree->set_serialization_indices(header.rootLeftIndex, header.rootRightIndex, (distType)header.rootBranchLength);
+
+	if (header.completedReplicates > 0) {
+		tree->bootstrap_counts = new int[header.nodeCount];
+		memcpy(tree->bootstrap_counts, &bootstrapCounts[0], header.nodeCount * sizeof(int));
+		getBootstrapReplicateCount(tree) = header.completedReplicates;
+	}
+	return tree;
+}
+
+bool treeCheckpoint::write(polytree* tree) {
+	polytreeTopology topology = getPolytreeTopology(tree);
+	int internalCount = topology.nodeCount - topology.leafCount;
+
+	treeCheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TREE_CHECKPOINT_MAGIC, sizeof(TREE_CHECKPOINT_MAGIC));
+	header.version = TREE_CHECKPOINT_VERSION;
+	header.inputLow = input.low;
+	header.inputHigh = input.high;
+	header.settings = settings;
+	header.sequenceCount = topology.leafCount;
+	header.nodeCount = topology.nodeCount;
+	header.rootLeftIndex = topology.rootLeftIndex;
+	header.rootRightIndex = topology.rootRightIndex;
+	header.rootBranchLength = topology.rootBranchLength;
+	header.completedReplicates = tree->bootstrap_counts != NULL ? getBootstrapReplicateCount(tree) : 0;
+	header.replicateCount = replicateCount;
+
+	vector<int> bootstrapCounts(topology.nodeCount, 0);
+	if (tree->bootstrap_counts != NULL) {
+		bootstrapCounts.assign(tree->bootstrap_counts, tree->bootstrap_counts + topology.nodeCount);
+	}
+
+	// The checkpoint is written to a temporary file, which is flushed to the disk before it replaces the previous checkpoint, so that a crash at any point leaves
+	// either the previous or the new checkpoint in place.
+	string temporaryName = fileName + ".tmp";
+	FILE* out = fopen(temporaryName.c_str(), "wb");
+	if (out == NULL) {
+		return false;
+	}
+	bool written = fwrite(&header, sizeof(header), 1, out) == 1;
+	if (internalCount > 0) {
+		written = written && fwrite(topology.leftChildIndices, sizeof(int), internalCount, out) == (size_t)internalCount;
+		written = written && fwrite(topology.rightChildIndices, sizeof(int), internalCount, out) == (size_t)internalCount;
+	}
+	written = written && fwrite(topology.branchLengths, sizeof(double), topology.nodeCount, out) == (size_t)topology.nodeCount;
+	written = written && fwrite(&bootstrapCounts[0], sizeof(int), topology.nodeCount, out) == (size_t)topology.nodeCount;
+	written = written && fflush(out) == 0;
+#ifdef __WINDOWS__
+	written = written && _commit(_fileno(out)) == 0;
+#else
+	written = written && fsync(fileno(out)) == 0;
+#endif
+	written = fclose(out) == 0 && written;
+	if (!written) {
+		std::remove(temporaryName.c_str());
+		return false;
+	}
+
+#ifdef __WINDOWS__
+	return MoveFileExA(temporaryName.c_str(), fileName.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	if (std::rename(temporaryName.c_str(), fileName.c_str()) != 0) {
+		return false;
+	}
+	// The rename itself is only durable once the directory is flushed too.
+	size_t separator = fileName.find_last_of('/');
+	string directory = separator == string::npos ? "." : separator == 0 ? "/" : fileName.substr(0, separator);
+	int directoryFile = open(directory.c_str(), O_RDONLY);
+	if (directoryFile >= 0) {
+		fsync(directoryFile);
+		close(directoryFile);
+	}
+	return true;
+#endif
+}
+
+bool treeCheckpoint::writeReplicates(polytree* tree) {
+	int completed = getBootstrapReplicateCount(tree);
+	if (completed % interval != 0 && completed != replicateCount) {
+		return true;
+	}
+	return write(tree);
+}
+
+void treeCheckpoint::remove() {
+	std::remove(fileName.c_str());
+}
@@ -0,0 +1,59 @@
+#ifndef TREE_CHECKPOINT_HPP
+#define TREE_CHECKPOINT_HPP
+
+#include "stdinclude.h"
+#include "polytree.h"
+#include "distanceCache.hpp"
+
+const char TREE_CHECKPOINT_MAGIC[8] = { 'R', 'N', 'J', 'C', 'K', 'P', 'T', '1' };
+const unsigned int TREE_CHECKPOINT_VERSION = 1;
+
+/*Start of a checkpoint file, in the byte order of the machine that wrote it. It is followed by the left and right children of the internal nodes, the branch lengths
+of all the nodes, and their bootstrap counts.*/
+struct treeCheckpointHeader {
+	char magic[8];
+	unsigned int version;
+	unsigned int reserved;
+	// The distanceCacheKey of the alignment, and a hash of the options that the tree and its replicates depend on.
+	unsigned long long inputLow;
+	unsigned long long inputHigh;
+	unsigned long long settings;
+	int sequenceCount;
+	int nodeCount;
+	int rootLeftIndex;
+	int rootRightIndex;
+	double rootBranchLength;
+	// Number of bootstrap replicates counted in the bootstrap counts.
+	int completedReplicates;
+	int replicateCount;
+};
+
+/*Saves a tree and the bootstrap counts of the replicates computed so far, so that a call interrupted while computing the replicates can resume from the last checkpoint
+rather than from the start. The tree is saved as soon as it is built, and the counts every few replicates; the file is written next to its final name and then renamed
+over it, so that it always holds a complete checkpoint. Checkpoints are only used again by calls with the same alignment and options.*/
+class treeCheckpoint {
+
+public:
+	treeCheckpoint(string fileName, distanceCacheKey input, unsigned long long settings, int replicateCount, int interval);
+
+	/*Returns the tree of the checkpoint, with its bootstrap counts, or NULL if there is no checkpoint of the same alignment and options. The leaves are named after sequenceNames.*/
+	polytree* read(vector<string>* sequenceNames);
+
+	/*Saves the tree with its bootstrap counts. Returns false if the file could not be written, in which case the previous checkpoint is kept.*/
+	bool write(polytree* tree);
+
+	/*Saves the tree if the number of replicates counted in it is a multiple of the interval, or all of them.*/
+	bool writeReplicates(polytree* tree);
+
+	/*Deletes the checkpoint, once the call has finished.*/
+	void remove();
+
+private:
+	string fileName;
+	distanceCacheKey input;
+	unsigned long long settings;
+	int replicateCount;
+	int interval;
+};
+
+#endif
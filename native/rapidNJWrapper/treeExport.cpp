@@ -0,0 +1,161 @@
+#include "treeExport.hpp"
+#include <map>
+
+// The polytree arrays are private members of the prebuilt library, without accessors. Member pointers to them can still be obtained
+// through an explicit template instantiation (where access checks do not apply), which keeps the class layout checked by the compiler.
+template <typename Tag, typename Tag::type Member>
+struct polytreeMember {
+	friend typename Tag::type getMember(Tag) {
+		return Member;
+	}
+};
+
+#define POLYTREE_MEMBER(name, memberType) \
+	struct polytree_##name { \
+		typedef memberType polytree::* type; \
+		friend type getMember(polytree_##name); \
+	}; \
+	template struct polytreeMember<polytree_##name, &polytree::name>;
+
+POLYTREE_MEMBER(distances, double*)
+POLYTREE_MEMBER(left_indexes, int*)
+POLYTREE_MEMBER(right_indexes, int*)
+POLYTREE_MEMBER(parent_indices, int*)
+POLYTREE_MEMBER(leaf_names, std::string*)
+POLYTREE_MEMBER(size, unsigned int)
+POLYTREE_MEMBER(current_index, int)
+POLYTREE_MEMBER(s_index_left, unsigned int)
+POLYTREE_MEMBER(s_index_right, unsigned int)
+POLYTREE_MEMBER(s_dist, distType)
+POLYTREE_MEMBER(leaf_index, int)
+POLYTREE_MEMBER(bootstrap_replicate_count, int)
+
+#undef POLYTREE_MEMBER
+
+polytree* createPolytree(int size, vector<string>* sequenceNames) {
+	polytree* tree = new polytree(size, sequenceNames);
+	// The leaves are normally added by the constructor; add them here if they were not.
+	if (tree->*getMember(polytree_leaf_index()) == 0) {
+		for (int i = 0; i < size; i++) {
+			tree->addLeaf((*sequenceNames)[i]);
+		}
+	}
+	return tree;
+}
+
+polytreeTopology getPolytreeTopology(polytree* tree) {
+	polytreeTopology topology;
+	topology.leafCount = tree->*getMember(polytree_size());
+	topology.nodeCount = tree->*getMember(polytree_current_index());
+	topology.leftChildIndices = tree->*getMember(polytree_left_indexes());
+	topology.rightChildIndices = tree->*getMember(polytree_right_indexes());
+	topology.branchLengths = tree->*getMember(polytree_distances());
+	topology.rootLeftIndex = tree->*getMember(polytree_s_index_left());
+	topology.rootRightIndex = tree->*getMember(polytree_s_index_right());
+	topology.rootBranchLength = tree->*getMember(polytree_s_dist());
+	return topology;
+}
+
+int& getBootstrapReplicateCount(polytree* tree) {
+	return tree->*getMember(polytree_bootstrap_replicate_count());
+}
+
+polytree* expandPolytreeLeaves(polytree* tree, const vector<vector<int> >& leafGroups, vector<string>* sequenceNames) {
+	polytreeTopology topology = getPolytreeTopology(tree);
+	double* distances = tree->*getMember(polytree_distances());
+	polytree* expanded = createPolytree((int)sequenceNames->size(), sequenceNames);
+
+	// Node of the expanded tree that stands for each node of tree.
+	vector<int> expandedNodes(topology.nodeCount);
+
+	for (int i = 0; i < topology.leafCount; i++) {
+		const vector<int>& group = leafGroups[i];
+		int node = group[0];
+		for (unsigned int j = 1; j < group.size(); j++) {
+			expanded->addInternalNode(0, 0, node, group[j]);
+			node = expanded->*getMember(polytree_current_index()) - 1;
+		}
+		expandedNodes[i] = node;
+	}
+
+	// The internal nodes are created again in the same order, so that the children of each node exist before it.
+	for (int i = topology.leafCount; i < topology.nodeCount; i++) {
+		int left = topology.leftChildIndices[i - topology.leafCount];
+		int right = topology.rightChildIndices[i - topology.leafCount];
+		expanded->addInternalNode(distances[left], distances[right], expandedNodes[left], expandedNodes[right]);
+		expandedNodes[i] = expanded->*getMember(polytree_current_index()) - 1;
+	}
+	expanded->set_serialization_indices(expandedNodes[topology.rootLeftIndex], expandedNodes[topology.rootRightIndex], tree->*getMember(polytree_s_dist()));
+
+	if (tree->bootstrap_counts != NULL) {
+		int replicateCount = getBootstrapReplicateCount(tree);
+		int expandedNodeCount = expanded->*getMember(polytree_current_index());
+		expanded->bootstrap_counts = new int[expandedNodeCount];
+		// Leaves are trivially supported by all the replicates, just like the groups.
+		for (int i = 0; i < expandedNodeCount; i++) {
+			expanded->bootstrap_counts[i] = replicateCount;
+		}
+		for (int i = 0; i < topology.nodeCount; i++) {
+			expanded->bootstrap_counts[expandedNodes[i]] = tree->bootstrap_counts[i];
+		}
+		getBootstrapReplicateCount(expanded) = replicateCount;
+	}
+
+	return expanded;
+}
+
+void exportTree(polytree* tree, vector<string>* sequenceNames, int bootstrapReplicates, tree_callback callback, statisticsCollector* statistics) {
+	phaseTimer timer(statistics, &rapidNJStatistics::serialization);
+	int leafCount = tree->*getMember(polytree_size());
+	int nodeCount = tree->*getMember(polytree_current_index());
+	int rootLeft = tree->*getMember(polytree_s_index_left());
+	int rootRight = tree->*getMember(polytree_s_index_right());
+	string* leafNames = tree->*getMember(polytree_leaf_names());
+
+	// The parents of the last two clusters are never set by the NJ algorithm.
+	vector<int> parentIndices(tree->*getMember(polytree_parent_indices()), tree->*getMember(polytree_parent_indices()) + nodeCount);
+	parentIndices[rootLeft] = -1;
+	parentIndices[rootRight] = -1;
+
+	// Leaves are normally stored in input order; only fall back to a lookup by name if they are not.
+	vector<int> leafNameIndices(leafCount);
+	map<string, int>* nameLookup = NULL;
+	for (int i = 0; i < leafCount; i++) {
+		if (i < (int)sequenceNames->size() && leafNames[i] == (*sequenceNames)[i]) {
+			leafNameIndices[i] = i;
+		}
+		else {
+			if (nameLookup == NULL) {
+				nameLookup = new map<string, int>();
+				for (int j = (int)sequenceNames->size() - 1; j >= 0; j--) {
+					(*nameLookup)[(*sequenceNames)[j]] = j;
+				}
+			}
+			map<string, int>::iterator it = nameLookup->find(leafNames[i]);
+			leafNameIndices[i] = it != nameLookup->end() ? it->second : -1;
+		}
+	}
+	delete nameLookup;
+
+	vector<int> bootstrapCounts;
+	if (bootstrapReplicates > 0) {
+		bootstrapCounts.assign(tree->bootstrap_counts, tree->bootstrap_counts + nodeCount);
+	}
+
+	rapidNJTree result;
+	result.leafCount = leafCount;
+	result.nodeCount = nodeCount;
+	result.parentIndices = &parentIndices[0];
+	result.leftChildIndices = tree->*getMember(polytree_left_indexes());
+	result.rightChildIndices = tree->*getMember(polytree_right_indexes());
+	result.branchLengths = tree->*getMember(polytree_distances());
+	result.bootstrapCounts = bootstrapReplicates > 0 ? &bootstrapCounts[0] : NULL;
+	result.bootstrapReplicates = bootstrapReplicates > 0 ? bootstrapReplicates : 0;
+	result.leafNameIndices = &leafNameIndices[0];
+	result.rootLeftIndex = rootLeft;
+	result.rootRightIndex = rootRight;
+	result.rootBranchLength = tree->*getMember(polytree_s_dist());
+
+	timer.stop();
+	callback(&result);
+}
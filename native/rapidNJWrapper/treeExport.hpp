@@ -0,0 +1,60 @@
+#ifndef TREE_EXPORT_HPP
+#define TREE_EXPORT_HPP
+
+#include "stdinclude.h"
+#include "polytree.h"
+#include "callStatistics.hpp"
+
+/*A tree returned through a tree_callback, without going through a Newick string.
+Nodes 0 to leafCount - 1 are the leaves, the other nodes are internal nodes in the order in which they were created by the NJ algorithm. The tree is unrooted: the last two clusters are joined by the edge between rootLeftIndex and rootRightIndex.
+All the arrays are owned by the library and are only valid until the callback returns.*/
+struct rapidNJTree {
+	int leafCount;
+	int nodeCount;
+	// Parent of each node (nodeCount elements); -1 for rootLeftIndex and rootRightIndex.
+	const int* parentIndices;
+	// Children of each internal node (nodeCount - leafCount elements, indexed by node - leafCount).
+	const int* leftChildIndices;
+	const int* rightChildIndices;
+	// Length of the branch between each node and its parent (nodeCount elements).
+	const double* branchLengths;
+	// Number of bootstrap replicates supporting the branch between each node and its parent (nodeCount elements), or NULL if no bootstrap was performed.
+	const int* bootstrapCounts;
+	int bootstrapReplicates;
+	// Index of the input sequence corresponding to each leaf (leafCount elements).
+	const int* leafNameIndices;
+	int rootLeftIndex;
+	int rootRightIndex;
+	double rootBranchLength;
+};
+
+typedef void (*tree_callback)(const rapidNJTree*);
+
+/*The topology of a polytree, in the same layout as rapidNJTree. The arrays are owned by the tree.*/
+struct polytreeTopology {
+	int leafCount;
+	int nodeCount;
+	const int* leftChildIndices;
+	const int* rightChildIndices;
+	const double* branchLengths;
+	int rootLeftIndex;
+	int rootRightIndex;
+	double rootBranchLength;
+};
+
+polytreeTopology getPolytreeTopology(polytree* tree);
+
+/*Returns the number of replicates that have been counted in the bootstrap counts of the tree.*/
+int& getBootstrapReplicateCount(polytree* tree);
+
+/*Creates a tree with size leaves and no internal nodes, to be built with addInternalNode. Leaf i is named after sequence i.*/
+polytree* createPolytree(int size, vector<string>* sequenceNames);
+
+/*Returns a copy of tree in which each leaf i is replaced by the leaves listed in leafGroups[i], joined by branches of length 0. The leaves of the copy are named after
+sequenceNames, and each index of sequenceNames must appear in exactly one group. If tree has bootstrap counts, they are copied, and the branches inside the groups are counted as supported by all the replicates.*/
+polytree* expandPolytreeLeaves(polytree* tree, const vector<vector<int> >& leafGroups, vector<string>* sequenceNames);
+
+/*Describes the tree and passes it to the callback. sequenceNames are the names of the input sequences, in order. The time spent describing the tree is added to the serialization time of statistics, if it is not NULL.*/
+void exportTree(polytree* tree, vector<string>* sequenceNames, int bootstrapReplicates, tree_callback callback, statisticsCollector* statistics = NULL);
+
+#endif
@@ -0,0 +1,406 @@
+#include "treePlacement.hpp"
+#include "distanceCorrections.hpp"
+
+static placementSums leafSums(distType distance) {
+	placementSums sums;
+	sums.leaves = 1;
+	sums.d = distance;
+	sums.d2 = (double)distance * distance;
+	sums.t = 0;
+	sums.t2 = 0;
+	sums.dt = 0;
+	return sums;
+}
+
+// The same leaves, with paths that are longer by length.
+static placementSums extendSums(const placementSums& sums, double length) {
+	placementSums retVal = sums;
+	retVal.t = sums.t + sums.leaves * length;
+	retVal.t2 = sums.t2 + 2 * length * sums.t + sums.leaves * length * length;
+	retVal.dt = sums.dt + length * sums.d;
+	return retVal;
+}
+
+static placementSums addSums(const placementSums& a, const placementSums& b) {
+	placementSums retVal;
+	retVal.leaves = a.leaves + b.leaves;
+	retVal.d = a.d + b.d;
+	retVal.d2 = a.d2 + b.d2;
+	retVal.t = a.t + b.t;
+	retVal.t2 = a.t2 + b.t2;
+	retVal.dt = a.dt + b.dt;
+	return retVal;
+}
+
+// Sum of the squares of d - (t + offset) over the leaves.
+static double squaredError(const placementSums& sums, double offset) {
+	return sums.d2 - 2 * sums.dt + sums.t2 - 2 * offset * (sums.d - sums.t) + sums.leaves * offset * offset;
+}
+
+treePlacement::treePlacement(const rapidNJTree* tree, int sequenceCount, kernelDistance* distances, int numThreads) {
+	treePlacement::sequenceCount = sequenceCount;
+	treePlacement::distances = distances;
+	pool = new workerPool(max(numThreads, 1));
+	valid = false;
+	rootLeft = -1;
+	rootRight = -1;
+	maxDistance = 0;
+
+	int leafCount = tree->leafCount;
+	if (leafCount < 2 || leafCount > sequenceCount || tree->nodeCount != 2 * leafCount - 2) {
+		nextInternalNode = sequenceCount;
+		return;
+	}
+
+	// A binary tree of sequenceCount leaves has sequenceCount - 2 internal nodes.
+	int capacity = 2 * sequenceCount - 2;
+	neighbours.assign((size_t)capacity * 3, -1);
+	lengths.assign((size_t)capacity * 3, 0);
+	placed.assign(sequenceCount, 0);
+	nextInternalNode = sequenceCount + leafCount - 2;
+
+	// Node of this tree that stands for each node of the input tree.
+	vector<int> nodes(tree->nodeCount);
+	for (int i = 0; i < leafCount; i++) {
+		int sequence = tree->leafNameIndices[i];
+		if (sequence < 0 || sequence >= leafCount || placed[sequence]) {
+			return;
+		}
+		placed[sequence] = 1;
+		nodes[i] = sequence;
+	}
+	for (int i = leafCount; i < tree->nodeCount; i++) {
+		nodes[i] = sequenceCount + i - leafCount;
+	}
+
+	for (int i = leafCount; i < tree->nodeCount; i++) {
+		int left = tree->leftChildIndices[i - leafCount];
+		int right = tree->rightChildIndices[i - leafCount];
+		if (left < 0 || left >= tree->nodeCount || right < 0 || right >= tree->nodeCount || !connect(nodes[i], nodes[left], tree->branchLengths[left]) || !connect(nodes[i], nodes[right], tree->branchLengths[right])) {
+			return;
+		}
+	}
+	if (tree->rootLeftIndex < 0 || tree->rootLeftIndex >= tree->nodeCount || tree->rootRightIndex < 0 || tree->rootRightIndex >= tree->nodeCount) {
+		return;
+	}
+	rootLeft = nodes[tree->rootLeftIndex];
+	rootRight = nodes[tree->rootRightIndex];
+	if (!connect(rootLeft, rootRight, tree->rootBranchLength)) {
+		return;
+	}
+
+	// With one edge less than nodes, the tree is connected if and only if it has no cycle, and all the nodes are then reached from any of them.
+	int reached = 0;
+	vector<char> visited(capacity, 0);
+	vector<int> pending(1, 0);
+	visited[0] = 1;
+	while (!pending.empty()) {
+		int node = pending.back();
+		pending.pop_back();
+		reached++;
+		for (int k = 0; k < 3; k++) {
+			int neighbour = neighbours[(size_t)node * 3 + k];
+			if (neighbour >= 0 && !visited[neighbour]) {
+				visited[neighbour] = 1;
+				pending.push_back(neighbour);
+			}
+		}
+	}
+	if (reached != tree->nodeCount) {
+		return;
+	}
+	for (int i = 0; i < leafCount; i++) {
+		if (neighbours[(size_t)i * 3 + 1] != -1) {
+			return;
+		}
+	}
+	for (int i = sequenceCount; i < nextInternalNode; i++) {
+		if (neighbours[(size_t)i * 3 + 2] == -1) {
+			return;
+		}
+	}
+
+	sequenceDistances.resize(sequenceCount);
+	parents.resize(capacity);
+	parentLengths.resize(capacity);
+	below.resize(capacity);
+	above.resize(capacity);
+	valid = true;
+}
+
+treePlacement::~treePlacement() {
+	delete pool;
+}
+
+bool treePlacement::isValid() {
+	return valid;
+}
+
+int treePlacement::allocateNode() {
+	if (!freeNodes.empty()) {
+		int node = freeNodes.back();
+		freeNodes.pop_back();
+		return node;
+	}
+	return nextInternalNode++;
+}
+
+int treePlacement::getSlot(int node, int neighbour) {
+	for (int k = 0; k < 3; k++) {
+		if (neighbours[(size_t)node * 3 + k] == neighbour) {
+			return node * 3 + k;
+		}
+	}
+	return -1;
+}
+
+bool treePlacement::connect(int node1, int node2, double length) {
+	int slot1 = getSlot(node1, -1);
+	int slot2 = getSlot(node2, -1);
+	if (slot1 < 0 || slot2 < 0) {
+		return false;
+	}
+	neighbours[slot1] = node2;
+	lengths[slot1] = length;
+	neighbours[slot2] = node1;
+	lengths[slot2] = length;
+	return true;
+}
+
+void treePlacement::computeDistances(int sequence) {
+	threadStatePlacement state;
+	state.distances = distances;
+	state.sequence = sequence;
+	state.sequenceCount = sequenceCount;
+	state.placed = &placed[0];
+	state.result = &sequenceDistances[0];
+	pool->run(distanceTask, (void*)&state);
+
+	// The whole matrix is never computed, so the distances that could not be corrected are replaced by twice the largest distance computed so far, which includes those
+	// of the sequence.
+	bool saturated = false;
+	for (int i = 0; i < sequenceCount; i++) {
+		if (placed[i]) {
+			if (sequenceDistances[i] == -1) {
+				saturated = true;
+			}
+			else {
+				maxDistance = max(maxDistance, sequenceDistances[i]);
+			}
+		}
+	}
+	if (saturated) {
+		distType substitute = getSaturatedDistance(maxDistance);
+		for (int i = 0; i < sequenceCount; i++) {
+			if (placed[i] && sequenceDistances[i] == -1) {
+				sequenceDistances[i] = substitute;
+			}
+		}
+	}
+}
+
+// Each worker computes the distances to its own share of the sequences, which are all about as long.
+void treePlacement::distanceTask(void* arg, int workerIndex, int workerCount) {
+	threadStatePlacement* state = (threadStatePlacement*)arg;
+	int begin = (int)((long long)state->sequenceCount * workerIndex / workerCount);
+	int end = (int)((long long)state->sequenceCount * (workerIndex + 1) / workerCount);
+	for (int i = begin; i < end; i++) {
+		if (state->placed[i]) {
+			state->result[i] = state->distances->computeDistance(state->sequence, i);
+		}
+	}
+}
+
+void treePlacement::place(int sequence) {
+	computeDistances(sequence);
+
+	// The tree is rooted at a leaf, so that every edge is between a node and its parent, and listed so that parents come before their children.
+	int root = 0;
+	while (!placed[root]) {
+		root++;
+	}
+	order.clear();
+	order.push_back(root);
+	parents[root] = -1;
+	for (size_t i = 0; i < order.size(); i++) {
+		int node = order[i];
+		for (int k = 0; k < 3; k++) {
+			int neighbour = neighbours[(size_t)node * 3 + k];
+			if (neighbour >= 0 && neighbour != parents[node]) {
+				parents[neighbour] = node;
+				parentLengths[neighbour] = lengths[(size_t)node * 3 + k];
+				order.push_back(neighbour);
+			}
+		}
+	}
+
+	// The leaves below each node, with the paths from the node.
+	for (size_t i = order.size() - 1; i > 0; i--) {
+		int node = order[i];
+		if (node < sequenceCount) {
+			below[node] = leafSums(sequenceDistances[node]);
+		}
+		else {
+			bool first = true;
+			for (int k = 0; k < 3; k++) {
+				int child = neighbours[(size_t)node * 3 + k];
+				if (child != parents[node]) {
+					placementSums childSums = extendSums(below[child], parentLengths[child]);
+					below[node] = first ? childSums : addSums(below[node], childSums);
+					first = false;
+				}
+			}
+		}
+	}
+
+	// The leaves that are not below each node, with the paths from its parent.
+	above[order[1]] = leafSums(sequenceDistances[root]);
+	for (size_t i = 1; i < order.size(); i++) {
+		int node = order[i];
+		if (node < sequenceCount) {
+			continue;
+		}
+		placementSums outside = extendSums(above[node], parentLengths[node]);
+		int children[2];
+		int childCount = 0;
+		for (int k = 0; k < 3; k++) {
+			int neighbour = neighbours[(size_t)node * 3 + k];
+			if (neighbour != parents[node]) {
+				children[childCount++] = neighbour;
+			}
+		}
+		above[children[0]] = addSums(outside, extendSums(below[children[1]], parentLengths[children[1]]));
+		above[children[1]] = addSums(outside, extendSums(below[children[0]], parentLengths[children[0]]));
+	}
+
+	// The sequence is attached at distance x from the child of an edge of length l, with a branch of length b: the paths to the leaves below the edge grow by x + b,
+	// and those to the other leaves by l - x + b. Each of these is best at the mean difference between the distances and the paths, within the bounds of the edge.
+	int bestChild = -1;
+	double bestError = 0;
+	double bestPosition = 0;
+	double bestBranch = 0;
+	for (size_t i = 1; i < order.size(); i++) {
+		int node = order[i];
+		const placementSums& inside = below[node];
+		const placementSums& outside = above[node];
+		double length = max(parentLengths[node], 0.0);
+		double insideOffset = (inside.d - inside.t) / inside.leaves;
+		double outsideOffset = (outside.d - outside.t) / outside.leaves;
+		double position = min(max((insideOffset - outsideOffset + length) / 2, 0.0), length);
+		double branch = max((inside.leaves * (insideOffset - position) + outside.leaves * (outsideOffset - length + position)) / (inside.leaves + outside.leaves), 0.0);
+		double error = squaredError(inside, position + branch) + squaredError(outside, length - position + branch);
+		if (bestChild == -1 || error < bestError) {
+			bestChild = node;
+			bestError = error;
+			bestPosition = position;
+			bestBranch = branch;
+		}
+	}
+
+	int child = bestChild;
+	int parent = parents[child];
+	double length = parentLengths[child];
+	int node = allocateNode();
+	int childSlot = getSlot(child, parent);
+	int parentSlot = getSlot(parent, child);
+	neighbours[childSlot] = node;
+	lengths[childSlot] = bestPosition;
+	neighbours[parentSlot] = node;
+	lengths[parentSlot] = length - bestPosition;
+	size_t nodeSlot = (size_t)node * 3;
+	neighbours[nodeSlot] = child;
+	lengths[nodeSlot] = bestPosition;
+	neighbours[nodeSlot + 1] = parent;
+	lengths[nodeSlot + 1] = length - bestPosition;
+	neighbours[nodeSlot + 2] = sequence;
+	lengths[nodeSlot + 2] = bestBranch;
+	neighbours[(size_t)sequence * 3] = node;
+	lengths[(size_t)sequence * 3] = bestBranch;
+	placed[sequence] = 1;
+
+	if ((rootLeft == child && rootRight == parent) || (rootLeft == parent && rootRight == child)) {
+		rootLeft = child;
+		rootRight = node;
+	}
+}
+
+void treePlacement::remove(int sequence) {
+	int node = neighbours[(size_t)sequence * 3];
+	int others[2];
+	double otherLengths[2];
+	int otherCount = 0;
+	for (int k = 0; k < 3; k++) {
+		int neighbour = neighbours[(size_t)node * 3 + k];
+		if (neighbour != sequence) {
+			others[otherCount] = neighbour;
+			otherLengths[otherCount] = lengths[(size_t)node * 3 + k];
+			otherCount++;
+		}
+	}
+
+	double length = otherLengths[0] + otherLengths[1];
+	int slot0 = getSlot(others[0], node);
+	int slot1 = getSlot(others[1], node);
+	neighbours[slot0] = others[1];
+	lengths[slot0] = length;
+	neighbours[slot1] = others[0];
+	lengths[slot1] = length;
+
+	for (int k = 0; k < 3; k++) {
+		neighbours[(size_t)node * 3 + k] = -1;
+		neighbours[(size_t)sequence * 3 + k] = -1;
+	}
+	freeNodes.push_back(node);
+	placed[sequence] = 0;
+
+	if (rootLeft == node || rootRight == node) {
+		rootLeft = others[0];
+		rootRight = others[1];
+	}
+}
+
+polytree* treePlacement::getTree(vector<string>* sequenceNames) {
+	polytree* tree = createPolytree(sequenceCount, sequenceNames);
+	vector<int> treeNodes(neighbours.size() / 3, -1);
+	for (int i = 0; i < sequenceCount; i++) {
+		treeNodes[i] = i;
+	}
+
+	// Each side of the root edge is listed with the parents before their children, and the internal nodes are created in the reverse order.
+	int sides[2] = { rootLeft, rootRight };
+	for (int side = 0; side < 2; side++) {
+		order.clear();
+		order.push_back(sides[side]);
+		parents[sides[side]] = sides[1 - side];
+		for (size_t i = 0; i < order.size(); i++) {
+			int node = order[i];
+			for (int k = 0; k < 3; k++) {
+				int neighbour = neighbours[(size_t)node * 3 + k];
+				if (neighbour >= 0 && neighbour != parents[node]) {
+					parents[neighbour] = node;
+					parentLengths[neighbour] = lengths[(size_t)node * 3 + k];
+					order.push_back(neighbour);
+				}
+			}
+		}
+		for (size_t i = order.size(); i > 0; i--) {
+			int node = order[i - 1];
+			if (node < sequenceCount) {
+				continue;
+			}
+			int children[2];
+			int childCount = 0;
+			for (int k = 0; k < 3; k++) {
+				int neighbour = neighbours[(size_t)node * 3 + k];
+				if (neighbour != parents[node]) {
+					children[childCount++] = neighbour;
+				}
+			}
+			tree->addInternalNode(parentLengths[children[0]], parentLengths[children[1]], treeNodes[children[0]], treeNodes[children[1]]);
+			treeNodes[node] = getPolytreeTopology(tree).nodeCount - 1;
+		}
+	}
+
+	tree->set_serialization_indices(treeNodes[rootLeft], treeNodes[rootRight], (distType)lengths[getSlot(rootLeft, rootRight)]);
+	return tree;
+}
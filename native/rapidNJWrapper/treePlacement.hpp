@@ -0,0 +1,84 @@
+#ifndef TREE_PLACEMENT_HPP
+#define TREE_PLACEMENT_HPP
+
+#include "stdinclude.h"
+#include "polytree.h"
+#include "treeExport.hpp"
+#include "kernelDistance.hpp"
+#include "workerPool.hpp"
+
+/*Sums over a set of leaves of the distances d between the leaves and the sequence being placed, and of the lengths t of the paths between the leaves and a node of the tree,
+from which the least squares error of attaching the sequence at any point of an edge can be computed in constant time.*/
+struct placementSums {
+	double leaves;
+	double d;
+	double d2;
+	double t;
+	double t2;
+	double dt;
+};
+
+/*Adds sequences to an existing tree without building it again: each new sequence is attached to the edge of the tree where the least squares error between its distances
+to the leaves and the lengths of the paths to them is the smallest, like the ordinary least squares placement of APPLES. The error of all the edges is computed with two
+passes over the tree, so placing a sequence in a tree of n leaves takes the n distances to the leaves and O(n) more operations.
+The leaves of the tree are the sequences of a kernelDistance, and sequences that are not yet in the tree can be placed in any order. Each placement takes the sequences
+placed before it into account.*/
+class treePlacement {
+
+public:
+	/*Starts from a tree whose leaves are sequences 0 to tree->leafCount - 1, in the order given by tree->leafNameIndices. sequenceCount is the number of sequences that the
+	tree will have once all of them are placed. valid is false if the tree is not a complete binary tree of those sequences.*/
+	treePlacement(const rapidNJTree* tree, int sequenceCount, kernelDistance* distances, int numThreads);
+	~treePlacement();
+	bool isValid();
+
+	/*Attaches a sequence that is not in the tree.*/
+	void place(int sequence);
+
+	/*Removes a sequence that is in the tree, leaving the tree binary. The tree must keep at least 2 leaves.*/
+	void remove(int sequence);
+
+	/*Returns the tree as a polytree with one leaf per sequence, named after sequenceNames, which must all have been placed. The tree has no bootstrap counts.*/
+	polytree* getTree(vector<string>* sequenceNames);
+
+private:
+	int sequenceCount;
+	kernelDistance* distances;
+	workerPool* pool;
+	bool valid;
+	// Up to 3 neighbours of each node, and the lengths of the edges to them; -1 for unused slots. Nodes 0 to sequenceCount - 1 are the leaves.
+	vector<int> neighbours;
+	vector<double> lengths;
+	// Internal nodes freed by remove, which are reused first.
+	vector<int> freeNodes;
+	int nextInternalNode;
+	vector<char> placed;
+	// The edge that becomes the root edge of the polytree.
+	int rootLeft;
+	int rootRight;
+	// The largest distance computed by place so far, used for the distances that could not be corrected.
+	distType maxDistance;
+	// Buffers of place, kept from one call to the next.
+	vector<distType> sequenceDistances;
+	vector<int> order;
+	vector<int> parents;
+	vector<double> parentLengths;
+	vector<placementSums> below;
+	vector<placementSums> above;
+
+	int allocateNode();
+	int getSlot(int node, int neighbour);
+	bool connect(int node1, int node2, double length);
+	void computeDistances(int sequence);
+	static void distanceTask(void* arg, int workerIndex, int workerCount);
+};
+
+struct threadStatePlacement {
+	kernelDistance* distances;
+	int sequence;
+	int sequenceCount;
+	const char* placed;
+	distType* result;
+};
+
+#endif
@@ -0,0 +1,273 @@
+#include "workerPool.hpp"
+
+#ifdef __WINDOWS__
+#include <windows.h>
+#elif defined __linux__
+#include <sched.h>
+#endif
+
+/*A task submitted to the shared threads. The task is finished once pendingWorkers reaches 0.*/
+struct workerJob {
+	workerTask task;
+	void* arg;
+	int workerCount;
+	vector<bool> started;
+	int unstartedWorkers;
+	int pendingWorkers;
+};
+
+struct threadStateShared {
+	int threadIndex;
+};
+
+// All the shared state is protected by sharedMutex.
+static pthread_mutex_t sharedMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobAvailable = PTHREAD_COND_INITIALIZER;
+// Signalled whenever a worker starts or finishes, for the threads that wait for the workers of their jobs.
+static pthread_cond_t workerChanged = PTHREAD_COND_INITIALIZER;
+// Jobs with workers that have not been started yet, oldest first.
+static vector<workerJob*> sharedJobs;
+static vector<pthread_t> sharedThreads;
+// Whether each shared thread is waiting for a worker, or has just been started. The workers of such a thread are left to it, as it is about to look for them.
+static vector<bool> sharedThreadWaiting;
+static vector<int> sharedCpus;
+static bool sharedFixedSize = false;
+static bool sharedStopping = false;
+
+static void bindThread(int threadIndex) {
+	if (sharedCpus.empty()) {
+		return;
+	}
+	int cpu = sharedCpus[threadIndex % sharedCpus.size()];
+#ifdef __WINDOWS__
+	SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+#elif defined __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+// Must be called with sharedMutex held.
+static void startWorker(workerJob* job, int workerIndex) {
+	job->started[workerIndex] = true;
+	job->unstartedWorkers--;
+	// The thread starting the worker is now busy, so the threads waiting for their jobs may take the workers it owns.
+	pthread_cond_broadcast(&workerChanged);
+	if (job->unstartedWorkers == 0) {
+		for (unsigned int i = 0; i < sharedJobs.size(); i++) {
+			if (sharedJobs[i] == job) {
+				sharedJobs.erase(sharedJobs.begin() + i);
+				break;
+			}
+		}
+	}
+}
+
+// Worker i of a job belongs to shared thread i - 1, and can only be taken by another shared thread if its own is busy or does not exist. Must be called with sharedMutex held.
+static bool canTakeWorker(workerJob* job, int workerIndex) {
+	if (job->started[workerIndex]) {
+		return false;
+	}
+	unsigned int owner = workerIndex - 1;
+	return owner >= sharedThreads.size() || !sharedThreadWaiting[owner];
+}
+
+// Shared thread i runs worker i + 1 of the jobs, so that a worker stays on the same thread, and thus on the same processor and memory node, from one task to the next,
+// and finds the memory it touched first in the previous tasks close by. Otherwise, it takes the last worker of the oldest job that it can take.
+// Must be called with sharedMutex held.
+static workerJob* takeWorker(int threadIndex, int& workerIndex) {
+	int own = threadIndex + 1;
+	for (unsigned int i = 0; i < sharedJobs.size(); i++) {
+		workerJob* job = sharedJobs[i];
+		if (own < job->workerCount && !job->started[own]) {
+			workerIndex = own;
+			startWorker(job, workerIndex);
+			return job;
+		}
+	}
+	for (unsigned int i = 0; i < sharedJobs.size(); i++) {
+		workerJob* job = sharedJobs[i];
+		for (workerIndex = job->workerCount - 1; workerIndex > 0; workerIndex--) {
+			if (canTakeWorker(job, workerIndex)) {
+				startWorker(job, workerIndex);
+				return job;
+			}
+		}
+	}
+	return NULL;
+}
+
+// Must be called with sharedMutex held.
+static bool hasUnstartedWorker(int workerIndex) {
+	for (unsigned int i = 0; i < sharedJobs.size(); i++) {
+		if (workerIndex < sharedJobs[i]->workerCount && !sharedJobs[i]->started[workerIndex]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Takes the first worker of job that the thread that submitted it can run. Like the other shared threads, it leaves the workers of the shared threads that are about
+// to look for them to their own threads, so that they keep running on the processor of their thread, and only runs the workers whose threads are busy or do not exist,
+// so that the job is finished even if all the threads are busy. Must be called with sharedMutex held.
+static bool takeOwnWorker(workerJob* job, int& workerIndex) {
+	for (workerIndex = 1; workerIndex < job->workerCount; workerIndex++) {
+		if (canTakeWorker(job, workerIndex)) {
+			startWorker(job, workerIndex);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Must be called with sharedMutex held.
+static void finishWorker(workerJob* job) {
+	job->pendingWorkers--;
+	pthread_cond_broadcast(&workerChanged);
+}
+
+static void* sharedThread(void* ptr) {
+	threadStateShared* state = (threadStateShared*)ptr;
+	int threadIndex = state->threadIndex;
+	bindThread(threadIndex);
+	delete state;
+
+	pthread_mutex_lock(&sharedMutex);
+	sharedThreadWaiting[threadIndex] = false;
+	while (!sharedStopping) {
+		int workerIndex;
+		workerJob* job = takeWorker(threadIndex, workerIndex);
+		if (job == NULL) {
+			sharedThreadWaiting[threadIndex] = true;
+			pthread_cond_wait(&jobAvailable, &sharedMutex);
+			sharedThreadWaiting[threadIndex] = false;
+			continue;
+		}
+		// The workers of this thread in the other jobs can now be taken by the other threads.
+		if (hasUnstartedWorker(threadIndex + 1)) {
+			pthread_cond_broadcast(&jobAvailable);
+		}
+		pthread_mutex_unlock(&sharedMutex);
+
+		job->task(job->arg, workerIndex, job->workerCount);
+
+		pthread_mutex_lock(&sharedMutex);
+		finishWorker(job);
+	}
+	pthread_mutex_unlock(&sharedMutex);
+	return NULL;
+}
+
+// Must be called with sharedMutex held.
+static void addSharedThreads(int threadCount) {
+	// Threads started while the others are being stopped would exit at once.
+	if (sharedStopping) {
+		return;
+	}
+	while ((int)sharedThreads.size() < threadCount) {
+		threadStateShared* state = new threadStateShared();
+		state->threadIndex = (int)sharedThreads.size();
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, sharedThread, (void*)state) != 0) {
+			// The callers run the workers themselves if there are not enough threads.
+			delete state;
+			return;
+		}
+		sharedThreads.push_back(thread);
+		sharedThreadWaiting.push_back(true);
+	}
+}
+
+void stopSharedWorkers() {
+	pthread_mutex_lock(&sharedMutex);
+	sharedStopping = true;
+	pthread_cond_broadcast(&jobAvailable);
+	vector<pthread_t> threads = sharedThreads;
+	sharedThreads.clear();
+	// The workers of the threads being stopped can now be taken by the threads that called run, which may be waiting for them.
+	pthread_cond_broadcast(&workerChanged);
+	pthread_mutex_unlock(&sharedMutex);
+
+	for (unsigned int i = 0; i < threads.size(); i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	pthread_mutex_lock(&sharedMutex);
+	// The threads only stop using their flags once they are joined.
+	sharedThreadWaiting.clear();
+	pthread_cond_broadcast(&workerChanged);
+	sharedStopping = false;
+	sharedFixedSize = false;
+	sharedCpus.clear();
+	pthread_mutex_unlock(&sharedMutex);
+}
+
+void startSharedWorkers(int threadCount, const vector<int>& cpus) {
+	stopSharedWorkers();
+
+	pthread_mutex_lock(&sharedMutex);
+	sharedCpus = cpus;
+	sharedFixedSize = true;
+	addSharedThreads(threadCount);
+	pthread_mutex_unlock(&sharedMutex);
+}
+
+workerPool::workerPool(int workerCount) {
+	workerPool::workerCount = max(1, workerCount);
+}
+
+workerPool::~workerPool() {
+}
+
+int workerPool::getWorkerCount() {
+	return workerCount;
+}
+
+void workerPool::run(workerTask task, void* arg) {
+	run(task, arg, workerCount);
+}
+
+void workerPool::run(workerTask task, void* arg, int activeWorkers) {
+	activeWorkers = min(activeWorkers, workerCount);
+	if (activeWorkers <= 1) {
+		task(arg, 0, 1);
+		return;
+	}
+
+	workerJob job;
+	job.task = task;
+	job.arg = arg;
+	job.workerCount = activeWorkers;
+	job.started.assign(activeWorkers, false);
+	job.started[0] = true;
+	job.unstartedWorkers = activeWorkers - 1;
+	job.pendingWorkers = activeWorkers;
+
+	pthread_mutex_lock(&sharedMutex);
+	if (!sharedFixedSize) {
+		addSharedThreads(activeWorkers - 1);
+	}
+	sharedJobs.push_back(&job);
+	pthread_cond_broadcast(&jobAvailable);
+	pthread_mutex_unlock(&sharedMutex);
+
+	task(arg, 0, activeWorkers);
+
+	pthread_mutex_lock(&sharedMutex);
+	finishWorker(&job);
+	while (job.pendingWorkers > 0) {
+		int workerIndex;
+		if (takeOwnWorker(&job, workerIndex)) {
+			pthread_mutex_unlock(&sharedMutex);
+			task(arg, workerIndex, activeWorkers);
+			pthread_mutex_lock(&sharedMutex);
+			finishWorker(&job);
+		}
+		else {
+			pthread_cond_wait(&workerChanged, &sharedMutex);
+		}
+	}
+	pthread_mutex_unlock(&sharedMutex);
+}
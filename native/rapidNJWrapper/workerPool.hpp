@@ -0,0 +1,43 @@
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+
+#include "stdinclude.h"
+#include <vector>
+
+/*A task executed by the workers of a pool. workerIndex goes from 0 to workerCount - 1, and each worker is expected to process its own share of the work.
+The workers of a task may run one after the other on the same thread, so a worker must never wait for another one.*/
+typedef void (*workerTask)(void* arg, int workerIndex, int workerCount);
+
+/*The workers of a task, for algorithms that need to run many short parallel steps and cannot afford to create threads for each of them.
+The workers are run by the threads shared by the whole library, see startSharedWorkers, which are started the first time they are needed and kept between calls. The thread calling
+run acts as worker 0, and also runs the workers of its task whose shared thread is busy or was not started, so tasks always finish, even if all the shared threads are busy
+or none were started.
+Worker i is run by shared thread i - 1 whenever that thread is free, and the other threads, including the one calling run, wait for it rather than take the worker. Memory
+that a worker touches first, and that the system therefore places on the memory node of its processor, is thus found there by the same worker in the next tasks.*/
+class workerPool {
+
+public:
+	workerPool(int workerCount);
+	~workerPool();
+	int getWorkerCount();
+
+	/*Runs the task on all the workers, and returns once all of them are finished.*/
+	void run(workerTask task, void* arg);
+
+	/*Runs the task on the first activeWorkers workers only; the task is called with a workerCount of activeWorkers.*/
+	void run(workerTask task, void* arg, int activeWorkers);
+
+private:
+	int workerCount;
+};
+
+/*Starts the threads shared by all the workerPools, after stopping the current ones. Thread i is bound to the processor cpus[i % cpus.size()] if cpus is not empty, on the
+platforms that support it. Once started this way, the number of threads is fixed until stopSharedWorkers is called; otherwise, it grows with the largest pool that is run,
+up to one thread per worker but the first.*/
+void startSharedWorkers(int threadCount, const vector<int>& cpus);
+
+/*Stops the shared threads, once they have finished the workers they are running. Tasks that are still running are finished by the threads that called run. The threads
+are started again the next time a task needs them. Must not be called from a task.*/
+void stopSharedWorkers();
+
+#endif